@@ -54,6 +54,7 @@
 #include "adb_listeners.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
+#include "checksum.h"
 #include "sysdeps/chrono.h"
 #include "transport.h"
 
@@ -126,9 +127,7 @@ void fatal_errno(const char* fmt, ...) {
 
 uint32_t calculate_apacket_checksum(const apacket* p) {
     uint32_t sum = 0;
-    for (size_t i = 0; i < p->msg.data_length; ++i) {
-        sum += static_cast<uint8_t>(p->payload[i]);
-    }
+    p->payload.iterate_blocks([&sum](const char* data, size_t len) { sum += byte_sum(data, len); });
     return sum;
 }
 
@@ -171,7 +170,7 @@ void handle_offline(atransport *t)
 
     // This is necessary to avoid a race condition that occurred when a transport closes
     // while a client socket is still active.
-    close_all_sockets(t);
+    t->RunOnLoop([t]() { close_all_sockets(t); });
 
     t->RunDisconnects();
 }
@@ -197,7 +196,8 @@ void print_packet(const char *label, apacket *p)
     fprintf(stderr, "%s: %s %08x %08x %04x \"",
             label, tag, p->msg.arg0, p->msg.arg1, p->msg.data_length);
     count = p->msg.data_length;
-    const char* x = p->payload.data();
+    std::string payload = p->payload.coalesce<std::string>();
+    const char* x = payload.data();
     if (count > DUMPMAX) {
         count = DUMPMAX;
         tag = "\n";
@@ -226,6 +226,18 @@ static void send_ready(unsigned local, unsigned remote, atransport *t)
     send_packet(p, t);
 }
 
+// Returns how many bytes of the window a READY message gives back, with kFeatureDelayedAck.
+static uint32_t get_acked_bytes(const apacket* p) {
+    uint32_t bytes = 0;
+    if (p->payload.size() == sizeof(bytes)) {
+        p->payload.coalesced(
+                [&bytes](const char* data, size_t len) { memcpy(&bytes, data, len); });
+    } else if (p->payload.size() != 0) {
+        D("ignoring READY with a %zu byte payload", p->payload.size());
+    }
+    return bytes;
+}
+
 static void send_close(unsigned local, unsigned remote, atransport *t)
 {
     D("Calling send_close");
@@ -317,6 +329,7 @@ void parse_banner(const std::string& banner, atransport* t) {
             }
         }
     }
+    reindex_transport(t);
 
     const std::string& type = pieces[0];
     if (type == "bootloader") {
@@ -341,7 +354,7 @@ static void handle_new_connection(atransport* t, apacket* p) {
     handle_offline(t);
 
     t->update_version(p->msg.arg0, p->msg.arg1);
-    std::string banner(p->payload.begin(), p->payload.end());
+    std::string banner = p->payload.coalesce<std::string>();
     parse_banner(banner, t);
 
 #if ADB_HOST
@@ -379,12 +392,14 @@ void handle_packet(apacket *p, atransport *t)
                 if (t->GetConnectionState() != kCsAuthorizing) {
                     t->SetConnectionState(kCsAuthorizing);
                 }
-                send_auth_response(p->payload.data(), p->msg.data_length, t);
+                p->payload.coalesced([t](const char* data, size_t len) {
+                    send_auth_response(data, len, t);
+                });
                 break;
 #else
             case ADB_AUTH_SIGNATURE: {
                 // TODO: Switch to string_view.
-                std::string signature(p->payload.begin(), p->payload.end());
+                std::string signature = p->payload.coalesce<std::string>();
                 if (adbd_auth_verify(t->token, sizeof(t->token), signature)) {
                     adbd_auth_verified(t);
                     t->failed_auth_attempts = 0;
@@ -396,7 +411,9 @@ void handle_packet(apacket *p, atransport *t)
             }
 
             case ADB_AUTH_RSAPUBLICKEY:
-                adbd_auth_confirm_key(p->payload.data(), p->msg.data_length, t);
+                p->payload.coalesced([t](const char* data, size_t len) {
+                    adbd_auth_confirm_key(data, len, t);
+                });
                 break;
 #endif
             default:
@@ -406,34 +423,57 @@ void handle_packet(apacket *p, atransport *t)
         }
         break;
 
-    case A_OPEN: /* OPEN(local-id, 0, "destination") */
-        if (t->online && p->msg.arg0 != 0 && p->msg.arg1 == 0) {
+    case A_OPEN: /* OPEN(local-id, 0, "destination") or OPEN(local-id, window, "destination") */
+        if (t->online && p->msg.arg0 != 0 &&
+            (p->msg.arg1 == 0 || t->has_feature(kFeatureDelayedAck))) {
             // TODO: Switch to string_view.
-            std::string address(p->payload.begin(), p->payload.end());
+            std::string address = p->payload.coalesce<std::string>();
             asocket* s = create_local_service_socket(address.c_str(), t);
             if (s == nullptr) {
                 send_close(0, p->msg.arg0, t);
             } else {
+                // So that find_transport_socket() lets t's packets through to it.
+                set_socket_transport(s, t);
                 s->peer = create_remote_socket(p->msg.arg0, t);
                 s->peer->peer = s;
-                send_ready(s->id, s->peer->id, t);
+                if (s->peer->available_send_bytes) {
+                    // Take the window we were offered, and offer ours in the first READY.
+                    *s->peer->available_send_bytes = p->msg.arg1;
+                    s->peer->pending_ack_bytes = get_delayed_ack_window();
+                    s->peer->ready(s->peer);
+                } else {
+                    send_ready(s->id, s->peer->id, t);
+                }
                 s->ready(s);
             }
         }
         break;
 
-    case A_OKAY: /* READY(local-id, remote-id, "") */
+    case A_OKAY: /* READY(local-id, remote-id, "") or READY(local-id, remote-id, acked-bytes) */
         if (t->online && p->msg.arg0 != 0 && p->msg.arg1 != 0) {
-            asocket* s = find_local_socket(p->msg.arg1, 0);
+            asocket* s = find_transport_socket(t, p->msg.arg1, 0);
             if (s) {
                 if(s->peer == nullptr) {
                     /* On first READY message, create the connection. */
                     s->peer = create_remote_socket(p->msg.arg0, t);
                     s->peer->peer = s;
+                    if (s->peer->available_send_bytes) {
+                        *s->peer->available_send_bytes += get_acked_bytes(p);
+                    }
                     s->ready(s);
                 } else if (s->peer->id == p->msg.arg0) {
                     /* Other READY messages must use the same local-id */
-                    s->ready(s);
+                    if (!s->peer->available_send_bytes) {
+                        s->ready(s);
+                    } else {
+                        // Only resume once there's room again, or the overshoot past the window
+                        // could keep growing.
+                        int64_t& available = *s->peer->available_send_bytes;
+                        available += get_acked_bytes(p);
+                        if (available > 0 && !s->peer->write_queue_blocked) {
+                            s->ready(s);
+                        }
+                    }
                 } else {
                     D("Invalid A_OKAY(%d,%d), expected A_OKAY(%d,%d) on transport %s", p->msg.arg0,
                       p->msg.arg1, s->peer->id, p->msg.arg1, t->serial.c_str());
@@ -449,7 +489,7 @@ void handle_packet(apacket *p, atransport *t)
 
     case A_CLSE: /* CLOSE(local-id, remote-id, "") or CLOSE(0, remote-id, "") */
         if (t->online && p->msg.arg1 != 0) {
-            asocket* s = find_local_socket(p->msg.arg1, p->msg.arg0);
+            asocket* s = find_transport_socket(t, p->msg.arg1, p->msg.arg0);
             if (s) {
                 /* According to protocol.txt, p->msg.arg0 might be 0 to indicate
                  * a failed OPEN only. However, due to a bug in previous ADB
@@ -473,12 +513,16 @@ void handle_packet(apacket *p, atransport *t)
 
     case A_WRTE: /* WRITE(local-id, remote-id, <data>) */
         if (t->online && p->msg.arg0 != 0 && p->msg.arg1 != 0) {
-            asocket* s = find_local_socket(p->msg.arg1, p->msg.arg0);
+            asocket* s = find_transport_socket(t, p->msg.arg1, p->msg.arg0);
             if (s) {
-                unsigned rid = p->msg.arg0;
+                // With delayed acks, the READY that s->peer->ready() sends, now or once s has
+                // written the data out, gives this much back to the sender's window.
+                if (s->peer->available_send_bytes) {
+                    s->peer->pending_ack_bytes += p->payload.size();
+                }
                 if (s->enqueue(s, std::move(p->payload)) == 0) {
                     D("Enqueue the socket");
-                    send_ready(s->id, rid, t);
+                    s->peer->ready(s->peer);
                 }
             }
         }
@@ -1246,6 +1290,23 @@ bool handle_host_request(const char* service, TransportType type, const char* se
         return true;
     }
 
+    if (!strcmp(service, "queue-stats")) {
+        std::string error;
+        atransport* t = acquire_one_transport(type, serial, transport_id, nullptr, &error);
+        if (t == nullptr) {
+            SendFail(reply_fd, error);
+            return true;
+        }
+        auto connection = t->connection();
+        PacketQueueStats stats;
+        if (!connection || !connection->GetWriteQueueStats(&stats)) {
+            SendFail(reply_fd, "no write queue statistics for this transport");
+            return true;
+        }
+        SendOkay(reply_fd, stats.ToString());
+        return true;
+    }
+
     // Indicates a new emulator instance has started.
     if (!strncmp(service, "emulator:", 9)) {
         int  port = atoi(service+9);
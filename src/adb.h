@@ -34,6 +34,18 @@
 constexpr size_t MAX_PAYLOAD_V1 = 4 * 1024;
 constexpr size_t MAX_PAYLOAD = 1024 * 1024;
 
+// How much data a stream lets the other side send ahead of its acknowledgements, when the
+// transport has kFeatureDelayedAck.
+constexpr size_t INITIAL_DELAYED_ACK_BYTES = 4 * MAX_PAYLOAD;
+
+// The window a stream actually offers: the most a socket buffers for its local end before the
+// other side has to wait. ADB_SOCKET_MAX_BUFFERED_BYTES overrides INITIAL_DELAYED_ACK_BYTES.
+size_t get_delayed_ack_window();
+
+// How much a transport queues up for a device that isn't keeping up before the sockets feeding it
+// have to wait. ADB_TRANSPORT_MAX_QUEUED_BYTES overrides this.
+constexpr size_t DEFAULT_TRANSPORT_MAX_QUEUED_BYTES = 16 * MAX_PAYLOAD;
+
 constexpr size_t LINUX_MAX_SOCKET_SIZE = 4194304;
 
 #define A_SYNC 0x434e5953
@@ -59,7 +71,7 @@ constexpr size_t LINUX_MAX_SOCKET_SIZE = 4194304;
 std::string adb_version();
 
 // Increment this when we want to force users to start a new adb server.
-#define ADB_SERVER_VERSION 40
+#define ADB_SERVER_VERSION 47
 
 using TransportId = uint64_t;
 class atransport;
@@ -21,7 +21,12 @@
 #ifndef _WIN32
 #include <unistd.h>
 #endif
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
 
+#include <algorithm>
 #include <thread>
 
 #include <android-base/stringprintf.h>
@@ -133,6 +138,45 @@ bool WriteFdExactly(int fd, const std::string& str) {
     return WriteFdExactly(fd, str.c_str(), str.size());
 }
 
+bool WriteFdExactly(int fd, adb_iovec* iov, size_t iovcnt) {
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            ++iov;
+            --iovcnt;
+            continue;
+        }
+
+        ssize_t r = adb_writev(fd, iov, static_cast<int>(std::min<size_t>(iovcnt, ADB_IOV_MAX)));
+        if (r == -1) {
+            D("writev: fd=%d error %d: %s", fd, errno, strerror(errno));
+            if (errno == EAGAIN) {
+                std::this_thread::yield();
+                continue;
+            } else if (errno == EPIPE) {
+                D("writev: fd=%d disconnected", fd);
+                errno = 0;
+                return false;
+            } else {
+                return false;
+            }
+        }
+
+        // Skip over what was written, which may end in the middle of an iovec.
+        size_t written = r;
+        while (written > 0) {
+            size_t n = std::min<size_t>(written, iov->iov_len);
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+            written -= n;
+            if (iov->iov_len == 0) {
+                ++iov;
+                --iovcnt;
+            }
+        }
+    }
+    return true;
+}
+
 bool WriteFdFmt(int fd, const char* fmt, ...) {
     std::string str;
 
@@ -144,6 +188,140 @@ bool WriteFdFmt(int fd, const char* fmt, ...) {
     return WriteFdExactly(fd, str);
 }
 
+FdCopier::FdCopier(size_t buffer_size) : buffer_(buffer_size) {}
+
+FdCopier::Result FdCopier::Copy(int out_fd, int in_fd, size_t len) {
+    size_t copied = 0;
+#if defined(__linux__)
+    // sendfile only takes files as input, and fails straight away otherwise: that costs a syscall
+    // per copy from a socket, which is cheap next to the copy itself.
+    Result result = Result::kSuccess;
+    copied += CopySendfile(out_fd, in_fd, len, &result);
+    if (copied < len && result == Result::kSuccess) {
+        copied += CopySplice(out_fd, in_fd, len - copied, &result);
+    }
+    if (result != Result::kSuccess) {
+        return result;
+    }
+#endif
+    return CopyBuffered(out_fd, in_fd, len - copied);
+}
+
+FdCopier::Result FdCopier::CopyBuffered(int out_fd, int in_fd, size_t len) {
+    while (len > 0) {
+        size_t chunk = std::min(len, buffer_.size());
+        if (!ReadFdExactly(in_fd, buffer_.data(), chunk)) {
+            return PadOutput(out_fd, len);
+        }
+        if (!WriteFdExactly(out_fd, buffer_.data(), chunk)) {
+            return DropInput(in_fd, len - chunk);
+        }
+        len -= chunk;
+    }
+    return Result::kSuccess;
+}
+
+FdCopier::Result FdCopier::PadOutput(int out_fd, size_t len) {
+    int saved_errno = errno;
+    std::fill(buffer_.begin(), buffer_.end(), 0);
+    while (len > 0) {
+        size_t chunk = std::min(len, buffer_.size());
+        if (!WriteFdExactly(out_fd, buffer_.data(), chunk)) {
+            return Result::kWriteFailed;
+        }
+        len -= chunk;
+    }
+    errno = saved_errno;
+    return Result::kReadFailed;
+}
+
+FdCopier::Result FdCopier::DropInput(int in_fd, size_t len) {
+    int saved_errno = errno;
+    while (len > 0) {
+        size_t chunk = std::min(len, buffer_.size());
+        if (!ReadFdExactly(in_fd, buffer_.data(), chunk)) {
+            return Result::kReadFailed;
+        }
+        len -= chunk;
+    }
+    errno = saved_errno;
+    return Result::kWriteFailed;
+}
+
+#if defined(__linux__)
+size_t FdCopier::CopySendfile(int out_fd, int in_fd, size_t len, Result* result) {
+    size_t copied = 0;
+    while (copied < len) {
+        ssize_t rc = sendfile(out_fd, in_fd, nullptr, len - copied);
+        if (rc > 0) {
+            copied += rc;
+        } else if (rc == 0) {
+            errno = 0;
+            *result = PadOutput(out_fd, len - copied);
+            break;
+        } else if (errno != EINTR) {
+            // Either sendfile doesn't work with these fds, or one of them failed. The next
+            // method along will find out which.
+            D("sendfile: out_fd=%d in_fd=%d error %d: %s", out_fd, in_fd, errno, strerror(errno));
+            break;
+        }
+    }
+    return copied;
+}
+
+size_t FdCopier::CopySplice(int out_fd, int in_fd, size_t len, Result* result) {
+    if (pipe_read_ == -1) {
+        if (!android::base::Pipe(&pipe_read_, &pipe_write_)) {
+            return 0;
+        }
+        // Make room for a whole buffer's worth, if we're allowed to.
+        fcntl(pipe_write_.get(), F_SETPIPE_SZ, static_cast<int>(buffer_.size()));
+    }
+
+    size_t copied = 0;
+    while (copied < len) {
+        // Never put more in the pipe than the buffer can take back out.
+        ssize_t rc = splice(in_fd, nullptr, pipe_write_.get(), nullptr,
+                            std::min(len - copied, buffer_.size()), SPLICE_F_MOVE);
+        if (rc == 0) {
+            errno = 0;
+            *result = PadOutput(out_fd, len - copied);
+            break;
+        } else if (rc == -1) {
+            if (errno == EINTR) continue;
+            D("splice: in_fd=%d error %d: %s", in_fd, errno, strerror(errno));
+            break;
+        }
+
+        size_t pending = rc;
+        while (pending > 0) {
+            rc = splice(pipe_read_.get(), nullptr, out_fd, nullptr, pending, SPLICE_F_MOVE);
+            if (rc > 0) {
+                pending -= rc;
+                copied += rc;
+            } else if (rc == 0 || errno != EINTR) {
+                break;
+            }
+        }
+
+        if (pending > 0) {
+            // Take what's left in the pipe back out, and let the buffered copy carry on.
+            D("splice: out_fd=%d error %d: %s", out_fd, errno, strerror(errno));
+            if (!ReadFdExactly(pipe_read_.get(), buffer_.data(), pending)) {
+                PLOG(FATAL) << "failed to drain splice pipe";
+            }
+            if (!WriteFdExactly(out_fd, buffer_.data(), pending)) {
+                *result = DropInput(in_fd, len - copied - pending);
+            } else {
+                copied += pending;
+            }
+            break;
+        }
+    }
+    return copied;
+}
+#endif
+
 bool ReadOrderlyShutdown(int fd) {
     char buf[16];
 
@@ -20,6 +20,10 @@
 #include <sys/types.h>
 
 #include <string>
+#include <vector>
+
+#include "adb_unique_fd.h"
+#include "sysdeps/uio.h"
 
 // Sends the protocol "OKAY" message.
 bool SendOkay(int fd);
@@ -70,6 +74,10 @@ bool WriteFdExactly(int fd, const void* buf, size_t len);
 bool WriteFdExactly(int fd, const char* s);
 bool WriteFdExactly(int fd, const std::string& s);
 
+// Same as above, but gathers the data from |iovcnt| iovecs in as few writes as possible. The
+// iovecs are used up as their data is written, so they're left in an unspecified state.
+bool WriteFdExactly(int fd, adb_iovec* iov, size_t iovcnt);
+
 // https://stackoverflow.com/a/6849629/4063520
 #undef FORMAT_STRING
 #if _MSC_VER >= 1400
@@ -90,4 +98,48 @@ bool WriteFdFmt(int fd, FORMAT_STRING(const char* fmt), ...)
 #endif
 ;
 
+// Copies file data between fds, without bringing it into userspace where the kernel can do that:
+// sendfile(2) from a file, and splice(2) through a pipe from anything else. Other fds, and other
+// operating systems, go through a buffer instead.
+class FdCopier {
+  public:
+    enum class Result {
+        kSuccess,
+        // Reading from in_fd failed, or found EOF (with errno set to 0). out_fd was padded with
+        // zeroes to the full length regardless, so that a stream written to stays in step.
+        kReadFailed,
+        // Writing to out_fd failed. The rest of the data was read from in_fd and dropped, so that
+        // a stream read from stays in step.
+        kWriteFailed,
+    };
+
+    // |buffer_size| is the most that a buffered copy moves per read, and should be at least the
+    // typical length of a copy.
+    explicit FdCopier(size_t buffer_size);
+
+    // Copies exactly len bytes from the current offset of in_fd to out_fd. If the padding or
+    // dropping after a failure fails too, the result describes that second failure instead.
+    Result Copy(int out_fd, int in_fd, size_t len);
+
+    // The buffer used for buffered copies, for callers to borrow between copies.
+    std::vector<char>& buffer() { return buffer_; }
+
+  private:
+    Result CopyBuffered(int out_fd, int in_fd, size_t len);
+    Result PadOutput(int out_fd, size_t len);
+    Result DropInput(int in_fd, size_t len);
+
+#if defined(__linux__)
+    // Returns the number of bytes moved before sendfile or splice turned out not to work, with
+    // *result set if one of the fds failed for good.
+    size_t CopySendfile(int out_fd, int in_fd, size_t len, Result* result);
+    size_t CopySplice(int out_fd, int in_fd, size_t len, Result* result);
+
+    unique_fd pipe_read_;
+    unique_fd pipe_write_;
+#endif
+
+    std::vector<char> buffer_;
+};
+
 #endif /* ADB_IO_H */
@@ -21,11 +21,13 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/test_utils.h>
@@ -120,6 +122,33 @@ POSIX_TEST(io, WriteFdExactly_partial) {
   EXPECT_EQ(expected, s);
 }
 
+POSIX_TEST(io, WriteFdExactly_iovecs) {
+  TemporaryFile tf;
+  ASSERT_NE(-1, tf.fd);
+
+  // Empty iovecs are skipped, and there are more iovecs than a single writev takes.
+  std::string expected;
+  std::vector<std::string> strings;
+  for (int i = 0; i < ADB_IOV_MAX + 10; ++i) {
+    strings.push_back(i % 3 == 0 ? "" : std::to_string(i) + ",");
+    expected += strings.back();
+  }
+  std::vector<adb_iovec> iovecs;
+  for (std::string& s : strings) {
+    adb_iovec iov;
+    iov.iov_base = &s[0];
+    iov.iov_len = s.size();
+    iovecs.push_back(iov);
+  }
+
+  ASSERT_TRUE(WriteFdExactly(tf.fd, iovecs.data(), iovecs.size())) << strerror(errno);
+  ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+
+  std::string s;
+  ASSERT_TRUE(android::base::ReadFdToString(tf.fd, &s));
+  EXPECT_EQ(expected, s);
+}
+
 POSIX_TEST(io, WriteFdExactly_ENOSPC) {
     int fd = open("/dev/full", O_WRONLY);
     ASSERT_NE(-1, fd);
@@ -155,3 +184,86 @@ POSIX_TEST(io, WriteFdFmt) {
     ASSERT_TRUE(android::base::ReadFdToString(tf.fd, &s));
     EXPECT_STREQ("Foobar123", s.c_str());
 }
+
+POSIX_TEST(io, FdCopier_file_to_file) {
+    std::string expected;
+    for (int i = 0; i < 10000; ++i) {
+        expected += std::to_string(i);
+    }
+    TemporaryFile in;
+    ASSERT_TRUE(android::base::WriteStringToFd(expected, in.fd)) << strerror(errno);
+    ASSERT_EQ(0, lseek(in.fd, 0, SEEK_SET));
+
+    // Copy in two parts, with a buffer smaller than either of them.
+    TemporaryFile out;
+    FdCopier copier(4096);
+    ASSERT_EQ(FdCopier::Result::kSuccess, copier.Copy(out.fd, in.fd, 10000));
+    ASSERT_EQ(FdCopier::Result::kSuccess, copier.Copy(out.fd, in.fd, expected.size() - 10000));
+    ASSERT_EQ(0, lseek(out.fd, 0, SEEK_SET));
+
+    std::string s;
+    ASSERT_TRUE(android::base::ReadFdToString(out.fd, &s));
+    EXPECT_EQ(expected, s);
+}
+
+POSIX_TEST(io, FdCopier_socket_to_file) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    unique_fd local(fds[0]);
+    unique_fd remote(fds[1]);
+    ASSERT_TRUE(WriteFdExactly(remote.get(), "Foobar123"));
+
+    TemporaryFile out;
+    FdCopier copier(4096);
+    ASSERT_EQ(FdCopier::Result::kSuccess, copier.Copy(out.fd, local.get(), 6));
+    ASSERT_EQ(0, lseek(out.fd, 0, SEEK_SET));
+
+    std::string s;
+    ASSERT_TRUE(android::base::ReadFdToString(out.fd, &s));
+    EXPECT_EQ("Foobar", s);
+
+    // The rest of the stream is still there.
+    char buf[4] = {};
+    ASSERT_TRUE(ReadFdExactly(local.get(), buf, 3));
+    EXPECT_STREQ("123", buf);
+}
+
+POSIX_TEST(io, FdCopier_eof) {
+    TemporaryFile in;
+    ASSERT_TRUE(android::base::WriteStringToFd("Foo", in.fd)) << strerror(errno);
+    ASSERT_EQ(0, lseek(in.fd, 0, SEEK_SET));
+
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    unique_fd local(fds[0]);
+    unique_fd remote(fds[1]);
+
+    // Running out of input pads the output to the full length.
+    FdCopier copier(4096);
+    ASSERT_EQ(FdCopier::Result::kReadFailed, copier.Copy(local.get(), in.fd, 6));
+    EXPECT_EQ(0, errno) << strerror(errno);
+
+    char buf[6];
+    ASSERT_TRUE(ReadFdExactly(remote.get(), buf, sizeof(buf)));
+    EXPECT_EQ(std::string("Foo\0\0\0", 6), std::string(buf, sizeof(buf)));
+}
+
+POSIX_TEST(io, FdCopier_ENOSPC) {
+    unique_fd out(open("/dev/full", O_WRONLY));
+    ASSERT_NE(-1, out.get());
+
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    unique_fd local(fds[0]);
+    unique_fd remote(fds[1]);
+    ASSERT_TRUE(WriteFdExactly(remote.get(), "Foobar123"));
+
+    // Failing to write still consumes the input.
+    FdCopier copier(4096);
+    ASSERT_EQ(FdCopier::Result::kWriteFailed, copier.Copy(out.get(), local.get(), 6));
+    EXPECT_EQ(ENOSPC, errno);
+
+    char buf[4] = {};
+    ASSERT_TRUE(ReadFdExactly(local.get(), buf, 3));
+    EXPECT_STREQ("123", buf);
+}
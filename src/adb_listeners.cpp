@@ -78,6 +78,7 @@ static void ss_listener_event_func(int _fd, unsigned ev, void *_l) {
         int fd = adb_socket_accept(_fd, nullptr, nullptr);
         if (fd < 0) return;
 
+        disable_tcp_nagle(fd);
         int rcv_buf_size = CHUNK_SIZE;
         adb_setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv_buf_size, sizeof(rcv_buf_size));
 
@@ -102,9 +103,23 @@ static void listener_event_func(int _fd, unsigned ev, void* _l)
             return;
         }
 
+        atransport* t = listener->transport;
+        if (t && t->loop() != fdevent_main_context()) {
+            // The socket belongs to the transport's loop, so that's where it has to be created.
+            // The transport going offline closes its sockets on that loop too, and since that
+            // also removes this listener, it can only be queued up after this.
+            std::string connect_to = listener->connect_to;
+            t->RunOnLoop([t, fd, connect_to]() {
+                asocket* s = create_local_socket(fd);
+                set_socket_transport(s, t);
+                connect_to_remote(s, connect_to.c_str());
+            });
+            return;
+        }
+
         s = create_local_socket(fd);
         if (s) {
-            s->transport = listener->transport;
+            set_socket_transport(s, listener->transport);
             connect_to_remote(s, listener->connect_to.c_str());
             return;
         }
@@ -202,6 +202,20 @@ std::string perror_str(const char* msg) {
     return android::base::StringPrintf("%s: %s", msg, strerror(errno));
 }
 
+size_t get_env_bytes(const char* name, size_t default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+
+    size_t result;
+    if (!android::base::ParseUint(value, &result)) {
+        LOG(WARNING) << "ignoring invalid " << name << " '" << value << "'";
+        return default_value;
+    }
+    return result;
+}
+
 #if !defined(_WIN32)
 // Windows version provided in sysdeps_win32.cpp
 bool set_file_block_mode(int fd, bool block) {
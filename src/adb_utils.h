@@ -62,6 +62,10 @@ std::string dump_hex(const void* ptr, size_t byte_count);
 
 std::string perror_str(const char* msg);
 
+// Returns the number of bytes in environment variable |name|, or |default_value| if it's unset or
+// isn't a number.
+size_t get_env_bytes(const char* name, size_t default_value);
+
 bool set_file_block_mode(int fd, bool block);
 
 extern int adb_close(int fd);
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "checksum.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ADB_BYTE_SUM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AVX2 is picked at runtime, which needs the compiler to let us target it one function at a time.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define ADB_BYTE_SUM_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ADB_BYTE_SUM_NEON 1
+#include <arm_neon.h>
+#endif
+
+static uint32_t byte_sum_scalar(const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; ++i) {
+        sum += p[i];
+    }
+    return sum;
+}
+
+// The x86 versions lean on psadbw, which sums groups of 8 bytes into 64-bit lanes that can't
+// overflow. Truncating the total to 32 bits at the end gives the same result as the plain loop.
+
+#if defined(ADB_BYTE_SUM_SSE2)
+static uint32_t byte_sum_sse2(const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum0 = zero;
+    __m128i sum1 = zero;
+    for (; len >= 32; p += 32, len -= 32) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+        sum0 = _mm_add_epi64(sum0, _mm_sad_epu8(a, zero));
+        sum1 = _mm_add_epi64(sum1, _mm_sad_epu8(b, zero));
+    }
+    __m128i sum = _mm_add_epi64(sum0, sum1);
+    sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(sum)) + byte_sum_scalar(p, len);
+}
+#endif
+
+#if defined(ADB_BYTE_SUM_AVX2)
+__attribute__((target("avx2"))) static uint32_t byte_sum_avx2(const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum0 = zero;
+    __m256i sum1 = zero;
+    for (; len >= 64; p += 64, len -= 64) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+        sum0 = _mm256_add_epi64(sum0, _mm256_sad_epu8(a, zero));
+        sum1 = _mm256_add_epi64(sum1, _mm256_sad_epu8(b, zero));
+    }
+    __m256i sum256 = _mm256_add_epi64(sum0, sum1);
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sum256),
+                                _mm256_extracti128_si256(sum256, 1));
+    sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(sum)) + byte_sum_scalar(p, len);
+}
+#endif
+
+#if defined(ADB_BYTE_SUM_NEON)
+static uint32_t byte_sum_neon(const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32x4_t sum = vdupq_n_u32(0);
+    while (len >= 16) {
+        // Each 16-bit lane gains at most 2 * 255 per vector, so it's good for 128 of them. The
+        // 32-bit lanes are allowed to wrap, since the result is modulo 2^32 anyway.
+        size_t vectors = std::min<size_t>(len / 16, 128);
+        uint16x8_t partial = vdupq_n_u16(0);
+        for (size_t i = 0; i < vectors; ++i, p += 16) {
+            partial = vpadalq_u8(partial, vld1q_u8(p));
+        }
+        sum = vpadalq_u16(sum, partial);
+        len -= vectors * 16;
+    }
+    return vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) +
+           vgetq_lane_u32(sum, 3) + byte_sum_scalar(p, len);
+}
+#endif
+
+static std::vector<ByteSumImpl> available_impls() {
+    std::vector<ByteSumImpl> impls = {{"scalar", byte_sum_scalar}};
+#if defined(ADB_BYTE_SUM_SSE2)
+    impls.push_back({"sse2", byte_sum_sse2});
+#endif
+#if defined(ADB_BYTE_SUM_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        impls.push_back({"avx2", byte_sum_avx2});
+    }
+#endif
+#if defined(ADB_BYTE_SUM_NEON)
+    impls.push_back({"neon", byte_sum_neon});
+#endif
+    return impls;
+}
+
+const std::vector<ByteSumImpl>& byte_sum_impls() {
+    static auto& impls = *new std::vector<ByteSumImpl>(available_impls());
+    return impls;
+}
+
+uint32_t byte_sum(const void* data, size_t len) {
+    // Too short to be worth a call through a pointer.
+    if (len < 32) {
+        return byte_sum_scalar(data, len);
+    }
+    static const auto fn = byte_sum_impls().back().fn;
+    return fn(data, len);
+}
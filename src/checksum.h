@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Returns the sum of the |len| bytes at |data|, modulo 2^32: the payload checksum that devices
+// older than A_VERSION_SKIP_CHECKSUM expect. Uses the fastest implementation this CPU supports.
+uint32_t byte_sum(const void* data, size_t len);
+
+// An implementation of byte_sum. They all return the same results.
+struct ByteSumImpl {
+    const char* name;
+    uint32_t (*fn)(const void* data, size_t len);
+};
+
+// Every implementation this CPU can run, for tests and benchmarks. The first is the plain loop the
+// others are checked against, and the last is the one that byte_sum uses.
+const std::vector<ByteSumImpl>& byte_sum_impls();
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "checksum.h"
+
+// A lone byte is what an A_OKAY-sized packet pays for the call, 16k is a typical old-device
+// payload, and 1M is the largest payload there is.
+#define ADB_CHECKSUM_BENCHMARK(impl) \
+    BENCHMARK_CAPTURE(BM_Checksum, impl, #impl)->Arg(1)->Arg(16 * 1024)->Arg(1024 * 1024)
+
+static void BM_Checksum(benchmark::State& state, const char* name) {
+    uint32_t (*fn)(const void*, size_t) = nullptr;
+    for (const ByteSumImpl& impl : byte_sum_impls()) {
+        if (strcmp(impl.name, name) == 0) {
+            fn = impl.fn;
+        }
+    }
+    if (!fn) {
+        state.SkipWithError("implementation unavailable on this CPU");
+        return;
+    }
+
+    std::vector<char> data(state.range(0), 'x');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fn(data.data(), data.size()));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data.size());
+}
+
+ADB_CHECKSUM_BENCHMARK(scalar);
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+ADB_CHECKSUM_BENCHMARK(sse2);
+ADB_CHECKSUM_BENCHMARK(avx2);
+#endif
+#if defined(__arm__) || defined(__aarch64__)
+ADB_CHECKSUM_BENCHMARK(neon);
+#endif
+
+// What calculate_apacket_checksum actually calls.
+static void BM_Checksum_Dispatched(benchmark::State& state) {
+    std::vector<char> data(state.range(0), 'x');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(byte_sum(data.data(), data.size()));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data.size());
+}
+BENCHMARK(BM_Checksum_Dispatched)->Arg(1)->Arg(16 * 1024)->Arg(1024 * 1024);
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+#include "adb.h"
+#include "checksum.h"
+#include "types.h"
+
+static uint32_t reference_sum(const std::vector<uint8_t>& data, size_t offset, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = offset; i < offset + len; ++i) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+TEST(checksum, scalar_first) {
+    ASSERT_FALSE(byte_sum_impls().empty());
+    EXPECT_STREQ("scalar", byte_sum_impls().front().name);
+}
+
+TEST(checksum, random) {
+    std::mt19937 rng(42);
+    std::vector<uint8_t> data(1024 * 1024 + 64);
+    for (auto& byte : data) {
+        byte = rng();
+    }
+
+    // Every length up to a few vectors, at every alignment, and a couple of big odd ones.
+    std::vector<size_t> lengths;
+    for (size_t len = 0; len <= 200; ++len) {
+        lengths.push_back(len);
+    }
+    lengths.push_back(16 * 1024 + 7);
+    lengths.push_back(1024 * 1024 + 33);
+
+    for (const ByteSumImpl& impl : byte_sum_impls()) {
+        for (size_t len : lengths) {
+            for (size_t offset = 0; offset < 32; ++offset) {
+                ASSERT_EQ(reference_sum(data, offset, len), impl.fn(&data[offset], len))
+                        << impl.name << ": len " << len << ", offset " << offset;
+            }
+        }
+    }
+}
+
+TEST(checksum, overflow) {
+    // All 0xff is the worst case for any intermediate lanes, and is enough to wrap the sum.
+    std::vector<uint8_t> data(0x1'0000'0000 / 0xff + 4096, 0xff);
+    uint32_t expected = reference_sum(data, 0, data.size());
+    for (const ByteSumImpl& impl : byte_sum_impls()) {
+        EXPECT_EQ(expected, impl.fn(data.data(), data.size())) << impl.name;
+    }
+}
+
+TEST(checksum, apacket) {
+    apacket packet;
+    std::vector<uint8_t> expected;
+    for (size_t i = 0; i < 5; ++i) {
+        Block block(1000 + i);
+        for (size_t j = 0; j < block.size(); ++j) {
+            block[j] = static_cast<char>(i * 31 + j);
+            expected.push_back(block[j]);
+        }
+        packet.payload.append(std::move(block));
+    }
+    EXPECT_EQ(reference_sum(expected, 0, expected.size()), calculate_apacket_checksum(&packet));
+}
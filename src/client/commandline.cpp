@@ -147,15 +147,18 @@ static void help() {
         " reverse --remove-all     remove all reverse socket connections from device\n"
         "\n"
         "file transfer:\n"
-        " push [--sync] LOCAL... REMOTE\n"
+        " push [--sync] [-j N] LOCAL... REMOTE\n"
         "     copy local files/directories to device\n"
         "     --sync: only push files that are newer on the host than the device\n"
-        " pull [-a] REMOTE... LOCAL\n"
+        "     -j: copy a directory's files over N connections (default $ADB_SYNC_JOBS or 1)\n"
+        " pull [-a] [-j N] REMOTE... LOCAL\n"
         "     copy files/dirs from device\n"
         "     -a: preserve file timestamp and mode\n"
-        " sync [all|data|odm|oem|product_services|product|system|vendor]\n"
+        "     -j: copy a directory's files over N connections (default $ADB_SYNC_JOBS or 1)\n"
+        " sync [-l] [-j N] [all|data|odm|oem|product_services|product|system|vendor]\n"
         "     sync a local build from $ANDROID_PRODUCT_OUT to the device (default all)\n"
         "     -l: list but don't copy\n"
+        "     -j: copy over N connections (default $ADB_SYNC_JOBS or 1)\n"
         "\n"
         "shell:\n"
         " shell [-e ESCAPE] [-n] [-Tt] [-x] [COMMAND...]\n"
@@ -238,11 +241,16 @@ static void help() {
         " reconnect                kick connection from host side to force reconnect\n"
         " reconnect device         kick connection from device side to force reconnect\n"
         " reconnect offline        reset offline/unauthorized devices to force reconnect\n"
+        " queue-stats              show how long packets have waited to be sent to the device\n"
         "\n"
         "environment variables:\n"
         " $ADB_TRACE\n"
         "     comma-separated list of debug info to log:\n"
         "     all,adb,sockets,packets,rwx,usb,sync,sysdeps,transport,jdwp\n"
+        " $ADB_SYNC_CHUNK_SIZE     size in bytes of push/pull data chunks (64k to 1M)\n"
+        " $ADB_SYNC_COMPRESS       0 to not compress push/pull data\n"
+        " $ADB_SYNC_FDATASYNC      flush pulled files to disk every N MiB, and when done\n"
+        " $ADB_SYNC_JOBS           number of connections for push/pull/sync (see -j)\n"
         " $ADB_VENDOR_KEYS         colon-separated list of keys (files or directories)\n"
         " $ANDROID_SERIAL          serial number to connect to (see -s)\n"
         " $ANDROID_LOG_TAGS        tags to be used by logcat (see logcat --help)\n");
@@ -1259,9 +1267,30 @@ static int restore(int argc, const char** argv) {
     return 0;
 }
 
+static constexpr size_t kMaxSyncJobs = 64;
+
+static size_t parse_sync_jobs(const char* jobs_str, const char* what) {
+    size_t jobs;
+    if (!android::base::ParseUint(jobs_str, &jobs, kMaxSyncJobs) || jobs == 0) {
+        fprintf(stderr, "adb: %s must be a number between 1 and %zu. Got \"%s\"\n", what,
+                kMaxSyncJobs, jobs_str);
+        exit(1);
+    }
+    return jobs;
+}
+
+static size_t default_sync_jobs() {
+    const char* jobs_str = getenv("ADB_SYNC_JOBS");
+    if (jobs_str == nullptr || *jobs_str == '\0') {
+        return 1;
+    }
+    return parse_sync_jobs(jobs_str, "Env var ADB_SYNC_JOBS");
+}
+
 static void parse_push_pull_args(const char** arg, int narg, std::vector<const char*>* srcs,
-                                 const char** dst, bool* copy_attrs, bool* sync) {
+                                 const char** dst, bool* copy_attrs, bool* sync, size_t* jobs) {
     *copy_attrs = false;
+    *jobs = default_sync_jobs();
 
     srcs->clear();
     bool ignore_flags = false;
@@ -1277,6 +1306,14 @@ static void parse_push_pull_args(const char** arg, int narg, std::vector<const c
                 if (sync != nullptr) {
                     *sync = true;
                 }
+            } else if (!strcmp(*arg, "-j")) {
+                if (narg < 2) {
+                    syntax_error("-j requires an argument");
+                    exit(1);
+                }
+                ++arg;
+                --narg;
+                *jobs = parse_sync_jobs(*arg, "-j");
             } else if (!strcmp(*arg, "--")) {
                 ignore_flags = true;
             } else {
@@ -1692,21 +1729,23 @@ int adb_commandline(int argc, const char** argv) {
     else if (!strcmp(argv[0], "push")) {
         bool copy_attrs = false;
         bool sync = false;
+        size_t jobs;
         std::vector<const char*> srcs;
         const char* dst = nullptr;
 
-        parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, &sync);
+        parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, &sync, &jobs);
         if (srcs.empty() || !dst) return syntax_error("push requires an argument");
-        return do_sync_push(srcs, dst, sync) ? 0 : 1;
+        return do_sync_push(srcs, dst, sync, jobs) ? 0 : 1;
     }
     else if (!strcmp(argv[0], "pull")) {
         bool copy_attrs = false;
+        size_t jobs;
         std::vector<const char*> srcs;
         const char* dst = ".";
 
-        parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, nullptr);
+        parse_push_pull_args(&argv[1], argc - 1, &srcs, &dst, &copy_attrs, nullptr, &jobs);
         if (srcs.empty()) return syntax_error("pull requires an argument");
-        return do_sync_pull(srcs, dst, copy_attrs) ? 0 : 1;
+        return do_sync_pull(srcs, dst, copy_attrs, nullptr, jobs) ? 0 : 1;
     }
     else if (!strcmp(argv[0], "install")) {
         if (argc < 2) return syntax_error("install requires an argument");
@@ -1723,15 +1762,17 @@ int adb_commandline(int argc, const char** argv) {
     else if (!strcmp(argv[0], "sync")) {
         std::string src;
         bool list_only = false;
-        if (argc < 2) {
-            // No partition specified: sync all of them.
-        } else if (argc >= 2 && strcmp(argv[1], "-l") == 0) {
-            list_only = true;
-            if (argc == 3) src = argv[2];
-        } else if (argc == 2) {
-            src = argv[1];
-        } else {
-            return syntax_error("adb sync [-l] [PARTITION]");
+        size_t jobs = default_sync_jobs();
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "-l") == 0) {
+                list_only = true;
+            } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                jobs = parse_sync_jobs(argv[++i], "-j");
+            } else if (src.empty() && argv[i][0] != '-') {
+                src = argv[i];
+            } else {
+                return syntax_error("adb sync [-l] [-j N] [PARTITION]");
+            }
         }
 
         if (src.empty()) src = "all";
@@ -1743,7 +1784,7 @@ int adb_commandline(int argc, const char** argv) {
                 std::string src_dir{product_file(partition)};
                 if (!directory_exists(src_dir)) continue;
                 found = true;
-                if (!do_sync_sync(src_dir, "/" + partition, list_only)) return 1;
+                if (!do_sync_sync(src_dir, "/" + partition, list_only, jobs)) return 1;
             }
         }
         return found ? 0 : syntax_error("don't know how to sync %s partition", src.c_str());
@@ -1751,7 +1792,8 @@ int adb_commandline(int argc, const char** argv) {
     /* passthrough commands */
     else if (!strcmp(argv[0],"get-state") ||
         !strcmp(argv[0],"get-serialno") ||
-        !strcmp(argv[0],"get-devpath"))
+        !strcmp(argv[0],"get-devpath") ||
+        !strcmp(argv[0],"queue-stats"))
     {
         return adb_query_command(format_host_command(argv[0]));
     }
@@ -21,6 +21,7 @@
 #else
 #include <dirent.h>
 #endif
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
@@ -47,11 +48,17 @@ typedef int mode_t;
 #include <utime.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "sysdeps.h"
@@ -60,6 +67,8 @@ typedef int mode_t;
 #include "adb_client.h"
 #include "adb_io.h"
 #include "adb_utils.h"
+#include "file_sync_compress.h"
+#include "file_sync_delta.h"
 #include "file_sync_protocol.h"
 #include "line_printer.h"
 #include "sysdeps/errno.h"
@@ -68,14 +77,25 @@ typedef int mode_t;
 #include "client/commandline.h"
 
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <android-base/stringprintf.h>
+#include <android-base/thread_annotations.h>
 
-struct syncsendbuf {
-    unsigned id;
-    unsigned size;
-    char data[SYNC_DATA_MAX];
-};
+// Upper bound on the number of requests we'll have in flight on a sync connection. The replies
+// pile up on the device side until we get around to reading them, and if too many of them do,
+// the device stops reading our requests and we're deadlocked.
+static constexpr size_t kSyncWindow = 256;
+
+// The DATA chunk size we ask for when the device lets us choose. Past this, the fewer syscalls
+// no longer make up for the worse cache behavior of the bigger buffers.
+static constexpr size_t kSyncChunkSize = 256 * 1024;
+
+// Files we'll send as a delta against the device's copy, when it has one. Below the minimum, the
+// extra round trip for the signatures costs more than sending the whole file; above the maximum,
+// we'd rather not hold the file in memory.
+static constexpr uint64_t kSyncDeltaMinSize = 256 * 1024;
+static constexpr uint64_t kSyncDeltaMaxSize = 256 * 1024 * 1024;
 
 static void ensure_trailing_separators(std::string& local_path, std::string& remote_path) {
     if (!adb_is_separator(local_path.back())) {
@@ -101,6 +121,7 @@ struct copyinfo {
     uint32_t mode;
     uint64_t size = 0;
     bool skip = false;
+    bool delta = false;
 
     copyinfo(const std::string& local_path,
              const std::string& remote_path,
@@ -121,11 +142,24 @@ enum class TransferDirection {
     pull,
 };
 
+// How a step of pushing a file as a delta went.
+enum class DeltaResult {
+    ok,
+    // The device can't take this file as a delta, so it's to be sent whole instead.
+    rejected,
+    // Sending it whole wouldn't work either: the error has already been reported.
+    failed,
+};
+
 struct TransferLedger {
     std::chrono::steady_clock::time_point start_time;
     uint64_t files_transferred;
     uint64_t files_skipped;
     uint64_t bytes_transferred;
+    // What delta pushes didn't have to send, because the device already had it.
+    uint64_t bytes_reused;
+    // What bytes_transferred came to on the wire, when the connection compresses it.
+    uint64_t bytes_on_wire;
     uint64_t bytes_expected;
     bool expect_multiple_files;
 
@@ -135,7 +169,9 @@ struct TransferLedger {
 
     bool operator==(const TransferLedger& other) const {
         return files_transferred == other.files_transferred &&
-               files_skipped == other.files_skipped && bytes_transferred == other.bytes_transferred;
+               files_skipped == other.files_skipped &&
+               bytes_transferred == other.bytes_transferred && bytes_reused == other.bytes_reused &&
+               bytes_on_wire == other.bytes_on_wire;
     }
 
     bool operator!=(const TransferLedger& other) const {
@@ -147,11 +183,13 @@ struct TransferLedger {
         files_transferred = 0;
         files_skipped = 0;
         bytes_transferred = 0;
+        bytes_reused = 0;
+        bytes_on_wire = 0;
         bytes_expected = 0;
     }
 
     std::string TransferRate() {
-        if (bytes_transferred == 0) return "";
+        if (bytes_transferred == 0 && bytes_reused == 0) return "";
 
         std::chrono::duration<double> duration;
         duration = std::chrono::steady_clock::now() - start_time;
@@ -161,15 +199,27 @@ struct TransferLedger {
             return "";
         }
         double rate = (static_cast<double>(bytes_transferred) / s) / (1024 * 1024);
-        return android::base::StringPrintf(" %.1f MB/s (%" PRIu64 " bytes in %.3fs)", rate,
-                                           bytes_transferred, s);
+        std::string result = android::base::StringPrintf(
+            " %.1f MB/s (%" PRIu64 " bytes in %.3fs)", rate, bytes_transferred, s);
+        if (bytes_reused > 0) {
+            result += android::base::StringPrintf(" %" PRIu64 " bytes reused from device.",
+                                                  bytes_reused);
+        }
+        if (bytes_on_wire > 0 && bytes_on_wire < bytes_transferred) {
+            double ratio = static_cast<double>(bytes_transferred) / bytes_on_wire;
+            double wire_rate = (static_cast<double>(bytes_on_wire) / s) / (1024 * 1024);
+            result += android::base::StringPrintf(" %.1fx compressed, %.1f MB/s on the wire.",
+                                                  ratio, wire_rate);
+        }
+        return result;
     }
 
     void ReportProgress(LinePrinter& lp, const std::string& file, uint64_t file_copied_bytes,
                         uint64_t file_total_bytes) {
         char overall_percentage_str[5] = "?";
-        if (bytes_expected != 0 && bytes_transferred <= bytes_expected) {
-            int overall_percentage = static_cast<int>(bytes_transferred * 100 / bytes_expected);
+        uint64_t bytes_done = bytes_transferred + bytes_reused;
+        if (bytes_expected != 0 && bytes_done <= bytes_expected) {
+            int overall_percentage = static_cast<int>(bytes_done * 100 / bytes_expected);
             // If we're pulling symbolic links, we'll pull the target of the link rather than
             // just create a local link, and that will cause us to go over 100%.
             if (overall_percentage <= 100) {
@@ -219,22 +269,224 @@ struct TransferLedger {
     }
 };
 
+// Writes pulled files out on a thread of its own, so that a slow local disk (or an NFS home
+// directory) doesn't hold up the stream from the device, and a slow device doesn't leave the disk
+// idle. Chunks go round a small ring of buffers, so the two can only get so far apart.
+class LocalFileWriter {
+  public:
+    // |sync_interval|, if it's not 0, is how many bytes to write between calls to fdatasync.
+    LocalFileWriter(size_t buffer_size, uint64_t sync_interval)
+        : buffer_size_(buffer_size), sync_interval_(sync_interval), thread_([this]() { Run(); }) {}
+
+    ~LocalFileWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    LocalFileWriter(const LocalFileWriter& copy) = delete;
+    LocalFileWriter& operator=(const LocalFileWriter& copy) = delete;
+
+    // Starts on |fd|, which is going to be |expected_size| bytes long if the device told us the
+    // truth, and preallocates that much where the filesystem lets us.
+    void Begin(int fd, uint64_t expected_size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        CHECK(jobs_.empty() && !busy_);
+        fd_ = fd;
+        error_ = 0;
+        bytes_written_ = 0;
+        bytes_since_sync_ = 0;
+        preallocated_ = 0;
+#if defined(__linux__)
+        // This keeps big files from ending up in pieces. It's only worth a try: not every
+        // filesystem can, and the size we were given might not be right anyway. The file keeps
+        // the size of what's been written, so an interrupted pull doesn't leave a zeroed tail.
+        preallocated_ =
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected_size) == 0 ? expected_size : 0;
+#endif
+    }
+
+    // A buffer_size buffer to read a chunk into, from the ring if there's one free.
+    std::vector<char> GetBuffer() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) return std::vector<char>(buffer_size_);
+        std::vector<char> buffer = std::move(free_.back());
+        free_.pop_back();
+        return buffer;
+    }
+
+    // Queues the first |length| bytes of |buffer| to be written, once there's room in the ring.
+    // Returns false with errno set if an earlier write has failed.
+    bool Write(std::vector<char> buffer, size_t length) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return error_ != 0 || jobs_.size() < kRingSize; });
+        if (error_ != 0) {
+            errno = error_;
+            return false;
+        }
+        jobs_.push_back(Job{std::move(buffer), length});
+        cv_.notify_all();
+        return true;
+    }
+
+    // Waits for the file to be written, flushes it if we're doing that, and releases any
+    // preallocated blocks it didn't use. Returns false with errno set if any of that failed.
+    bool Finish() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return jobs_.empty() && !busy_; });
+#if defined(__linux__)
+        // Truncating to the size the file already has still frees the blocks past its end.
+        if (error_ == 0 && preallocated_ > bytes_written_ && ftruncate(fd_, bytes_written_)) {
+            error_ = errno;
+        }
+#endif
+        if (error_ == 0 && sync_interval_ != 0 && SyncFileData(fd_)) {
+            error_ = errno;
+        }
+        fd_ = -1;
+        errno = error_;
+        return error_ == 0;
+    }
+
+    // Drops whatever hasn't been written yet, and waits for the write in progress, so the file
+    // can be closed.
+    void Abandon() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        jobs_.clear();
+        cv_.wait(lock, [this]() { return !busy_; });
+        fd_ = -1;
+    }
+
+  private:
+    static constexpr size_t kRingSize = 8;
+
+    struct Job {
+        std::vector<char> buffer;
+        size_t length;
+    };
+
+    static int SyncFileData(int fd) {
+#if defined(_WIN32)
+        // Our fds aren't the CRT's, so there's nothing to hand to _commit.
+        return 0;
+#elif defined(__linux__)
+        return fdatasync(fd);
+#else
+        return fsync(fd);
+#endif
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this]() { return quit_ || !jobs_.empty(); });
+            if (jobs_.empty()) return;
+
+            Job job = std::move(jobs_.front());
+            jobs_.pop_front();
+            busy_ = true;
+            int fd = fd_;
+            bool write = error_ == 0;
+            bool sync = sync_interval_ != 0 && bytes_since_sync_ + job.length >= sync_interval_;
+            lock.unlock();
+
+            int error = 0;
+            if (write && !WriteFdExactly(fd, job.buffer.data(), job.length)) {
+                error = errno;
+            } else if (write && sync && SyncFileData(fd)) {
+                error = errno;
+            }
+
+            lock.lock();
+            busy_ = false;
+            if (error != 0 && error_ == 0) error_ = error;
+            bytes_written_ += job.length;
+            bytes_since_sync_ = sync ? 0 : bytes_since_sync_ + job.length;
+            if (job.buffer.size() == buffer_size_ && free_.size() < kRingSize) {
+                free_.push_back(std::move(job.buffer));
+            }
+            cv_.notify_all();
+        }
+    }
+
+    const size_t buffer_size_;
+    const uint64_t sync_interval_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    std::vector<std::vector<char>> free_;
+    bool busy_ = false;
+    bool quit_ = false;
+
+    int fd_ = -1;
+    int error_ = 0;
+    uint64_t bytes_written_ = 0;
+    uint64_t bytes_since_sync_ = 0;
+    uint64_t preallocated_ = 0;
+
+    std::thread thread_;
+};
+
+// Progress of a transfer, shared by all of the connections working on it.
+struct TransferProgress {
+    std::mutex mutex;
+    TransferLedger global_ledger GUARDED_BY(mutex);
+    TransferLedger current_ledger GUARDED_BY(mutex);
+    LinePrinter line_printer GUARDED_BY(mutex);
+};
+
 class SyncConnection {
   public:
-    SyncConnection() : expect_done_(false) {
-        max = SYNC_DATA_MAX; // TODO: decide at runtime.
+    SyncConnection() : SyncConnection(nullptr) {}
+
+    // A connection opened with another one's progress reports through it, so that several
+    // connections can work on the same transfer from their own threads. Such a helper doesn't
+    // report failing to connect: see ConnectError().
+    explicit SyncConnection(std::shared_ptr<TransferProgress> progress)
+        : expect_done_(false), progress_(std::move(progress)), owns_progress_(!progress_) {
+        if (owns_progress_) {
+            progress_ = std::make_shared<TransferProgress>();
+        }
+        max = SYNC_DATA_MAX;
 
         std::string error;
         if (!adb_get_feature_set(&features_, &error)) {
             fd = -1;
-            Error("failed to get feature set: %s", error.c_str());
+            connect_error_ = "failed to get feature set: " + error;
         } else {
             have_stat_v2_ = CanUseFeature(features_, kFeatureStat2);
-            fd = adb_connect("sync:", &error);
+            have_sync_pipeline_ = CanUseFeature(features_, kFeatureSyncPipeline);
+            have_sync_delta_ = CanUseFeature(features_, kFeatureSyncDelta);
+            have_sync_list_tree_ = CanUseFeature(features_, kFeatureSyncListTree);
+            have_lstat_batch_ = have_stat_v2_ && CanUseFeature(features_, kFeatureSyncLstatBatch);
+
+            std::vector<std::string> options;
+            if (CanUseFeature(features_, kFeatureSyncChunkSize)) {
+                max = ChunkSize();
+                options.push_back(android::base::StringPrintf("chunk_size=%zu", max));
+            }
+            const char* compress_str = getenv("ADB_SYNC_COMPRESS");
+            if (CanUseFeature(features_, kFeatureSyncCompress) &&
+                (compress_str == nullptr || strcmp(compress_str, "0") != 0)) {
+                compress_ = true;
+                options.push_back("compress");
+            }
+            std::string service = "sync:" + android::base::Join(options, ",");
+            buffer.resize(max);
+            copier_ = std::make_unique<FdCopier>(max);
+
+            fd = adb_connect(service, &error);
             if (fd < 0) {
-                Error("connect failed: %s", error.c_str());
+                connect_error_ = "connect failed: " + error;
             }
         }
+        if (!connect_error_.empty() && owns_progress_) {
+            Error("%s", connect_error_.c_str());
+        }
     }
 
     ~SyncConnection() {
@@ -251,59 +503,118 @@ class SyncConnection {
         }
         adb_close(fd);
 
-        line_printer_.KeepInfoLine();
+        if (owns_progress_) {
+            std::lock_guard<std::mutex> lock(progress_->mutex);
+            progress_->line_printer.KeepInfoLine();
+        }
     }
 
     const FeatureSet& Features() const { return features_; }
 
+    bool HaveSyncDelta() const { return have_sync_delta_; }
+    bool HaveSyncListTree() const { return have_sync_list_tree_; }
+
+    const std::shared_ptr<TransferProgress>& Progress() const { return progress_; }
+
+    // The thread that writes out the files we pull, started the first time we need it.
+    LocalFileWriter& Writer() {
+        if (!writer_) {
+            writer_ = std::make_unique<LocalFileWriter>(max, FdatasyncInterval());
+        }
+        return *writer_;
+    }
+
     bool IsValid() { return fd >= 0; }
 
+    // Why the connection isn't valid, if it isn't.
+    const std::string& ConnectError() const { return connect_error_; }
+
     bool ReceivedError(const char* from, const char* to) {
-        adb_pollfd pfd;
-       	pfd.fd = fd; pfd.events = POLLIN;
-        int rc = adb_poll(&pfd, 1, 0);
-        if (rc < 0) {
-            Error("failed to poll: %s", strerror(errno));
-            return true;
+        while (true) {
+            adb_pollfd pfd;
+            pfd.fd = fd; pfd.events = POLLIN;
+            int rc = adb_poll(&pfd, 1, 0);
+            if (rc < 0) {
+                Error("failed to poll: %s", strerror(errno));
+                return true;
+            }
+            if (rc == 0) return false;
+
+            // The statuses of pending sends come first: only what follows them is about this file.
+            if (pending_sends_.empty() || !ReadSendStatus()) return true;
         }
-        return rc != 0;
     }
 
     void NewTransfer() {
-        current_ledger_.Reset();
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.Reset();
     }
 
     void RecordBytesTransferred(size_t bytes) {
-        current_ledger_.bytes_transferred += bytes;
-        global_ledger_.bytes_transferred += bytes;
+        RecordBytesTransferred(bytes, bytes);
+    }
+
+    // For file data that took |wire_bytes| to send compressed.
+    void RecordBytesTransferred(size_t bytes, size_t wire_bytes) {
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.bytes_transferred += bytes;
+        progress_->global_ledger.bytes_transferred += bytes;
+        if (compress_) {
+            progress_->current_ledger.bytes_on_wire += wire_bytes;
+            progress_->global_ledger.bytes_on_wire += wire_bytes;
+        }
+    }
+
+    void RecordBytesReused(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.bytes_reused += bytes;
+        progress_->global_ledger.bytes_reused += bytes;
     }
 
     void RecordFilesTransferred(size_t files) {
-        current_ledger_.files_transferred += files;
-        global_ledger_.files_transferred += files;
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.files_transferred += files;
+        progress_->global_ledger.files_transferred += files;
     }
 
     void RecordFilesSkipped(size_t files) {
-        current_ledger_.files_skipped += files;
-        global_ledger_.files_skipped += files;
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.files_skipped += files;
+        progress_->global_ledger.files_skipped += files;
     }
 
     void ReportProgress(const std::string& file, uint64_t file_copied_bytes,
                         uint64_t file_total_bytes) {
-        current_ledger_.ReportProgress(line_printer_, file, file_copied_bytes, file_total_bytes);
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.ReportProgress(progress_->line_printer, file, file_copied_bytes,
+                                                 file_total_bytes);
     }
 
     void ReportTransferRate(const std::string& file, TransferDirection direction) {
-        current_ledger_.ReportTransferRate(line_printer_, file, direction);
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.ReportTransferRate(progress_->line_printer, file, direction);
     }
 
     void ReportOverallTransferRate(TransferDirection direction) {
-        if (current_ledger_ != global_ledger_) {
-            global_ledger_.ReportTransferRate(line_printer_, "", direction);
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        if (progress_->current_ledger != progress_->global_ledger) {
+            progress_->global_ledger.ReportTransferRate(progress_->line_printer, "", direction);
         }
     }
 
     bool SendRequest(int id, const char* path_and_mode) {
+        if (id == ID_SEND) {
+            // There's no reply until the file is done, so the statuses of pending sends can wait,
+            // but the small files batched up before it can't.
+            if (!pending_sends_.empty()) {
+                const std::pair<std::string, std::string>& newest = pending_sends_.back();
+                FlushSendBuffer(newest.first.c_str(), newest.second.c_str());
+            }
+        } else if (!pending_sends_.empty() && !ReadPendingSendStatuses()) {
+            // Anything else has a reply that would queue up behind those statuses.
+            return false;
+        }
+
         size_t path_length = strlen(path_and_mode);
         if (path_length > 1024) {
             Error("SendRequest failed: path too long: %zu", path_length);
@@ -339,6 +650,47 @@ class SyncConnection {
         }
     }
 
+    // Sends an lstat for each of |paths|, in one request if the device can take them that way.
+    // Either way, each has its own reply for FinishStat.
+    bool SendLstats(const std::vector<const char*>& paths) {
+        if (!have_lstat_batch_ || paths.size() < 2) {
+            for (const char* path : paths) {
+                if (!SendLstat(path)) return false;
+            }
+            return true;
+        }
+
+        if (!pending_sends_.empty() && !ReadPendingSendStatuses()) {
+            return false;
+        }
+
+        std::vector<char> buf;
+        for (size_t i = 0; i < paths.size(); i += SYNC_LSTAT_BATCH_MAX) {
+            size_t count = std::min<size_t>(paths.size() - i, SYNC_LSTAT_BATCH_MAX);
+            buf.resize(sizeof(SyncRequest) + sizeof(syncmsg::lstat_batch));
+            for (size_t j = i; j < i + count; ++j) {
+                size_t path_length = strlen(paths[j]);
+                if (path_length > 1024) {
+                    Error("SendLstats failed: path too long: %zu", path_length);
+                    errno = ENAMETOOLONG;
+                    return false;
+                }
+                buf.insert(buf.end(), paths[j], paths[j] + path_length + 1);
+            }
+
+            SyncRequest* req = reinterpret_cast<SyncRequest*>(&buf[0]);
+            req->id = ID_LSTAT_BATCH;
+            req->path_length = 0;
+            syncmsg msg;
+            msg.lstat_batch.id = ID_LSTAT_BATCH;
+            msg.lstat_batch.count = count;
+            msg.lstat_batch.size = buf.size() - sizeof(SyncRequest) - sizeof(msg.lstat_batch);
+            memcpy(req + 1, &msg.lstat_batch, sizeof(msg.lstat_batch));
+            if (!WriteFdExactly(fd, &buf[0], buf.size())) return false;
+        }
+        return true;
+    }
+
     bool FinishStat(struct stat* st) {
         syncmsg msg;
 
@@ -395,11 +747,13 @@ class SyncConnection {
     }
 
     // Sending header, payload, and footer in a single write makes a huge
-    // difference to "adb sync" performance.
+    // difference to "adb sync" performance. When sends are pipelined, we go
+    // further and batch several small files into each write. The data of a
+    // regular file is sent compressed if it's worth it.
     bool SendSmallFile(const char* path_and_mode,
                        const char* lpath, const char* rpath,
                        unsigned mtime,
-                       const char* data, size_t data_length) {
+                       const char* data, size_t data_length, bool regular_file) {
         size_t path_length = strlen(path_and_mode);
         if (path_length > 1024) {
             Error("SendSmallFile failed: path too long: %zu", path_length);
@@ -407,35 +761,35 @@ class SyncConnection {
             return false;
         }
 
-        std::vector<char> buf(sizeof(SyncRequest) + path_length +
-                              sizeof(SyncRequest) + data_length +
-                              sizeof(SyncRequest));
-        char* p = &buf[0];
-
-        SyncRequest* req_send = reinterpret_cast<SyncRequest*>(p);
-        req_send->id = ID_SEND;
-        req_send->path_length = path_length;
-        p += sizeof(SyncRequest);
-        memcpy(p, path_and_mode, path_length);
-        p += path_length;
-
-        SyncRequest* req_data = reinterpret_cast<SyncRequest*>(p);
-        req_data->id = ID_DATA;
-        req_data->path_length = data_length;
-        p += sizeof(SyncRequest);
-        memcpy(p, data, data_length);
-        p += data_length;
+        SyncRequest req;
+        req.id = ID_SEND;
+        req.path_length = path_length;
+        AppendToSendBuffer(&req, sizeof(req));
+        AppendToSendBuffer(path_and_mode, path_length);
+
+        size_t wire_length = data_length;
+        size_t offset = send_buffer_.size();
+        if (compress_ && regular_file && data_length >= kSyncMinCompressSize &&
+            SyncAppendCompressed(data, data_length, &send_buffer_)) {
+            wire_length = send_buffer_.size() - offset;
+        } else {
+            req.id = ID_DATA;
+            req.path_length = data_length;
+            AppendToSendBuffer(&req, sizeof(req));
+            AppendToSendBuffer(data, data_length);
+        }
 
-        SyncRequest* req_done = reinterpret_cast<SyncRequest*>(p);
-        req_done->id = ID_DONE;
-        req_done->path_length = mtime;
-        p += sizeof(SyncRequest);
+        req.id = ID_DONE;
+        req.path_length = mtime;
+        AppendToSendBuffer(&req, sizeof(req));
 
-        WriteOrDie(lpath, rpath, &buf[0], (p - &buf[0]));
+        if (!have_sync_pipeline_ || send_buffer_.size() >= max) {
+            FlushSendBuffer(lpath, rpath);
+        }
         expect_done_ = true;
 
-        // RecordFilesTransferred gets called in CopyDone.
-        RecordBytesTransferred(data_length);
+        // RecordFilesTransferred gets called in CopyDone or ReadSendStatus.
+        RecordBytesTransferred(data_length, wire_length);
         ReportProgress(rpath, data_length, data_length);
         return true;
     }
@@ -463,23 +817,39 @@ class SyncConnection {
             return false;
         }
 
-        syncsendbuf sbuf;
-        sbuf.id = ID_DATA;
-        while (true) {
-            int bytes_read = adb_read(lfd, sbuf.data, max - sizeof(SyncRequest));
-            if (bytes_read == -1) {
-                Error("reading '%s' locally failed: %s", lpath, strerror(errno));
+        if (compress_) {
+            bool result = SendCompressedData(lfd, lpath, rpath, total_size);
+            adb_close(lfd);
+            if (!result) return false;
+            return SendDone(lpath, rpath, mtime);
+        }
+
+        // The header of each chunk gives its size up front, so we send as much as stat told us
+        // about, and let the kernel move the data where it can.
+        SyncRequest req_data;
+        req_data.id = ID_DATA;
+        while (bytes_copied < total_size) {
+            req_data.path_length = std::min<uint64_t>(total_size - bytes_copied,
+                                                      max - sizeof(SyncRequest));
+            if (!WriteOrDie(lpath, rpath, &req_data, sizeof(req_data))) {
                 adb_close(lfd);
                 return false;
-            } else if (bytes_read == 0) {
-                break;
             }
 
-            sbuf.size = bytes_read;
-            WriteOrDie(lpath, rpath, &sbuf, sizeof(SyncRequest) + bytes_read);
+            FdCopier::Result result = copier_->Copy(fd, lfd, req_data.path_length);
+            if (result != FdCopier::Result::kSuccess) {
+                if (result == FdCopier::Result::kReadFailed) {
+                    Error("reading '%s' locally failed: %s", lpath,
+                          errno == 0 ? "file shrank" : strerror(errno));
+                } else {
+                    Error("%u-byte write failed: %s", req_data.path_length, strerror(errno));
+                }
+                adb_close(lfd);
+                return false;
+            }
 
-            RecordBytesTransferred(bytes_read);
-            bytes_copied += bytes_read;
+            RecordBytesTransferred(req_data.path_length);
+            bytes_copied += req_data.path_length;
 
             // Check to see if we've received an error from the other side.
             if (ReceivedError(lpath, rpath)) {
@@ -490,14 +860,135 @@ class SyncConnection {
         }
 
         adb_close(lfd);
+        return SendDone(lpath, rpath, mtime);
+    }
+
+    // Asks for the block signatures of the device's copy of |rpath|. The request is rejected if the
+    // device has none to give.
+    DeltaResult GetDeltaSignatures(const char* rpath, uint64_t* size, size_t* block_size,
+                                   std::vector<DeltaBlockSignature>* signatures) {
+        if (!SendRequest(ID_SIGS, rpath)) {
+            Error("failed to send ID_SIGS message '%s': %s", rpath, strerror(errno));
+            return DeltaResult::failed;
+        }
+
+        syncmsg msg;
+        if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
+            fatal_errno("protocol fault: failed to read signatures response");
+        }
+        if (msg.status.id == ID_FAIL) {
+            std::string reason(msg.status.msglen, '\0');
+            if (!ReadFdExactly(fd, &reason[0], reason.size())) {
+                fatal_errno("protocol fault: failed to read signatures failure");
+            }
+            return DeltaResult::rejected;
+        }
+        if (msg.sigs.id != ID_SIGS) {
+            fatal_errno("protocol fault: signatures response has wrong message id: %" PRIx32,
+                        msg.sigs.id);
+        }
+        if (!ReadFdExactly(fd, &msg.sigs.size, sizeof(msg.sigs.size))) {
+            fatal_errno("protocol fault: failed to read signatures response");
+        }
+
+        *size = msg.sigs.size;
+        *block_size = msg.sigs.block_size;
+        if (*block_size == 0 || *size / *block_size > (1 << 24)) {
+            fatal("protocol fault: %" PRIu64 "-byte file in %zu-byte blocks", *size, *block_size);
+        }
+        signatures->resize((*size + *block_size - 1) / *block_size);
+        size_t signatures_length = signatures->size() * sizeof(DeltaBlockSignature);
+        if (!ReadFdExactly(fd, signatures->data(), signatures_length)) {
+            fatal_errno("protocol fault: failed to read signatures");
+        }
+        return DeltaResult::ok;
+    }
+
+    // Sends |data| to |rpath| as |ops| against the file that GetDeltaSignatures described, and
+    // waits for the result. The delta is rejected if the device couldn't rebuild the file from it.
+    DeltaResult SendDeltaFile(const char* path_and_mode, const char* lpath, const char* rpath,
+                              unsigned mtime, const std::string& data,
+                              const std::vector<DeltaOp>& ops) {
+        if (!SendRequest(ID_DELTA, path_and_mode)) {
+            Error("failed to send ID_DELTA message '%s': %s", path_and_mode, strerror(errno));
+            return DeltaResult::failed;
+        }
+
+        // The COPY messages are tiny, so they're batched with the DATA around them.
+        std::vector<char> out;
+        auto append = [&out](const void* p, size_t len) {
+            out.insert(out.end(), static_cast<const char*>(p), static_cast<const char*>(p) + len);
+        };
+        auto flush = [&]() {
+            WriteOrDie(lpath, rpath, out.data(), out.size());
+            out.clear();
+        };
+
+        uint64_t bytes_done = 0;
+        uint64_t bytes_reused = 0;
+        for (const DeltaOp& op : ops) {
+            for (uint64_t done = 0; done < op.length;) {
+                if (op.type == DeltaOp::kCopy) {
+                    syncmsg msg;
+                    msg.copy.id = ID_COPY;
+                    msg.copy.size = std::min<uint64_t>(op.length - done, UINT32_MAX);
+                    msg.copy.offset = op.offset + done;
+                    append(&msg.copy, sizeof(msg.copy));
+                    done += msg.copy.size;
+                } else {
+                    SyncRequest req_data;
+                    req_data.id = ID_DATA;
+                    req_data.path_length =
+                        std::min<uint64_t>(op.length - done, max - sizeof(SyncRequest));
+                    append(&req_data, sizeof(req_data));
+                    append(&data[op.offset + done], req_data.path_length);
+                    done += req_data.path_length;
+                    RecordBytesTransferred(req_data.path_length);
+                }
+                if (out.size() >= max) {
+                    flush();
+                }
+            }
+
+            bytes_done += op.length;
+            if (op.type == DeltaOp::kCopy) {
+                bytes_reused += op.length;
+            }
+            ReportProgress(rpath, bytes_done, data.size());
+        }
 
         syncmsg msg;
         msg.data.id = ID_DONE;
         msg.data.size = mtime;
-        expect_done_ = true;
+        append(&msg.data, sizeof(msg.data));
+        DeltaDigest digest;
+        digest.Update(data.data(), data.size());
+        uint8_t expected[SYNC_DELTA_DIGEST_SIZE];
+        digest.Finish(expected);
+        append(expected, sizeof(expected));
+        flush();
 
-        // RecordFilesTransferred gets called in CopyDone.
-        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+        if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
+            Error("failed to copy '%s' to '%s': couldn't read from device", lpath, rpath);
+            return DeltaResult::failed;
+        }
+        if (msg.status.id == ID_OKAY) {
+            RecordBytesReused(bytes_reused);
+            RecordFilesTransferred(1);
+            return DeltaResult::ok;
+        }
+        if (msg.status.id != ID_FAIL) {
+            Error("failed to copy '%s' to '%s': unknown reason %d", lpath, rpath, msg.status.id);
+            return DeltaResult::failed;
+        }
+
+        // Most likely, the file changed on the device since it sent its signatures.
+        std::string reason(msg.status.msglen, '\0');
+        if (!ReadFdExactly(fd, &reason[0], reason.size())) {
+            Error("failed to copy '%s' to '%s': couldn't read from device", lpath, rpath);
+            return DeltaResult::failed;
+        }
+        return DeltaResult::rejected;
     }
 
     bool CopyDone(const char* from, const char* to) {
@@ -523,6 +1014,29 @@ class SyncConnection {
         return ReportCopyFailure(from, to, msg);
     }
 
+    // Finishes a file started with SendSmallFile or SendLargeFile. If the device supports it, we
+    // don't wait for its status: that's read when the window is full, or by FinishPendingSends.
+    bool FinishSend(const char* from, const char* to) {
+        if (!have_sync_pipeline_) {
+            return CopyDone(from, to);
+        }
+
+        expect_done_ = false;
+        pending_sends_.emplace_back(from, to);
+        if (pending_sends_.size() > kSyncWindow) {
+            return ReadSendStatus();
+        }
+        return true;
+    }
+
+    // Waits for the status of every pending send, and returns false if any of them failed since
+    // the last call.
+    bool FinishPendingSends() {
+        bool success = ReadPendingSendStatuses() && !pending_send_failed_;
+        pending_send_failed_ = false;
+        return success;
+    }
+
     bool ReportCopyFailure(const char* from, const char* to, const syncmsg& msg) {
         std::vector<char> buf(msg.status.msglen + 1);
         if (!ReadFdExactly(fd, &buf[0], msg.status.msglen)) {
@@ -560,7 +1074,8 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::INFO);
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->line_printer.Print(s, LinePrinter::INFO);
     }
 
     void Println(FORMAT_STRING(const char* fmt), ...)
@@ -575,8 +1090,9 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::INFO);
-        line_printer_.KeepInfoLine();
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->line_printer.Print(s, LinePrinter::INFO);
+        progress_->line_printer.KeepInfoLine();
     }
 
     void Error(FORMAT_STRING(const char* fmt), ...)
@@ -591,7 +1107,8 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::ERROR);
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->line_printer.Print(s, LinePrinter::ERROR);
     }
 
     void Warning(FORMAT_STRING(const char* fmt), ...)
@@ -606,41 +1123,213 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::WARNING);
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->line_printer.Print(s, LinePrinter::WARNING);
     }
 
     void ComputeExpectedTotalBytes(const std::vector<copyinfo>& file_list) {
-        current_ledger_.bytes_expected = 0;
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        TransferLedger& ledger = progress_->current_ledger;
+        ledger.bytes_expected = 0;
         for (const copyinfo& ci : file_list) {
             // Unfortunately, this doesn't work for symbolic links, because we'll copy the
             // target of the link rather than just creating a link. (But ci.size is the link size.)
-            if (!ci.skip) current_ledger_.bytes_expected += ci.size;
+            if (!ci.skip) ledger.bytes_expected += ci.size;
         }
-        current_ledger_.expect_multiple_files = true;
+        ledger.expect_multiple_files = true;
     }
 
     void SetExpectedTotalBytes(uint64_t expected_total_bytes) {
-        current_ledger_.bytes_expected = expected_total_bytes;
-        current_ledger_.expect_multiple_files = false;
+        std::lock_guard<std::mutex> lock(progress_->mutex);
+        progress_->current_ledger.bytes_expected = expected_total_bytes;
+        progress_->current_ledger.expect_multiple_files = false;
     }
 
-    // TODO: add a char[max] buffer here, to replace syncsendbuf...
     int fd;
+
+    // The largest DATA chunk either side will send, and a buffer to hold one.
     size_t max;
+    std::vector<char> buffer;
 
   private:
     bool expect_done_;
     FeatureSet features_;
     bool have_stat_v2_;
+    bool have_sync_pipeline_ = false;
+    bool have_sync_delta_ = false;
+    bool have_sync_list_tree_ = false;
+    bool have_lstat_batch_ = false;
+
+    // Whether we asked the device to send file data compressed, in which case we compress what
+    // we send it too.
+    bool compress_ = false;
+
+    // Files that have been sent without waiting for their status, as (from, to), oldest first.
+    std::deque<std::pair<std::string, std::string>> pending_sends_;
+    bool pending_send_failed_ = false;
+
+    // Small files that haven't been written yet.
+    std::vector<char> send_buffer_;
 
-    TransferLedger global_ledger_;
-    TransferLedger current_ledger_;
-    LinePrinter line_printer_;
+    // Moves the data of large files.
+    std::unique_ptr<FdCopier> copier_;
+
+    std::unique_ptr<LocalFileWriter> writer_;
+
+    std::shared_ptr<TransferProgress> progress_;
+    bool owns_progress_;
+    std::string connect_error_;
 
     bool SendQuit() {
         return SendRequest(ID_QUIT, ""); // TODO: add a SendResponse?
     }
 
+    void AppendToSendBuffer(const void* data, size_t length) {
+        const char* p = reinterpret_cast<const char*>(data);
+        send_buffer_.insert(send_buffer_.end(), p, p + length);
+    }
+
+    bool SendDone(const char* lpath, const char* rpath, unsigned mtime) {
+        syncmsg msg;
+        msg.data.id = ID_DONE;
+        msg.data.size = mtime;
+        expect_done_ = true;
+
+        // RecordFilesTransferred gets called in CopyDone or ReadSendStatus.
+        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+    }
+
+    // SendLargeFile's data when we're compressing: chunks are compressed on other threads, while
+    // we read the ones after them and send the ones before.
+    bool SendCompressedData(int lfd, const char* lpath, const char* rpath, uint64_t total_size) {
+        SyncCodecPipeline compressor(SyncCodecPipeline::kCompress, max);
+        uint64_t bytes_read = 0;
+        uint64_t bytes_copied = 0;
+
+        auto send_oldest = [&]() {
+            SyncCodecChunk chunk = compressor.Pop();
+            if (!WriteOrDie(lpath, rpath, chunk.message.data(), chunk.message.size())) {
+                return false;
+            }
+            RecordBytesTransferred(chunk.data.size(), chunk.message.size());
+            bytes_copied += chunk.data.size();
+            ReportProgress(rpath, bytes_copied, total_size);
+            return true;
+        };
+
+        while (bytes_read < total_size) {
+            std::vector<char> chunk(
+                    std::min<uint64_t>(total_size - bytes_read, compressor.max_data_size()));
+            if (!ReadFdExactly(lfd, chunk.data(), chunk.size())) {
+                Error("reading '%s' locally failed: %s", lpath,
+                      errno == 0 ? "file shrank" : strerror(errno));
+                return false;
+            }
+            bytes_read += chunk.size();
+
+            if (compressor.full() && !send_oldest()) return false;
+            compressor.Push(std::move(chunk));
+
+            // Check to see if we've received an error from the other side.
+            if (ReceivedError(lpath, rpath)) {
+                break;
+            }
+        }
+
+        while (!compressor.empty()) {
+            if (!send_oldest()) return false;
+        }
+        return true;
+    }
+
+    // The DATA chunk size to ask for when the device lets us choose: kSyncChunkSize, unless
+    // overridden by $ADB_SYNC_CHUNK_SIZE.
+    size_t ChunkSize() {
+        const char* chunk_size_str = getenv("ADB_SYNC_CHUNK_SIZE");
+        if (chunk_size_str == nullptr || *chunk_size_str == '\0') {
+            return kSyncChunkSize;
+        }
+
+        size_t chunk_size;
+        if (!android::base::ParseUint(chunk_size_str, &chunk_size,
+                                      static_cast<size_t>(SYNC_CHUNK_SIZE_MAX)) ||
+            chunk_size < SYNC_DATA_MAX) {
+            // Helpers would only say it again.
+            if (owns_progress_) {
+                Warning("ignoring $ADB_SYNC_CHUNK_SIZE '%s': must be between %dk and %dk",
+                        chunk_size_str, SYNC_DATA_MAX / 1024, SYNC_CHUNK_SIZE_MAX / 1024);
+            }
+            return kSyncChunkSize;
+        }
+        return chunk_size;
+    }
+
+    // How often the files we pull should be flushed to disk: every $ADB_SYNC_FDATASYNC MiB, or
+    // never, leaving it to the OS. Flushing as we go keeps a slow disk from building up a backlog
+    // of dirty pages that stalls everything once it has to be written back.
+    uint64_t FdatasyncInterval() {
+        const char* interval_str = getenv("ADB_SYNC_FDATASYNC");
+        if (interval_str == nullptr || *interval_str == '\0') {
+            return 0;
+        }
+
+        uint64_t interval;
+        if (!android::base::ParseUint(interval_str, &interval, UINT64_MAX >> 20) ||
+            interval == 0) {
+            Warning("ignoring $ADB_SYNC_FDATASYNC '%s': must be a number of MiB", interval_str);
+            return 0;
+        }
+        return interval << 20;
+    }
+
+    void FlushSendBuffer(const char* from, const char* to) {
+        if (!send_buffer_.empty()) {
+            WriteOrDie(from, to, &send_buffer_[0], send_buffer_.size());
+            send_buffer_.clear();
+        }
+    }
+
+    // Reads the status of the oldest pending send. A file that the device failed to write is
+    // reported and remembered for FinishPendingSends; false means the connection is unusable.
+    bool ReadSendStatus() {
+        const std::pair<std::string, std::string>& newest = pending_sends_.back();
+        FlushSendBuffer(newest.first.c_str(), newest.second.c_str());
+
+        std::pair<std::string, std::string> send = std::move(pending_sends_.front());
+        pending_sends_.pop_front();
+        const char* from = send.first.c_str();
+        const char* to = send.second.c_str();
+
+        syncmsg msg;
+        if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
+            Error("failed to copy '%s' to '%s': couldn't read from device", from, to);
+        } else if (msg.status.id == ID_OKAY) {
+            RecordFilesTransferred(1);
+            return true;
+        } else if (msg.status.id != ID_FAIL) {
+            Error("failed to copy '%s' to '%s': unknown reason %d", from, to, msg.status.id);
+        } else {
+            // If we couldn't read the reason, we'll find out when we try to read the next status.
+            ReportCopyFailure(from, to, msg);
+            pending_send_failed_ = true;
+            return true;
+        }
+
+        // There's no telling where the rest of the statuses went.
+        pending_sends_.clear();
+        pending_send_failed_ = true;
+        return false;
+    }
+
+    bool ReadPendingSendStatuses() {
+        while (!pending_sends_.empty()) {
+            if (!ReadSendStatus()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     bool WriteOrDie(const char* from, const char* to, const void* data, size_t data_length) {
         if (!WriteFdExactly(fd, data, data_length)) {
             if (errno == ECONNRESET) {
@@ -687,6 +1376,31 @@ static bool sync_ls(SyncConnection& sc, const char* path,
     }
 }
 
+typedef void(sync_list_tree_cb)(const syncmsg& msg, const std::string& name);
+
+// Lists everything under |path| with a single request, passing each entry's path relative to
+// |path| along with it.
+static bool sync_list_tree(SyncConnection& sc, const char* path,
+                           const std::function<sync_list_tree_cb>& func) {
+    if (!sc.SendRequest(ID_LIST_TREE, path)) return false;
+
+    std::string name;
+    while (true) {
+        syncmsg msg;
+        if (!ReadFdExactly(sc.fd, &msg.tree_dent, sizeof(msg.tree_dent))) return false;
+
+        if (msg.tree_dent.id == ID_DONE) return true;
+        if (msg.tree_dent.id != ID_TREE_DENT) return false;
+
+        // Names are paths, but there's no limit on how deep they go.
+        if (msg.tree_dent.namelen > 64 * 1024) return false;
+        name.resize(msg.tree_dent.namelen);
+        if (!ReadFdExactly(sc.fd, &name[0], name.size())) return false;
+
+        func(msg, name);
+    }
+}
+
 static bool sync_stat(SyncConnection& sc, const char* path, struct stat* st) {
     return sc.SendStat(path) && sc.FinishStat(st);
 }
@@ -728,8 +1442,45 @@ static bool sync_stat_fallback(SyncConnection& sc, const char* path, struct stat
     return true;
 }
 
+// Whether to push a |local_size|-byte file over the device's |remote_st| one as a delta.
+static bool should_send_delta(SyncConnection& sc, mode_t local_mode, uint64_t local_size,
+                              const struct stat& remote_st) {
+    uint64_t remote_size = remote_st.st_size;
+    return sc.HaveSyncDelta() && S_ISREG(local_mode) && S_ISREG(remote_st.st_mode) &&
+           local_size >= kSyncDeltaMinSize && local_size <= kSyncDeltaMaxSize &&
+           remote_size >= kSyncDeltaMinSize && remote_size <= kSyncDeltaMaxSize;
+}
+
+// Sends only what's changed in |lpath| since the device's copy at |rpath|. If that's rejected, the
+// file is still to be sent whole.
+static DeltaResult sync_send_delta(SyncConnection& sc, const char* lpath, const char* rpath,
+                                   unsigned mtime, const std::string& path_and_mode) {
+    uint64_t basis_size;
+    size_t block_size;
+    std::vector<DeltaBlockSignature> signatures;
+    DeltaResult result = sc.GetDeltaSignatures(rpath, &basis_size, &block_size, &signatures);
+    if (result != DeltaResult::ok) {
+        return result;
+    }
+
+    // If this fails, sending the file whole will too, and report why.
+    std::string data;
+    if (!android::base::ReadFileToString(lpath, &data, true)) {
+        return DeltaResult::rejected;
+    }
+
+    std::vector<DeltaOp> ops =
+        ComputeDelta(data.data(), data.size(), basis_size, block_size, signatures);
+    if (std::none_of(ops.begin(), ops.end(),
+                     [](const DeltaOp& op) { return op.type == DeltaOp::kCopy; })) {
+        return DeltaResult::rejected;
+    }
+    return sc.SendDeltaFile(path_and_mode.c_str(), lpath, rpath, mtime, data, ops);
+}
+
+// With |delta|, the device has an older version of the file worth sending a delta against.
 static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath, unsigned mtime,
-                      mode_t mode, bool sync) {
+                      mode_t mode, bool sync, bool delta) {
     std::string path_and_mode = android::base::StringPrintf("%s,%d", rpath, mode);
 
     if (sync) {
@@ -741,6 +1492,17 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
                 sc.RecordFilesSkipped(1);
                 return true;
             }
+
+            struct stat local_st;
+            delta = stat(lpath, &local_st) == 0 &&
+                    should_send_delta(sc, mode, local_st.st_size, st);
+        }
+    }
+
+    if (delta) {
+        DeltaResult result = sync_send_delta(sc, lpath, rpath, mtime, path_and_mode);
+        if (result != DeltaResult::rejected) {
+            return result == DeltaResult::ok;
         }
     }
 
@@ -754,10 +1516,11 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
         }
         buf[data_length++] = '\0';
 
-        if (!sc.SendSmallFile(path_and_mode.c_str(), lpath, rpath, mtime, buf, data_length)) {
+        if (!sc.SendSmallFile(path_and_mode.c_str(), lpath, rpath, mtime, buf, data_length,
+                              false)) {
             return false;
         }
-        return sc.CopyDone(lpath, rpath);
+        return sc.FinishSend(lpath, rpath);
 #endif
     }
 
@@ -766,14 +1529,14 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
         sc.Error("failed to stat local file '%s': %s", lpath, strerror(errno));
         return false;
     }
-    if (st.st_size < SYNC_DATA_MAX) {
+    if (static_cast<uint64_t>(st.st_size) < sc.max) {
         std::string data;
         if (!android::base::ReadFileToString(lpath, &data, true)) {
             sc.Error("failed to read all of '%s': %s", lpath, strerror(errno));
             return false;
         }
         if (!sc.SendSmallFile(path_and_mode.c_str(), lpath, rpath, mtime,
-                              data.data(), data.size())) {
+                              data.data(), data.size(), true)) {
             return false;
         }
     } else {
@@ -781,7 +1544,7 @@ static bool sync_send(SyncConnection& sc, const char* lpath, const char* rpath,
             return false;
         }
     }
-    return sc.CopyDone(lpath, rpath);
+    return sc.FinishSend(lpath, rpath);
 }
 
 static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
@@ -795,49 +1558,105 @@ static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath,
         return false;
     }
 
+    // Files of more than a chunk are written out on the writer's thread, while we read the rest.
+    LocalFileWriter* writer = nullptr;
+    if (expected_size > sc.max) {
+        writer = &sc.Writer();
+        writer->Begin(lfd, expected_size);
+    }
+
+    auto fail = [&]() {
+        if (writer) writer->Abandon();
+        adb_close(lfd);
+        adb_unlink(lpath);
+        return false;
+    };
+
     uint64_t bytes_copied = 0;
+    const char* progress_name = name != nullptr ? name : rpath;
+
+    // Writes out the first |length| bytes of |buffer|, which goes to the writer if we have one.
+    auto write = [&](std::vector<char>* buffer, size_t length) {
+        bool written = writer ? writer->Write(std::move(*buffer), length)
+                              : WriteFdExactly(lfd, buffer->data(), length);
+        if (!written) {
+            sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+            return false;
+        }
+        bytes_copied += length;
+        sc.ReportProgress(progress_name, bytes_copied, expected_size);
+        return true;
+    };
+
+    // Compressed chunks are decompressed on other threads while we read the ones after them.
+    std::unique_ptr<SyncCodecPipeline> decompressor;
+    auto write_decompressed = [&](bool all) {
+        while (decompressor && !decompressor->empty()) {
+            SyncCodecChunk chunk = decompressor->Pop();
+            if (!chunk.valid) {
+                sc.Error("invalid compressed data for '%s'", rpath);
+                return false;
+            }
+            if (!write(&chunk.data, chunk.data.size())) return false;
+            if (!all) break;
+        }
+        return true;
+    };
+
     while (true) {
         syncmsg msg;
-        if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) {
-            adb_close(lfd);
-            adb_unlink(lpath);
-            return false;
+        if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) return fail();
+
+        if (msg.data.id == ID_CDATA) {
+            if (!ReadFdExactly(sc.fd, &msg.cdata.decompressed_size,
+                               sizeof(msg.cdata.decompressed_size))) {
+                return fail();
+            }
+            if (msg.cdata.size > sc.max || msg.cdata.decompressed_size > sc.max) {
+                sc.Error("msg.cdata.size too large: %u/%u (max %zu)", msg.cdata.size,
+                         msg.cdata.decompressed_size, sc.max);
+                return fail();
+            }
+
+            std::vector<char> compressed(msg.cdata.size);
+            if (!ReadFdExactly(sc.fd, compressed.data(), compressed.size())) return fail();
+
+            if (!decompressor) {
+                decompressor = std::make_unique<SyncCodecPipeline>(SyncCodecPipeline::kDecompress,
+                                                                   sc.max);
+            }
+            if (decompressor->full() && !write_decompressed(false)) return fail();
+            decompressor->Push(std::move(compressed), msg.cdata.decompressed_size);
+            sc.RecordBytesTransferred(msg.cdata.decompressed_size, msg.cdata.size);
+            continue;
         }
 
+        // Whatever came compressed before this has to be written first.
+        if (!write_decompressed(true)) return fail();
+
         if (msg.data.id == ID_DONE) break;
 
         if (msg.data.id != ID_DATA) {
-            adb_close(lfd);
-            adb_unlink(lpath);
             sc.ReportCopyFailure(rpath, lpath, msg);
-            return false;
+            return fail();
         }
 
         if (msg.data.size > sc.max) {
             sc.Error("msg.data.size too large: %u (max %zu)", msg.data.size, sc.max);
-            adb_close(lfd);
-            adb_unlink(lpath);
-            return false;
+            return fail();
         }
 
-        char buffer[SYNC_DATA_MAX];
-        if (!ReadFdExactly(sc.fd, buffer, msg.data.size)) {
-            adb_close(lfd);
-            adb_unlink(lpath);
-            return false;
-        }
-
-        if (!WriteFdExactly(lfd, buffer, msg.data.size)) {
-            sc.Error("cannot write '%s': %s", lpath, strerror(errno));
-            adb_close(lfd);
-            adb_unlink(lpath);
-            return false;
-        }
-
-        bytes_copied += msg.data.size;
+        std::vector<char> writer_buffer = writer ? writer->GetBuffer() : std::vector<char>();
+        std::vector<char>& buffer = writer ? writer_buffer : sc.buffer;
+        if (!ReadFdExactly(sc.fd, buffer.data(), msg.data.size)) return fail();
 
         sc.RecordBytesTransferred(msg.data.size);
-        sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+        if (!write(&buffer, msg.data.size)) return fail();
+    }
+
+    if (writer && !writer->Finish()) {
+        sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+        return fail();
     }
 
     sc.RecordFilesTransferred(1);
@@ -911,9 +1730,61 @@ static bool local_build_list(SyncConnection& sc, std::vector<copyinfo>* file_lis
     return true;
 }
 
+// Runs |fn| on each of |work| in turn, spread across |jobs| connections: |sc|, and as many more
+// as we can open alongside it, each on its own thread. With more than one job, the biggest files
+// go first so that a big one doesn't start last and leave the other connections idle.
+static bool run_sync_jobs(SyncConnection& sc, size_t jobs, std::vector<const copyinfo*> work,
+                          const std::function<bool(SyncConnection&, const copyinfo&)>& fn) {
+    std::vector<std::unique_ptr<SyncConnection>> helpers;
+    for (size_t i = 1; i < std::min(jobs, work.size()); ++i) {
+        auto helper = std::make_unique<SyncConnection>(sc.Progress());
+        if (!helper->IsValid()) {
+            // Fewer connections will still do, so this isn't an error.
+            sc.Warning("only opened %zu of %zu sync connections: %s", helpers.size() + 1,
+                       std::min(jobs, work.size()), helper->ConnectError().c_str());
+            break;
+        }
+        helpers.push_back(std::move(helper));
+    }
+
+    if (!helpers.empty()) {
+        std::stable_sort(work.begin(), work.end(), [](const copyinfo* lhs, const copyinfo* rhs) {
+            return lhs->size > rhs->size;
+        });
+    }
+
+    std::atomic<size_t> next_work(0);
+    std::atomic<bool> failed(false);
+    auto run = [&](SyncConnection* conn) {
+        // Stop handing out work after a failure, like we would if we were doing this serially.
+        while (!failed) {
+            size_t i = next_work++;
+            if (i >= work.size()) {
+                break;
+            }
+            if (!fn(*conn, *work[i])) {
+                failed = true;
+            }
+        }
+        if (!conn->FinishPendingSends()) {
+            failed = true;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (const auto& helper : helpers) {
+        threads.emplace_back(run, helper.get());
+    }
+    run(&sc);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return !failed;
+}
+
 static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
                                   std::string rpath, bool check_timestamps,
-                                  bool list_only) {
+                                  bool list_only, size_t jobs) {
     sc.NewTransfer();
 
     // Make sure that both directory paths end in a slash.
@@ -971,13 +1842,23 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
     }
 
     if (check_timestamps) {
-        for (const copyinfo& ci : file_list) {
-            if (!sc.SendLstat(ci.rpath.c_str())) {
-                sc.Error("failed to send lstat");
-                return false;
+        size_t lstats_sent = 0;
+        for (size_t i = 0; i < file_list.size(); ++i) {
+            // Keep at least kSyncWindow lstats ahead of the one we're waiting for, topping them
+            // up a kSyncWindow at a time so that they can go out as one request.
+            if (lstats_sent < std::min(file_list.size(), i + kSyncWindow)) {
+                std::vector<const char*> paths;
+                for (; lstats_sent < std::min(file_list.size(), i + 2 * kSyncWindow);
+                     ++lstats_sent) {
+                    paths.push_back(file_list[lstats_sent].rpath.c_str());
+                }
+                if (!sc.SendLstats(paths)) {
+                    sc.Error("failed to send lstat");
+                    return false;
+                }
             }
-        }
-        for (copyinfo& ci : file_list) {
+
+            copyinfo& ci = file_list[i];
             struct stat st;
             if (sc.FinishStat(&st)) {
                 if (st.st_size == static_cast<off_t>(ci.size)) {
@@ -987,32 +1868,41 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath,
                         ci.skip = true;
                     }
                 }
+                ci.delta = !ci.skip && should_send_delta(sc, ci.mode, ci.size, st);
             }
         }
     }
 
     sc.ComputeExpectedTotalBytes(file_list);
 
+    std::vector<const copyinfo*> work;
     for (const copyinfo& ci : file_list) {
         if (!ci.skip) {
             if (list_only) {
                 sc.Println("would push: %s -> %s", ci.lpath.c_str(), ci.rpath.c_str());
             } else {
-                if (!sync_send(sc, ci.lpath.c_str(), ci.rpath.c_str(), ci.time, ci.mode, false)) {
-                    return false;
-                }
+                work.push_back(&ci);
             }
         } else {
             skipped++;
         }
     }
 
+    // With a pipelined sync connection, a file that failed doesn't stop the ones after it, and
+    // we only find out once run_sync_jobs has collected all of the statuses.
+    if (!run_sync_jobs(sc, jobs, std::move(work), [](SyncConnection& conn, const copyinfo& ci) {
+            return sync_send(conn, ci.lpath.c_str(), ci.rpath.c_str(), ci.time, ci.mode, false,
+                             ci.delta);
+        })) {
+        return false;
+    }
+
     sc.RecordFilesSkipped(skipped);
     sc.ReportTransferRate(lpath, TransferDirection::push);
     return true;
 }
 
-bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync) {
+bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync, size_t jobs) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
 
@@ -1077,7 +1967,7 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
                 dst_dir.append(android::base::Basename(src_path));
             }
 
-            success &= copy_local_dir_remote(sc, src_path, dst_dir.c_str(), sync, false);
+            success &= copy_local_dir_remote(sc, src_path, dst_dir.c_str(), sync, false, jobs);
             continue;
         } else if (!should_push_file(st.st_mode)) {
             sc.Warning("skipping special file '%s' (mode = 0o%o)", src_path, st.st_mode);
@@ -1098,7 +1988,8 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
 
         sc.NewTransfer();
         sc.SetExpectedTotalBytes(st.st_size);
-        success &= sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync);
+        success &= sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync, false) &&
+                   sc.FinishPendingSends();
         sc.ReportTransferRate(src_path, TransferDirection::push);
     }
 
@@ -1106,8 +1997,56 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
     return success;
 }
 
+// remote_build_list for a device that can list the whole tree in one go, and tell us what the
+// symlinks in it point to while it's at it.
+static bool remote_build_tree_list(SyncConnection& sc, std::vector<copyinfo>* file_list,
+                                   const std::string& rpath, const std::string& lpath) {
+    copyinfo ci(android::base::Dirname(lpath), android::base::Dirname(rpath),
+                android::base::Basename(lpath), S_IFDIR);
+    file_list->push_back(ci);
+
+    auto callback = [&](const syncmsg& msg, const std::string& name) {
+        unsigned mode = msg.tree_dent.mode;
+        unsigned target_mode = msg.tree_dent.target_mode;
+
+        // Symlinks are pulled as whatever they point to, and the device has already listed the
+        // contents of those that point to directories.
+        copyinfo ci(lpath, rpath, name, S_ISDIR(target_mode) ? S_IFDIR : mode);
+#if defined(_WIN32)
+        std::replace(ci.lpath.begin() + lpath.size(), ci.lpath.end(), '/', OS_PATH_SEPARATOR);
+#endif
+        if (S_ISDIR(ci.mode) && msg.tree_dent.error != 0) {
+            // The directory was listed already: this is the device saying it couldn't open it.
+            sc.Warning("skipping contents of '%s': %s", ci.rpath.c_str(),
+                       strerror(errno_from_wire(msg.tree_dent.error)));
+            return;
+        }
+        if (S_ISLNK(ci.mode)) {
+            if (target_mode == 0) {
+                sc.Warning("stat failed for path %s: %s", ci.rpath.c_str(),
+                           strerror(errno_from_wire(msg.tree_dent.error)));
+                return;
+            }
+        } else if (!S_ISDIR(ci.mode)) {
+            if (!should_pull_file(ci.mode)) {
+                sc.Warning("skipping special file '%s' (mode = 0o%o)", ci.rpath.c_str(), ci.mode);
+                ci.skip = true;
+            }
+            ci.time = msg.tree_dent.mtime;
+            ci.size = msg.tree_dent.size;
+        }
+        file_list->push_back(ci);
+    };
+
+    return sync_list_tree(sc, rpath.c_str(), callback);
+}
+
 static bool remote_build_list(SyncConnection& sc, std::vector<copyinfo>* file_list,
                               const std::string& rpath, const std::string& lpath) {
+    if (sc.HaveSyncListTree()) {
+        return remote_build_tree_list(sc, file_list, rpath, lpath);
+    }
+
     std::vector<copyinfo> dirlist;
     std::vector<copyinfo> linklist;
 
@@ -1180,6 +2119,17 @@ static void TimetToFileTime(time_t t, LPFILETIME pft)
 }
 #endif
 
+// The only way to read the umask is to change it, which would race with files being created by
+// other threads, so we only do it once.
+static mode_t get_umask() {
+    static const mode_t mask = []() {
+        mode_t mask = umask(0000);
+        umask(mask);
+        return mask;
+    }();
+    return mask;
+}
+
 static int set_time_and_mode(const std::string& lpath, time_t time,
                              unsigned int mode) {
 #ifdef _WIN32
@@ -1194,15 +2144,13 @@ static int set_time_and_mode(const std::string& lpath, time_t time,
     int r1 = utime(lpath.c_str(), &times);
 #endif
     /* use umask for permissions */
-    mode_t mask = umask(0000);
-    umask(mask);
-    int r2 = chmod(lpath.c_str(), mode & ~mask);
+    int r2 = chmod(lpath.c_str(), mode & ~get_umask());
 
     return r1 ? r1 : r2;
 }
 
 static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
-                                  std::string lpath, bool copy_attrs) {
+                                  std::string lpath, bool copy_attrs, size_t jobs) {
     sc.NewTransfer();
 
     // Make sure that both directory paths end in a slash.
@@ -1218,7 +2166,9 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
 
     sc.ComputeExpectedTotalBytes(file_list);
 
+    // Create all of the directories up front, so that the files can be pulled in any order.
     int skipped = 0;
+    std::vector<const copyinfo*> work;
     for (const copyinfo &ci : file_list) {
         if (!ci.skip) {
             if (S_ISDIR(ci.mode)) {
@@ -1231,26 +2181,33 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath,
                 }
                 continue;
             }
-
-            if (!sync_recv(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size)) {
-                return false;
-            }
-
-            if (copy_attrs && set_time_and_mode(ci.lpath, ci.time, ci.mode)) {
-                return false;
-            }
+            work.push_back(&ci);
         } else {
             skipped++;
         }
     }
 
+    // Get the umask out of the way while there's only one thread.
+    get_umask();
+
+    if (!run_sync_jobs(sc, jobs, std::move(work),
+                       [copy_attrs](SyncConnection& conn, const copyinfo& ci) {
+                           if (!sync_recv(conn, ci.rpath.c_str(), ci.lpath.c_str(), nullptr,
+                                          ci.size)) {
+                               return false;
+                           }
+                           return !copy_attrs || set_time_and_mode(ci.lpath, ci.time, ci.mode) == 0;
+                       })) {
+        return false;
+    }
+
     sc.RecordFilesSkipped(skipped);
     sc.ReportTransferRate(rpath, TransferDirection::pull);
     return true;
 }
 
 bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst,
-                  bool copy_attrs, const char* name) {
+                  bool copy_attrs, const char* name, size_t jobs) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
 
@@ -1324,7 +2281,7 @@ bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst,
                 dst_dir.append(android::base::Basename(src_path));
             }
 
-            success &= copy_remote_dir_local(sc, src_path, dst_dir.c_str(), copy_attrs);
+            success &= copy_remote_dir_local(sc, src_path, dst_dir.c_str(), copy_attrs, jobs);
             continue;
         } else if (!should_pull_file(src_st.st_mode)) {
             sc.Warning("skipping special file '%s' (mode = 0o%o)", src_path, src_st.st_mode);
@@ -1359,11 +2316,12 @@ bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst,
     return success;
 }
 
-bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_only) {
+bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_only,
+                  size_t jobs) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
 
-    bool success = copy_local_dir_remote(sc, lpath, rpath, true, list_only);
+    bool success = copy_local_dir_remote(sc, lpath, rpath, true, list_only, jobs);
     if (!list_only) {
         sc.ReportOverallTransferRate(TransferDirection::push);
     }
@@ -20,8 +20,11 @@
 #include <vector>
 
 bool do_sync_ls(const char* path);
-bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync);
+// |jobs| is the number of sync connections to spread the files of a directory across.
+bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync,
+                  size_t jobs = 1);
 bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst, bool copy_attrs,
-                  const char* name = nullptr);
+                  const char* name = nullptr, size_t jobs = 1);
 
-bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_only);
+bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_only,
+                  size_t jobs = 1);
@@ -30,6 +30,7 @@
 #include <android-base/errors.h>
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 
 #include "adb.h"
@@ -126,6 +127,17 @@ int adb_server_main(int is_daemon, const std::string& socket_spec, int ack_reply
 
     atexit(adb_server_cleanup);
 
+    // ADB_SERVER_LOOPS=N handles devices' sockets on N event loops of their own, rather than all
+    // on the main one, for servers with lots of busy devices.
+    const char* loops_str = getenv("ADB_SERVER_LOOPS");
+    if (loops_str && *loops_str) {
+        size_t loops;
+        if (!android::base::ParseUint(loops_str, &loops, size_t(64))) {
+            fatal("invalid ADB_SERVER_LOOPS '%s'", loops_str);
+        }
+        init_transport_loops(loops);
+    }
+
     init_transport_registration();
     init_reconnect_handler();
 
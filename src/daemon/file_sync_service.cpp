@@ -22,6 +22,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/xattr.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,7 +33,14 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
 #include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <private/android_filesystem_config.h>
@@ -45,9 +53,12 @@
 #include "adb_io.h"
 #include "adb_trace.h"
 #include "adb_utils.h"
+#include "file_sync_compress.h"
+#include "file_sync_delta.h"
 #include "file_sync_protocol.h"
 #include "security_log_tags.h"
 #include "sysdeps/errno.h"
+#include "thread_pool.h"
 
 using android::base::StringPrintf;
 
@@ -128,9 +139,11 @@ static bool do_lstat_v1(int s, const char* path) {
     return WriteFdExactly(s, &msg.stat_v1, sizeof(msg.stat_v1));
 }
 
-static bool do_stat_v2(int s, uint32_t id, const char* path) {
-    syncmsg msg = {};
-    msg.stat_v2.id = id;
+using StatV2 = decltype(syncmsg::stat_v2);
+
+static void fill_stat_v2(uint32_t id, const char* path, StatV2* result) {
+    *result = {};
+    result->id = id;
 
     decltype(&stat) stat_fn;
     if (id == ID_STAT_V2) {
@@ -142,21 +155,25 @@ static bool do_stat_v2(int s, uint32_t id, const char* path) {
     struct stat st = {};
     int rc = stat_fn(path, &st);
     if (rc == -1) {
-        msg.stat_v2.error = errno_to_wire(errno);
+        result->error = errno_to_wire(errno);
     } else {
-        msg.stat_v2.dev = st.st_dev;
-        msg.stat_v2.ino = st.st_ino;
-        msg.stat_v2.mode = st.st_mode;
-        msg.stat_v2.nlink = st.st_nlink;
-        msg.stat_v2.uid = st.st_uid;
-        msg.stat_v2.gid = st.st_gid;
-        msg.stat_v2.size = st.st_size;
-        msg.stat_v2.atime = st.st_atime;
-        msg.stat_v2.mtime = st.st_mtime;
-        msg.stat_v2.ctime = st.st_ctime;
-    }
-
-    return WriteFdExactly(s, &msg.stat_v2, sizeof(msg.stat_v2));
+        result->dev = st.st_dev;
+        result->ino = st.st_ino;
+        result->mode = st.st_mode;
+        result->nlink = st.st_nlink;
+        result->uid = st.st_uid;
+        result->gid = st.st_gid;
+        result->size = st.st_size;
+        result->atime = st.st_atime;
+        result->mtime = st.st_mtime;
+        result->ctime = st.st_ctime;
+    }
+}
+
+static bool do_stat_v2(int s, uint32_t id, const char* path) {
+    StatV2 result;
+    fill_stat_v2(id, path, &result);
+    return WriteFdExactly(s, &result, sizeof(result));
 }
 
 static bool do_list(int s, const char* path) {
@@ -195,6 +212,106 @@ done:
     return WriteFdExactly(s, &msg.dent, sizeof(msg.dent));
 }
 
+using DirectoryId = std::pair<dev_t, ino_t>;
+
+// Queues an ID_TREE_DENT for everything in the directory |fd|, named by its path from where the
+// listing started (|prefix| being the directory's), then does the same for each directory in it,
+// symlinks to directories included. |ancestors| are the directories we're already in, so that a
+// symlink back up to one of them doesn't send us round in circles. A directory that can't be opened
+// is sent again, with the error, so the client knows its contents are missing.
+static bool list_tree(int s, unique_fd fd, const std::string& prefix,
+                      std::vector<DirectoryId>* ancestors, std::string* buffer) {
+    std::unique_ptr<DIR, int (*)(DIR*)> d(fdopendir(fd.get()), closedir);
+    if (!d) return true;
+    fd.release();
+
+    auto append = [s, buffer](const syncmsg& msg, const std::string& name) {
+        buffer->append(reinterpret_cast<const char*>(&msg.tree_dent), sizeof(msg.tree_dent));
+        buffer->append(name);
+        if (buffer->size() >= SYNC_DATA_MAX) {
+            if (!WriteFdExactly(s, buffer->data(), buffer->size())) return false;
+            buffer->clear();
+        }
+        return true;
+    };
+
+    std::vector<std::pair<std::string, syncmsg>> subdirs;
+    while (dirent* de = readdir(d.get())) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        struct stat st;
+        if (fstatat(dirfd(d.get()), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+
+        syncmsg msg = {};
+        msg.tree_dent.id = ID_TREE_DENT;
+        msg.tree_dent.dev = st.st_dev;
+        msg.tree_dent.ino = st.st_ino;
+        msg.tree_dent.mode = st.st_mode;
+        msg.tree_dent.target_mode = st.st_mode;
+        msg.tree_dent.nlink = st.st_nlink;
+        msg.tree_dent.uid = st.st_uid;
+        msg.tree_dent.gid = st.st_gid;
+        msg.tree_dent.size = st.st_size;
+        msg.tree_dent.atime = st.st_atime;
+        msg.tree_dent.mtime = st.st_mtime;
+        msg.tree_dent.ctime = st.st_ctime;
+        if (S_ISLNK(st.st_mode)) {
+            struct stat target_st;
+            if (fstatat(dirfd(d.get()), de->d_name, &target_st, 0) == 0) {
+                msg.tree_dent.target_mode = target_st.st_mode;
+            } else {
+                msg.tree_dent.target_mode = 0;
+                msg.tree_dent.error = errno_to_wire(errno);
+            }
+        }
+
+        msg.tree_dent.namelen = prefix.size() + strlen(de->d_name);
+        if (!append(msg, prefix + de->d_name)) return false;
+
+        if (S_ISDIR(msg.tree_dent.target_mode)) {
+            subdirs.emplace_back(de->d_name, msg);
+        }
+    }
+
+    for (auto& [name, msg] : subdirs) {
+        unique_fd subdir(openat(dirfd(d.get()), name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        struct stat st;
+        if (subdir == -1 || fstat(subdir.get(), &st) != 0) {
+            msg.tree_dent.error = errno_to_wire(errno);
+            if (!append(msg, prefix + name)) return false;
+            continue;
+        }
+
+        DirectoryId id(st.st_dev, st.st_ino);
+        if (std::find(ancestors->begin(), ancestors->end(), id) != ancestors->end()) continue;
+
+        ancestors->push_back(id);
+        bool ok = list_tree(s, std::move(subdir), prefix + name + "/", ancestors, buffer);
+        ancestors->pop_back();
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Lists everything under |path| in one go, instead of a LIST per directory and a STAT per
+// symlink. Entries are batched up into writes of around SYNC_DATA_MAX.
+static bool do_list_tree(int s, const char* path) {
+    std::string buffer;
+    std::vector<DirectoryId> ancestors;
+
+    unique_fd fd(adb_open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    struct stat st;
+    if (fd != -1 && fstat(fd.get(), &st) == 0) {
+        ancestors.emplace_back(st.st_dev, st.st_ino);
+        if (!list_tree(s, std::move(fd), "", &ancestors, &buffer)) return false;
+    }
+
+    syncmsg msg = {};
+    msg.tree_dent.id = ID_DONE;
+    buffer.append(reinterpret_cast<const char*>(&msg.tree_dent), sizeof(msg.tree_dent));
+    return WriteFdExactly(s, buffer.data(), buffer.size());
+}
+
 // Make sure that SendFail from adb_io.cpp isn't accidentally used in this file.
 #pragma GCC poison SendFail
 
@@ -211,10 +328,109 @@ static bool SendSyncFailErrno(int fd, const std::string& reason) {
     return SendSyncFail(fd, StringPrintf("%s: %s", reason.c_str(), strerror(errno)));
 }
 
+// Uncached lstats wait on the disk, so a big batch is shared out between a few threads.
+static constexpr size_t kLstatBatchThreads = 4;
+static constexpr size_t kLstatBatchMinPerThread = 64;
+
+static ThreadPool& lstat_thread_pool() {
+    static auto& pool =
+            *new ThreadPool("sync lstat", kLstatBatchThreads - 1, std::chrono::seconds(10));
+    return pool;
+}
+
+static bool do_lstat_batch(int s) {
+    syncmsg msg;
+    if (!ReadFdExactly(s, &msg.lstat_batch, sizeof(msg.lstat_batch))) {
+        SendSyncFail(s, "lstat batch read failure");
+        return false;
+    }
+    size_t count = msg.lstat_batch.count;
+    size_t size = msg.lstat_batch.size;
+    if (msg.lstat_batch.id != ID_LSTAT_BATCH || count > SYNC_LSTAT_BATCH_MAX ||
+        size > count * 1025) {
+        SendSyncFail(s, "invalid lstat batch");
+        return false;
+    }
+
+    std::string buffer(size, '\0');
+    if (!ReadFdExactly(s, &buffer[0], size)) {
+        SendSyncFail(s, "lstat batch read failure");
+        return false;
+    }
+    std::vector<const char*> paths;
+    for (size_t start = 0; start < size;) {
+        size_t end = buffer.find('\0', start);
+        if (end == std::string::npos || end - start > 1024) break;
+        paths.push_back(&buffer[start]);
+        start = end + 1;
+    }
+    if (paths.size() != count) {
+        SendSyncFail(s, "invalid lstat batch");
+        return false;
+    }
+
+    std::vector<StatV2> results(count);
+    auto lstat_range = [&paths, &results](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            fill_stat_v2(ID_LSTAT_V2, paths[i], &results[i]);
+        }
+    };
+
+    size_t threads = std::clamp<size_t>(count / kLstatBatchMinPerThread, 1, kLstatBatchThreads);
+    size_t per_thread = (count + threads - 1) / threads;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t running = 0;
+    for (size_t begin = per_thread; begin < count; begin += per_thread) {
+        size_t end = std::min(count, begin + per_thread);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++running;
+        }
+        lstat_thread_pool().Run([&, begin, end]() {
+            lstat_range(begin, end);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0) cv.notify_one();
+        });
+    }
+    lstat_range(0, std::min(count, per_thread));
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&running]() { return running == 0; });
+    }
+
+    return WriteFdExactly(s, results.data(), results.size() * sizeof(StatV2));
+}
+
+// Writes out the oldest chunk that |decompressor| is working on, or with |all|, every one of them.
+// If one turns out to be invalid or can't be written, sends ID_FAIL and returns false.
+static bool finish_decompressing(int s, int fd, SyncCodecPipeline* decompressor, bool all) {
+    while (!decompressor->empty()) {
+        SyncCodecChunk chunk = decompressor->Pop();
+        if (!chunk.valid) {
+            SendSyncFail(s, "invalid compressed data");
+            return false;
+        }
+        if (!WriteFdExactly(fd, chunk.data.data(), chunk.data.size())) {
+            SendSyncFailErrno(s, "write failed");
+            return false;
+        }
+        if (!all) break;
+    }
+    return true;
+}
+
+// The handlers below return false if the sync stream can't be used any more. A failure that's
+// been reported with ID_FAIL after consuming the rest of the request leaves the stream intact, and
+// we carry on with the next request: that's what lets a client with kFeatureSyncPipeline keep
+// several files in flight.
 static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint64_t capabilities,
-                             mode_t mode, std::vector<char>& buffer, bool do_unlink) {
+                             mode_t mode, FdCopier& copier, bool do_unlink) {
+    std::vector<char>& buffer = copier.buffer();
     syncmsg msg;
     unsigned int timestamp = 0;
+    bool in_sync = false;
+    std::unique_ptr<SyncCodecPipeline> decompressor;
 
     __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path);
 
@@ -258,26 +474,66 @@ static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint
     while (true) {
         if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) goto fail;
 
+        if (msg.data.id == ID_CDATA) {
+            if (!ReadFdExactly(s, &msg.cdata.decompressed_size,
+                               sizeof(msg.cdata.decompressed_size))) {
+                goto fail;
+            }
+            if (msg.cdata.size > buffer.size() || msg.cdata.decompressed_size > buffer.size()) {
+                SendSyncFail(s, "oversize data message");
+                goto abort;
+            }
+
+            std::vector<char> compressed(msg.cdata.size);
+            if (!ReadFdExactly(s, compressed.data(), compressed.size())) goto fail;
+
+            // The decompression happens on other threads, while we read the next chunk.
+            if (!decompressor) {
+                decompressor = std::make_unique<SyncCodecPipeline>(SyncCodecPipeline::kDecompress,
+                                                                   buffer.size());
+            }
+            if (decompressor->full() &&
+                !finish_decompressing(s, fd, decompressor.get(), false)) {
+                goto fail;
+            }
+            decompressor->Push(std::move(compressed), msg.cdata.decompressed_size);
+            continue;
+        }
+
         if (msg.data.id != ID_DATA) {
             if (msg.data.id == ID_DONE) {
                 timestamp = msg.data.size;
+                if (decompressor && !finish_decompressing(s, fd, decompressor.get(), true)) {
+                    in_sync = true;
+                    goto abort;
+                }
                 break;
             }
             SendSyncFail(s, "invalid data message");
             goto abort;
         }
 
-        if (msg.data.size > buffer.size()) {  // TODO: resize buffer?
+        if (msg.data.size > buffer.size()) {  // Larger than the chunk size we agreed on.
             SendSyncFail(s, "oversize data message");
             goto abort;
         }
 
-        if (!ReadFdExactly(s, &buffer[0], msg.data.size)) goto abort;
-
-        if (!WriteFdExactly(fd, &buffer[0], msg.data.size)) {
-            SendSyncFailErrno(s, "write failed");
+        // Whatever came compressed before this chunk has to be written first. If that fails, this
+        // chunk is thrown away with the rest.
+        if (decompressor && !finish_decompressing(s, fd, decompressor.get(), true)) {
+            if (!ReadFdExactly(s, &buffer[0], msg.data.size)) goto abort;
             goto fail;
         }
+
+        switch (copier.Copy(fd, s, msg.data.size)) {
+            case FdCopier::Result::kSuccess:
+                break;
+            case FdCopier::Result::kReadFailed:
+                goto abort;
+            case FdCopier::Result::kWriteFailed:
+                SendSyncFailErrno(s, "write failed");
+                goto fail;
+        }
     }
 
     adb_close(fd);
@@ -297,17 +553,22 @@ static bool handle_send_file(int s, const char* path, uid_t uid, gid_t gid, uint
     return WriteFdExactly(s, &msg.status, sizeof(msg.status));
 
 fail:
-    // If there's a problem on the device, we'll send an ID_FAIL message and
-    // close the socket. Unfortunately the kernel will sometimes throw that
-    // data away if the other end keeps writing without reading (which is
-    // the case with old versions of adb). To maintain compatibility, keep
-    // reading and throwing away ID_DATA packets until the other side notices
-    // that we've reported an error.
+    // If there's a problem on the device, we'll send an ID_FAIL message. The
+    // other side doesn't notice until it's done writing (old versions of adb
+    // don't even look), so keep reading and throwing away ID_DATA packets
+    // until the ID_DONE that ends this file, after which the stream is back
+    // in sync.
     while (true) {
         if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) break;
 
         if (msg.data.id == ID_DONE) {
+            in_sync = true;
             break;
+        } else if (msg.data.id == ID_CDATA) {
+            if (!ReadFdExactly(s, &msg.cdata.decompressed_size,
+                               sizeof(msg.cdata.decompressed_size))) {
+                break;
+            }
         } else if (msg.data.id != ID_DATA) {
             char id[5];
             memcpy(id, &msg.data.id, sizeof(msg.data.id));
@@ -328,13 +589,14 @@ fail:
 abort:
     if (fd >= 0) adb_close(fd);
     if (do_unlink) adb_unlink(path);
-    return false;
+    return in_sync;
 }
 
 #if defined(_WIN32)
-extern bool handle_send_link(int s, const std::string& path, std::vector<char>& buffer) __attribute__((error("no symlinks on Windows")));
+extern bool handle_send_link(int s, const std::string& path, FdCopier& copier) __attribute__((error("no symlinks on Windows")));
 #else
-static bool handle_send_link(int s, const std::string& path, std::vector<char>& buffer) {
+static bool handle_send_link(int s, const std::string& path, FdCopier& copier) {
+    std::vector<char>& buffer = copier.buffer();
     syncmsg msg;
     unsigned int len;
     int ret;
@@ -353,17 +615,21 @@ static bool handle_send_link(int s, const std::string& path, std::vector<char>&
     }
     if (!ReadFdExactly(s, &buffer[0], len)) return false;
 
+    // Consume the ID_DONE that follows a failure, so that we can carry on with the next request.
+    auto fail = [&](const char* reason) {
+        return SendSyncFailErrno(s, reason) && ReadFdExactly(s, &msg.data, sizeof(msg.data)) &&
+               msg.data.id == ID_DONE;
+    };
+
     ret = symlink(&buffer[0], path.c_str());
     if (ret && errno == ENOENT) {
         if (!secure_mkdirs(android::base::Dirname(path))) {
-            SendSyncFailErrno(s, "secure_mkdirs failed");
-            return false;
+            return fail("secure_mkdirs failed");
         }
         ret = symlink(&buffer[0], path.c_str());
     }
     if (ret) {
-        SendSyncFailErrno(s, "symlink failed");
-        return false;
+        return fail("symlink failed");
     }
 
     if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
@@ -381,22 +647,51 @@ static bool handle_send_link(int s, const std::string& path, std::vector<char>&
 }
 #endif
 
-static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
-    // 'spec' is of the form "/some/path,0755". Break it up.
+// Splits the "/some/path,0755" that follows ID_SEND and ID_DELTA.
+static bool parse_send_spec(int s, const std::string& spec, std::string* path, mode_t* mode) {
     size_t comma = spec.find_last_of(',');
     if (comma == std::string::npos) {
         SendSyncFail(s, "missing , in ID_SEND");
         return false;
     }
 
-    std::string path = spec.substr(0, comma);
+    *path = spec.substr(0, comma);
 
     errno = 0;
-    mode_t mode = strtoul(spec.substr(comma + 1).c_str(), nullptr, 0);
+    *mode = strtoul(spec.substr(comma + 1).c_str(), nullptr, 0);
     if (errno != 0) {
         SendSyncFail(s, "bad mode");
         return false;
     }
+    return true;
+}
+
+// Works out the mode, owner and capabilities of a regular file pushed to |path| with |*mode|.
+static void get_send_attributes(const std::string& path, mode_t* mode, uid_t* uid, gid_t* gid,
+                                uint64_t* capabilities) {
+    // Copy user permission bits to "group" and "other" permissions.
+    *mode &= 0777;
+    *mode |= ((*mode >> 3) & 0070);
+    *mode |= ((*mode >> 3) & 0007);
+
+    *uid = -1;
+    *gid = -1;
+    *capabilities = 0;
+#if !ADB_NON_ANDROID
+    if (should_use_fs_config(path)) {
+        unsigned int broken_api_hack = *mode;
+        fs_config(path.c_str(), 0, nullptr, uid, gid, &broken_api_hack, capabilities);
+        *mode = broken_api_hack;
+    }
+#endif
+}
+
+static bool do_send(int s, const std::string& spec, FdCopier& copier) {
+    std::string path;
+    mode_t mode;
+    if (!parse_send_spec(s, spec, &path, &mode)) {
+        return false;
+    }
 
     // Don't delete files before copying if they are not "regular" or symlinks.
     struct stat st;
@@ -406,49 +701,134 @@ static bool do_send(int s, const std::string& spec, std::vector<char>& buffer) {
     }
 
     if (S_ISLNK(mode)) {
-        return handle_send_link(s, path.c_str(), buffer);
+        return handle_send_link(s, path.c_str(), copier);
     }
 
-    // Copy user permission bits to "group" and "other" permissions.
-    mode &= 0777;
-    mode |= ((mode >> 3) & 0070);
-    mode |= ((mode >> 3) & 0007);
+    uid_t uid;
+    gid_t gid;
+    uint64_t capabilities;
+    get_send_attributes(path, &mode, &uid, &gid, &capabilities);
+    return handle_send_file(s, path.c_str(), uid, gid, capabilities, mode, copier, do_unlink);
+}
 
-    uid_t uid = -1;
-    gid_t gid = -1;
-    uint64_t capabilities = 0;
-#if !ADB_NON_ANDROID
-    if (should_use_fs_config(path)) {
-        unsigned int broken_api_hack = mode;
-        fs_config(path.c_str(), 0, nullptr, &uid, &gid, &broken_api_hack, &capabilities);
-        mode = broken_api_hack;
+// do_recv for a client that asked for compression. We can't let the kernel move the data, so it's
+// read a chunk at a time, and compressed on other threads while we read and send the rest.
+static bool recv_compressed(int s, int fd, size_t max_message_size) {
+    SyncCodecPipeline compressor(SyncCodecPipeline::kCompress, max_message_size);
+    syncmsg msg;
+
+    // A file that fits in a chunk has nothing for that to overlap with, so it's compressed here,
+    // and sent along with the ID_DONE in a single write.
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        static_cast<uint64_t>(st.st_size) < compressor.max_data_size()) {
+        // One byte more than we expect, to see whether it's grown since.
+        std::vector<char> data(st.st_size + 1);
+        int r = adb_read(fd, data.data(), data.size());
+        if (r < 0) return SendSyncFailErrno(s, "read failed");
+        data.resize(r);
+
+        if (static_cast<uint64_t>(r) <= static_cast<uint64_t>(st.st_size)) {
+            std::vector<char> message;
+            if (r > 0 && (data.size() < kSyncMinCompressSize ||
+                          !SyncAppendCompressed(data.data(), data.size(), &message))) {
+                SyncAppendData(data.data(), data.size(), &message);
+            }
+            msg.data.id = ID_DONE;
+            msg.data.size = 0;
+            const char* done = reinterpret_cast<const char*>(&msg.data);
+            message.insert(message.end(), done, done + sizeof(msg.data));
+            return WriteFdExactly(s, message.data(), message.size());
+        }
+        compressor.Push(std::move(data));
     }
-#endif
-    return handle_send_file(s, path.c_str(), uid, gid, capabilities, mode, buffer, do_unlink);
+
+    auto send_oldest = [&s, &compressor]() {
+        SyncCodecChunk chunk = compressor.Pop();
+        return WriteFdExactly(s, chunk.message.data(), chunk.message.size());
+    };
+
+    while (true) {
+        std::vector<char> chunk(compressor.max_data_size());
+        int r = adb_read(fd, chunk.data(), chunk.size());
+        if (r <= 0) {
+            int saved_errno = errno;
+            while (!compressor.empty()) {
+                if (!send_oldest()) return false;
+            }
+            if (r == 0) break;
+            // The client treats ID_FAIL in place of ID_DATA as the end of this file.
+            errno = saved_errno;
+            return SendSyncFailErrno(s, "read failed");
+        }
+
+        chunk.resize(r);
+        if (compressor.full() && !send_oldest()) return false;
+        compressor.Push(std::move(chunk));
+    }
+
+    msg.data.id = ID_DONE;
+    msg.data.size = 0;
+    return WriteFdExactly(s, &msg.data, sizeof(msg.data));
 }
 
-static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
+static bool do_recv(int s, const char* path, FdCopier& copier, bool compress) {
     __android_log_security_bswrite(SEC_TAG_ADB_RECV_FILE, path);
 
     int fd = adb_open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
-        SendSyncFailErrno(s, "open failed");
-        return false;
+        return SendSyncFailErrno(s, "open failed");
     }
 
     if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE) < 0) {
         D("[ Failed to fadvise: %d ]", errno);
     }
 
+    if (compress) {
+        bool result = recv_compressed(s, fd, copier.buffer().size());
+        adb_close(fd);
+        return result;
+    }
+
     syncmsg msg;
     msg.data.id = ID_DATA;
+
+    // The header of each chunk has to give its size up front, so we can only let the kernel move
+    // the data for as much as we know is there. Files that aren't regular, or that have grown
+    // since, are read into the buffer below.
+    const size_t max_chunk_size = copier.buffer().size() - sizeof(msg.data);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        uint64_t remaining = st.st_size;
+        while (remaining > 0) {
+            msg.data.size = std::min<uint64_t>(remaining, max_chunk_size);
+            if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))) {
+                adb_close(fd);
+                return false;
+            }
+
+            FdCopier::Result result = copier.Copy(s, fd, msg.data.size);
+            if (result != FdCopier::Result::kSuccess) {
+                // If the file shrank or couldn't be read, the chunk was padded, and it's followed
+                // by the ID_FAIL that tells the client to throw it away.
+                bool sent = result == FdCopier::Result::kReadFailed &&
+                            SendSyncFailErrno(s, "read failed");
+                adb_close(fd);
+                return sent;
+            }
+            remaining -= msg.data.size;
+        }
+    }
+
+    std::vector<char>& buffer = copier.buffer();
     while (true) {
-        int r = adb_read(fd, &buffer[0], buffer.size() - sizeof(msg.data));
+        int r = adb_read(fd, &buffer[0], max_chunk_size);
         if (r <= 0) {
             if (r == 0) break;
-            SendSyncFailErrno(s, "read failed");
+            // The client treats ID_FAIL in place of ID_DATA as the end of this file.
+            bool sent = SendSyncFailErrno(s, "read failed");
             adb_close(fd);
-            return false;
+            return sent;
         }
         msg.data.size = r;
         if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) || !WriteFdExactly(s, &buffer[0], r)) {
@@ -464,6 +844,201 @@ static bool do_recv(int s, const char* path, std::vector<char>& buffer) {
     return WriteFdExactly(s, &msg.data, sizeof(msg.data));
 }
 
+static bool do_sigs(int s, const char* path) {
+    unique_fd fd(adb_open(path, O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+        return SendSyncFailErrno(s, "open failed");
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1) {
+        return SendSyncFailErrno(s, "fstat failed");
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return SendSyncFail(s, "not a regular file");
+    }
+
+    if (posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL) < 0) {
+        D("[ Failed to fadvise: %d ]", errno);
+    }
+
+    // The file may have changed size since the fstat, so the size we report is what we read.
+    syncmsg msg;
+    msg.sigs.id = ID_SIGS;
+    msg.sigs.block_size = DeltaBlockSize(st.st_size);
+    std::vector<DeltaBlockSignature> signatures;
+    if (!ComputeDeltaSignatures(fd.get(), msg.sigs.block_size, &msg.sigs.size, &signatures)) {
+        return SendSyncFailErrno(s, "read failed");
+    }
+
+    return WriteFdExactly(s, &msg.sigs, sizeof(msg.sigs)) &&
+           WriteFdExactly(s, signatures.data(), signatures.size() * sizeof(signatures[0]));
+}
+
+// Reads and throws away the rest of an ID_DELTA, up to and including the digest after its ID_DONE,
+// so that the stream is back in sync after a failure.
+static bool skip_delta(int s, std::vector<char>& buffer) {
+    syncmsg msg;
+    while (true) {
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
+
+        if (msg.data.id == ID_DONE) {
+            uint8_t digest[SYNC_DELTA_DIGEST_SIZE];
+            return ReadFdExactly(s, digest, sizeof(digest));
+        } else if (msg.data.id == ID_DATA) {
+            if (msg.data.size > buffer.size()) return false;
+            if (!ReadFdExactly(s, &buffer[0], msg.data.size)) return false;
+        } else if (msg.data.id == ID_COPY) {
+            if (!ReadFdExactly(s, &msg.copy.offset, sizeof(msg.copy.offset))) return false;
+        } else {
+            return false;
+        }
+    }
+}
+
+// Copies |len| bytes at |offset| in |basis| to the end of |fd|, adding them to |digest|.
+static bool copy_from_basis(int basis, int fd, uint64_t offset, size_t len,
+                            std::vector<char>& buffer, DeltaDigest& digest) {
+    while (len > 0) {
+        size_t chunk = std::min(len, buffer.size());
+        ssize_t rc = TEMP_FAILURE_RETRY(pread(basis, &buffer[0], chunk, offset));
+        if (rc <= 0) {
+            if (rc == 0) errno = EIO;  // The file shrank since we sent its signatures.
+            return false;
+        }
+        digest.Update(&buffer[0], rc);
+        if (!WriteFdExactly(fd, &buffer[0], rc)) return false;
+        offset += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+// Rebuilds |path| from the ID_DATA and ID_COPY messages of an ID_DELTA, in a temporary file that
+// only replaces it once the result has been checked against the digest that follows the ID_DONE.
+// Until then the old file is left alone, since that's what the copies come from.
+static bool handle_send_delta(int s, const std::string& path, uid_t uid, gid_t gid,
+                              uint64_t capabilities, mode_t mode, FdCopier& copier) {
+    std::vector<char>& buffer = copier.buffer();
+
+    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path.c_str());
+
+    unique_fd basis(adb_open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat basis_st;
+    if (basis < 0 || fstat(basis.get(), &basis_st) == -1) {
+        return SendSyncFailErrno(s, "open failed") && skip_delta(s, buffer);
+    }
+
+    std::string temp_path = StringPrintf("%s/.%s.XXXXXX", android::base::Dirname(path).c_str(),
+                                         android::base::Basename(path).c_str());
+    unique_fd fd(mkostemp(&temp_path[0], O_CLOEXEC));
+    if (fd < 0) {
+        return SendSyncFailErrno(s, "couldn't create temporary file") && skip_delta(s, buffer);
+    }
+
+    // A failure we can report and carry on from, or one that leaves the stream unusable.
+    auto fail = [&](const std::string& reason) {
+        adb_unlink(temp_path.c_str());
+        return SendSyncFail(s, reason) && skip_delta(s, buffer);
+    };
+    auto abort = [&]() {
+        adb_unlink(temp_path.c_str());
+        return false;
+    };
+
+    DeltaDigest digest;
+    syncmsg msg;
+    while (true) {
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return abort();
+
+        if (msg.data.id == ID_DONE) {
+            break;
+        } else if (msg.data.id == ID_DATA) {
+            if (msg.data.size > buffer.size()) {
+                SendSyncFail(s, "oversize data message");
+                return abort();
+            }
+            if (!ReadFdExactly(s, &buffer[0], msg.data.size)) return abort();
+            digest.Update(&buffer[0], msg.data.size);
+            if (!WriteFdExactly(fd.get(), &buffer[0], msg.data.size)) {
+                return fail(StringPrintf("write failed: %s", strerror(errno)));
+            }
+        } else if (msg.data.id == ID_COPY) {
+            if (!ReadFdExactly(s, &msg.copy.offset, sizeof(msg.copy.offset))) return abort();
+            uint64_t basis_size = basis_st.st_size;
+            if (msg.copy.offset > basis_size || msg.copy.size > basis_size - msg.copy.offset) {
+                return fail("copy out of range");
+            }
+            if (!copy_from_basis(basis.get(), fd.get(), msg.copy.offset, msg.copy.size, buffer,
+                                 digest)) {
+                return fail(StringPrintf("copy failed: %s", strerror(errno)));
+            }
+        } else {
+            SendSyncFail(s, "invalid data message");
+            return abort();
+        }
+    }
+
+    unsigned int timestamp = msg.data.size;
+    uint8_t expected[SYNC_DELTA_DIGEST_SIZE];
+    if (!ReadFdExactly(s, expected, sizeof(expected))) return abort();
+
+    // The stream is in sync again, so failures from here on only need reporting.
+    uint8_t actual[SYNC_DELTA_DIGEST_SIZE];
+    digest.Finish(actual);
+    if (memcmp(expected, actual, sizeof(actual)) != 0) {
+        adb_unlink(temp_path.c_str());
+        return SendSyncFail(s, "delta doesn't match the file it was made against");
+    }
+
+    if (fchown(fd.get(), uid, gid) == -1) {
+        bool sent = SendSyncFailErrno(s, "fchown failed");
+        adb_unlink(temp_path.c_str());
+        return sent;
+    }
+    // fchown clears the setuid bit, and mkostemp created the file 0600.
+    fchmod(fd.get(), mode);
+    fd.reset();
+
+    if (rename(temp_path.c_str(), path.c_str()) == -1) {
+        bool sent = SendSyncFailErrno(s, "rename failed");
+        adb_unlink(temp_path.c_str());
+        return sent;
+    }
+
+#if !ADB_NON_ANDROID
+    // Not all filesystems support setting SELinux labels. http://b/23530370.
+    selinux_android_restorecon(path.c_str(), 0);
+#endif
+
+    if (!update_capabilities(path.c_str(), capabilities)) {
+        return SendSyncFailErrno(s, "update_capabilities failed");
+    }
+
+    utimbuf u;
+    u.actime = timestamp;
+    u.modtime = timestamp;
+    utime(path.c_str(), &u);
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return WriteFdExactly(s, &msg.status, sizeof(msg.status));
+}
+
+static bool do_delta(int s, const std::string& spec, FdCopier& copier) {
+    std::string path;
+    mode_t mode;
+    if (!parse_send_spec(s, spec, &path, &mode)) {
+        return false;
+    }
+
+    uid_t uid;
+    gid_t gid;
+    uint64_t capabilities;
+    get_send_attributes(path, &mode, &uid, &gid, &capabilities);
+    return handle_send_delta(s, path, uid, gid, capabilities, mode, copier);
+}
+
 static const char* sync_id_to_name(uint32_t id) {
   switch (id) {
     case ID_LSTAT_V1:
@@ -474,10 +1049,18 @@ static const char* sync_id_to_name(uint32_t id) {
       return "stat_v2";
     case ID_LIST:
       return "list";
+    case ID_LIST_TREE:
+      return "list_tree";
+    case ID_LSTAT_BATCH:
+      return "lstat_batch";
     case ID_SEND:
       return "send";
     case ID_RECV:
       return "recv";
+    case ID_SIGS:
+      return "sigs";
+    case ID_DELTA:
+      return "delta";
     case ID_QUIT:
         return "quit";
     default:
@@ -485,7 +1068,7 @@ static const char* sync_id_to_name(uint32_t id) {
   }
 }
 
-static bool handle_sync_command(int fd, std::vector<char>& buffer) {
+static bool handle_sync_command(int fd, FdCopier& copier, bool compress) {
     D("sync: waiting for request");
 
     ATRACE_CALL();
@@ -519,14 +1102,26 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
         case ID_STAT_V2:
             if (!do_stat_v2(fd, request.id, name)) return false;
             break;
+        case ID_LSTAT_BATCH:
+            if (!do_lstat_batch(fd)) return false;
+            break;
         case ID_LIST:
             if (!do_list(fd, name)) return false;
             break;
+        case ID_LIST_TREE:
+            if (!do_list_tree(fd, name)) return false;
+            break;
         case ID_SEND:
-            if (!do_send(fd, name, buffer)) return false;
+            if (!do_send(fd, name, copier)) return false;
             break;
         case ID_RECV:
-            if (!do_recv(fd, name, buffer)) return false;
+            if (!do_recv(fd, name, copier, compress)) return false;
+            break;
+        case ID_SIGS:
+            if (!do_sigs(fd, name)) return false;
+            break;
+        case ID_DELTA:
+            if (!do_delta(fd, name, copier)) return false;
             break;
         case ID_QUIT:
             return false;
@@ -538,10 +1133,34 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
     return true;
 }
 
-void file_sync_service(unique_fd fd) {
-    std::vector<char> buffer(SYNC_DATA_MAX);
+static_assert(SYNC_CHUNK_SIZE_MAX <= MAX_PAYLOAD, "sync chunks shouldn't outgrow the transport");
+
+// |options| is whatever followed "sync:" in the service name: a comma-separated list.
+void file_sync_service(unique_fd fd, const std::string& options) {
+    size_t chunk_size = SYNC_DATA_MAX;
+    bool compress = false;
+    for (const std::string& option : android::base::Split(options, ",")) {
+        if (android::base::StartsWith(option, "chunk_size=")) {
+            size_t value;
+            if (android::base::ParseUint(option.substr(strlen("chunk_size=")), &value,
+                                         static_cast<size_t>(SYNC_CHUNK_SIZE_MAX)) &&
+                value >= SYNC_DATA_MAX) {
+                chunk_size = value;
+            } else {
+                LOG(WARNING) << "Ignoring invalid sync service option: " << option;
+            }
+        } else if (option == "compress") {
+            compress = true;
+        } else if (!option.empty()) {
+            // This is not an error to allow for future expansion.
+            LOG(WARNING) << "Ignoring unknown sync service option: " << option;
+        }
+    }
+
+    // Its buffer is both the largest DATA chunk we'll accept and the largest we'll send.
+    FdCopier copier(chunk_size);
 
-    while (handle_sync_command(fd.get(), buffer)) {
+    while (handle_sync_command(fd.get(), copier, compress)) {
     }
 
     D("sync: done");
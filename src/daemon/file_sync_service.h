@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <string>
+
 #include "adb_unique_fd.h"
 
-void file_sync_service(unique_fd fd);
+void file_sync_service(unique_fd fd, const std::string& options);
@@ -35,6 +35,7 @@
 
 #include <android-base/logging.h>
 #include <android-base/macros.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #ifndef ADB_NON_ANDROID
@@ -56,6 +57,7 @@
 #include "mdns.h"
 
 static const char* root_seclabel = nullptr;
+static int tcp_port = 0;
 
 #ifndef ADB_NON_ANDROID
 static bool should_drop_capabilities_bounding_set() {
@@ -229,18 +231,18 @@ int adbd_main(int server_port) {
         is_usb = true;
     }
 
-    // If one of these properties is set, also listen on that port.
-    // If one of the properties isn't set and we couldn't listen on usb, listen
-    // on the default port.
+    // If --tcp_port or one of these properties is set, also listen on that port.
+    // If none of them are set and we couldn't listen on usb, listen on the
+    // default port.
     std::string prop_port = android::base::GetProperty("service.adb.tcp.port", "");
     if (prop_port.empty()) {
         prop_port = android::base::GetProperty("persist.adb.tcp.port", "");
     }
 
-    int port;
-    if (sscanf(prop_port.c_str(), "%d", &port) == 1 && port > 0) {
+    int port = tcp_port;
+    if (port > 0 || (sscanf(prop_port.c_str(), "%d", &port) == 1 && port > 0)) {
         D("using port=%d", port);
-        // Listen on TCP port specified by service.adb.tcp.port property.
+        // Listen on the TCP port we were asked to.
         setup_port(port);
     } else if (!is_usb) {
         // Listen on default port.
@@ -269,7 +271,9 @@ int main(int argc, char** argv) {
         static struct option opts[] = {
             {"root_seclabel", required_argument, nullptr, 's'},
             {"device_banner", required_argument, nullptr, 'b'},
+            {"tcp_port", required_argument, nullptr, 'p'},
             {"version", no_argument, nullptr, 'v'},
+            {nullptr, 0, nullptr, 0},
         };
 
         int option_index = 0;
@@ -285,6 +289,12 @@ int main(int argc, char** argv) {
         case 'b':
             adb_device_banner = optarg;
             break;
+        case 'p':
+            if (!android::base::ParseInt(optarg, &tcp_port, 1, 65535)) {
+                fprintf(stderr, "adbd: invalid --tcp_port: %s\n", optarg);
+                return 1;
+            }
+            break;
         case 'v':
             printf("Android Debug Bridge Daemon version %d.%d.%d\n", ADB_VERSION_MAJOR,
                    ADB_VERSION_MINOR, ADB_SERVER_VERSION);
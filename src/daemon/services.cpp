@@ -222,7 +222,9 @@ unique_fd daemon_service_to_fd(const char* name, atransport* transport) {
     } else if (!strncmp(name, "exec:", 5)) {
         return StartSubprocess(name + 5, nullptr, SubprocessType::kRaw, SubprocessProtocol::kNone);
     } else if (!strncmp(name, "sync:", 5)) {
-        return create_service_thread("sync", file_sync_service);
+        std::string options(name + strlen("sync:"));
+        return create_service_thread("sync",
+                                     std::bind(file_sync_service, std::placeholders::_1, options));
 #if !ADB_NON_ANDROID
     } else if (!strncmp(name, "remount:", 8)) {
         std::string options(name + strlen("remount:"));
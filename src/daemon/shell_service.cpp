@@ -33,30 +33,28 @@
 // Non-protocol subprocesses work by passing subprocess stdin/out/err through
 // a single pipe which is registered with a local socket in adbd. The local
 // socket uses the fdevent loop to pass raw data between this pipe and the
-// transport, which then passes data back to the adb client. Cleanup is done by
-// waiting in a separate thread for the subprocesses to exit and then signaling
-// a separate fdevent to close out the local socket from the main loop.
+// transport, which then passes data back to the adb client. The local socket
+// closes when the subprocess closes its end, and the subprocess is reaped by
+// the main loop when SIGCHLD says it has exited, so no thread is needed.
 //
-// ------------------+-------------------------+------------------------------
-//   Subprocess      |  adbd subprocess thread |   adbd main fdevent loop
-// ------------------+-------------------------+------------------------------
-//                   |                         |
-//   stdin/out/err <----------------------------->       LocalSocket
-//      |            |                         |
-//      |            |      Block on exit      |
-//      |            |           *             |
-//      v            |           *             |
-//     Exit         --->      Unblock          |
-//                   |           |             |
-//                   |           v             |
-//                   |   Notify shell exit FD --->    Close LocalSocket
-// ------------------+-------------------------+------------------------------
+// ------------------+------------------------------
+//   Subprocess      |   adbd main fdevent loop
+// ------------------+------------------------------
+//                   |
+//   stdin/out/err <----->       LocalSocket
+//      |            |
+//      v            |
+//     Exit         --->     Close LocalSocket
+//                   |
+//                   |
+//   SIGCHLD        --->     Reap subprocess
+// ------------------+------------------------------
 //
-// The protocol requires the thread to intercept stdin/out/err in order to
-// wrap/unwrap data with shell protocol packets.
+// The protocol requires a service worker thread to intercept stdin/out/err in
+// order to wrap/unwrap data with shell protocol packets.
 //
 // ------------------+-------------------------+------------------------------
-//   Subprocess      |  adbd subprocess thread |   adbd main fdevent loop
+//   Subprocess      |  adbd service worker    |   adbd main fdevent loop
 // ------------------+-------------------------+------------------------------
 //                   |                         |
 //     stdin/out   <--->      Protocol       <--->       LocalSocket
@@ -85,13 +83,15 @@
 #include <paths.h>
 #include <pty.h>
 #include <pwd.h>
+#include <signal.h>
 #include <sys/select.h>
+#include <sys/wait.h>
 #include <termios.h>
 
 #include <memory>
 #include <string>
-#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -108,7 +108,9 @@
 #include "adb_trace.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
+#include "fdevent.h"
 #include "security_log_tags.h"
+#include "services.h"
 #include "shell_protocol.h"
 
 namespace {
@@ -157,8 +159,9 @@ class Subprocess {
     // and exec's the child. Returns false and sets error on failure.
     bool ForkAndExec(std::string* _Nonnull error);
 
-    // Start the subprocess manager thread. Consumes the subprocess, regardless of success.
-    // Returns false and sets error on failure.
+    // Hands the subprocess over to whatever looks after it from now on: a service worker
+    // passing the shell protocol along, or just the main loop reaping it once it exits.
+    // Consumes the subprocess, regardless of success. Returns false and sets error on failure.
     static bool StartThread(std::unique_ptr<Subprocess> subprocess,
                             std::string* _Nonnull error);
 
@@ -433,9 +436,73 @@ bool Subprocess::ForkAndExec(std::string* error) {
     return true;
 }
 
+// Subprocesses that nothing else waits for, to be reaped when SIGCHLD says one of them exited.
+// Only touched on the main thread.
+static auto& unreaped_pids = *new std::unordered_set<pid_t>();
+static int sigchld_write_fd = -1;
+
+static void sigchld_handler(int) {
+    int saved_errno = errno;
+    char byte = 0;
+    adb_write(sigchld_write_fd, &byte, 1);
+    errno = saved_errno;
+}
+
+static void reap_subprocesses(int fd, unsigned, void*) {
+    char buf[64];
+    while (adb_read(fd, buf, sizeof(buf)) > 0) {
+    }
+
+    for (auto it = unreaped_pids.begin(); it != unreaped_pids.end();) {
+        pid_t pid = *it;
+        int status;
+        pid_t rc = waitpid(pid, &status, WNOHANG);
+        if (rc == pid || (rc == -1 && errno == ECHILD)) {
+            D("reaped pid %d", pid);
+            it = unreaped_pids.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+static void reap_on_main_thread(pid_t pid) {
+    fdevent_run_on_main_thread([pid]() {
+        static fdevent* fde = []() {
+            unique_fd read, write;
+            if (!Pipe(&read, &write) || !set_file_block_mode(read.get(), false) ||
+                !set_file_block_mode(write.get(), false)) {
+                PLOG(FATAL) << "failed to create SIGCHLD pipe";
+            }
+            sigchld_write_fd = write.release();
+
+            struct sigaction sa = {};
+            sa.sa_handler = sigchld_handler;
+            sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+            sigaction(SIGCHLD, &sa, nullptr);
+
+            fdevent* fde = fdevent_create(read.release(), reap_subprocesses, nullptr);
+            fdevent_add(fde, FDE_READ);
+            return fde;
+        }();
+
+        // It might have exited before anything was listening for SIGCHLD.
+        unreaped_pids.insert(pid);
+        reap_subprocesses(fde->fd.get(), 0, nullptr);
+    });
+}
+
 bool Subprocess::StartThread(std::unique_ptr<Subprocess> subprocess, std::string* error) {
+    if (subprocess->protocol_ == SubprocessProtocol::kNone) {
+        // The local socket talks to the subprocess directly, so there's nothing to pass along.
+        D("reaping PID %d on the main thread", subprocess->pid());
+        reap_on_main_thread(subprocess->pid_);
+        subprocess->pid_ = -1;
+        return true;
+    }
+
     Subprocess* raw = subprocess.release();
-    std::thread(ThreadHandler, raw).detach();
+    service_thread_pool().RunBlocking([raw]() { ThreadHandler(raw); });
 
     return true;
 }
@@ -682,6 +749,11 @@ unique_fd* Subprocess::PassOutput(unique_fd* sfd, ShellProtocol::Id id) {
 }
 
 void Subprocess::WaitForExit() {
+    if (pid_ == -1) {
+        // It never started, or something else is waiting for it.
+        return;
+    }
+
     int exit_code = 1;
 
     D("waiting for pid %d", pid_);
@@ -22,30 +22,37 @@
 
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
+#include <algorithm>
 #include <atomic>
-#include <deque>
+#include <chrono>
 #include <functional>
 #include <list>
-#include <mutex>
-#include <unordered_map>
-#include <vector>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
 
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
-#include <android-base/thread_annotations.h>
 #include <android-base/threads.h>
 
 #include "adb_io.h"
 #include "adb_trace.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
+#include "fdevent_backend.h"
+#include "timer_wheel.h"
 
 #define FDE_EVENTMASK  0x00ff
 #define FDE_STATEMASK  0xff00
@@ -54,46 +61,180 @@
 #define FDE_PENDING    0x0200
 #define FDE_CREATED    0x0400
 
-struct PollNode {
-  fdevent* fde;
-  adb_pollfd pollfd;
+// Functions queued by fdevent_run_on go through a lock-free multi-producer, single-consumer queue
+// (Vyukov's): a producer swaps its node in as the tail and then links it from the previous one, and
+// the loop's thread follows the links from the head. The head is always a node whose function has
+// already been taken.
+struct RunQueueNode {
+    std::atomic<RunQueueNode*> next{nullptr};
+    std::function<void()> fn;
+};
 
-  explicit PollNode(fdevent* fde) : fde(fde) {
-      memset(&pollfd, 0, sizeof(pollfd));
-      pollfd.fd = fde->fd.get();
+// Timers count milliseconds of the steady clock.
+static uint64_t fdevent_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
 
-#if defined(__linux__)
-      // Always enable POLLRDHUP, so the host server can take action when some clients disconnect.
-      // Then we can avoid leaving many sockets in CLOSE_WAIT state. See http://b/23314034.
-      pollfd.events = POLLRDHUP;
-#endif
-  }
+struct fdevent_timer : public TimerWheel::Entry {
+    fdevent_context* context;
+    std::function<void()> fn;
+    uint64_t interval_ms = 0;
+    // Destroyed from its own function, which still needs it until it returns.
+    bool destroyed = false;
+};
+
+// An event loop, and everything that belongs to it. The main loop always exists, and the server can
+// start more with fdevent_start_loop_thread().
+//
+// Everything here other than the run queue's tail, notification flag and notification fd is only
+// touched on the thread that runs the loop. That's why we don't need a lock for fdevent.
+struct fdevent_context {
+    std::unique_ptr<fdevent_backend> backend;
+    std::list<fdevent*> pending_list;
+    TimerWheel timers{fdevent_now_ms()};
+    fdevent_timer* running_timer = nullptr;
+    std::atomic<bool> terminate_loop{false};
+    bool looper_valid = false;
+    uint64_t looper_thread_id = 0;
+
+    RunQueueNode* run_queue_head = new RunQueueNode();
+    std::atomic<RunQueueNode*> run_queue_tail{run_queue_head};
+
+    // Set by the first producer to find it clear, which is the one that wakes up the loop. The loop
+    // clears it before it starts taking functions off the queue.
+    std::atomic<bool> run_queue_notified{false};
+    bool run_needs_flush = false;
+
+    // Producers write to this to wake the loop up: it's a dup of the eventfd that the loop reads on
+    // Linux, and the other end of a socketpair elsewhere.
+    unique_fd run_queue_notify_fd;
+    std::atomic<int> run_queue_notify_fd_value{-1};
 };
 
-// All operations to fdevent should happen only in the main thread.
-// That's why we don't need a lock for fdevent.
-static auto& g_poll_node_map = *new std::unordered_map<int, PollNode>();
-static auto& g_pending_list = *new std::list<fdevent*>();
-static std::atomic<bool> terminate_loop(false);
-static bool main_thread_valid;
-static uint64_t main_thread_id;
+static auto& g_main_context = *new fdevent_context();
 
-static uint64_t fdevent_id;
+// The loop running on this thread, if any.
+static thread_local fdevent_context* g_current_context = nullptr;
 
-static bool run_needs_flush = false;
-static auto& run_queue_notify_fd = *new unique_fd();
-static auto& run_queue_mutex = *new std::mutex();
-static auto& run_queue GUARDED_BY(run_queue_mutex) = *new std::deque<std::function<void()>>();
+static std::atomic<uint64_t> fdevent_id(0);
 
-void check_main_thread() {
-    if (main_thread_valid) {
-        CHECK_EQ(main_thread_id, android::base::GetThreadId());
+// Nodes are recycled instead of being freed. A loop pushes the ones it's done with onto a stack
+// shared by all loops, and a producer that runs out of nodes takes the whole stack at once, which
+// (unlike popping one node at a time) can't fall foul of ABA. That also means a producer can sit on
+// all of them, so the stack is kept to about kMaxFreeRunQueueNodes, and the rest are freed.
+static constexpr size_t kMaxFreeRunQueueNodes = 1024;
+static std::atomic<RunQueueNode*> run_queue_free_nodes(nullptr);
+static std::atomic<size_t> run_queue_free_node_count(0);
+
+// Takes a null-terminated list of |count| nodes.
+static void run_queue_release_nodes(RunQueueNode* first, RunQueueNode* last, size_t count) {
+    if (run_queue_free_node_count.load(std::memory_order_relaxed) >= kMaxFreeRunQueueNodes) {
+        while (first) {
+            RunQueueNode* next = first->next.load(std::memory_order_relaxed);
+            delete first;
+            first = next;
+        }
+        return;
+    }
+
+    RunQueueNode* top = run_queue_free_nodes.load(std::memory_order_relaxed);
+    do {
+        last->next.store(top, std::memory_order_relaxed);
+    } while (!run_queue_free_nodes.compare_exchange_weak(top, first, std::memory_order_release,
+                                                          std::memory_order_relaxed));
+    run_queue_free_node_count.fetch_add(count, std::memory_order_relaxed);
+}
+
+namespace {
+
+struct RunQueueNodeCache {
+    RunQueueNode* nodes = nullptr;
+
+    ~RunQueueNodeCache() {
+        if (nodes) {
+            size_t count = 1;
+            RunQueueNode* last = nodes;
+            while (RunQueueNode* next = last->next.load(std::memory_order_relaxed)) {
+                last = next;
+                ++count;
+            }
+            run_queue_release_nodes(nodes, last, count);
+        }
+    }
+};
+
+}  // namespace
+
+static thread_local RunQueueNodeCache run_queue_node_cache;
+
+static RunQueueNode* run_queue_allocate_node() {
+    RunQueueNodeCache& cache = run_queue_node_cache;
+    if (!cache.nodes) {
+        cache.nodes = run_queue_free_nodes.exchange(nullptr, std::memory_order_acquire);
+        // This can lose count of nodes released in the meantime, which only lets the stack grow by
+        // a few more than it should.
+        run_queue_free_node_count.store(0, std::memory_order_relaxed);
+        if (!cache.nodes) {
+            return new RunQueueNode();
+        }
+    }
+    RunQueueNode* node = cache.nodes;
+    cache.nodes = node->next.load(std::memory_order_relaxed);
+    node->next.store(nullptr, std::memory_order_relaxed);
+    return node;
+}
+
+static std::unique_ptr<fdevent_backend> fdevent_create_backend(const std::string& name) {
+#if defined(__linux__)
+    if (name == "epoll") {
+        return fdevent_create_epoll_backend();
+    }
+#endif
+    if (name == "poll") {
+        return fdevent_create_poll_backend();
+    }
+    return nullptr;
+}
+
+static fdevent_backend& fdevent_get_backend(fdevent_context* context) {
+    if (!context->backend) {
+        // Other loops use whatever the main loop does.
+        if (context != &g_main_context) {
+            context->backend = fdevent_create_backend(fdevent_get_backend(&g_main_context).name());
+            return *context->backend;
+        }
+#if defined(__linux__)
+        // ADB_EPOLL=0 falls back to poll(), in case we ever need to rule the epoll backend out.
+        const char* env = getenv("ADB_EPOLL");
+        const char* name = (env && strcmp(env, "0") == 0) ? "poll" : "epoll";
+#else
+        const char* name = "poll";
+#endif
+        context->backend = fdevent_create_backend(name);
+        D("using %s fdevent backend", context->backend->name());
     }
+    return *context->backend;
+}
+
+static void check_looper_thread(const fdevent_context* context) {
+    if (context->looper_valid) {
+        CHECK_EQ(context->looper_thread_id, android::base::GetThreadId());
+    }
+}
+
+void check_main_thread() {
+    check_looper_thread(&g_main_context);
 }
 
 void set_main_thread() {
-    main_thread_valid = true;
-    main_thread_id = android::base::GetThreadId();
+    g_main_context.looper_valid = true;
+    g_main_context.looper_thread_id = android::base::GetThreadId();
+}
+
+fdevent_context* fdevent_main_context() {
+    return &g_main_context;
 }
 
 static std::string dump_fde(const fdevent* fde) {
@@ -127,11 +268,13 @@ void fdevent_install(fdevent* fde, int fd, fd_func func, void* arg) {
 }
 
 fdevent* fdevent_create(int fd, fd_func func, void* arg) {
-    check_main_thread();
+    fdevent_context* context = g_current_context ? g_current_context : &g_main_context;
+    check_looper_thread(context);
     CHECK_GE(fd, 0);
 
     fdevent* fde = new fdevent();
     fde->id = fdevent_id++;
+    fde->context = context;
     fde->state = FDE_ACTIVE;
     fde->fd.reset(fd);
     fde->func = func;
@@ -142,53 +285,51 @@ fdevent* fdevent_create(int fd, fd_func func, void* arg) {
         // to handle it.
         LOG(ERROR) << "failed to set non-blocking mode for fd " << fd;
     }
-    auto pair = g_poll_node_map.emplace(fde->fd.get(), PollNode(fde));
-    CHECK(pair.second) << "install existing fd " << fd;
+    fdevent_get_backend(context).Register(fde);
 
     fde->state |= FDE_CREATED;
     return fde;
 }
 
-void fdevent_destroy(fdevent* fde) {
-    check_main_thread();
-    if (fde == nullptr) return;
+unique_fd fdevent_release(fdevent* fde) {
+    check_looper_thread(fde->context);
     if (!(fde->state & FDE_CREATED)) {
-        LOG(FATAL) << "destroying fde not created by fdevent_create(): " << dump_fde(fde);
+        LOG(FATAL) << "releasing fde not created by fdevent_create(): " << dump_fde(fde);
+    }
+
+    if (fde->timeout_timer) {
+        fdevent_destroy_timer(fde->timeout_timer);
+        fde->timeout_timer = nullptr;
     }
 
+    unique_fd result;
     if (fde->state & FDE_ACTIVE) {
-        g_poll_node_map.erase(fde->fd.get());
+        fdevent_get_backend(fde->context).Unregister(fde);
         if (fde->state & FDE_PENDING) {
-            g_pending_list.remove(fde);
+            fde->context->pending_list.remove(fde);
         }
-        fde->fd.reset();
+        result = std::move(fde->fd);
         fde->state = 0;
         fde->events = 0;
     }
 
     delete fde;
+    return result;
 }
 
-static void fdevent_update(fdevent* fde, unsigned events) {
-    auto it = g_poll_node_map.find(fde->fd.get());
-    CHECK(it != g_poll_node_map.end());
-    PollNode& node = it->second;
-    if (events & FDE_READ) {
-        node.pollfd.events |= POLLIN;
-    } else {
-        node.pollfd.events &= ~POLLIN;
-    }
+void fdevent_destroy(fdevent* fde) {
+    if (fde == nullptr) return;
+    // The fd is closed on the way out.
+    fdevent_release(fde);
+}
 
-    if (events & FDE_WRITE) {
-        node.pollfd.events |= POLLOUT;
-    } else {
-        node.pollfd.events &= ~POLLOUT;
-    }
+static void fdevent_update(fdevent* fde, unsigned events) {
+    fdevent_get_backend(fde->context).Update(fde, events);
     fde->state = (fde->state & FDE_STATEMASK) | events;
 }
 
 void fdevent_set(fdevent* fde, unsigned events) {
-    check_main_thread();
+    check_looper_thread(fde->context);
     events &= FDE_EVENTMASK;
     if ((fde->state & FDE_EVENTMASK) == events) {
         return;
@@ -199,82 +340,125 @@ void fdevent_set(fdevent* fde, unsigned events) {
 
     if (fde->state & FDE_PENDING) {
         // If we are pending, make sure we don't signal an event that is no longer wanted.
-        fde->events &= events;
+        fde->events &= events | FDE_TIMEOUT;
         if (fde->events == 0) {
-            g_pending_list.remove(fde);
+            fde->context->pending_list.remove(fde);
             fde->state &= ~FDE_PENDING;
         }
     }
 }
 
 void fdevent_add(fdevent* fde, unsigned events) {
-    check_main_thread();
     fdevent_set(fde, (fde->state & FDE_EVENTMASK) | events);
 }
 
 void fdevent_del(fdevent* fde, unsigned events) {
-    check_main_thread();
     fdevent_set(fde, (fde->state & FDE_EVENTMASK) & ~events);
 }
 
-static std::string dump_pollfds(const std::vector<adb_pollfd>& pollfds) {
-    std::string result;
-    for (const auto& pollfd : pollfds) {
-        std::string op;
-        if (pollfd.events & POLLIN) {
-            op += "R";
+static fdevent_timer* fdevent_create_timer(fdevent_context* context, std::function<void()> fn) {
+    check_looper_thread(context);
+    fdevent_timer* timer = new fdevent_timer();
+    timer->context = context;
+    timer->fn = std::move(fn);
+    return timer;
+}
+
+fdevent_timer* fdevent_create_timer(std::function<void()> fn) {
+    return fdevent_create_timer(g_current_context ? g_current_context : &g_main_context,
+                                std::move(fn));
+}
+
+void fdevent_destroy_timer(fdevent_timer* timer) {
+    if (timer == nullptr) return;
+    check_looper_thread(timer->context);
+    timer->context->timers.Cancel(timer);
+    if (timer == timer->context->running_timer) {
+        timer->destroyed = true;
+    } else {
+        delete timer;
+    }
+}
+
+void fdevent_timer_start(fdevent_timer* timer, std::chrono::milliseconds delay,
+                         std::chrono::milliseconds interval) {
+    check_looper_thread(timer->context);
+    CHECK_GE(delay.count(), 0);
+    CHECK_GE(interval.count(), 0);
+    timer->interval_ms = interval.count();
+    // Part of the current millisecond may have gone already: round up, so it's never early.
+    timer->context->timers.Schedule(timer, fdevent_now_ms() + delay.count() + 1);
+}
+
+void fdevent_timer_stop(fdevent_timer* timer) {
+    check_looper_thread(timer->context);
+    timer->context->timers.Cancel(timer);
+}
+
+bool fdevent_timer_running(const fdevent_timer* timer) {
+    return timer->scheduled();
+}
+
+static void fdevent_run_timers(fdevent_context* context) {
+    uint64_t now = fdevent_now_ms();
+    context->timers.Advance(now, [context, now](TimerWheel::Entry* entry) {
+        fdevent_timer* timer = static_cast<fdevent_timer*>(entry);
+        if (timer->interval_ms != 0) {
+            // From when it was due rather than now, so that it doesn't drift, but without trying to
+            // make up for the times it missed if the loop was held up.
+            context->timers.Schedule(
+                    timer, std::max(context->timers.now() + timer->interval_ms, now + 1));
         }
-        if (pollfd.events & POLLOUT) {
-            op += "W";
+
+        context->running_timer = timer;
+        timer->fn();
+        context->running_timer = nullptr;
+        if (timer->destroyed) {
+            delete timer;
         }
-        android::base::StringAppendF(&result, " %d(%s)", pollfd.fd, op.c_str());
-    }
-    return result;
+    });
 }
 
-static void fdevent_process() {
-    std::vector<adb_pollfd> pollfds;
-    for (const auto& pair : g_poll_node_map) {
-        pollfds.push_back(pair.second.pollfd);
+// How long the loop can wait for before the next timer is due, in milliseconds, or -1 for forever.
+static int fdevent_timer_wait_ms(fdevent_context* context) {
+    std::optional<uint64_t> next = context->timers.NextEvent();
+    if (!next) {
+        return -1;
     }
-    CHECK_GT(pollfds.size(), 0u);
-    D("poll(), pollfds = %s", dump_pollfds(pollfds).c_str());
-    int ret = adb_poll(&pollfds[0], pollfds.size(), -1);
-    if (ret == -1) {
-        PLOG(ERROR) << "poll(), ret = " << ret;
+    uint64_t now = fdevent_now_ms();
+    if (*next <= now) {
+        return 0;
+    }
+    return static_cast<int>(std::min<uint64_t>(*next - now, INT_MAX));
+}
+
+void fdevent_set_timeout(fdevent* fde, int64_t timeout_ms) {
+    check_looper_thread(fde->context);
+    if (timeout_ms < 0) {
+        fdevent_destroy_timer(fde->timeout_timer);
+        fde->timeout_timer = nullptr;
         return;
     }
-    for (const auto& pollfd : pollfds) {
-        if (pollfd.revents != 0) {
-            D("for fd %d, revents = %x", pollfd.fd, pollfd.revents);
-        }
-        unsigned events = 0;
-        if (pollfd.revents & POLLIN) {
-            events |= FDE_READ;
-        }
-        if (pollfd.revents & POLLOUT) {
-            events |= FDE_WRITE;
-        }
-        if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-            // We fake a read, as the rest of the code assumes that errors will
-            // be detected at that point.
-            events |= FDE_READ | FDE_ERROR;
-        }
-#if defined(__linux__)
-        if (pollfd.revents & POLLRDHUP) {
-            events |= FDE_READ | FDE_ERROR;
-        }
-#endif
-        if (events != 0) {
-            auto it = g_poll_node_map.find(pollfd.fd);
-            CHECK(it != g_poll_node_map.end());
-            fdevent* fde = it->second.fde;
-            CHECK_EQ(fde->fd.get(), pollfd.fd);
-            fde->events |= events;
-            D("%s got events %x", dump_fde(fde).c_str(), events);
-            fde->state |= FDE_PENDING;
-            g_pending_list.push_back(fde);
-        }
+
+    if (!fde->timeout_timer) {
+        fde->timeout_timer = fdevent_create_timer(fde->context, [fde]() {
+            // Whatever else it's about to be told about counts as activity.
+            if (fde->state & FDE_PENDING) {
+                return;
+            }
+            fdevent_queue_events(fde, FDE_TIMEOUT);
+        });
+    }
+    fde->timeout = std::chrono::milliseconds(timeout_ms);
+    fdevent_timer_start(fde->timeout_timer, fde->timeout, fde->timeout);
+}
+
+void fdevent_queue_events(fdevent* fde, unsigned events) {
+    fde->events |= events;
+    D("%s got events %x", dump_fde(fde).c_str(), events);
+    if (!(fde->state & FDE_PENDING)) {
+        fde->state |= FDE_PENDING;
+        fde->context->pending_list.push_back(fde);
     }
 }
 
@@ -283,28 +467,47 @@ static void fdevent_call_fdfunc(fdevent* fde) {
     fde->events = 0;
     CHECK(fde->state & FDE_PENDING);
     fde->state &= (~FDE_PENDING);
+    if (fde->timeout_timer && (events & ~FDE_TIMEOUT)) {
+        fdevent_timer_start(fde->timeout_timer, fde->timeout, fde->timeout);
+    }
     D("fdevent_call_fdfunc %s", dump_fde(fde).c_str());
     fde->func(fde->fd.get(), events, fde->arg);
 }
 
-static void fdevent_run_flush() EXCLUDES(run_queue_mutex) {
-    // We need to be careful around reentrancy here, since a function we call can queue up another
-    // function.
-    while (true) {
-        std::function<void()> fn;
-        {
-            std::lock_guard<std::mutex> lock(run_queue_mutex);
-            if (run_queue.empty()) {
-                break;
+static void fdevent_run_flush(fdevent_context* context) {
+    // Anything queued from here on notifies us again, even if we find it below. A producer that
+    // has swapped in its node but not linked it yet will do so too, so it's fine to stop there.
+    context->run_queue_notified.store(false);
+
+    // A function we call can queue up another function, which we'll run in this pass too.
+    RunQueueNode* done_first = nullptr;
+    RunQueueNode* done_last = nullptr;
+    size_t done_count = 0;
+    while (RunQueueNode* next = context->run_queue_head->next.load()) {
+        std::function<void()> fn = std::move(next->fn);
+
+        RunQueueNode* done = context->run_queue_head;
+        context->run_queue_head = next;
+        if (done_count == kMaxFreeRunQueueNodes) {
+            delete done;
+        } else {
+            done->next.store(done_first, std::memory_order_relaxed);
+            done_first = done;
+            if (!done_last) {
+                done_last = done;
             }
-            fn = run_queue.front();
-            run_queue.pop_front();
+            ++done_count;
         }
+
         fn();
     }
+
+    if (done_first) {
+        run_queue_release_nodes(done_first, done_last, done_count);
+    }
 }
 
-static void fdevent_run_func(int fd, unsigned ev, void* /* userdata */) {
+static void fdevent_run_func(int fd, unsigned ev, void* userdata) {
     CHECK_GE(fd, 0);
     CHECK(ev & FDE_READ);
 
@@ -315,92 +518,165 @@ static void fdevent_run_func(int fd, unsigned ev, void* /* userdata */) {
         PLOG(FATAL) << "failed to empty run queue notify fd";
     }
 
-    // Mark that we need to flush, and then run it at the end of fdevent_loop.
-    run_needs_flush = true;
+    // Mark that we need to flush, and then run it at the end of the loop's iteration.
+    static_cast<fdevent_context*>(userdata)->run_needs_flush = true;
 }
 
-static void fdevent_run_setup() {
-    {
-        std::lock_guard<std::mutex> lock(run_queue_mutex);
-        CHECK(run_queue_notify_fd.get() == -1);
-        int s[2];
-        if (adb_socketpair(s) != 0) {
-            PLOG(FATAL) << "failed to create run queue notify socketpair";
-        }
+static void fdevent_run_setup(fdevent_context* context) {
+    CHECK(context->run_queue_notify_fd.get() == -1);
+#if defined(__linux__)
+    int read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (read_fd == -1) {
+        PLOG(FATAL) << "failed to create run queue notify eventfd";
+    }
+    context->run_queue_notify_fd.reset(fcntl(read_fd, F_DUPFD_CLOEXEC, 0));
+    if (context->run_queue_notify_fd == -1) {
+        PLOG(FATAL) << "failed to dup run queue notify eventfd";
+    }
+#else
+    int s[2];
+    if (adb_socketpair(s) != 0) {
+        PLOG(FATAL) << "failed to create run queue notify socketpair";
+    }
 
-        if (!set_file_block_mode(s[0], false) || !set_file_block_mode(s[1], false)) {
-            PLOG(FATAL) << "failed to make run queue notify socket nonblocking";
-        }
+    if (!set_file_block_mode(s[0], false) || !set_file_block_mode(s[1], false)) {
+        PLOG(FATAL) << "failed to make run queue notify socket nonblocking";
+    }
+
+    context->run_queue_notify_fd.reset(s[0]);
+    int read_fd = s[1];
+#endif
+    fdevent* fde = fdevent_create(read_fd, fdevent_run_func, context);
+    CHECK(fde != nullptr);
+    fdevent_add(fde, FDE_READ);
+
+    // Anything queued before now didn't get to notify us.
+    context->run_queue_notify_fd_value = context->run_queue_notify_fd.get();
+    fdevent_run_flush(context);
+}
 
-        run_queue_notify_fd.reset(s[0]);
-        fdevent* fde = fdevent_create(s[1], fdevent_run_func, nullptr);
-        CHECK(fde != nullptr);
-        fdevent_add(fde, FDE_READ);
+static void fdevent_run_notify(fdevent_context* context) {
+    // The loop hasn't finished setting up yet: it'll flush the queue once it has.
+    int fd = context->run_queue_notify_fd_value;
+    if (fd == -1) {
+        return;
     }
 
-    fdevent_run_flush();
+#if defined(__linux__)
+    uint64_t count = 1;
+    int rc = adb_write(fd, &count, sizeof(count));
+#else
+    // It's possible that we get EAGAIN here, if lots of notifications came in while handling.
+    int rc = adb_write(fd, "", 1);
+#endif
+    if (rc == 0) {
+        PLOG(FATAL) << "run queue notify fd was closed?";
+    } else if (rc == -1 && errno != EAGAIN) {
+        PLOG(FATAL) << "failed to write to run queue notify fd";
+    }
 }
 
-void fdevent_run_on_main_thread(std::function<void()> fn) {
-    std::lock_guard<std::mutex> lock(run_queue_mutex);
-    run_queue.push_back(std::move(fn));
-
-    // run_queue_notify_fd could still be -1 if we're called before fdevent has finished setting up.
-    // In that case, rely on the setup code to flush the queue without a notification being needed.
-    if (run_queue_notify_fd != -1) {
-        int rc = adb_write(run_queue_notify_fd.get(), "", 1);
-
-        // It's possible that we get EAGAIN here, if lots of notifications came in while handling.
-        if (rc == 0) {
-            PLOG(FATAL) << "run queue notify fd was closed?";
-        } else if (rc == -1 && errno != EAGAIN) {
-            PLOG(FATAL) << "failed to write to run queue notify fd";
-        }
+void fdevent_run_on(fdevent_context* context, std::function<void()> fn) {
+    RunQueueNode* node = run_queue_allocate_node();
+    node->fn = std::move(fn);
+
+    RunQueueNode* prev = context->run_queue_tail.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node);
+
+    // Only the first function queued since the loop last looked needs to wake it up.
+    if (!context->run_queue_notified.exchange(true)) {
+        fdevent_run_notify(context);
     }
 }
 
-void fdevent_loop() {
-    set_main_thread();
-    fdevent_run_setup();
+void fdevent_run_on_main_thread(std::function<void()> fn) {
+    fdevent_run_on(&g_main_context, std::move(fn));
+}
+
+static void fdevent_run_loop(fdevent_context* context) {
+    g_current_context = context;
+    fdevent_run_setup(context);
 
     while (true) {
-        if (terminate_loop) {
+        if (context->terminate_loop) {
             return;
         }
 
         D("--- --- waiting for events");
 
-        fdevent_process();
+        fdevent_get_backend(context).Wait(fdevent_timer_wait_ms(context));
+        fdevent_run_timers(context);
 
-        while (!g_pending_list.empty()) {
-            fdevent* fde = g_pending_list.front();
-            g_pending_list.pop_front();
+        while (!context->pending_list.empty()) {
+            fdevent* fde = context->pending_list.front();
+            context->pending_list.pop_front();
             fdevent_call_fdfunc(fde);
         }
 
-        if (run_needs_flush) {
-            fdevent_run_flush();
-            run_needs_flush = false;
+        if (context->run_needs_flush) {
+            fdevent_run_flush(context);
+            context->run_needs_flush = false;
         }
     }
 }
 
+void fdevent_loop() {
+    set_main_thread();
+    fdevent_run_loop(&g_main_context);
+}
+
+fdevent_context* fdevent_start_loop_thread(const std::string& name) {
+    // Make sure the main loop has settled on a backend, for the new loop to copy.
+    fdevent_get_backend(&g_main_context);
+
+    fdevent_context* context = new fdevent_context();
+    std::thread([context, name]() {
+        adb_thread_setname(name);
+        context->looper_valid = true;
+        context->looper_thread_id = android::base::GetThreadId();
+        fdevent_run_loop(context);
+    }).detach();
+    return context;
+}
+
 void fdevent_terminate_loop() {
-    terminate_loop = true;
+    g_main_context.terminate_loop = true;
 }
 
 size_t fdevent_installed_count() {
-    return g_poll_node_map.size();
+    return fdevent_get_backend(&g_main_context).size();
 }
 
-void fdevent_reset() {
-    g_poll_node_map.clear();
-    g_pending_list.clear();
+bool fdevent_use_backend(const char* name) {
+    auto backend = fdevent_create_backend(name);
+    if (!backend) {
+        return false;
+    }
+    g_main_context.backend = std::move(backend);
+    return true;
+}
 
-    std::lock_guard<std::mutex> lock(run_queue_mutex);
-    run_queue_notify_fd.reset();
-    run_queue.clear();
+const char* fdevent_backend_name() {
+    return fdevent_get_backend(&g_main_context).name();
+}
+
+void fdevent_reset() {
+    fdevent_context& context = g_main_context;
+    context.backend.reset();
+    context.pending_list.clear();
+    context.timers.Clear();
+    context.running_timer = nullptr;
+
+    context.run_queue_notify_fd_value = -1;
+    context.run_queue_notify_fd.reset();
+    context.run_queue_notified = false;
+    context.run_needs_flush = false;
+    while (RunQueueNode* next = context.run_queue_head->next.load()) {
+        next->fn = nullptr;
+        delete context.run_queue_head;
+        context.run_queue_head = next;
+    }
 
-    main_thread_valid = false;
-    terminate_loop = false;
+    context.looper_valid = false;
+    context.terminate_loop = false;
 }
@@ -20,7 +20,9 @@
 #include <stddef.h>
 #include <stdint.h>  /* for int64_t */
 
+#include <chrono>
 #include <functional>
+#include <string>
 
 #include "adb_unique_fd.h"
 
@@ -28,12 +30,21 @@
 #define FDE_READ              0x0001
 #define FDE_WRITE             0x0002
 #define FDE_ERROR             0x0004
+#define FDE_TIMEOUT           0x0008
 
 typedef void (*fd_func)(int fd, unsigned events, void *userdata);
 
+// An event loop: the main one, or another started by fdevent_start_loop_thread().
+struct fdevent_context;
+
+struct fdevent_timer;
+
 struct fdevent {
     uint64_t id;
 
+    // The loop that this fdevent belongs to, which is the only thread that may touch it.
+    fdevent_context* context = nullptr;
+
     unique_fd fd;
     int force_eof = 0;
 
@@ -42,6 +53,10 @@ struct fdevent {
 
     fd_func func = nullptr;
     void* arg = nullptr;
+
+    // Set by fdevent_set_timeout().
+    fdevent_timer* timeout_timer = nullptr;
+    std::chrono::milliseconds timeout{0};
 };
 
 /* Allocate and initialize a new fdevent object
@@ -55,14 +70,35 @@ fdevent *fdevent_create(int fd, fd_func func, void *arg);
 */
 void fdevent_destroy(fdevent *fde);
 
+// Like fdevent_destroy, but hands the fd back instead of closing it, e.g. for it to be watched by
+// another loop.
+unique_fd fdevent_release(fdevent* fde);
+
 /* Change which events should cause notifications
 */
 void fdevent_set(fdevent *fde, unsigned events);
 void fdevent_add(fdevent *fde, unsigned events);
 void fdevent_del(fdevent *fde, unsigned events);
 
+// Calls the fdevent's function with FDE_TIMEOUT when none of the events that it's waiting for have
+// happened for |timeout_ms|, and again every |timeout_ms| after that until one does. A negative
+// timeout turns that off.
 void fdevent_set_timeout(fdevent *fde, int64_t  timeout_ms);
 
+// A timer belongs to a loop the same way as an fdevent does, and calls its function on that loop
+// once its delay is up, and then every |interval|, unless that's zero. Timers have millisecond
+// resolution, and cost the same however many of them there are.
+fdevent_timer* fdevent_create_timer(std::function<void()> fn);
+
+// May be called from the timer's own function.
+void fdevent_destroy_timer(fdevent_timer* timer);
+
+// Starts the timer, or restarts it if it was already running.
+void fdevent_timer_start(fdevent_timer* timer, std::chrono::milliseconds delay,
+                         std::chrono::milliseconds interval = std::chrono::milliseconds::zero());
+void fdevent_timer_stop(fdevent_timer* timer);
+bool fdevent_timer_running(const fdevent_timer* timer);
+
 /* loop forever, handling events.
 */
 void fdevent_loop();
@@ -72,10 +108,22 @@ void check_main_thread();
 // Queue an operation to run on the main thread.
 void fdevent_run_on_main_thread(std::function<void()> fn);
 
+// The server can run more event loops besides the main one, each on a thread of its own. An
+// fdevent belongs to the loop of the thread that created it (or the main loop, before it starts),
+// so work on another loop's fdevents has to be handed over with fdevent_run_on().
+fdevent_context* fdevent_main_context();
+fdevent_context* fdevent_start_loop_thread(const std::string& name);
+void fdevent_run_on(fdevent_context* context, std::function<void()> fn);
+
 // The following functions are used only for tests.
 void fdevent_terminate_loop();
 size_t fdevent_installed_count();
 void fdevent_reset();
 void set_main_thread();
 
+// Switch to the named backend ("poll", or "epoll" on Linux). Must be called before any fdevents are
+// created, e.g. right after fdevent_reset(). Returns false if the backend isn't available.
+bool fdevent_use_backend(const char* name);
+const char* fdevent_backend_name();
+
 #endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+
+#include "fdevent.h"
+
+// The OS-specific half of fdevent: keeps track of which fds we're interested in, and waits for
+// them to become ready. fdevent.cpp owns the fdevent objects, the pending list and the run queue.
+//
+// Each loop has a backend of its own, whose methods are only ever called on that loop's thread.
+struct fdevent_backend {
+    virtual ~fdevent_backend() = default;
+
+    virtual const char* name() const = 0;
+
+    // Start watching fde->fd. Called once from fdevent_create(), with no FDE_READ/FDE_WRITE
+    // interest yet; errors and hangups are still reported.
+    virtual void Register(fdevent* fde) = 0;
+
+    // Stop watching fde->fd. Called once from fdevent_destroy(), before the fd is closed.
+    virtual void Unregister(fdevent* fde) = 0;
+
+    // Change the FDE_READ/FDE_WRITE interest of a registered fdevent.
+    // Only called when the mask actually changes.
+    virtual void Update(fdevent* fde, unsigned events) = 0;
+
+    // Wait for up to |timeout_ms| milliseconds (-1 waits forever), and hand every fdevent that
+    // became ready to fdevent_queue_events().
+    virtual void Wait(int timeout_ms) = 0;
+
+    // The number of registered fdevents.
+    virtual size_t size() const = 0;
+};
+
+std::unique_ptr<fdevent_backend> fdevent_create_poll_backend();
+#if defined(__linux__)
+std::unique_ptr<fdevent_backend> fdevent_create_epoll_backend();
+#endif
+
+// Called by the backend from Wait() to mark |fde| as pending with |events|.
+void fdevent_queue_events(fdevent* fde, unsigned events);
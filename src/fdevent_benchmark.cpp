@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include <atomic>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "adb_io.h"
+#include "adb_unique_fd.h"
+#include "fdevent.h"
+#include "sysdeps.h"
+
+// Each registered fd costs us an fd, and 4096 of them won't fit in the usual soft limit of 1024.
+static void RaiseFdLimit() {
+#if !defined(_WIN32)
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+#endif
+}
+
+static void EchoCallback(int fd, unsigned events, void*) {
+    if (events & FDE_READ) {
+        char c;
+        if (adb_read(fd, &c, 1) == 1) {
+            adb_write(fd, &c, 1);
+        }
+    }
+}
+
+// Measure the latency of a single wakeup of the fdevent loop, while it's also watching
+// |state.range(0)| idle fds. With poll, every iteration pays for all of the idle fds.
+static void BM_Fdevent_Wakeup(benchmark::State& state, const char* backend) {
+    RaiseFdLimit();
+    fdevent_reset();
+    if (!fdevent_use_backend(backend)) {
+        state.SkipWithError("fdevent backend unavailable");
+        return;
+    }
+
+    // fdevent_destroy() closes the fds for us.
+    std::vector<fdevent*> fdes;
+    for (int64_t i = 0; i < state.range(0); i += 2) {
+        int idle_fds[2];
+        if (adb_socketpair(idle_fds) != 0) {
+            state.SkipWithError("failed to create socketpair");
+            break;
+        }
+        for (int fd : idle_fds) {
+            fdevent* fde = fdevent_create(fd, [](int, unsigned, void*) {}, nullptr);
+            fdevent_add(fde, FDE_READ);
+            fdes.push_back(fde);
+        }
+    }
+
+    int echo_fds[2];
+    if (adb_socketpair(echo_fds) != 0) {
+        PLOG(FATAL) << "failed to create socketpair";
+    }
+    unique_fd client(echo_fds[0]);
+    fdevent* echo = fdevent_create(echo_fds[1], EchoCallback, nullptr);
+    fdevent_add(echo, FDE_READ);
+    fdes.push_back(echo);
+
+    std::thread fdevent_thread([]() { fdevent_loop(); });
+
+    for (auto _ : state) {
+        char c = 'x';
+        if (!WriteFdExactly(client.get(), &c, 1) || !ReadFdExactly(client.get(), &c, 1)) {
+            state.SkipWithError("echo failed");
+            break;
+        }
+    }
+
+    // Make sure the fdevents are gone before the loop is told to terminate, or we'd leak their fds.
+    std::promise<void> destroyed;
+    fdevent_run_on_main_thread([&fdes, &destroyed]() {
+        for (fdevent* fde : fdes) {
+            fdevent_destroy(fde);
+        }
+        destroyed.set_value();
+    });
+    destroyed.get_future().wait();
+    fdevent_terminate_loop();
+    fdevent_run_on_main_thread([]() {});
+    fdevent_thread.join();
+}
+
+BENCHMARK_CAPTURE(BM_Fdevent_Wakeup, poll, "poll")->RangeMultiplier(8)->Range(0, 4096)->UseRealTime();
+#if defined(__linux__)
+BENCHMARK_CAPTURE(BM_Fdevent_Wakeup, epoll, "epoll")->RangeMultiplier(8)->Range(0, 4096)->UseRealTime();
+#endif
+
+// Measure how fast |state.range(0)| threads can hand tasks over to the main thread, which is what
+// every packet that a transport reads goes through.
+static void BM_Fdevent_RunOnMainThread(benchmark::State& state) {
+    static constexpr size_t kTasksPerThread = 10000;
+    const size_t thread_count = state.range(0);
+
+    fdevent_reset();
+    std::thread fdevent_thread([]() { fdevent_loop(); });
+
+    std::atomic<size_t> tasks_run(0);
+    for (auto _ : state) {
+        tasks_run = 0;
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < thread_count; ++i) {
+            threads.emplace_back([&tasks_run]() {
+                for (size_t j = 0; j < kTasksPerThread; ++j) {
+                    fdevent_run_on_main_thread(
+                            [&tasks_run]() { tasks_run.fetch_add(1, std::memory_order_relaxed); });
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        while (tasks_run < thread_count * kTasksPerThread) {
+            std::this_thread::yield();
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * thread_count *
+                            kTasksPerThread);
+
+    fdevent_terminate_loop();
+    fdevent_run_on_main_thread([]() {});
+    fdevent_thread.join();
+}
+BENCHMARK(BM_Fdevent_RunOnMainThread)->Arg(1)->Arg(4)->UseRealTime();
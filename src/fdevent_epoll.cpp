@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if defined(__linux__)
+
+#define TRACE_TAG FDEVENT
+
+#include "sysdeps.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include <unordered_map>
+
+#include <android-base/logging.h>
+
+#include "adb_trace.h"
+#include "adb_unique_fd.h"
+#include "fdevent_backend.h"
+
+namespace {
+
+// epoll(7) keeps the interest set in the kernel, so an iteration of the event loop costs time
+// proportional to the number of ready fds rather than the number of registered ones, and the
+// fdevent for each ready fd comes back directly in epoll_event.data.ptr.
+//
+// We stay level-triggered on purpose: local sockets stop reading once they've filled a payload
+// and rely on being woken up again for whatever is left in the socket buffer. What we do avoid is
+// redundant work: epoll_ctl is only issued when an fdevent's interest mask changes.
+struct EpollBackend : public fdevent_backend {
+    EpollBackend() {
+        epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+        if (epoll_fd_ == -1) {
+            PLOG(FATAL) << "failed to create epoll fd";
+        }
+    }
+
+    const char* name() const override final { return "epoll"; }
+
+    void Register(fdevent* fde) override final {
+        epoll_event ev = {};
+        // Always enable EPOLLRDHUP, so the host server can take action when some clients
+        // disconnect. Then we can avoid leaving many sockets in CLOSE_WAIT state.
+        // See http://b/23314034.
+        ev.events = EPOLLRDHUP;
+        ev.data.ptr = fde;
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, fde->fd.get(), &ev) != 0) {
+            if (errno == EEXIST) {
+                LOG(FATAL) << "install existing fd " << fde->fd.get();
+            }
+
+            // epoll refuses fds that poll() happily accepts: invalid fds (which poll reports as
+            // POLLNVAL) and regular files (which poll always reports as ready). Keep track of them
+            // on the side and emulate poll's behavior.
+            D("epoll_ctl(ADD, %d) failed: %s, emulating poll()", fde->fd.get(), strerror(errno));
+            unpollable_.emplace(fde, errno);
+        }
+        ++count_;
+    }
+
+    void Unregister(fdevent* fde) override final {
+        --count_;
+        if (unpollable_.erase(fde) != 0) {
+            return;
+        }
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fde->fd.get(), nullptr) != 0) {
+            PLOG(ERROR) << "epoll_ctl(DEL, " << fde->fd.get() << ") failed";
+        }
+    }
+
+    void Update(fdevent* fde, unsigned events) override final {
+        if (unpollable_.count(fde)) {
+            return;
+        }
+
+        epoll_event ev = {};
+        ev.events = EPOLLRDHUP;
+        if (events & FDE_READ) {
+            ev.events |= EPOLLIN;
+        }
+        if (events & FDE_WRITE) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.ptr = fde;
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_MOD, fde->fd.get(), &ev) != 0) {
+            PLOG(FATAL) << "epoll_ctl(MOD, " << fde->fd.get() << ") failed";
+        }
+    }
+
+    void Wait(int timeout_ms) override final {
+        CHECK_GT(count_, 0u);
+
+        // Unpollable fds are always ready, so don't block if any of them have something to report.
+        if (QueueUnpollableEvents()) {
+            timeout_ms = 0;
+        }
+
+        D("epoll_wait(), %zu fds registered", count_);
+        int rc = epoll_wait(epoll_fd_.get(), events_, kMaxEvents, timeout_ms);
+        if (rc == -1) {
+            if (errno != EINTR) {
+                PLOG(ERROR) << "epoll_wait() failed";
+            }
+            return;
+        }
+
+        for (int i = 0; i < rc; ++i) {
+            fdevent* fde = static_cast<fdevent*>(events_[i].data.ptr);
+            uint32_t revents = events_[i].events;
+            D("for fd %d, revents = %x", fde->fd.get(), revents);
+
+            unsigned events = 0;
+            if (revents & EPOLLIN) {
+                events |= FDE_READ;
+            }
+            if (revents & EPOLLOUT) {
+                events |= FDE_WRITE;
+            }
+            if (revents & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                // We fake a read, as the rest of the code assumes that errors will
+                // be detected at that point.
+                events |= FDE_READ | FDE_ERROR;
+            }
+            if (events != 0) {
+                fdevent_queue_events(fde, events);
+            }
+        }
+    }
+
+    size_t size() const override final { return count_; }
+
+  private:
+    bool QueueUnpollableEvents() {
+        bool queued = false;
+        for (const auto& pair : unpollable_) {
+            fdevent* fde = pair.first;
+            unsigned events;
+            if (pair.second == EPERM) {
+                events = fde->state & (FDE_READ | FDE_WRITE);
+            } else {
+                events = FDE_READ | FDE_ERROR;
+            }
+            if (events != 0) {
+                fdevent_queue_events(fde, events);
+                queued = true;
+            }
+        }
+        return queued;
+    }
+
+    // Ready fds beyond this are picked up on the next iteration, since we're level-triggered.
+    static constexpr int kMaxEvents = 256;
+
+    unique_fd epoll_fd_;
+    epoll_event events_[kMaxEvents];
+    size_t count_ = 0;
+
+    // fdevents that epoll refused, mapped to the errno from EPOLL_CTL_ADD.
+    std::unordered_map<fdevent*, int> unpollable_;
+};
+
+}  // namespace
+
+std::unique_ptr<fdevent_backend> fdevent_create_epoll_backend() {
+    return std::make_unique<EpollBackend>();
+}
+
+#endif  // defined(__linux__)
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG FDEVENT
+
+#include "sysdeps.h"
+
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include "adb_trace.h"
+#include "fdevent_backend.h"
+
+namespace {
+
+struct PollNode {
+    fdevent* fde;
+    adb_pollfd pollfd;
+
+    explicit PollNode(fdevent* fde) : fde(fde) {
+        memset(&pollfd, 0, sizeof(pollfd));
+        pollfd.fd = fde->fd.get();
+
+#if defined(__linux__)
+        // Always enable POLLRDHUP, so the host server can take action when some clients disconnect.
+        // Then we can avoid leaving many sockets in CLOSE_WAIT state. See http://b/23314034.
+        pollfd.events = POLLRDHUP;
+#endif
+    }
+};
+
+std::string dump_pollfds(const std::vector<adb_pollfd>& pollfds) {
+    std::string result;
+    for (const auto& pollfd : pollfds) {
+        std::string op;
+        if (pollfd.events & POLLIN) {
+            op += "R";
+        }
+        if (pollfd.events & POLLOUT) {
+            op += "W";
+        }
+        android::base::StringAppendF(&result, " %d(%s)", pollfd.fd, op.c_str());
+    }
+    return result;
+}
+
+// The portable backend: rebuilds a pollfd array from every registered fd on each iteration.
+// Used everywhere epoll isn't available, and on Linux when ADB_EPOLL=0.
+struct PollBackend : public fdevent_backend {
+    const char* name() const override final { return "poll"; }
+
+    void Register(fdevent* fde) override final {
+        auto pair = poll_node_map_.emplace(fde->fd.get(), PollNode(fde));
+        CHECK(pair.second) << "install existing fd " << fde->fd.get();
+    }
+
+    void Unregister(fdevent* fde) override final { poll_node_map_.erase(fde->fd.get()); }
+
+    void Update(fdevent* fde, unsigned events) override final {
+        auto it = poll_node_map_.find(fde->fd.get());
+        CHECK(it != poll_node_map_.end());
+        PollNode& node = it->second;
+        if (events & FDE_READ) {
+            node.pollfd.events |= POLLIN;
+        } else {
+            node.pollfd.events &= ~POLLIN;
+        }
+
+        if (events & FDE_WRITE) {
+            node.pollfd.events |= POLLOUT;
+        } else {
+            node.pollfd.events &= ~POLLOUT;
+        }
+    }
+
+    void Wait(int timeout_ms) override final {
+        std::vector<adb_pollfd> pollfds;
+        for (const auto& pair : poll_node_map_) {
+            pollfds.push_back(pair.second.pollfd);
+        }
+        CHECK_GT(pollfds.size(), 0u);
+        D("poll(), pollfds = %s", dump_pollfds(pollfds).c_str());
+        int ret = adb_poll(&pollfds[0], pollfds.size(), timeout_ms);
+        if (ret == -1) {
+            if (errno != EINTR) {
+                PLOG(ERROR) << "poll(), ret = " << ret;
+            }
+            return;
+        }
+        for (const auto& pollfd : pollfds) {
+            if (pollfd.revents != 0) {
+                D("for fd %d, revents = %x", pollfd.fd, pollfd.revents);
+            }
+            unsigned events = 0;
+            if (pollfd.revents & POLLIN) {
+                events |= FDE_READ;
+            }
+            if (pollfd.revents & POLLOUT) {
+                events |= FDE_WRITE;
+            }
+            if (pollfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                // We fake a read, as the rest of the code assumes that errors will
+                // be detected at that point.
+                events |= FDE_READ | FDE_ERROR;
+            }
+#if defined(__linux__)
+            if (pollfd.revents & POLLRDHUP) {
+                events |= FDE_READ | FDE_ERROR;
+            }
+#endif
+            if (events != 0) {
+                auto it = poll_node_map_.find(pollfd.fd);
+                CHECK(it != poll_node_map_.end());
+                fdevent* fde = it->second.fde;
+                CHECK_EQ(fde->fd.get(), pollfd.fd);
+                fdevent_queue_events(fde, events);
+            }
+        }
+    }
+
+    size_t size() const override final { return poll_node_map_.size(); }
+
+  private:
+    std::unordered_map<int, PollNode> poll_node_map_;
+};
+
+}  // namespace
+
+std::unique_ptr<fdevent_backend> fdevent_create_poll_backend() {
+    return std::make_unique<PollBackend>();
+}
@@ -18,12 +18,15 @@
 
 #include <gtest/gtest.h>
 
+#include <future>
 #include <limits>
 #include <queue>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <android-base/test_utils.h>
+
 #include "adb_io.h"
 #include "fdevent_test.h"
 #include "sysdeps/memory.h"
@@ -174,6 +177,43 @@ TEST_F(FdeventTest, invalid_fd) {
     thread.join();
 }
 
+TEST_F(FdeventTest, invalid_fd_poll) {
+    ASSERT_TRUE(fdevent_use_backend("poll"));
+    std::thread thread(InvalidFdThreadFunc);
+    thread.join();
+}
+
+TEST_F(FdeventTest, backend) {
+    ASSERT_TRUE(fdevent_use_backend("poll"));
+    ASSERT_STREQ("poll", fdevent_backend_name());
+#if defined(__linux__)
+    ASSERT_TRUE(fdevent_use_backend("epoll"));
+    ASSERT_STREQ("epoll", fdevent_backend_name());
+#endif
+    ASSERT_FALSE(fdevent_use_backend("select"));
+}
+
+static void RegularFileEventCallback(int, unsigned events, void* userdata) {
+    fdevent* fde = reinterpret_cast<fdevent*>(userdata);
+    ASSERT_EQ(static_cast<unsigned>(FDE_READ), events);
+    fdevent_destroy(fde);
+    fdevent_terminate_loop();
+}
+
+// poll() always reports regular files as readable, but epoll refuses to watch them at all.
+TEST_F(FdeventTest, regular_file) {
+    TemporaryFile tf;
+    std::thread thread([&tf]() {
+        unique_fd fd(adb_open(tf.path, O_RDONLY));
+        ASSERT_NE(-1, fd.get());
+        fdevent* fde = fdevent_create(fd.release(), RegularFileEventCallback, nullptr);
+        fde->arg = fde;
+        fdevent_add(fde, FDE_READ);
+        fdevent_loop();
+    });
+    thread.join();
+}
+
 TEST_F(FdeventTest, run_on_main_thread) {
     std::vector<int> vec;
 
@@ -224,3 +264,150 @@ TEST_F(FdeventTest, run_on_main_thread_reentrant) {
         ASSERT_EQ(i, vec[i]);
     }
 }
+
+TEST_F(FdeventTest, release) {
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+
+    fdevent* fde = fdevent_create(fds[0], [](int, unsigned, void*) {}, nullptr);
+    fdevent_add(fde, FDE_READ);
+    ASSERT_EQ(1u, fdevent_installed_count());
+
+    unique_fd fd = fdevent_release(fde);
+    ASSERT_EQ(fds[0], fd.get());
+    ASSERT_EQ(0u, fdevent_installed_count());
+
+    // The fd is still open.
+    char c;
+    ASSERT_TRUE(WriteFdExactly(fds[1], "x", 1));
+    ASSERT_TRUE(ReadFdExactly(fd.get(), &c, 1));
+    ASSERT_EQ('x', c);
+    ASSERT_EQ(0, adb_close(fds[1]));
+}
+
+struct LoopThreadArg {
+    std::thread::id loop_thread;
+    fdevent* fde = nullptr;
+    std::promise<std::string> received;
+};
+
+static void LoopThreadEventCallback(int fd, unsigned, void* userdata) {
+    LoopThreadArg* arg = reinterpret_cast<LoopThreadArg*>(userdata);
+    ASSERT_EQ(arg->loop_thread, std::this_thread::get_id());
+
+    char buf[16];
+    int rc = adb_read(fd, buf, sizeof(buf));
+    ASSERT_GT(rc, 0);
+    fdevent_destroy(arg->fde);
+    arg->received.set_value(std::string(buf, rc));
+}
+
+TEST_F(FdeventTest, loop_thread) {
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+
+    fdevent_context* loop = fdevent_start_loop_thread("fdevent test");
+    ASSERT_NE(fdevent_main_context(), loop);
+
+    // An fdevent created on the loop's thread belongs to that loop, and is called back there.
+    LoopThreadArg arg;
+    std::future<std::string> received = arg.received.get_future();
+    fdevent_run_on(loop, [&arg, fd = fds[1]]() {
+        arg.loop_thread = std::this_thread::get_id();
+        arg.fde = fdevent_create(fd, LoopThreadEventCallback, &arg);
+        fdevent_add(arg.fde, FDE_READ);
+    });
+
+    ASSERT_TRUE(WriteFdExactly(fds[0], "hello"));
+    ASSERT_EQ("hello", received.get());
+    ASSERT_NE(std::this_thread::get_id(), arg.loop_thread);
+    ASSERT_EQ(0u, fdevent_installed_count());
+    ASSERT_EQ(0, adb_close(fds[0]));
+}
+
+TEST_F(FdeventTest, timer) {
+    using namespace std::chrono_literals;
+    PrepareThread();
+
+    std::promise<std::chrono::steady_clock::duration> one_shot;
+    std::promise<std::vector<std::chrono::steady_clock::time_point>> periodic;
+    auto start = std::chrono::steady_clock::now();
+    fdevent_timer* every = nullptr;
+    fdevent_run_on_main_thread([&]() {
+        fdevent_timer* once = fdevent_create_timer([&]() {
+            one_shot.set_value(std::chrono::steady_clock::now() - start);
+        });
+        fdevent_timer_start(once, 50ms);
+
+        auto ticks = std::make_shared<std::vector<std::chrono::steady_clock::time_point>>();
+        // A timer can be destroyed from its own function.
+        every = fdevent_create_timer([&periodic, ticks, &every, once]() {
+            ticks->push_back(std::chrono::steady_clock::now());
+            if (ticks->size() == 5) {
+                EXPECT_FALSE(fdevent_timer_running(once));
+                fdevent_destroy_timer(once);
+                fdevent_destroy_timer(every);
+                periodic.set_value(*ticks);
+            }
+        });
+        fdevent_timer_start(every, 10ms, 20ms);
+        EXPECT_TRUE(fdevent_timer_running(every));
+    });
+
+    EXPECT_GE(one_shot.get_future().get(), 50ms);
+    std::vector<std::chrono::steady_clock::time_point> ticks = periodic.get_future().get();
+    // Periodic timers are rescheduled from when they were due, so a late tick is followed by an
+    // early one: only the total is reliable.
+    ASSERT_EQ(5u, ticks.size());
+    EXPECT_GE(ticks.back() - start, 90ms);
+    TerminateThread();
+}
+
+struct TimeoutArg {
+    int fd;
+    fdevent* fde = nullptr;
+    size_t reads = 0;
+    std::promise<size_t> timed_out;
+};
+
+static void TimeoutCallback(int fd, unsigned events, void* userdata) {
+    TimeoutArg* arg = reinterpret_cast<TimeoutArg*>(userdata);
+    if (events & FDE_READ) {
+        char c;
+        ASSERT_EQ(1, adb_read(fd, &c, 1));
+        ++arg->reads;
+    }
+    if (events & FDE_TIMEOUT) {
+        fdevent_set_timeout(arg->fde, -1);
+        arg->timed_out.set_value(arg->reads);
+    }
+}
+
+TEST_F(FdeventTest, timeout) {
+    using namespace std::chrono_literals;
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+    PrepareThread();
+
+    TimeoutArg arg;
+    arg.fd = fds[1];
+    fdevent_run_on_main_thread([&arg]() {
+        arg.fde = fdevent_create(arg.fd, TimeoutCallback, &arg);
+        fdevent_add(arg.fde, FDE_READ);
+        fdevent_set_timeout(arg.fde, 200);
+    });
+
+    // Keeping it busy holds the timeout off.
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(WriteFdExactly(fds[0], "x", 1));
+        std::this_thread::sleep_for(50ms);
+    }
+    EXPECT_EQ(10u, arg.timed_out.get_future().get());
+    EXPECT_GE(std::chrono::steady_clock::now() - start, 600ms);
+
+    fdevent_run_on_main_thread([&arg]() { fdevent_destroy(arg.fde); });
+    WaitForFdeventLoop();
+    ASSERT_EQ(0, adb_close(fds[0]));
+    TerminateThread();
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/test_utils.h>
+#include <benchmark/benchmark.h>
+
+#include "adb_io.h"
+#include "adb_unique_fd.h"
+#include "file_sync_compress.h"
+#include "file_sync_delta.h"
+#include "file_sync_protocol.h"
+#include "sysdeps.h"
+
+static constexpr size_t kFileSize = 64 * 1024 * 1024;
+
+// Push a file through a socketpair as a stream of DATA chunks of |state.range(0)| bytes, with the
+// receiving end doing what the sync service does with each of them: read the header, read the
+// payload, and write it out (to /dev/null, to leave the disk out of it).
+static void BM_Sync_Send(benchmark::State& state) {
+    const size_t chunk_size = state.range(0);
+
+    int fds[2];
+    if (adb_socketpair(fds) != 0) {
+        PLOG(FATAL) << "failed to create socketpair";
+    }
+    unique_fd client(fds[0]);
+    unique_fd service(fds[1]);
+
+    unique_fd dev_null(adb_open("/dev/null", O_WRONLY));
+    if (dev_null == -1) {
+        PLOG(FATAL) << "failed to open /dev/null";
+    }
+
+    std::thread service_thread([&service, &dev_null, chunk_size]() {
+        std::vector<char> buffer(chunk_size);
+        syncmsg msg;
+        while (ReadFdExactly(service.get(), &msg.data, sizeof(msg.data))) {
+            if (msg.data.id == ID_DONE) {
+                msg.status.id = ID_OKAY;
+                msg.status.msglen = 0;
+                WriteFdExactly(service.get(), &msg.status, sizeof(msg.status));
+                continue;
+            }
+            CHECK_EQ(static_cast<uint32_t>(ID_DATA), msg.data.id);
+            CHECK_LE(msg.data.size, buffer.size());
+            if (!ReadFdExactly(service.get(), buffer.data(), msg.data.size) ||
+                !WriteFdExactly(dev_null.get(), buffer.data(), msg.data.size)) {
+                break;
+            }
+        }
+    });
+
+    // Like SyncConnection::SendLargeFile, each chunk's header and payload go out in one write.
+    std::vector<char> buffer(chunk_size);
+    SyncRequest* req = reinterpret_cast<SyncRequest*>(buffer.data());
+    const size_t payload_size = chunk_size - sizeof(SyncRequest);
+
+    for (auto _ : state) {
+        for (size_t sent = 0; sent < kFileSize; sent += payload_size) {
+            req->id = ID_DATA;
+            req->path_length = std::min(payload_size, kFileSize - sent);
+            if (!WriteFdExactly(client.get(), buffer.data(),
+                                sizeof(SyncRequest) + req->path_length)) {
+                PLOG(FATAL) << "failed to write DATA";
+            }
+        }
+
+        syncmsg msg;
+        msg.data.id = ID_DONE;
+        msg.data.size = 0;
+        if (!WriteFdExactly(client.get(), &msg.data, sizeof(msg.data)) ||
+            !ReadFdExactly(client.get(), &msg.status, sizeof(msg.status))) {
+            PLOG(FATAL) << "failed to finish file";
+        }
+    }
+
+    client.reset();
+    service_thread.join();
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * kFileSize);
+}
+
+BENCHMARK(BM_Sync_Send)
+    ->Arg(SYNC_DATA_MAX)
+    ->Arg(256 * 1024)
+    ->Arg(SYNC_CHUNK_SIZE_MAX)
+    ->UseRealTime();
+
+// Move a file's worth of chunks of |state.range(0)| bytes between a file and a socketpair, with
+// either FdCopier or the read-into-a-buffer-and-write loop it replaced.
+static bool CopyChunk(bool use_fd_copier, FdCopier& copier, int out_fd, int in_fd, size_t len) {
+    if (use_fd_copier) {
+        return copier.Copy(out_fd, in_fd, len) == FdCopier::Result::kSuccess;
+    }
+    std::vector<char>& buffer = copier.buffer();
+    return ReadFdExactly(in_fd, buffer.data(), len) && WriteFdExactly(out_fd, buffer.data(), len);
+}
+
+static void FillFile(int fd) {
+    std::vector<char> data(1024 * 1024, 'x');
+    for (size_t written = 0; written < kFileSize; written += data.size()) {
+        if (!WriteFdExactly(fd, data.data(), data.size())) {
+            PLOG(FATAL) << "failed to fill file";
+        }
+    }
+}
+
+// The device's side of a RECV: from a file to the sync socket.
+template <bool UseFdCopier>
+static void BM_Sync_CopyFromFile(benchmark::State& state) {
+    const size_t chunk_size = state.range(0);
+    TemporaryFile tf;
+    FillFile(tf.fd);
+
+    int fds[2];
+    if (adb_socketpair(fds) != 0) {
+        PLOG(FATAL) << "failed to create socketpair";
+    }
+    unique_fd sender(fds[0]);
+    unique_fd receiver(fds[1]);
+
+    std::thread receiver_thread([&receiver, chunk_size]() {
+        std::vector<char> buffer(chunk_size);
+        while (adb_read(receiver.get(), buffer.data(), buffer.size()) > 0) {
+        }
+    });
+
+    FdCopier copier(chunk_size);
+    for (auto _ : state) {
+        adb_lseek(tf.fd, 0, SEEK_SET);
+        for (size_t copied = 0; copied < kFileSize; copied += chunk_size) {
+            size_t len = std::min(chunk_size, kFileSize - copied);
+            if (!CopyChunk(UseFdCopier, copier, sender.get(), tf.fd, len)) {
+                PLOG(FATAL) << "copy failed";
+            }
+        }
+    }
+
+    sender.reset();
+    receiver_thread.join();
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * kFileSize);
+}
+
+// The device's side of a SEND: from the sync socket to a file.
+template <bool UseFdCopier>
+static void BM_Sync_CopyToFile(benchmark::State& state) {
+    const size_t chunk_size = state.range(0);
+    TemporaryFile tf;
+
+    int fds[2];
+    if (adb_socketpair(fds) != 0) {
+        PLOG(FATAL) << "failed to create socketpair";
+    }
+    unique_fd sender(fds[0]);
+    unique_fd receiver(fds[1]);
+
+    std::atomic<bool> done(false);
+    std::thread sender_thread([&sender, &done, chunk_size]() {
+        std::vector<char> buffer(chunk_size, 'x');
+        while (!done && WriteFdExactly(sender.get(), buffer.data(), buffer.size())) {
+        }
+        sender.reset();
+    });
+
+    FdCopier copier(chunk_size);
+    for (auto _ : state) {
+        adb_lseek(tf.fd, 0, SEEK_SET);
+        for (size_t copied = 0; copied < kFileSize; copied += chunk_size) {
+            size_t len = std::min(chunk_size, kFileSize - copied);
+            if (!CopyChunk(UseFdCopier, copier, tf.fd, receiver.get(), len)) {
+                PLOG(FATAL) << "copy failed";
+            }
+        }
+    }
+
+    // Let the sender's last write through, so that it sees it's done.
+    done = true;
+    std::vector<char>& buffer = copier.buffer();
+    while (adb_read(receiver.get(), buffer.data(), buffer.size()) > 0) {
+    }
+    sender_thread.join();
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * kFileSize);
+}
+
+#define ADB_FD_COPIER_BENCHMARK(benchmark_name) \
+    BENCHMARK(benchmark_name)->Arg(SYNC_DATA_MAX)->Arg(256 * 1024)->UseRealTime()
+
+static void BM_Sync_CopyFromFileBuffered(benchmark::State& state) {
+    BM_Sync_CopyFromFile<false>(state);
+}
+ADB_FD_COPIER_BENCHMARK(BM_Sync_CopyFromFileBuffered);
+
+static void BM_Sync_CopyFromFileFdCopier(benchmark::State& state) {
+    BM_Sync_CopyFromFile<true>(state);
+}
+ADB_FD_COPIER_BENCHMARK(BM_Sync_CopyFromFileFdCopier);
+
+static void BM_Sync_CopyToFileBuffered(benchmark::State& state) {
+    BM_Sync_CopyToFile<false>(state);
+}
+ADB_FD_COPIER_BENCHMARK(BM_Sync_CopyToFileBuffered);
+
+static void BM_Sync_CopyToFileFdCopier(benchmark::State& state) {
+    BM_Sync_CopyToFile<true>(state);
+}
+ADB_FD_COPIER_BENCHMARK(BM_Sync_CopyToFileFdCopier);
+
+// What a delta push costs the device: the signatures of the |state.range(0)|-byte file it has.
+static void BM_Sync_DeltaSignatures(benchmark::State& state) {
+    TemporaryFile tf;
+    std::string data(state.range(0), '\0');
+    std::generate(data.begin(), data.end(), rand);
+    CHECK(android::base::WriteStringToFd(data, tf.fd));
+
+    std::vector<DeltaBlockSignature> signatures;
+    for (auto _ : state) {
+        adb_lseek(tf.fd, 0, SEEK_SET);
+        uint64_t size;
+        CHECK(ComputeDeltaSignatures(tf.fd, DeltaBlockSize(data.size()), &size, &signatures));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data.size());
+}
+BENCHMARK(BM_Sync_DeltaSignatures)->Arg(1024 * 1024)->Arg(16 * 1024 * 1024);
+
+// What it costs the host: finding the device's blocks in a new version of the file, with a few
+// bytes changed, inserted and removed here and there.
+static void BM_Sync_ComputeDelta(benchmark::State& state) {
+    TemporaryFile tf;
+    std::string basis(state.range(0), '\0');
+    std::generate(basis.begin(), basis.end(), rand);
+    CHECK(android::base::WriteStringToFd(basis, tf.fd));
+    adb_lseek(tf.fd, 0, SEEK_SET);
+
+    size_t block_size = DeltaBlockSize(basis.size());
+    uint64_t basis_size;
+    std::vector<DeltaBlockSignature> signatures;
+    CHECK(ComputeDeltaSignatures(tf.fd, block_size, &basis_size, &signatures));
+
+    std::string data = basis;
+    for (size_t i = 1; i < 8; ++i) {
+        size_t pos = data.size() * i / 8;
+        data[pos] ^= 1;
+        data.insert(pos + data.size() / 16, "inserted");
+        data.erase(pos + data.size() / 32, 5);
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            ComputeDelta(data.data(), data.size(), basis_size, block_size, signatures));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data.size());
+}
+BENCHMARK(BM_Sync_ComputeDelta)->Arg(1024 * 1024)->Arg(16 * 1024 * 1024);
+
+// A 256k chunk of file data for the codec: log-like text when |compressible|, random bytes
+// otherwise.
+static std::string CodecChunk(bool compressible) {
+    std::string data;
+    if (!compressible) {
+        data.resize(256 * 1024);
+        std::generate(data.begin(), data.end(), rand);
+        return data;
+    }
+    while (data.size() < 256 * 1024) {
+        data += android::base::StringPrintf("10-17 06:%02d:%02d.%03d  %5d  %5d I ActivityManager: "
+                                            "Start proc %d:com.example.app%d\n",
+                                            rand() % 60, rand() % 60, rand() % 1000, rand() % 32768,
+                                            rand() % 32768, rand() % 32768, rand() % 10);
+    }
+    data.resize(256 * 1024);
+    return data;
+}
+
+// Compressing a chunk of CodecChunk(state.range(0)), on one thread.
+static void BM_Sync_Compress(benchmark::State& state) {
+    std::string data = CodecChunk(state.range(0));
+    std::vector<char> message;
+    for (auto _ : state) {
+        message.clear();
+        benchmark::DoNotOptimize(SyncAppendCompressed(data.data(), data.size(), &message));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data.size());
+}
+BENCHMARK(BM_Sync_Compress)->Arg(0)->Arg(1);
+
+static void BM_Sync_Decompress(benchmark::State& state) {
+    std::string data = CodecChunk(true);
+    std::vector<char> compressed(data.size());
+    size_t size = SyncCompress(data.data(), data.size(), compressed.data(), compressed.size());
+    CHECK_NE(0u, size);
+
+    std::string out(data.size(), '\0');
+    for (auto _ : state) {
+        CHECK(SyncDecompress(compressed.data(), size, &out[0], out.size()));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data.size());
+}
+BENCHMARK(BM_Sync_Decompress);
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sysdeps.h"
+
+#include "file_sync_compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <android-base/logging.h>
+
+#include "file_sync_protocol.h"
+#include "thread_pool.h"
+
+// The LZ4 block format is a series of sequences, each a run of literal bytes followed by a copy of
+// earlier output. A sequence starts with a token byte: the literal length in the high nibble and
+// the match length less kMinMatch in the low one, either of which is continued in the bytes after
+// it (for literals) or after the offset (for the match) when it's 15. Every byte of those adds up
+// to 255, and the first that's less than 255 is the last. The 16-bit little-endian offset of the
+// match follows the literals. The last sequence is literals alone, at least kLastLiterals of them,
+// and the last match starts at least kMatchLimit bytes before the end.
+static constexpr size_t kMinMatch = 4;
+static constexpr size_t kLastLiterals = 5;
+static constexpr size_t kMatchLimit = 12;
+static constexpr size_t kMaxOffset = 65535;
+
+static constexpr int kHashBits = 13;
+
+// After this many positions in a row without a match, we start skipping ahead, further and further
+// until we find one: that's what makes data that doesn't compress cheap to try.
+static constexpr int kSkipShift = 6;
+
+static uint32_t Read32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t Hash(uint32_t value) {
+    return (value * 2654435761U) >> (32 - kHashBits);
+}
+
+// The number of bytes needed to continue a length of |length| past its nibble.
+static size_t LengthBytes(size_t length) {
+    return length < 15 ? 0 : (length - 15) / 255 + 1;
+}
+
+static char* WriteLength(char* op, size_t length) {
+    length -= 15;
+    while (length >= 255) {
+        *op++ = static_cast<char>(255);
+        length -= 255;
+    }
+    *op++ = static_cast<char>(length);
+    return op;
+}
+
+size_t SyncCompress(const char* src, size_t len, char* dst, size_t capacity) {
+    char* op = dst;
+    char* const op_end = dst + capacity;
+
+    // Emits a sequence of the literals from |anchor| to |ip|, followed by a match unless it's the
+    // last. Returns false if it doesn't fit.
+    auto emit = [&](const char* anchor, const char* ip, size_t offset, size_t match_length) {
+        size_t literals = ip - anchor;
+        size_t match_code = match_length == 0 ? 0 : match_length - kMinMatch;
+        size_t needed = 1 + LengthBytes(literals) + literals;
+        if (match_length != 0) needed += 2 + LengthBytes(match_code);
+        if (needed > static_cast<size_t>(op_end - op)) return false;
+
+        char* token = op++;
+        *token = static_cast<char>((std::min<size_t>(literals, 15) << 4) |
+                                   std::min<size_t>(match_code, 15));
+        if (literals >= 15) op = WriteLength(op, literals);
+        memcpy(op, anchor, literals);
+        op += literals;
+
+        if (match_length != 0) {
+            *op++ = static_cast<char>(offset & 0xff);
+            *op++ = static_cast<char>(offset >> 8);
+            if (match_code >= 15) op = WriteLength(op, match_code);
+        }
+        return true;
+    };
+
+    const char* anchor = src;
+    if (len > kMatchLimit) {
+        std::vector<uint32_t> table(1 << kHashBits);
+        const char* const match_start_limit = src + len - kMatchLimit;
+        const char* const match_end_limit = src + len - kLastLiterals;
+
+        const char* ip = src + 1;
+        while (ip < match_start_limit) {
+            // Look for a match, skipping ahead faster the longer we go without one.
+            const char* ref;
+            size_t attempts = 1 << kSkipShift;
+            while (true) {
+                uint32_t h = Hash(Read32(ip));
+                ref = src + table[h];
+                table[h] = ip - src;
+                if (ref < ip && static_cast<size_t>(ip - ref) <= kMaxOffset &&
+                    Read32(ref) == Read32(ip)) {
+                    break;
+                }
+                ip += attempts++ >> kSkipShift;
+                if (ip >= match_start_limit) goto last_literals;
+            }
+
+            // Extend the match backwards over the literals, and forwards as far as it goes.
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            const char* match_end = ip + kMinMatch;
+            const char* ref_end = ref + kMinMatch;
+            while (match_end + sizeof(uint64_t) <= match_end_limit) {
+                uint64_t a, b;
+                memcpy(&a, match_end, sizeof(a));
+                memcpy(&b, ref_end, sizeof(b));
+                if (a != b) break;
+                match_end += sizeof(uint64_t);
+                ref_end += sizeof(uint64_t);
+            }
+            while (match_end < match_end_limit && *match_end == *ref_end) {
+                ++match_end;
+                ++ref_end;
+            }
+
+            if (!emit(anchor, ip, ip - ref, match_end - ip)) return 0;
+            ip = anchor = match_end;
+
+            // The position just before the next search often starts a match of its own.
+            if (ip < match_start_limit) {
+                table[Hash(Read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+
+last_literals:
+    if (!emit(anchor, src + len, 0, 0)) return 0;
+    return op - dst;
+}
+
+bool SyncDecompress(const char* src, size_t len, char* dst, size_t dst_len) {
+    const char* ip = src;
+    const char* const ip_end = src + len;
+    char* op = dst;
+    char* const op_end = dst + dst_len;
+
+    // Reads the continuation of a length whose nibble was 15.
+    auto read_length = [&](size_t* length) {
+        uint8_t byte;
+        do {
+            if (ip == ip_end) return false;
+            byte = static_cast<uint8_t>(*ip++);
+            *length += byte;
+        } while (byte == 255 && *length < dst_len);
+        return byte != 255;
+    };
+
+    while (ip < ip_end) {
+        uint8_t token = static_cast<uint8_t>(*ip++);
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(&literals)) return false;
+        if (literals > static_cast<size_t>(ip_end - ip) ||
+            literals > static_cast<size_t>(op_end - op)) {
+            return false;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match.
+        if (ip == ip_end) break;
+
+        if (ip_end - ip < 2) return false;
+        size_t offset = static_cast<uint8_t>(ip[0]) | (static_cast<uint8_t>(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst)) return false;
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(&match_length)) return false;
+        match_length += kMinMatch;
+        if (match_length > static_cast<size_t>(op_end - op)) return false;
+
+        const char* ref = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, ref, match_length);
+            op += match_length;
+        } else {
+            // The match overlaps what it's producing, which is how runs are encoded.
+            for (size_t i = 0; i < match_length; ++i) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == op_end;
+}
+
+// Compressing a chunk takes a millisecond or so, and a pool of threads that's shared by every sync
+// connection keeps the number of threads down when there are several of them.
+static ThreadPool& codec_thread_pool() {
+    static auto& pool =
+            *new ThreadPool("sync codec", std::max(1u, std::thread::hardware_concurrency()),
+                            std::chrono::seconds(10));
+    return pool;
+}
+
+struct SyncCodecPipeline::Slot {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    bool attempted = false;
+    SyncCodecChunk chunk;
+};
+
+// A chunk is only worth sending compressed if it saves a good part of the bandwidth, because
+// decompressing it isn't free either. Asking for that much up front also lets SyncCompress give up
+// early on data that doesn't compress.
+bool SyncAppendCompressed(const char* data, size_t len, std::vector<char>* message) {
+    syncmsg msg;
+    size_t offset = message->size();
+    size_t capacity = len - len / 16;
+    message->resize(offset + sizeof(msg.cdata) + capacity);
+
+    size_t compressed_size = SyncCompress(data, len, &(*message)[offset + sizeof(msg.cdata)],
+                                          capacity);
+    if (compressed_size == 0) {
+        message->resize(offset);
+        return false;
+    }
+
+    msg.cdata.id = ID_CDATA;
+    msg.cdata.size = compressed_size;
+    msg.cdata.decompressed_size = len;
+    memcpy(&(*message)[offset], &msg.cdata, sizeof(msg.cdata));
+    message->resize(offset + sizeof(msg.cdata) + compressed_size);
+    return true;
+}
+
+void SyncAppendData(const char* data, size_t len, std::vector<char>* message) {
+    syncmsg msg;
+    msg.data.id = ID_DATA;
+    msg.data.size = len;
+    const char* header = reinterpret_cast<const char*>(&msg.data);
+    message->insert(message->end(), header, header + sizeof(msg.data));
+    message->insert(message->end(), data, data + len);
+}
+
+static void Compress(SyncCodecChunk* chunk, bool attempt) {
+    const std::vector<char>& data = chunk->data;
+    if (attempt && data.size() >= kSyncMinCompressSize &&
+        SyncAppendCompressed(data.data(), data.size(), &chunk->message)) {
+        chunk->compressed = true;
+        return;
+    }
+    SyncAppendData(data.data(), data.size(), &chunk->message);
+}
+
+static void Decompress(SyncCodecChunk* chunk) {
+    chunk->valid = SyncDecompress(chunk->message.data(), chunk->message.size(), chunk->data.data(),
+                                  chunk->data.size());
+}
+
+SyncCodecPipeline::SyncCodecPipeline(Mode mode, size_t max_message_size)
+    : mode_(mode),
+      max_message_size_(max_message_size),
+      depth_(std::max(4u, 2 * std::thread::hardware_concurrency())) {}
+
+SyncCodecPipeline::~SyncCodecPipeline() {
+    // The tasks hold on to their slots, so there's no need to wait for the ones still running.
+}
+
+size_t SyncCodecPipeline::max_data_size() const {
+    syncmsg msg;
+    return max_message_size_ - sizeof(msg.cdata);
+}
+
+void SyncCodecPipeline::Push(std::vector<char> chunk, size_t decompressed_size) {
+    auto slot = std::make_shared<Slot>();
+    if (mode_ == kCompress) {
+        CHECK_LE(chunk.size(), max_data_size());
+        slot->chunk.data = std::move(chunk);
+        if (skip_remaining_ > 0) {
+            --skip_remaining_;
+        } else {
+            slot->attempted = true;
+        }
+    } else {
+        slot->chunk.message = std::move(chunk);
+        slot->chunk.data.resize(decompressed_size);
+        slot->chunk.compressed = true;
+    }
+    chunks_.push_back(slot);
+
+    codec_thread_pool().Run([slot, mode = mode_]() {
+        if (mode == kCompress) {
+            Compress(&slot->chunk, slot->attempted);
+        } else {
+            Decompress(&slot->chunk);
+        }
+        std::lock_guard<std::mutex> lock(slot->mutex);
+        slot->done = true;
+        slot->cv.notify_one();
+    });
+}
+
+SyncCodecChunk SyncCodecPipeline::Pop() {
+    CHECK(!chunks_.empty());
+    std::shared_ptr<Slot> slot = std::move(chunks_.front());
+    chunks_.pop_front();
+    {
+        std::unique_lock<std::mutex> lock(slot->mutex);
+        slot->cv.wait(lock, [&slot]() { return slot->done; });
+    }
+
+    if (slot->attempted) {
+        if (slot->chunk.compressed) {
+            skip_length_ = 0;
+        } else {
+            skip_length_ = std::min<size_t>(std::max<size_t>(1, skip_length_ * 2), 16);
+            skip_remaining_ = skip_length_;
+        }
+    }
+    return std::move(slot->chunk);
+}
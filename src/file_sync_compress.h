@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// Compression of the file data in a sync stream (ID_CDATA, with kFeatureSyncCompress). The codec
+// is LZ77 in the LZ4 block format: quick enough on either end to keep up with a USB or network
+// link, and simple enough that we don't need a library for it. See SYNC.TXT.
+
+#include <stddef.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Compresses the |len| bytes at |src| into |dst|, which has room for |capacity| bytes. Returns
+// the compressed size, or 0 if it doesn't fit.
+size_t SyncCompress(const char* src, size_t len, char* dst, size_t capacity);
+
+// Decompresses the |len| bytes at |src| into exactly |dst_len| bytes at |dst|. Returns false if
+// they aren't a valid block, or don't come to that many bytes.
+bool SyncDecompress(const char* src, size_t len, char* dst, size_t dst_len);
+
+// Less file data than this isn't worth trying to compress.
+static constexpr size_t kSyncMinCompressSize = 1024;
+
+// Appends the ID_CDATA message for the |len| bytes at |data| to |message| and returns true, if
+// they're worth sending compressed. Otherwise, leaves |message| alone and returns false.
+bool SyncAppendCompressed(const char* data, size_t len, std::vector<char>* message);
+
+// Appends the ID_DATA message for the |len| bytes at |data| to |message|.
+void SyncAppendData(const char* data, size_t len, std::vector<char>* message);
+
+// A chunk of file data on its way through a SyncCodecPipeline.
+struct SyncCodecChunk {
+    // The file data for kCompress, and what it becomes for kDecompress.
+    std::vector<char> data;
+
+    // For kCompress, the whole ID_CDATA or ID_DATA message to send for the data. For kDecompress,
+    // the compressed data of an ID_CDATA message.
+    std::vector<char> message;
+
+    // Whether the message is compressed, or for kDecompress, whether it was valid.
+    bool compressed = false;
+    bool valid = true;
+};
+
+// Compresses or decompresses a stream of chunks on worker threads, handing them back in order,
+// so that the work overlaps with the I/O on either side of it. For compression, it gives up on
+// chunks that don't compress, and tries less and less often while they keep not compressing.
+class SyncCodecPipeline {
+  public:
+    enum Mode { kCompress, kDecompress };
+
+    // |max_message_size| is the most that a message of ours, header included, may be.
+    SyncCodecPipeline(Mode mode, size_t max_message_size);
+    ~SyncCodecPipeline();
+
+    SyncCodecPipeline(const SyncCodecPipeline& copy) = delete;
+    SyncCodecPipeline& operator=(const SyncCodecPipeline& copy) = delete;
+
+    // The most file data to put in a chunk for kCompress, so that its message fits either way.
+    size_t max_data_size() const;
+
+    // Whether there are as many chunks in flight as there should be: time to Pop one.
+    bool full() const { return chunks_.size() >= depth_; }
+    bool empty() const { return chunks_.empty(); }
+
+    // For kCompress, |chunk| is the file data; for kDecompress, an ID_CDATA message's payload,
+    // and the size it decompresses to.
+    void Push(std::vector<char> chunk, size_t decompressed_size = 0);
+
+    // Waits for the oldest chunk.
+    SyncCodecChunk Pop();
+
+  private:
+    struct Slot;
+
+    const Mode mode_;
+    const size_t max_message_size_;
+    const size_t depth_;
+    std::deque<std::shared_ptr<Slot>> chunks_;
+
+    // While chunks don't compress, we skip compressing the next |skip_length_| of them, doubling
+    // that each time another one fails.
+    size_t skip_length_ = 0;
+    size_t skip_remaining_ = 0;
+};
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_compress.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/stringprintf.h>
+
+#include "file_sync_protocol.h"
+
+static std::string RandomData(size_t len, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::string data(len, '\0');
+    for (char& c : data) {
+        c = rng();
+    }
+    return data;
+}
+
+// Something like a log: lines that are mostly the same as the ones before.
+static std::string LogData(size_t len) {
+    std::mt19937 rng(1);
+    auto below = [&rng](unsigned n) { return static_cast<unsigned>(rng() % n); };
+    std::string data;
+    while (data.size() < len) {
+        data += android::base::StringPrintf("10-17 06:%02u:%02u.%03u  %5u  %5u I ActivityManager: "
+                                            "Start proc %u:com.example.app%u/u0a%u\n",
+                                            below(60), below(60), below(1000), below(32768),
+                                            below(32768), below(32768), below(10), below(100));
+    }
+    data.resize(len);
+    return data;
+}
+
+// Compresses |data|, checks that it decompresses to the same, and returns the compressed size.
+static size_t RoundTrip(const std::string& data) {
+    std::vector<char> compressed(data.size() + data.size() / 255 + 16);
+    size_t size = SyncCompress(data.data(), data.size(), compressed.data(), compressed.size());
+    EXPECT_NE(0u, size);
+
+    std::string decompressed(data.size(), '\0');
+    EXPECT_TRUE(SyncDecompress(compressed.data(), size, &decompressed[0], decompressed.size()));
+    EXPECT_EQ(data, decompressed);
+    return size;
+}
+
+TEST(file_sync_compress, round_trip) {
+    for (size_t len : {0, 1, 5, 12, 13, 17, 100, 4096, 65536, 1000000}) {
+        SCOPED_TRACE(len);
+        RoundTrip(RandomData(len, len));
+        RoundTrip(std::string(len, 'x'));
+        RoundTrip(LogData(len));
+    }
+}
+
+TEST(file_sync_compress, ratio) {
+    EXPECT_LT(RoundTrip(std::string(256 * 1024, '\0')), 1100u);
+    EXPECT_LT(RoundTrip(LogData(256 * 1024)), 256 * 1024 / 2u);
+
+    // Data that doesn't compress shouldn't grow by more than the format's overhead.
+    EXPECT_LE(RoundTrip(RandomData(256 * 1024, 1)), 256 * 1024 + 256 * 1024 / 255 + 16);
+}
+
+TEST(file_sync_compress, no_room) {
+    std::string data = RandomData(10000, 2);
+    std::vector<char> compressed(9000);
+    EXPECT_EQ(0u, SyncCompress(data.data(), data.size(), compressed.data(), compressed.size()));
+}
+
+TEST(file_sync_compress, corrupt) {
+    std::string data = LogData(100000);
+    std::vector<char> compressed(data.size() * 2);
+    size_t size = SyncCompress(data.data(), data.size(), compressed.data(), compressed.size());
+    ASSERT_NE(0u, size);
+    compressed.resize(size);
+
+    std::string out(data.size(), '\0');
+    EXPECT_FALSE(SyncDecompress(compressed.data(), size, &out[0], out.size() - 1));
+    EXPECT_FALSE(SyncDecompress(compressed.data(), size, &out[0], out.size() + 1));
+    EXPECT_FALSE(SyncDecompress(compressed.data(), size - 1, &out[0], out.size()));
+
+    // Whatever garbage it's given, it mustn't go outside its buffers.
+    std::mt19937 rng(3);
+    for (int i = 0; i < 1000; ++i) {
+        std::vector<char> garbage = compressed;
+        for (int j = 0; j < 10; ++j) {
+            garbage[rng() % garbage.size()] = rng();
+        }
+        SyncDecompress(garbage.data(), garbage.size(), &out[0], out.size());
+    }
+}
+
+TEST(file_sync_compress, pipeline) {
+    const size_t max = 64 * 1024;
+    SyncCodecPipeline compressor(SyncCodecPipeline::kCompress, max);
+    SyncCodecPipeline decompressor(SyncCodecPipeline::kDecompress, max);
+
+    std::string data = LogData(20 * compressor.max_data_size()) +
+                       RandomData(20 * compressor.max_data_size(), 4) +
+                       LogData(20 * compressor.max_data_size());
+    std::string result;
+    size_t compressed_chunks = 0;
+    size_t uncompressed_chunks = 0;
+
+    auto finish = [&](SyncCodecChunk chunk) {
+        syncmsg msg;
+        ASSERT_LE(chunk.message.size(), max);
+        if (!chunk.compressed) {
+            ++uncompressed_chunks;
+            memcpy(&msg.data, chunk.message.data(), sizeof(msg.data));
+            ASSERT_EQ(static_cast<uint32_t>(ID_DATA), msg.data.id);
+            ASSERT_EQ(chunk.message.size() - sizeof(msg.data), msg.data.size);
+            result.append(chunk.message.data() + sizeof(msg.data), msg.data.size);
+            return;
+        }
+
+        ++compressed_chunks;
+        memcpy(&msg.cdata, chunk.message.data(), sizeof(msg.cdata));
+        ASSERT_EQ(static_cast<uint32_t>(ID_CDATA), msg.cdata.id);
+        ASSERT_EQ(chunk.message.size() - sizeof(msg.cdata), msg.cdata.size);
+        decompressor.Push(std::vector<char>(chunk.message.begin() + sizeof(msg.cdata),
+                                            chunk.message.end()),
+                          msg.cdata.decompressed_size);
+        SyncCodecChunk decompressed = decompressor.Pop();
+        ASSERT_TRUE(decompressed.valid);
+        result.append(decompressed.data.data(), decompressed.data.size());
+    };
+
+    for (size_t pos = 0; pos < data.size(); pos += compressor.max_data_size()) {
+        size_t len = std::min(compressor.max_data_size(), data.size() - pos);
+        compressor.Push(std::vector<char>(&data[pos], &data[pos] + len));
+        if (compressor.full()) finish(compressor.Pop());
+    }
+    while (!compressor.empty()) {
+        finish(compressor.Pop());
+    }
+
+    EXPECT_EQ(data, result);
+
+    // The random part isn't worth compressing. We stop trying for a while after that, but not for
+    // so long that most of what follows goes uncompressed too.
+    EXPECT_GE(uncompressed_chunks, 20u);
+    EXPECT_LE(uncompressed_chunks, 40u);
+    EXPECT_EQ(60u, compressed_chunks + uncompressed_chunks);
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sysdeps.h"
+
+#include "file_sync_delta.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <android-base/logging.h>
+#include <openssl/evp.h>
+
+static constexpr size_t kMinBlockSize = 2048;
+static constexpr size_t kMaxBlockSize = 64 * 1024;
+
+size_t DeltaBlockSize(uint64_t file_size) {
+    size_t block_size = static_cast<size_t>(sqrt(static_cast<double>(file_size)));
+    block_size = (block_size + 63) & ~static_cast<size_t>(63);
+    return std::min(std::max(block_size, kMinBlockSize), kMaxBlockSize);
+}
+
+RollingChecksum::RollingChecksum(const void* data, size_t len) : len_(len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < len; ++i) {
+        a_ += p[i];
+        b_ += (len - i) * p[i];
+    }
+}
+
+void DeltaStrongHash(const void* data, size_t len, uint8_t* out) {
+    uint8_t md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    CHECK_EQ(1, EVP_Digest(data, len, md, &md_len, EVP_sha256(), nullptr));
+    memcpy(out, md, SYNC_DELTA_HASH_SIZE);
+}
+
+struct DeltaDigest::Context {
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    ~Context() { EVP_MD_CTX_free(ctx); }
+};
+
+DeltaDigest::DeltaDigest() : context_(std::make_unique<Context>()) {
+    CHECK_EQ(1, EVP_DigestInit_ex(context_->ctx, EVP_sha256(), nullptr));
+}
+
+DeltaDigest::~DeltaDigest() = default;
+
+void DeltaDigest::Update(const void* data, size_t len) {
+    CHECK_EQ(1, EVP_DigestUpdate(context_->ctx, data, len));
+}
+
+void DeltaDigest::Finish(uint8_t* out) {
+    unsigned int len;
+    CHECK_EQ(1, EVP_DigestFinal_ex(context_->ctx, out, &len));
+    CHECK_EQ(static_cast<unsigned int>(SYNC_DELTA_DIGEST_SIZE), len);
+}
+
+// Fills |buf| from |fd|, unless it reaches the end first. Returns how much it read, or -1.
+static ssize_t ReadBlock(int fd, char* buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t rc = adb_read(fd, buf + total, len - total);
+        if (rc < 0) return -1;
+        if (rc == 0) break;
+        total += rc;
+    }
+    return total;
+}
+
+bool ComputeDeltaSignatures(int fd, size_t block_size, uint64_t* size,
+                            std::vector<DeltaBlockSignature>* signatures) {
+    std::vector<char> buf(block_size);
+    *size = 0;
+    signatures->clear();
+    while (true) {
+        ssize_t len = ReadBlock(fd, buf.data(), block_size);
+        if (len < 0) return false;
+        if (len == 0) return true;
+
+        DeltaBlockSignature signature;
+        signature.weak = RollingChecksum(buf.data(), len).value();
+        DeltaStrongHash(buf.data(), len, signature.strong);
+        signatures->push_back(signature);
+        *size += len;
+        if (static_cast<size_t>(len) < block_size) return true;
+    }
+}
+
+// Most positions in the new contents match no block at all, and a 64k-entry bitmap of the low
+// bits of the blocks' weak checksums rules them out without a hash lookup.
+static size_t WeakTag(uint32_t weak) {
+    return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+std::vector<DeltaOp> ComputeDelta(const char* data, size_t size, uint64_t basis_size,
+                                  size_t block_size,
+                                  const std::vector<DeltaBlockSignature>& signatures) {
+    std::vector<DeltaOp> ops;
+    auto add = [&ops](DeltaOp::Type type, uint64_t offset, uint64_t length) {
+        if (length == 0) return;
+        if (!ops.empty() && ops.back().type == type &&
+            ops.back().offset + ops.back().length == offset) {
+            ops.back().length += length;
+        } else {
+            ops.push_back(DeltaOp{type, offset, length});
+        }
+    };
+
+    if (block_size == 0 || signatures.size() != (basis_size + block_size - 1) / block_size) {
+        add(DeltaOp::kLiteral, 0, size);
+        return ops;
+    }
+
+    const size_t full_blocks = basis_size / block_size;
+    std::vector<bool> tags(1 << 16);
+    std::unordered_multimap<uint32_t, size_t> blocks;
+    for (size_t i = 0; i < full_blocks; ++i) {
+        tags[WeakTag(signatures[i].weak)] = true;
+        blocks.emplace(signatures[i].weak, i);
+    }
+
+    // A block that follows the last one we copied makes for a longer copy, so it wins ties.
+    size_t next_block = 0;
+    size_t pos = 0;
+    size_t literal_start = 0;
+    if (full_blocks > 0 && size >= block_size) {
+        RollingChecksum sum(data, block_size);
+        while (true) {
+            uint32_t weak = sum.value();
+            size_t match = SIZE_MAX;
+            if (tags[WeakTag(weak)]) {
+                uint8_t strong[SYNC_DELTA_HASH_SIZE];
+                bool hashed = false;
+                auto range = blocks.equal_range(weak);
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (!hashed) {
+                        DeltaStrongHash(data + pos, block_size, strong);
+                        hashed = true;
+                    }
+                    if (memcmp(strong, signatures[it->second].strong, sizeof(strong)) == 0) {
+                        match = it->second;
+                        if (match == next_block) break;
+                    }
+                }
+            }
+
+            if (match != SIZE_MAX) {
+                add(DeltaOp::kLiteral, literal_start, pos - literal_start);
+                add(DeltaOp::kCopy, static_cast<uint64_t>(match) * block_size, block_size);
+                next_block = match + 1;
+                pos += block_size;
+                literal_start = pos;
+                if (size - pos < block_size) break;
+                sum = RollingChecksum(data + pos, block_size);
+            } else {
+                if (pos + block_size >= size) break;
+                sum.Roll(data[pos], data[pos + block_size]);
+                ++pos;
+            }
+        }
+    }
+
+    // The basis's last block may be short. We only look for it where it's likely to be: right after
+    // the block before it, for a file that's been appended to, or at the end of the new contents.
+    size_t tail_length = basis_size % block_size;
+    auto matches_tail = [&](size_t offset) {
+        const DeltaBlockSignature& signature = signatures.back();
+        if (RollingChecksum(data + offset, tail_length).value() != signature.weak) return false;
+        uint8_t strong[SYNC_DELTA_HASH_SIZE];
+        DeltaStrongHash(data + offset, tail_length, strong);
+        return memcmp(strong, signature.strong, sizeof(strong)) == 0;
+    };
+    if (tail_length > 0 && size - literal_start >= tail_length) {
+        size_t offset = size - tail_length;
+        if (next_block == full_blocks && matches_tail(literal_start)) {
+            offset = literal_start;
+        } else if (!matches_tail(offset)) {
+            offset = SIZE_MAX;
+        }
+        if (offset != SIZE_MAX) {
+            add(DeltaOp::kLiteral, literal_start, offset - literal_start);
+            add(DeltaOp::kCopy, static_cast<uint64_t>(full_blocks) * block_size, tail_length);
+            literal_start = offset + tail_length;
+        }
+    }
+
+    add(DeltaOp::kLiteral, literal_start, size - literal_start);
+    return ops;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// Block-level deltas for pushing a file over an older copy of itself, as rsync does it: the device
+// sends the signatures of the blocks of the file it has (ID_SIGS), the host finds those blocks in
+// the new contents, and sends only the data between them, along with where to copy the rest from
+// (ID_DELTA). See SYNC.TXT.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+// Strong block hashes are truncated SHA-256, and the whole-file digest that checks the result is
+// all of it.
+#define SYNC_DELTA_HASH_SIZE 16
+#define SYNC_DELTA_DIGEST_SIZE 32
+
+struct DeltaBlockSignature {
+#pragma pack(push, 1)
+    uint32_t weak;
+    uint8_t strong[SYNC_DELTA_HASH_SIZE];
+#pragma pack(pop)
+};
+
+// The block size the device uses for a file of |file_size| bytes: about its square root, so that
+// the signatures and the blocks grow at the same rate.
+size_t DeltaBlockSize(uint64_t file_size);
+
+// The weak checksum of a window of bytes, which can slide along a byte at a time: rsync's variant
+// of Adler-32.
+class RollingChecksum {
+  public:
+    RollingChecksum() = default;
+    RollingChecksum(const void* data, size_t len);
+
+    // Slides the window forward by one byte, dropping |out| from the front and adding |in|.
+    void Roll(uint8_t out, uint8_t in) {
+        a_ += in - out;
+        b_ += a_ - len_ * out;
+    }
+
+    uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); }
+
+  private:
+    uint32_t a_ = 0;
+    uint32_t b_ = 0;
+    uint32_t len_ = 0;
+};
+
+void DeltaStrongHash(const void* data, size_t len, uint8_t* out);
+
+// SHA-256, a piece at a time.
+class DeltaDigest {
+  public:
+    DeltaDigest();
+    ~DeltaDigest();
+
+    void Update(const void* data, size_t len);
+    void Finish(uint8_t* out);
+
+  private:
+    struct Context;
+    std::unique_ptr<Context> context_;
+};
+
+// Reads |fd| from its current offset to the end, and returns the signatures of its blocks, the
+// last of which may be short. Returns false if reading failed.
+bool ComputeDeltaSignatures(int fd, size_t block_size, uint64_t* size,
+                            std::vector<DeltaBlockSignature>* signatures);
+
+// One step in rebuilding a file: either |length| bytes of the new contents from |offset|, or
+// |length| bytes of the old file from |offset|.
+struct DeltaOp {
+    enum Type { kLiteral, kCopy };
+
+    Type type;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Finds the blocks of a |basis_size|-byte file with the given signatures in the |size| bytes at
+// |data|, and returns how to rebuild |data| from them. Adjacent ops of the same kind are merged.
+std::vector<DeltaOp> ComputeDelta(const char* data, size_t size, uint64_t basis_size,
+                                  size_t block_size,
+                                  const std::vector<DeltaBlockSignature>& signatures);
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_delta.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+
+#include "sysdeps.h"
+
+static std::string RandomData(size_t len, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::string data(len, '\0');
+    for (char& c : data) {
+        c = rng();
+    }
+    return data;
+}
+
+struct Delta {
+    size_t block_size;
+    std::vector<DeltaOp> ops;
+    uint64_t literal_bytes = 0;
+};
+
+// Goes through the whole thing, from the device's signatures of |basis| to rebuilding |data| from
+// the ops, and checks that the result is |data|.
+static Delta DeltaOf(const std::string& basis, const std::string& data) {
+    TemporaryFile tf;
+    EXPECT_TRUE(android::base::WriteStringToFd(basis, tf.fd));
+    EXPECT_EQ(0, adb_lseek(tf.fd, 0, SEEK_SET));
+
+    Delta delta;
+    delta.block_size = DeltaBlockSize(basis.size());
+    uint64_t basis_size;
+    std::vector<DeltaBlockSignature> signatures;
+    EXPECT_TRUE(ComputeDeltaSignatures(tf.fd, delta.block_size, &basis_size, &signatures));
+    EXPECT_EQ(basis.size(), basis_size);
+
+    delta.ops = ComputeDelta(data.data(), data.size(), basis_size, delta.block_size, signatures);
+    std::string rebuilt;
+    for (const DeltaOp& op : delta.ops) {
+        const std::string& source = op.type == DeltaOp::kCopy ? basis : data;
+        EXPECT_LE(op.offset + op.length, source.size());
+        rebuilt.append(source, op.offset, op.length);
+        if (op.type == DeltaOp::kLiteral) delta.literal_bytes += op.length;
+    }
+    EXPECT_EQ(data, rebuilt);
+    return delta;
+}
+
+TEST(file_sync_delta, rolling_checksum) {
+    std::string data = RandomData(4096, 1);
+    const size_t window = 700;
+    RollingChecksum sum(data.data(), window);
+    for (size_t pos = 0; pos + window < data.size(); ++pos) {
+        ASSERT_EQ(RollingChecksum(&data[pos], window).value(), sum.value()) << "at " << pos;
+        sum.Roll(data[pos], data[pos + window]);
+    }
+}
+
+TEST(file_sync_delta, block_size) {
+    EXPECT_EQ(2048u, DeltaBlockSize(0));
+    EXPECT_EQ(4096u, DeltaBlockSize(16 * 1024 * 1024));
+    EXPECT_EQ(64 * 1024u, DeltaBlockSize(64ULL * 1024 * 1024 * 1024));
+}
+
+TEST(file_sync_delta, digest_in_pieces) {
+    std::string data = RandomData(100000, 2);
+    uint8_t whole[SYNC_DELTA_DIGEST_SIZE];
+    uint8_t pieces[SYNC_DELTA_DIGEST_SIZE];
+
+    DeltaDigest one;
+    one.Update(data.data(), data.size());
+    one.Finish(whole);
+
+    DeltaDigest many;
+    for (size_t pos = 0; pos < data.size(); pos += 999) {
+        many.Update(&data[pos], std::min<size_t>(999, data.size() - pos));
+    }
+    many.Finish(pieces);
+    EXPECT_EQ(0, memcmp(whole, pieces, sizeof(whole)));
+}
+
+TEST(file_sync_delta, unchanged) {
+    std::string basis = RandomData(1000 * 1000 + 17, 3);
+    Delta delta = DeltaOf(basis, basis);
+    ASSERT_EQ(1u, delta.ops.size());
+    EXPECT_EQ(DeltaOp::kCopy, delta.ops[0].type);
+    EXPECT_EQ(0u, delta.ops[0].offset);
+    EXPECT_EQ(basis.size(), delta.ops[0].length);
+}
+
+TEST(file_sync_delta, no_basis) {
+    std::string data = RandomData(10000, 4);
+    Delta delta = DeltaOf("", data);
+    ASSERT_EQ(1u, delta.ops.size());
+    EXPECT_EQ(DeltaOp::kLiteral, delta.ops[0].type);
+    EXPECT_EQ(data.size(), delta.literal_bytes);
+}
+
+TEST(file_sync_delta, unrelated) {
+    Delta delta = DeltaOf(RandomData(100000, 5), RandomData(100000, 6));
+    EXPECT_EQ(100000u, delta.literal_bytes);
+}
+
+TEST(file_sync_delta, edits) {
+    std::string basis = RandomData(1000 * 1000 + 17, 7);
+
+    // Changing a byte costs a block, and inserting or removing some costs about one more, wherever
+    // it happens: the rest of the file is found at its new offset.
+    std::string changed = basis;
+    changed[500000] ^= 1;
+    Delta delta = DeltaOf(basis, changed);
+    EXPECT_EQ(delta.block_size, delta.literal_bytes);
+
+    std::string inserted = basis;
+    inserted.insert(300001, "hello, world");
+    delta = DeltaOf(basis, inserted);
+    EXPECT_LE(delta.literal_bytes, 2 * delta.block_size + 12);
+
+    std::string removed = basis;
+    removed.erase(12345, 678);
+    delta = DeltaOf(basis, removed);
+    EXPECT_LE(delta.literal_bytes, 2 * delta.block_size);
+
+    // Growing at the end still finds the short last block.
+    std::string appended = basis + "more";
+    delta = DeltaOf(basis, appended);
+    EXPECT_EQ(4u, delta.literal_bytes);
+
+    std::string prepended = "more" + basis;
+    delta = DeltaOf(basis, prepended);
+    EXPECT_EQ(4u, delta.literal_bytes);
+}
+
+TEST(file_sync_delta, repeated_blocks) {
+    // Every block is the same, and the copies should still come out as one run.
+    std::string basis(DeltaBlockSize(1000000) * 100, 'x');
+    Delta delta = DeltaOf(basis, basis);
+    ASSERT_EQ(1u, delta.ops.size());
+    EXPECT_EQ(DeltaOp::kCopy, delta.ops[0].type);
+}
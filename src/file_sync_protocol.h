@@ -31,6 +31,21 @@
 #define ID_FAIL MKID('F', 'A', 'I', 'L')
 #define ID_QUIT MKID('Q', 'U', 'I', 'T')
 
+// With kFeatureSyncDelta.
+#define ID_SIGS MKID('S', 'I', 'G', 'S')
+#define ID_DELTA MKID('D', 'L', 'T', 'A')
+#define ID_COPY MKID('C', 'O', 'P', 'Y')
+
+// With kFeatureSyncListTree.
+#define ID_LIST_TREE MKID('T', 'R', 'E', 'E')
+#define ID_TREE_DENT MKID('T', 'D', 'N', 'T')
+
+// With kFeatureSyncLstatBatch.
+#define ID_LSTAT_BATCH MKID('L', 'S', 'T', 'B')
+
+// With kFeatureSyncCompress: in SEND, and in RECV once the client has asked for it.
+#define ID_CDATA MKID('C', 'D', 'A', 'T')
+
 struct SyncRequest {
 #pragma pack(push, 1)
     uint32_t id;           // ID_STAT, et cetera.
@@ -74,17 +89,69 @@ union syncmsg {
 #pragma pack(pop)
     } dent;
     struct {
+#pragma pack(push, 1)
+        uint32_t id;
+        uint32_t error;  // Why a symlink's target_mode, or a directory's contents, are missing.
+        uint64_t dev;
+        uint64_t ino;
+        uint32_t mode;
+        uint32_t target_mode;  // The mode of what a symlink points to, or the same as mode.
+        uint32_t nlink;
+        uint32_t uid;
+        uint32_t gid;
+        uint64_t size;
+        int64_t atime;
+        int64_t mtime;
+        int64_t ctime;
+        uint32_t namelen;
+#pragma pack(pop)
+    } tree_dent;
+    struct {
+#pragma pack(push, 1)
+        uint32_t id;
+        uint32_t count;
+        uint32_t size;  // Of the NUL-terminated paths that follow.
+#pragma pack(pop)
+    } lstat_batch;
+    struct {
 #pragma pack(push, 1)
         uint32_t id;
         uint32_t size;
 #pragma pack(pop)
     } data;
     struct {
+#pragma pack(push, 1)
+        uint32_t id;
+        uint32_t size;
+        uint32_t decompressed_size;
+#pragma pack(pop)
+    } cdata;
+    struct {
 #pragma pack(push, 1)
         uint32_t id;
         uint32_t msglen;
 #pragma pack(pop)
     } status;
+    struct {
+#pragma pack(push, 1)
+        uint32_t id;
+        uint32_t block_size;
+        uint64_t size;
+#pragma pack(pop)
+    } sigs;
+    struct {
+#pragma pack(push, 1)
+        uint32_t id;
+        uint32_t size;
+        uint64_t offset;
+#pragma pack(pop)
+    } copy;
 };
 
 #define SYNC_DATA_MAX (64 * 1024)
+
+// The most paths one ID_LSTAT_BATCH can carry.
+#define SYNC_LSTAT_BATCH_MAX 1024
+
+// With kFeatureSyncChunkSize, the client can ask for DATA chunks of up to this size instead.
+#define SYNC_CHUNK_SIZE_MAX (1024 * 1024)
@@ -0,0 +1,607 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// End-to-end benchmark of adb against a local adbd. It starts an adbd listening on localhost and
+// an adb server of its own on spare ports, drives them with the adb client and through the
+// server's smart socket the way a host tool would, and prints the results as JSON, in the same
+// shape as Google Benchmark's --benchmark_format=json.
+//
+// The "device" is this machine, so the remote paths are in the same temporary directory as the
+// local ones: set $TMPDIR to a tmpfs to take the disk out of the picture.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/scopeguard.h>
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+using namespace std::chrono_literals;
+
+struct Options {
+    std::string adb;
+    std::string adbd;
+    std::string output;
+    std::string label;
+    bool quick = false;
+};
+
+// How much of each thing to do; --quick is for checking that it all works, not for numbers.
+struct Workload {
+    size_t big_file_mib;
+    size_t big_file_runs;
+    size_t small_files;
+    size_t small_file_runs;
+    size_t round_trips;
+    size_t open_close_batches;
+    size_t open_close_batch_size;
+    std::vector<size_t> concurrent_streams;
+    std::chrono::milliseconds concurrent_duration;
+    size_t concurrent_runs;
+};
+
+static const Workload kFullWorkload = {64, 5, 1000, 3, 2000, 5, 100, {1, 4, 16, 64, 256}, 1000ms, 3};
+static const Workload kQuickWorkload = {8, 2, 100, 2, 200, 2, 20, {1, 16}, 200ms, 1};
+
+struct Result {
+    std::string name;
+    std::string unit;
+    std::vector<double> samples;
+};
+
+static std::string g_tmpdir;
+static int g_server_port;
+static std::string g_serial;
+
+using Clock = std::chrono::steady_clock;
+
+static double SecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Each concurrent stream costs an fd or two, which could add up to more than the soft limit.
+static void RaiseFdLimit() {
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// Finds a port that nothing is listening on right now.
+static int FindFreePort() {
+    unique_fd fd(socket(AF_INET, SOCK_STREAM, 0));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd == -1 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        PLOG(FATAL) << "failed to find a free port";
+    }
+    return ntohs(addr.sin_port);
+}
+
+static pid_t Spawn(const std::vector<std::string>& args, const std::string& log_path) {
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        PLOG(FATAL) << "fork failed";
+    } else if (pid == 0) {
+        int fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+static bool WaitForExit(pid_t pid) {
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid) {
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool RunAdb(const Options& options, std::vector<std::string> args) {
+    if (!g_serial.empty()) {
+        args.insert(args.begin(), {"-s", g_serial});
+    }
+    args.insert(args.begin(), options.adb);
+    return WaitForExit(Spawn(args, g_tmpdir + "/adb.log"));
+}
+
+static bool ReadExactly(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+        ssize_t rc = TEMP_FAILURE_RETRY(read(fd, p, len));
+        if (rc <= 0) {
+            return false;
+        }
+        p += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+static bool WriteExactly(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t rc = TEMP_FAILURE_RETRY(write(fd, p, len));
+        if (rc <= 0) {
+            return false;
+        }
+        p += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+// Sends a request to the server, and waits for its OKAY.
+static bool Request(int fd, const std::string& service) {
+    std::string request = StringPrintf("%04zx", service.size()) + service;
+    char status[4];
+    if (!WriteExactly(fd, request.data(), request.size()) ||
+        !ReadExactly(fd, status, sizeof(status))) {
+        return false;
+    }
+    if (memcmp(status, "OKAY", 4) != 0) {
+        LOG(ERROR) << "server refused '" << service << "'";
+        return false;
+    }
+    return true;
+}
+
+static unique_fd ConnectToServer() {
+    unique_fd fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(g_server_port);
+    if (fd == -1 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        PLOG(ERROR) << "failed to connect to the adb server";
+        return unique_fd();
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+// Opens a stream to |service| on the device, through the server.
+static unique_fd OpenService(const std::string& service) {
+    unique_fd fd = ConnectToServer();
+    if (fd == -1 || !Request(fd, "host:transport:" + g_serial) || !Request(fd, service)) {
+        return unique_fd();
+    }
+    return fd;
+}
+
+static std::string GetState() {
+    unique_fd fd = ConnectToServer();
+    char length[5] = {};
+    if (fd == -1 || !Request(fd, "host-serial:" + g_serial + ":get-state") ||
+        !ReadExactly(fd, length, 4)) {
+        return "";
+    }
+    std::string state(strtoul(length, nullptr, 16), '\0');
+    return ReadExactly(fd, &state[0], state.size()) ? state : "";
+}
+
+static void RemoveTree(const std::string& path) {
+    nftw(path.c_str(), [](const char* p, const struct stat*, int, FTW*) { return remove(p); }, 64,
+         FTW_DEPTH | FTW_PHYS);
+}
+
+static void WriteRandomFile(const std::string& path, size_t size, std::mt19937* rng) {
+    // Random, so that nothing along the way gets to compress it.
+    std::string data(size, '\0');
+    for (size_t i = 0; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t)) {
+        uint32_t word = (*rng)();
+        memcpy(&data[i], &word, sizeof(word));
+    }
+    if (!android::base::WriteStringToFile(data, path)) {
+        PLOG(FATAL) << "failed to write " << path;
+    }
+}
+
+static bool BenchmarkBigFile(const Options& options, const Workload& workload,
+                             std::vector<Result>* results) {
+    std::mt19937 rng(1);
+    const size_t mib = workload.big_file_mib;
+    const std::string local = g_tmpdir + "/big";
+    const std::string remote = g_tmpdir + "/big.remote";
+    const std::string pulled = g_tmpdir + "/big.pulled";
+    WriteRandomFile(local, mib * 1024 * 1024, &rng);
+
+    Result push{StringPrintf("push/%zuMiB", mib), "MiB/s", {}};
+    Result pull{StringPrintf("pull/%zuMiB", mib), "MiB/s", {}};
+    for (size_t i = 0; i < workload.big_file_runs; ++i) {
+        Clock::time_point start = Clock::now();
+        if (!RunAdb(options, {"push", local, remote})) {
+            LOG(ERROR) << "push failed";
+            return false;
+        }
+        push.samples.push_back(mib / SecondsSince(start));
+
+        start = Clock::now();
+        if (!RunAdb(options, {"pull", remote, pulled})) {
+            LOG(ERROR) << "pull failed";
+            return false;
+        }
+        pull.samples.push_back(mib / SecondsSince(start));
+        unlink(pulled.c_str());
+    }
+    unlink(remote.c_str());
+    unlink(local.c_str());
+
+    results->push_back(std::move(push));
+    results->push_back(std::move(pull));
+    return true;
+}
+
+static bool BenchmarkSmallFiles(const Options& options, const Workload& workload,
+                                std::vector<Result>* results) {
+    std::mt19937 rng(2);
+    const std::string local = g_tmpdir + "/small";
+    const std::string remote = g_tmpdir + "/small.remote";
+    const std::string pulled = g_tmpdir + "/small.pulled";
+    mkdir(local.c_str(), 0755);
+    for (size_t i = 0; i < workload.small_files; ++i) {
+        WriteRandomFile(StringPrintf("%s/%zu", local.c_str(), i), 1024, &rng);
+    }
+
+    Result push{StringPrintf("push_small_files/%zu", workload.small_files), "files/s", {}};
+    Result pull{StringPrintf("pull_small_files/%zu", workload.small_files), "files/s", {}};
+    for (size_t i = 0; i < workload.small_file_runs; ++i) {
+        Clock::time_point start = Clock::now();
+        if (!RunAdb(options, {"push", local, remote})) {
+            LOG(ERROR) << "push of small files failed";
+            return false;
+        }
+        push.samples.push_back(workload.small_files / SecondsSince(start));
+
+        start = Clock::now();
+        if (!RunAdb(options, {"pull", remote, pulled})) {
+            LOG(ERROR) << "pull of small files failed";
+            return false;
+        }
+        pull.samples.push_back(workload.small_files / SecondsSince(start));
+        RemoveTree(remote);
+        RemoveTree(pulled);
+    }
+    RemoveTree(local);
+
+    results->push_back(std::move(push));
+    results->push_back(std::move(pull));
+    return true;
+}
+
+// One byte to cat on the device and back, which is about as small as an interactive shell gets.
+static bool BenchmarkShellRoundTrip(const Workload& workload, std::vector<Result>* results) {
+    unique_fd fd = OpenService("exec:cat");
+    if (fd == -1) {
+        return false;
+    }
+
+    Result result{"shell_round_trip", "us", {}};
+    for (size_t i = 0; i < workload.round_trips + workload.round_trips / 10; ++i) {
+        Clock::time_point start = Clock::now();
+        char c = 'x';
+        if (!WriteExactly(fd, &c, 1) || !ReadExactly(fd, &c, 1)) {
+            LOG(ERROR) << "shell round trip failed";
+            return false;
+        }
+        // The first tenth is to warm up.
+        if (i >= workload.round_trips / 10) {
+            result.samples.push_back(SecondsSince(start) * 1e6);
+        }
+    }
+    results->push_back(std::move(result));
+    return true;
+}
+
+static bool SendSyncRequest(int fd, const char* id, const std::string& path) {
+    std::string request(id, 4);
+    uint32_t length = path.size();
+    request.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    request.append(path);
+    return WriteExactly(fd, request.data(), request.size());
+}
+
+// A stream that does as little as possible: open sync:, and QUIT straight away.
+static bool BenchmarkOpenClose(const Workload& workload, std::vector<Result>* results) {
+    Result result{"stream_open_close", "streams/s", {}};
+    for (size_t batch = 0; batch < workload.open_close_batches; ++batch) {
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < workload.open_close_batch_size; ++i) {
+            unique_fd fd = OpenService("sync:");
+            char c;
+            if (fd == -1 || !SendSyncRequest(fd, "QUIT", "") || ReadExactly(fd, &c, 1)) {
+                LOG(ERROR) << "sync stream didn't open and close";
+                return false;
+            }
+        }
+        result.samples.push_back(workload.open_close_batch_size / SecondsSince(start));
+    }
+    results->push_back(std::move(result));
+    return true;
+}
+
+// |streams| sync streams at once, each with one STAT in flight at a time: how well the server,
+// the transport and adbd keep up as there are more streams to juggle.
+static bool BenchmarkConcurrentStreams(const Workload& workload, size_t streams,
+                                       std::vector<Result>* results) {
+    std::vector<unique_fd> fds;
+    std::vector<pollfd> pfds;
+    for (size_t i = 0; i < streams; ++i) {
+        unique_fd fd = OpenService("sync:");
+        if (fd == -1) {
+            LOG(ERROR) << "failed to open " << streams << " streams";
+            return false;
+        }
+        pfds.push_back({fd.get(), POLLIN, 0});
+        fds.push_back(std::move(fd));
+    }
+
+    // STAT replies are always 16 bytes: the id, mode, size and mtime.
+    constexpr size_t kReplySize = 16;
+    std::vector<size_t> received(streams);
+    Result result{StringPrintf("concurrent_streams/%zu", streams), "stats/s", {}};
+    for (size_t run = 0; run < workload.concurrent_runs; ++run) {
+        size_t completed = 0;
+        for (const unique_fd& fd : fds) {
+            if (!SendSyncRequest(fd, "STAT", g_tmpdir)) {
+                return false;
+            }
+        }
+
+        Clock::time_point start = Clock::now();
+        Clock::time_point end = start + workload.concurrent_duration;
+        size_t in_flight = streams;
+        while (in_flight > 0) {
+            if (TEMP_FAILURE_RETRY(poll(pfds.data(), pfds.size(), 10000)) <= 0) {
+                LOG(ERROR) << "sync streams stopped answering";
+                return false;
+            }
+            bool more = Clock::now() < end;
+            for (size_t i = 0; i < streams; ++i) {
+                if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue;
+                }
+                char buf[kReplySize];
+                ssize_t rc = TEMP_FAILURE_RETRY(read(pfds[i].fd, buf, kReplySize - received[i]));
+                if (rc <= 0) {
+                    LOG(ERROR) << "sync stream closed";
+                    return false;
+                }
+                received[i] += rc;
+                if (received[i] < kReplySize) {
+                    continue;
+                }
+                received[i] = 0;
+                ++completed;
+                if (!more) {
+                    --in_flight;
+                } else if (!SendSyncRequest(pfds[i].fd, "STAT", g_tmpdir)) {
+                    return false;
+                }
+            }
+        }
+        result.samples.push_back(completed / SecondsSince(start));
+    }
+
+    for (const unique_fd& fd : fds) {
+        SendSyncRequest(fd, "QUIT", "");
+    }
+    results->push_back(std::move(result));
+    return true;
+}
+
+static double Percentile(std::vector<double> samples, double p) {
+    std::sort(samples.begin(), samples.end());
+    size_t index = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    return samples[index];
+}
+
+static std::string ResultsToJson(const Options& options, const std::vector<Result>& results) {
+    char date[64];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+    std::string json = "{\n  \"context\": {\n";
+    json += StringPrintf("    \"date\": \"%s\",\n", date);
+    json += StringPrintf("    \"label\": \"%s\",\n", options.label.c_str());
+    json += StringPrintf("    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+    json += StringPrintf("    \"quick\": %s\n", options.quick ? "true" : "false");
+    json += "  },\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& result = results[i];
+        const std::vector<double>& samples = result.samples;
+        double mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+        double variance = 0;
+        for (double sample : samples) {
+            variance += (sample - mean) * (sample - mean);
+        }
+        double stddev = samples.size() > 1 ? std::sqrt(variance / (samples.size() - 1)) : 0;
+
+        json += StringPrintf("    {\"name\": \"%s\", \"unit\": \"%s\", \"samples\": %zu, ",
+                             result.name.c_str(), result.unit.c_str(), samples.size());
+        json += StringPrintf("\"median\": %.3f, \"mean\": %.3f, \"stddev\": %.3f, ",
+                             Percentile(samples, 0.5), mean, stddev);
+        json += StringPrintf("\"min\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+                             Percentile(samples, 0), Percentile(samples, 0.9),
+                             Percentile(samples, 0.99), Percentile(samples, 1),
+                             i + 1 < results.size() ? "," : "");
+    }
+    json += "  ]\n}\n";
+    return json;
+}
+
+static void Usage() {
+    fprintf(stderr,
+            "usage: adb_loopback_benchmark --adb=PATH --adbd=PATH [--output=FILE] "
+            "[--label=TEXT] [--quick]\n");
+}
+
+static bool ParseOptions(int argc, char** argv, Options* options) {
+    static const option opts[] = {
+            {"adb", required_argument, nullptr, 'a'},   {"adbd", required_argument, nullptr, 'd'},
+            {"output", required_argument, nullptr, 'o'}, {"label", required_argument, nullptr, 'l'},
+            {"quick", no_argument, nullptr, 'q'},        {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "", opts, nullptr)) != -1) {
+        switch (c) {
+            case 'a':
+                options->adb = optarg;
+                break;
+            case 'd':
+                options->adbd = optarg;
+                break;
+            case 'o':
+                options->output = optarg;
+                break;
+            case 'l':
+                options->label = optarg;
+                break;
+            case 'q':
+                options->quick = true;
+                break;
+            default:
+                return false;
+        }
+    }
+    return optind == argc && !options->adb.empty() && !options->adbd.empty();
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, &options)) {
+        Usage();
+        return 1;
+    }
+    const Workload& workload = options.quick ? kQuickWorkload : kFullWorkload;
+
+    signal(SIGPIPE, SIG_IGN);
+    RaiseFdLimit();
+
+    const char* tmp = getenv("TMPDIR");
+    std::string tmpdir_template = StringPrintf("%s/adb_loopback_XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(&tmpdir_template[0])) {
+        PLOG(FATAL) << "failed to create a temporary directory";
+    }
+    g_tmpdir = tmpdir_template;
+
+    // Our own server, so as not to disturb (or be disturbed by) anyone else's.
+    g_server_port = FindFreePort();
+    setenv("ADB_SERVER_SOCKET", StringPrintf("tcp:localhost:%d", g_server_port).c_str(), 1);
+    unsetenv("ANDROID_SERIAL");
+
+    int device_port = FindFreePort();
+    pid_t adbd = Spawn({options.adbd, "--device_banner=device",
+                        StringPrintf("--tcp_port=%d", device_port)},
+                       g_tmpdir + "/adbd.log");
+    auto cleanup = android::base::make_scope_guard([&options, adbd]() {
+        g_serial.clear();
+        RunAdb(options, {"kill-server"});
+        kill(adbd, SIGTERM);
+        WaitForExit(adbd);
+        RemoveTree(g_tmpdir);
+    });
+
+    if (!RunAdb(options, {"start-server"})) {
+        LOG(ERROR) << "failed to start the adb server";
+        return 1;
+    }
+
+    // adbd might not be listening yet, so keep trying for a while.
+    std::string serial = StringPrintf("127.0.0.1:%d", device_port);
+    Clock::time_point deadline = Clock::now() + 10s;
+    while (true) {
+        RunAdb(options, {"connect", serial});
+        g_serial = serial;
+        if (GetState() == "device") {
+            break;
+        }
+        g_serial.clear();
+        if (Clock::now() > deadline) {
+            std::string log;
+            android::base::ReadFileToString(g_tmpdir + "/adbd.log", &log);
+            LOG(ERROR) << "adbd didn't come up; its log:\n" << log;
+            return 1;
+        }
+        std::this_thread::sleep_for(100ms);
+    }
+
+    std::vector<Result> results;
+    bool ok = BenchmarkBigFile(options, workload, &results) &&
+              BenchmarkSmallFiles(options, workload, &results) &&
+              BenchmarkShellRoundTrip(workload, &results) &&
+              BenchmarkOpenClose(workload, &results);
+    for (size_t streams : workload.concurrent_streams) {
+        ok = ok && BenchmarkConcurrentStreams(workload, streams, &results);
+    }
+    if (!ok) {
+        return 1;
+    }
+
+    std::string json = ResultsToJson(options, results);
+    if (options.output.empty()) {
+        fputs(json.c_str(), stdout);
+    } else if (!android::base::WriteStringToFile(json, options.output)) {
+        PLOG(ERROR) << "failed to write " << options.output;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_scheduler.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+#include <android-base/stringprintf.h>
+
+#include "adb.h"
+
+static void AppendClass(std::string* result, const char* name, const PacketQueueStats::Class& c) {
+    double average_ms = c.packets ? c.total_delay.count() / 1000.0 / c.packets : 0;
+    android::base::StringAppendF(result, "%s: %" PRIu64 " packets, average %.3fms, max %.3fms\n",
+                                 name, c.packets, average_ms, c.max_delay.count() / 1000.0);
+}
+
+std::string PacketQueueStats::ToString() const {
+    std::string result;
+    AppendClass(&result, "control", control);
+    AppendClass(&result, "interactive", interactive);
+    AppendClass(&result, "bulk", bulk);
+    android::base::StringAppendF(&result, "queued: %" PRIu64 " bytes, peak %" PRIu64 " bytes\n",
+                                 queued_bytes, peak_queued_bytes);
+    return result;
+}
+
+void PacketScheduler::Push(std::unique_ptr<apacket> packet, Clock::time_point now) {
+    ++size_;
+    stats_.queued_bytes += sizeof(amessage) + packet->payload.size();
+    stats_.peak_queued_bytes = std::max(stats_.peak_queued_bytes, stats_.queued_bytes);
+    unsigned id = packet->msg.arg0;
+    Entry entry{std::move(packet), now};
+
+    if (id != 0 && entry.packet->msg.command == A_CLSE) {
+        // Don't let a CLOSE overtake its stream's data.
+        auto it = streams_.find(id);
+        if (it != streams_.end()) {
+            it->second.entries.push_back(std::move(entry));
+            return;
+        }
+    }
+
+    if (id == 0 || entry.packet->msg.command != A_WRTE) {
+        control_.push_back(std::move(entry));
+        return;
+    }
+
+    auto [it, inserted] = streams_.try_emplace(id);
+    if (inserted) {
+        it->second.deficit = quantum_;
+        new_streams_.push_back(id);
+    }
+    it->second.entries.push_back(std::move(entry));
+}
+
+std::unique_ptr<apacket> PacketScheduler::Take(std::deque<Entry>* entries,
+                                               PacketQueueStats::Class* stats,
+                                               Clock::time_point now) {
+    Entry entry = std::move(entries->front());
+    entries->pop_front();
+    --size_;
+    stats_.queued_bytes -= sizeof(amessage) + entry.packet->payload.size();
+
+    auto delay = std::chrono::duration_cast<std::chrono::microseconds>(now - entry.queued);
+    ++stats->packets;
+    stats->total_delay += delay;
+    stats->max_delay = std::max(stats->max_delay, delay);
+    return std::move(entry.packet);
+}
+
+std::unique_ptr<apacket> PacketScheduler::Pop(Clock::time_point now) {
+    if (!control_.empty()) {
+        return Take(&control_, &stats_.control, now);
+    }
+
+    while (!new_streams_.empty() || !old_streams_.empty()) {
+        bool is_new = !new_streams_.empty();
+        std::deque<unsigned>& order = is_new ? new_streams_ : old_streams_;
+        unsigned id = order.front();
+        auto it = streams_.find(id);
+        Stream& stream = it->second;
+
+        if (stream.deficit <= 0) {
+            // That was its turn: go to the back of the line of busy streams.
+            stream.deficit += quantum_;
+            order.pop_front();
+            old_streams_.push_back(id);
+            continue;
+        }
+
+        stream.deficit -= sizeof(amessage) + stream.entries.front().packet->payload.size();
+        std::unique_ptr<apacket> packet =
+                Take(&stream.entries, is_new ? &stats_.interactive : &stats_.bulk, now);
+        if (stream.entries.empty()) {
+            order.pop_front();
+            streams_.erase(it);
+        }
+        return packet;
+    }
+
+    return nullptr;
+}
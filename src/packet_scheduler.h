@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "types.h"
+
+// How long packets waited to be written, by how they were scheduled.
+struct PacketQueueStats {
+    struct Class {
+        uint64_t packets = 0;
+        std::chrono::microseconds total_delay{0};
+        std::chrono::microseconds max_delay{0};
+    };
+
+    // Everything but stream data: READY, OPEN, the connection handshake, and CLOSE when its
+    // stream has nothing else queued.
+    Class control;
+    // Data from streams that haven't used up their first turn since they were last idle.
+    Class interactive;
+    // Data from streams taking turns.
+    Class bulk;
+
+    // Bytes waiting to be written, headers included: now, and the most there have been.
+    uint64_t queued_bytes = 0;
+    uint64_t peak_queued_bytes = 0;
+
+    std::string ToString() const;
+};
+
+// Decides the order in which the packets waiting for a connection get written, so that one busy
+// stream doesn't hold up everything queued behind it. Control packets go first, then data from
+// streams that only send a little at a time (an interactive shell, say), and then the busy
+// streams take turns sending about |quantum| bytes each (deficit round robin). Each stream's own
+// packets stay in order.
+//
+// Not thread-safe.
+class PacketScheduler {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t kDefaultQuantum = 64 * 1024;
+
+    explicit PacketScheduler(size_t quantum = kDefaultQuantum) : quantum_(quantum) {}
+
+    void Push(std::unique_ptr<apacket> packet, Clock::time_point now = Clock::now());
+
+    // Returns the next packet to write, or null if there aren't any.
+    std::unique_ptr<apacket> Pop(Clock::time_point now = Clock::now());
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+    size_t bytes() const { return stats_.queued_bytes; }
+
+    const PacketQueueStats& stats() const { return stats_; }
+
+  private:
+    struct Entry {
+        std::unique_ptr<apacket> packet;
+        Clock::time_point queued;
+    };
+
+    struct Stream {
+        std::deque<Entry> entries;
+        int64_t deficit = 0;
+    };
+
+    std::unique_ptr<apacket> Take(std::deque<Entry>* entries, PacketQueueStats::Class* stats,
+                                  Clock::time_point now);
+
+    const size_t quantum_;
+    size_t size_ = 0;
+
+    std::deque<Entry> control_;
+
+    // Streams with data queued, by local socket id, and the order they get their turns in.
+    std::unordered_map<unsigned, Stream> streams_;
+    std::deque<unsigned> new_streams_;
+    std::deque<unsigned> old_streams_;
+
+    PacketQueueStats stats_;
+};
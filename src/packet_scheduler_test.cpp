@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include <map>
+
+#include "adb.h"
+
+static std::unique_ptr<apacket> MakePacket(unsigned command, unsigned local_id,
+                                           size_t payload_size = 0) {
+    auto packet = std::make_unique<apacket>();
+    packet->msg.command = command;
+    packet->msg.arg0 = local_id;
+    packet->msg.arg1 = 1000 + local_id;
+    if (payload_size != 0) {
+        packet->payload = IOVector(Block(payload_size));
+    }
+    packet->msg.data_length = payload_size;
+    return packet;
+}
+
+TEST(PacketScheduler, empty) {
+    PacketScheduler scheduler;
+    EXPECT_TRUE(scheduler.empty());
+    EXPECT_EQ(nullptr, scheduler.Pop());
+}
+
+TEST(PacketScheduler, control_first) {
+    PacketScheduler scheduler;
+    scheduler.Push(MakePacket(A_WRTE, 1, 1024 * 1024));
+    scheduler.Push(MakePacket(A_OKAY, 2));
+    scheduler.Push(MakePacket(A_OPEN, 3, 10));
+    EXPECT_EQ(3u, scheduler.size());
+
+    EXPECT_EQ(static_cast<uint32_t>(A_OKAY), scheduler.Pop()->msg.command);
+    EXPECT_EQ(static_cast<uint32_t>(A_OPEN), scheduler.Pop()->msg.command);
+    EXPECT_EQ(static_cast<uint32_t>(A_WRTE), scheduler.Pop()->msg.command);
+    EXPECT_TRUE(scheduler.empty());
+}
+
+TEST(PacketScheduler, close_after_data) {
+    PacketScheduler scheduler;
+    scheduler.Push(MakePacket(A_WRTE, 1, 100));
+    scheduler.Push(MakePacket(A_WRTE, 1, 200));
+    scheduler.Push(MakePacket(A_CLSE, 1));
+    // Nothing queued for stream 2, so its CLOSE can go right away.
+    scheduler.Push(MakePacket(A_CLSE, 2));
+
+    auto p = scheduler.Pop();
+    EXPECT_EQ(static_cast<uint32_t>(A_CLSE), p->msg.command);
+    EXPECT_EQ(2u, p->msg.arg0);
+    EXPECT_EQ(100u, scheduler.Pop()->payload.size());
+    EXPECT_EQ(200u, scheduler.Pop()->payload.size());
+    p = scheduler.Pop();
+    EXPECT_EQ(static_cast<uint32_t>(A_CLSE), p->msg.command);
+    EXPECT_EQ(1u, p->msg.arg0);
+    EXPECT_TRUE(scheduler.empty());
+}
+
+TEST(PacketScheduler, interactive_before_bulk) {
+    PacketScheduler scheduler(64 * 1024);
+    for (int i = 0; i < 16; ++i) {
+        scheduler.Push(MakePacket(A_WRTE, 1, 64 * 1024));
+    }
+    // Stream 1 uses up its first turn, and becomes a bulk stream.
+    EXPECT_EQ(1u, scheduler.Pop()->msg.arg0);
+
+    // A keystroke doesn't wait for the rest of it.
+    scheduler.Push(MakePacket(A_WRTE, 2, 1));
+    EXPECT_EQ(2u, scheduler.Pop()->msg.arg0);
+    EXPECT_EQ(1u, scheduler.Pop()->msg.arg0);
+
+    const PacketQueueStats& stats = scheduler.stats();
+    EXPECT_EQ(2u, stats.interactive.packets);
+    EXPECT_EQ(1u, stats.bulk.packets);
+}
+
+TEST(PacketScheduler, bulk_streams_take_turns) {
+    PacketScheduler scheduler(64 * 1024);
+    // Stream 1 sends big packets and stream 2 small ones, but they get the same share.
+    for (int i = 0; i < 8; ++i) {
+        scheduler.Push(MakePacket(A_WRTE, 1, 256 * 1024));
+    }
+    for (int i = 0; i < 512; ++i) {
+        scheduler.Push(MakePacket(A_WRTE, 2, 4096));
+    }
+
+    std::map<unsigned, size_t> sent;
+    while (sent[1] < 1024 * 1024) {
+        auto p = scheduler.Pop();
+        ASSERT_NE(nullptr, p);
+        sent[p->msg.arg0] += p->payload.size();
+    }
+    EXPECT_NEAR(sent[1], sent[2], 256 * 1024 + 64 * 1024);
+}
+
+TEST(PacketScheduler, stream_order) {
+    PacketScheduler scheduler(1);
+    for (size_t i = 1; i <= 10; ++i) {
+        scheduler.Push(MakePacket(A_WRTE, 1, i));
+        scheduler.Push(MakePacket(A_WRTE, 2, i));
+    }
+
+    std::map<unsigned, size_t> last;
+    while (auto p = scheduler.Pop()) {
+        EXPECT_EQ(last[p->msg.arg0] + 1, p->payload.size());
+        last[p->msg.arg0] = p->payload.size();
+    }
+    EXPECT_EQ(10u, last[1]);
+    EXPECT_EQ(10u, last[2]);
+}
+
+TEST(PacketScheduler, stats) {
+    PacketScheduler scheduler;
+    auto start = PacketScheduler::Clock::now();
+    scheduler.Push(MakePacket(A_OKAY, 1), start);
+    scheduler.Push(MakePacket(A_OKAY, 2), start + std::chrono::milliseconds(1));
+    scheduler.Pop(start + std::chrono::milliseconds(5));
+    scheduler.Pop(start + std::chrono::milliseconds(5));
+
+    const PacketQueueStats::Class& control = scheduler.stats().control;
+    EXPECT_EQ(2u, control.packets);
+    EXPECT_EQ(std::chrono::milliseconds(9), control.total_delay);
+    EXPECT_EQ(std::chrono::milliseconds(5), control.max_delay);
+    EXPECT_EQ(0u, scheduler.stats().bulk.packets);
+}
+
+TEST(PacketScheduler, queued_bytes) {
+    PacketScheduler scheduler;
+    scheduler.Push(MakePacket(A_WRTE, 1, 1000));
+    scheduler.Push(MakePacket(A_OKAY, 2));
+    EXPECT_EQ(2 * sizeof(amessage) + 1000, scheduler.bytes());
+
+    scheduler.Pop();
+    scheduler.Pop();
+    EXPECT_EQ(0u, scheduler.bytes());
+    EXPECT_EQ(0u, scheduler.stats().queued_bytes);
+    EXPECT_EQ(2 * sizeof(amessage) + 1000, scheduler.stats().peak_queued_bytes);
+}
@@ -24,7 +24,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <thread>
+#include <memory>
+
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <cutils/sockets.h>
@@ -36,18 +37,17 @@
 #include "services.h"
 #include "socket_spec.h"
 #include "sysdeps.h"
+#include "thread_pool.h"
 #include "transport.h"
 
-namespace {
-
-void service_bootstrap_func(std::string service_name, std::function<void(unique_fd)> func,
-                            unique_fd fd) {
-    adb_thread_setname(android::base::StringPrintf("%s svc %d", service_name.c_str(), fd.get()));
-    func(std::move(fd));
+ThreadPool& service_thread_pool() {
+    // Services wait on their streams as well as on whatever they're doing, so they're run with
+    // RunBlocking(): a stream is never left waiting for another to close. The limit is only on how
+    // many workers are kept around for the next services once they're done.
+    static auto& pool = *new ThreadPool("service pool", 32, std::chrono::seconds(10));
+    return pool;
 }
 
-}  // namespace
-
 unique_fd create_service_thread(const char* service_name, std::function<void(unique_fd)> func) {
     int s[2];
     if (adb_socketpair(s)) {
@@ -65,12 +65,14 @@ unique_fd create_service_thread(const char* service_name, std::function<void(uni
     }
 #endif // !ADB_HOST
 
-    std::thread th([&] {
-        service_bootstrap_func(service_name, func, unique_fd(s[1]));
+    // The task may well run after we've returned, so it gets its own copies of everything.
+    service_thread_pool().RunBlocking([name = std::string(service_name), func = std::move(func),
+                                       fd = std::make_shared<unique_fd>(s[1])]() {
+        adb_thread_setname(android::base::StringPrintf("%s svc %d", name.c_str(), fd->get()));
+        func(std::move(*fd));
     });
-    th.detach();
 
-    D("service thread started, %d:%d",s[0], s[1]);
+    D("service started, %d:%d", s[0], s[1]);
     return unique_fd(s[0]);
 }
 
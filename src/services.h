@@ -17,11 +17,18 @@
 #ifndef SERVICES_H_
 #define SERVICES_H_
 
+#include <functional>
+
 #include "adb_unique_fd.h"
+#include "thread_pool.h"
 
 constexpr char kShellServiceArgRaw[] = "raw";
 constexpr char kShellServiceArgPty[] = "pty";
 constexpr char kShellServiceArgShellProtocol[] = "v2";
 
+// The workers that services which block run on, with ThreadPool::RunBlocking().
+ThreadPool& service_thread_pool();
+
+// Runs |func| on a service worker with one end of a new socketpair, and returns the other end.
 unique_fd create_service_thread(const char* service_name, std::function<void(unique_fd)> func);
 #endif  // SERVICES_H_
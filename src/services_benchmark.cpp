@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "adb_io.h"
+#include "adb_unique_fd.h"
+#include "services.h"
+#include "sysdeps.h"
+
+// A service that answers straight away, and then waits for its stream to close.
+static void PingService(unique_fd fd) {
+    WriteFdExactly(fd.get(), "x", 1);
+    char c;
+    while (adb_read(fd.get(), &c, 1) > 0) {
+    }
+}
+
+// What create_service_thread() used to do: a new thread for every service.
+static unique_fd StartServiceThread(std::function<void(unique_fd)> func) {
+    int s[2];
+    if (adb_socketpair(s)) {
+        PLOG(FATAL) << "failed to create socketpair";
+    }
+    std::thread([func, fd = s[1]]() { func(unique_fd(fd)); }).detach();
+    return unique_fd(s[0]);
+}
+
+// Measure how long it takes to open |state.range(0)| service streams at once, and hear back from
+// every one of them, like a client running that many short commands in parallel does.
+template <typename StartFn>
+static void BM_Service_Open(benchmark::State& state, StartFn start) {
+    const size_t streams = state.range(0);
+    for (auto _ : state) {
+        std::vector<unique_fd> fds;
+        for (size_t i = 0; i < streams; ++i) {
+            fds.push_back(start(PingService));
+        }
+        for (unique_fd& fd : fds) {
+            char c;
+            if (!ReadFdExactly(fd.get(), &c, 1)) {
+                state.SkipWithError("service failed");
+                return;
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * streams);
+}
+
+static void BM_Service_OpenPooled(benchmark::State& state) {
+    BM_Service_Open(state, [](auto func) { return create_service_thread("bench", func); });
+}
+// Within the pool's limit, so that none of them have to wait for another to close.
+BENCHMARK(BM_Service_OpenPooled)->Arg(1)->Arg(64)->Arg(256)->UseRealTime();
+
+static void BM_Service_OpenThread(benchmark::State& state) {
+    BM_Service_Open(state, [](auto func) { return StartServiceThread(func); });
+}
+BENCHMARK(BM_Service_OpenThread)->Arg(1)->Arg(64)->Arg(256)->UseRealTime();
@@ -21,6 +21,7 @@
 
 #include <deque>
 #include <memory>
+#include <optional>
 #include <string>
 
 #include "fdevent.h"
@@ -94,14 +95,38 @@ struct asocket {
     /* A socket is bound to atransport */
     atransport* transport = nullptr;
 
+    // For remote asockets on a transport with kFeatureDelayedAck: how many more bytes may be sent
+    // before the other side has to acknowledge some (it may go negative by the last payload),
+    // and how many bytes the next READY gives back to the other side. Without the feature, every
+    // WRITE waits for its own READY, and available_send_bytes is unset.
+    std::optional<int64_t> available_send_bytes;
+    size_t pending_ack_bytes = 0;
+
+    // For remote asockets with a window: whether the transport's write queue filled up, and the
+    // local peer has to wait for resume_blocked_sockets() whatever the window says.
+    bool write_queue_blocked = false;
+
     size_t get_max_payload() const;
 };
 
 asocket *find_local_socket(unsigned local_id, unsigned remote_id);
+
+// Like find_local_socket(), for a packet from |t|: only sockets bound to |t| will do. Anything else
+// may belong to another transport's loop, so it isn't even looked at.
+asocket* find_transport_socket(atransport* t, unsigned local_id, unsigned peer_id);
+
 void install_local_socket(asocket *s);
 void remove_socket(asocket *s);
 void close_all_sockets(atransport *t);
 
+// Lets the sockets that stopped because |t|'s write queue was full send again. Must be called on
+// |t|'s loop.
+void resume_blocked_sockets(atransport* t);
+
+// Bind |s| to |t| (or unbind it, if |t| is null), so that close_all_sockets(t) can find it.
+// Use this rather than assigning s->transport for installed local sockets and remote sockets.
+void set_socket_transport(asocket* s, atransport* t);
+
 asocket *create_local_socket(int fd);
 asocket* create_local_service_socket(const char* destination, atransport* transport);
 
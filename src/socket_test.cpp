@@ -19,7 +19,9 @@
 #include <gtest/gtest.h>
 
 #include <array>
+#include <condition_variable>
 #include <limits>
+#include <mutex>
 #include <queue>
 #include <string>
 #include <thread>
@@ -33,6 +35,7 @@
 #include "socket.h"
 #include "sysdeps.h"
 #include "sysdeps/chrono.h"
+#include "transport.h"
 
 struct ThreadArg {
     int first_read_fd;
@@ -118,10 +121,9 @@ static void CreateCloser(CloseWithPacketArg* arg) {
         // each write to give the underlying implementation time to flush.
         bool socket_filled = false;
         for (int i = 0; i < 128; ++i) {
-            apacket::payload_type data;
-            data.resize(MAX_PAYLOAD);
+            Block data(MAX_PAYLOAD);
             arg->bytes_written += data.size();
-            int ret = s->enqueue(s, std::move(data));
+            int ret = s->enqueue(s, IOVector(std::move(data)));
             if (ret == 1) {
                 socket_filled = true;
                 break;
@@ -260,6 +262,261 @@ TEST_F(LocalSocketTest, flush_after_shutdown) {
     TerminateThread();
 }
 
+// Ensure that close_all_sockets only closes the sockets bound to the given transport.
+TEST_F(LocalSocketTest, close_all_sockets) {
+    int bound_fd[2];
+    int unbound_fd[2];
+    ASSERT_EQ(0, adb_socketpair(bound_fd));
+    ASSERT_EQ(0, adb_socketpair(unbound_fd));
+
+    atransport t;
+    asocket* bound = create_local_socket(bound_fd[1]);
+    set_socket_transport(bound, &t);
+    create_local_socket(unbound_fd[1]);
+
+    PrepareThread();
+    WaitForFdeventLoop();
+    EXPECT_EQ(2u + GetAdditionalLocalSocketCount(), fdevent_installed_count());
+
+    fdevent_run_on_main_thread([&t]() { close_all_sockets(&t); });
+    WaitForFdeventLoop();
+    EXPECT_EQ(1u + GetAdditionalLocalSocketCount(), fdevent_installed_count());
+
+    // The peer of the closed socket sees EOF, the other one doesn't.
+    char buf;
+    EXPECT_EQ(0, adb_read(bound_fd[0], &buf, 1));
+
+    ASSERT_EQ(0, adb_close(unbound_fd[0]));
+    WaitForFdeventLoop();
+    ASSERT_EQ(GetAdditionalLocalSocketCount(), fdevent_installed_count());
+    TerminateThread();
+
+    ASSERT_EQ(0, adb_close(bound_fd[0]));
+}
+
+// A transport only gets at the sockets bound to it, whatever ids its device sends.
+TEST_F(LocalSocketTest, find_transport_socket) {
+    int fd[2];
+    int other_fd[2];
+    ASSERT_EQ(0, adb_socketpair(fd));
+    ASSERT_EQ(0, adb_socketpair(other_fd));
+
+    atransport t;
+    atransport other;
+    asocket* s = create_local_socket(fd[1]);
+    set_socket_transport(s, &t);
+    asocket* other_s = create_local_socket(other_fd[1]);
+    set_socket_transport(other_s, &other);
+
+    EXPECT_EQ(s, find_transport_socket(&t, s->id, 0));
+    EXPECT_EQ(nullptr, find_transport_socket(&t, other_s->id, 0));
+    EXPECT_EQ(other_s, find_transport_socket(&other, other_s->id, 0));
+    EXPECT_EQ(nullptr, find_transport_socket(&other, s->id, 0));
+
+    // The peer id is checked too, as with find_local_socket().
+    EXPECT_EQ(nullptr, find_transport_socket(&t, s->id, 1234));
+
+    PrepareThread();
+    WaitForFdeventLoop();
+    ASSERT_EQ(0, adb_close(fd[0]));
+    ASSERT_EQ(0, adb_close(other_fd[0]));
+    WaitForFdeventLoop();
+    ASSERT_EQ(GetAdditionalLocalSocketCount(), fdevent_installed_count());
+    TerminateThread();
+}
+
+// Collects the packets that remote sockets send, instead of sending them anywhere.
+struct CapturingConnection : public Connection {
+    bool Write(std::unique_ptr<apacket> packet) override {
+        packets.push_back(std::move(packet));
+        return true;
+    }
+    void Start() override {}
+    void Stop() override {}
+
+    std::vector<std::unique_ptr<apacket>> packets;
+};
+
+// With kFeatureDelayedAck, a remote socket takes WRITEs until its window is used up, and only
+// sends READY to give back what it received.
+TEST(socket_test, delayed_ack) {
+    atransport t;
+    t.SetFeatures(kFeatureDelayedAck);
+    auto connection = std::make_unique<CapturingConnection>();
+    std::vector<std::unique_ptr<apacket>>& packets = connection->packets;
+    t.SetConnection(std::move(connection));
+
+    asocket local;
+    local.id = 1;
+    asocket* s = create_remote_socket(2, &t);
+    s->peer = &local;
+    ASSERT_TRUE(s->available_send_bytes);
+    *s->available_send_bytes = 250;
+
+    EXPECT_EQ(0, s->enqueue(s, IOVector(Block(100))));
+    EXPECT_EQ(0, s->enqueue(s, IOVector(Block(100))));
+    EXPECT_EQ(1, s->enqueue(s, IOVector(Block(100))));
+    EXPECT_EQ(-50, *s->available_send_bytes);
+    ASSERT_EQ(3u, packets.size());
+    for (const auto& p : packets) {
+        EXPECT_EQ(static_cast<uint32_t>(A_WRTE), p->msg.command);
+        EXPECT_EQ(1u, p->msg.arg0);
+        EXPECT_EQ(2u, p->msg.arg1);
+        EXPECT_EQ(100u, p->msg.data_length);
+    }
+
+    // Nothing was received, so there's nothing to give back.
+    s->ready(s);
+    EXPECT_EQ(3u, packets.size());
+
+    s->pending_ack_bytes = 300;
+    s->ready(s);
+    ASSERT_EQ(4u, packets.size());
+    const apacket* ack = packets.back().get();
+    EXPECT_EQ(static_cast<uint32_t>(A_OKAY), ack->msg.command);
+    ASSERT_EQ(sizeof(uint32_t), ack->msg.data_length);
+    uint32_t acked;
+    memcpy(&acked, ack->payload.coalesce<std::string>().data(), sizeof(acked));
+    EXPECT_EQ(300u, acked);
+    EXPECT_EQ(0u, s->pending_ack_bytes);
+
+    set_socket_transport(s, nullptr);
+    delete s;
+}
+
+// Without it, every WRITE waits for a READY of its own.
+TEST(socket_test, no_delayed_ack) {
+    atransport t;
+    auto connection = std::make_unique<CapturingConnection>();
+    std::vector<std::unique_ptr<apacket>>& packets = connection->packets;
+    t.SetConnection(std::move(connection));
+
+    asocket local;
+    local.id = 1;
+    asocket* s = create_remote_socket(2, &t);
+    s->peer = &local;
+    EXPECT_FALSE(s->available_send_bytes);
+
+    EXPECT_EQ(1, s->enqueue(s, IOVector(Block(100))));
+    s->ready(s);
+    ASSERT_EQ(2u, packets.size());
+    EXPECT_EQ(static_cast<uint32_t>(A_OKAY), packets.back()->msg.command);
+    EXPECT_EQ(0u, packets.back()->msg.data_length);
+
+    set_socket_transport(s, nullptr);
+    delete s;
+}
+
+// Doesn't write anything until it's released, like a device that stopped reading in the middle
+// of a push.
+struct StalledConnection : public BlockingConnection {
+    bool Read(apacket*) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return closed; });
+        return false;
+    }
+
+    bool Write(apacket* packet) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return released || closed; });
+        if (packet->msg.command == A_WRTE) {
+            written += packet->payload.size();
+            cv.notify_all();
+        }
+        return !closed;
+    }
+
+    void Close() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_all();
+    }
+
+    void Release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        released = true;
+        cv.notify_all();
+    }
+
+    bool WaitForWritten(size_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cv.wait_for(lock, 10s, [this, bytes]() { return written >= bytes; });
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool released = false;
+    bool closed = false;
+    size_t written = 0;
+};
+
+// However big a window the device offers, a socket stops reading once the transport has queued up
+// as much as it may, and starts again when the device catches up.
+TEST_F(LocalSocketTest, write_queue_limit) {
+    constexpr size_t kMaxQueuedBytes = 2 * MAX_PAYLOAD;
+    constexpr size_t kTotalBytes = 32 * MAX_PAYLOAD;
+
+    atransport t;
+    t.SetFeatures(kFeatureDelayedAck);
+    auto stalled = std::make_unique<StalledConnection>();
+    StalledConnection* device = stalled.get();
+    t.SetConnection(
+            std::make_unique<BlockingConnectionAdapter>(std::move(stalled), kMaxQueuedBytes));
+    std::shared_ptr<Connection> connection = t.connection();
+    connection->SetReadCallback([](Connection*, std::unique_ptr<apacket>) { return true; });
+    connection->SetErrorCallback([](Connection*, const std::string&) {});
+    connection->SetWritableCallback([&t](Connection*) {
+        fdevent_run_on_main_thread([&t]() { resume_blocked_sockets(&t); });
+    });
+    connection->Start();
+
+    int fds[2];
+    ASSERT_EQ(0, adb_socketpair(fds));
+    PrepareThread();
+    fdevent_run_on_main_thread([&t, fd = fds[1]]() {
+        asocket* s = create_local_socket(fd);
+        ASSERT_NE(nullptr, s);
+        s->peer = create_remote_socket(1, &t);
+        s->peer->peer = s;
+        *s->peer->available_send_bytes = std::numeric_limits<uint32_t>::max();
+        s->ready(s);
+    });
+
+    std::thread writer([fd = fds[0]]() {
+        std::string data(MAX_PAYLOAD, 'x');
+        for (size_t i = 0; i < kTotalBytes / data.size(); ++i) {
+            ASSERT_TRUE(WriteFdExactly(fd, data));
+        }
+    });
+
+    for (int i = 0; i < 1000 && !connection->WriteQueueFull(); ++i) {
+        std::this_thread::sleep_for(10ms);
+    }
+    ASSERT_TRUE(connection->WriteQueueFull());
+    // Give the socket the chance to queue up more than it should.
+    std::this_thread::sleep_for(200ms);
+
+    // It may go over by the packet that filled the queue, but no more than that.
+    constexpr size_t kMaxPeakBytes = kMaxQueuedBytes + sizeof(amessage) + MAX_PAYLOAD;
+    PacketQueueStats stats;
+    ASSERT_TRUE(connection->GetWriteQueueStats(&stats));
+    EXPECT_GE(stats.queued_bytes, kMaxQueuedBytes);
+    EXPECT_LE(stats.peak_queued_bytes, kMaxPeakBytes);
+
+    device->Release();
+    writer.join();
+    EXPECT_TRUE(device->WaitForWritten(kTotalBytes));
+    ASSERT_TRUE(connection->GetWriteQueueStats(&stats));
+    EXPECT_LE(stats.peak_queued_bytes, kMaxPeakBytes);
+
+    ASSERT_EQ(0, adb_close(fds[0]));
+    WaitForFdeventLoop();
+    connection->Stop();
+    WaitForFdeventLoop();
+    EXPECT_EQ(GetAdditionalLocalSocketCount(), fdevent_installed_count());
+    TerminateThread();
+}
+
 #if defined(__linux__)
 
 static void ClientThreadFunc() {
@@ -30,6 +30,8 @@
 #include <algorithm>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #if !ADB_HOST
@@ -45,38 +47,79 @@ static int __android_log_is_debuggable() {
 
 #include "adb.h"
 #include "adb_io.h"
+#include "adb_utils.h"
 #include "transport.h"
 #include "types.h"
 
 static std::recursive_mutex& local_socket_list_lock = *new std::recursive_mutex();
 static unsigned local_socket_next_id = 1;
 
-static auto& local_socket_list = *new std::vector<asocket*>();
+// Installed local sockets, indexed by id.
+static auto& local_socket_list = *new std::unordered_map<unsigned, asocket*>();
 
 /* the the list of currently closing local sockets.
 ** these have no peer anymore, but still packets to
 ** write to their fd.
 */
-static auto& local_socket_closing_list = *new std::vector<asocket*>();
+static auto& local_socket_closing_list = *new std::unordered_set<asocket*>();
+
+// Local and remote sockets bound to each transport, so that close_all_sockets() doesn't need to
+// look at every socket on the server. For remote sockets, it's their local peer that gets closed.
+static auto& transport_socket_index =
+        *new std::unordered_map<atransport*, std::unordered_set<asocket*>>();
+
+static void unindex_socket(asocket* s) {
+    if (s->transport) {
+        auto it = transport_socket_index.find(s->transport);
+        if (it != transport_socket_index.end()) {
+            it->second.erase(s);
+            if (it->second.empty()) {
+                transport_socket_index.erase(it);
+            }
+        }
+    }
+}
+
+void set_socket_transport(asocket* s, atransport* t) {
+    std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
+    unindex_socket(s);
+    s->transport = t;
+    if (t) {
+        transport_socket_index[t].insert(s);
+    }
+}
 
-// Parse the global list of sockets to find one with id |local_id|.
+// Look up the socket with id |local_id|.
 // If |peer_id| is not 0, also check that it is connected to a peer
 // with id |peer_id|. Returns an asocket handle on success, NULL on failure.
 asocket* find_local_socket(unsigned local_id, unsigned peer_id) {
-    asocket* result = nullptr;
+    std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
+    auto it = local_socket_list.find(local_id);
+    if (it == local_socket_list.end()) {
+        return nullptr;
+    }
 
+    asocket* s = it->second;
+    if (peer_id == 0 || (s->peer && s->peer->id == peer_id)) {
+        return s;
+    }
+    return nullptr;
+}
+
+asocket* find_transport_socket(atransport* t, unsigned local_id, unsigned peer_id) {
     std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
-    for (asocket* s : local_socket_list) {
-        if (s->id != local_id) {
-            continue;
-        }
-        if (peer_id == 0 || (s->peer && s->peer->id == peer_id)) {
-            result = s;
-        }
-        break;
+    auto it = local_socket_list.find(local_id);
+    if (it == local_socket_list.end()) {
+        return nullptr;
     }
 
-    return result;
+    asocket* s = it->second;
+    auto index = transport_socket_index.find(t);
+    if (index == transport_socket_index.end() || index->second.count(s) == 0) {
+        D("socket %u doesn't belong to transport %s", local_id, t->serial.c_str());
+        return nullptr;
+    }
+    return find_local_socket(local_id, peer_id);
 }
 
 void install_local_socket(asocket* s) {
@@ -89,27 +132,71 @@ void install_local_socket(asocket* s) {
         fatal("local socket id overflow");
     }
 
-    local_socket_list.push_back(s);
+    local_socket_list.emplace(s->id, s);
 }
 
 void remove_socket(asocket* s) {
     std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
-    for (auto list : { &local_socket_list, &local_socket_closing_list }) {
-        list->erase(std::remove_if(list->begin(), list->end(), [s](asocket* x) { return x == s; }),
-                    list->end());
+    auto it = local_socket_list.find(s->id);
+    if (it != local_socket_list.end() && it->second == s) {
+        local_socket_list.erase(it);
     }
+    local_socket_closing_list.erase(s);
+    unindex_socket(s);
 }
 
 void close_all_sockets(atransport* t) {
-    /* this is a little gross, but since s->close() *will* modify
-    ** the list out from under you, your options are limited.
-    */
     std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
-restart:
-    for (asocket* s : local_socket_list) {
-        if (s->transport == t || (s->peer && s->peer->transport == t)) {
+    auto index = transport_socket_index.find(t);
+    if (index == transport_socket_index.end()) {
+        return;
+    }
+
+    // s->close() can close and delete any number of other sockets, so collect the ids of the
+    // local sockets to close up front, and look each one up again before closing it.
+    std::vector<unsigned> ids;
+    for (asocket* s : index->second) {
+        if (find_local_socket(s->id, 0) != s) {
+            // A remote socket: close its local peer.
+            s = s->peer;
+        }
+        if (s) {
+            ids.push_back(s->id);
+        }
+    }
+
+    for (unsigned id : ids) {
+        asocket* s = find_local_socket(id, 0);
+        if (s && (s->transport == t || (s->peer && s->peer->transport == t))) {
             s->close(s);
-            goto restart;
+        }
+    }
+}
+
+void resume_blocked_sockets(atransport* t) {
+    std::lock_guard<std::recursive_mutex> lock(local_socket_list_lock);
+    auto index = transport_socket_index.find(t);
+    if (index == transport_socket_index.end()) {
+        return;
+    }
+
+    // As in close_all_sockets(), s->ready() can change the index out from under us.
+    std::vector<unsigned> ids;
+    for (asocket* s : index->second) {
+        if (s->write_queue_blocked && s->peer) {
+            ids.push_back(s->peer->id);
+        }
+    }
+
+    for (unsigned id : ids) {
+        asocket* s = find_local_socket(id, 0);
+        if (!s || !s->peer || s->peer->transport != t || !s->peer->write_queue_blocked) {
+            continue;
+        }
+        s->peer->write_queue_blocked = false;
+        // Otherwise, the READY that refills the window does this.
+        if (*s->peer->available_send_bytes > 0) {
+            s->ready(s);
         }
     }
 }
@@ -122,13 +209,14 @@ enum class SocketFlushResult {
 
 static SocketFlushResult local_socket_flush_incoming(asocket* s) {
     if (!s->packet_queue.empty()) {
-        std::vector<adb_iovec> iov = s->packet_queue.iovecs();
+        // Share the storage between all of the sockets on a loop.
+        static thread_local std::vector<adb_iovec> iov;
+        s->packet_queue.iovecs(&iov, ADB_IOV_MAX);
         ssize_t rc = adb_writev(s->fd, iov.data(), iov.size());
         if (rc > 0 && static_cast<size_t>(rc) == s->packet_queue.size()) {
             s->packet_queue.clear();
         } else if (rc > 0) {
-            // TODO: Implement a faster drop_front?
-            s->packet_queue.take_front(rc);
+            s->packet_queue.drop_front(rc);
             fdevent_add(s->fde, FDE_WRITE);
             return SocketFlushResult::TryAgain;
         } else if (rc == -1 && errno == EAGAIN) {
@@ -154,8 +242,7 @@ static SocketFlushResult local_socket_flush_incoming(asocket* s) {
 // Returns false if the socket has been closed and destroyed as a side-effect of this function.
 static bool local_socket_flush_outgoing(asocket* s) {
     const size_t max_payload = s->get_max_payload();
-    apacket::payload_type data;
-    data.resize(max_payload);
+    Block data(max_payload);
     char* x = &data[0];
     size_t avail = max_payload;
     int r = 0;
@@ -189,7 +276,7 @@ static bool local_socket_flush_outgoing(asocket* s) {
         // so save variables for debug printing below.
         unsigned saved_id = s->id;
         int saved_fd = s->fd;
-        r = s->peer->enqueue(s->peer, std::move(data));
+        r = s->peer->enqueue(s->peer, IOVector(std::move(data)));
         D("LS(%u): fd=%d post peer->enqueue(). r=%d", saved_id, saved_fd, r);
 
         if (r < 0) {
@@ -299,7 +386,7 @@ static void local_socket_close(asocket* s) {
     fdevent_del(s->fde, FDE_READ);
     remove_socket(s);
     D("LS(%d): put on socket_closing_list fd=%d", s->id, s->fd);
-    local_socket_closing_list.push_back(s);
+    local_socket_closing_list.insert(s);
     CHECK_EQ(FDE_WRITE, s->fde->state & FDE_WRITE);
 }
 
@@ -400,6 +487,14 @@ static asocket* create_host_service_socket(const char* name, const char* serial,
 }
 #endif /* ADB_HOST */
 
+size_t get_delayed_ack_window() {
+    // Anything less than a small packet would leave the other side unable to send at all.
+    static const size_t window = std::clamp<size_t>(
+            get_env_bytes("ADB_SOCKET_MAX_BUFFERED_BYTES", INITIAL_DELAYED_ACK_BYTES),
+            MAX_PAYLOAD_V1, UINT32_MAX);
+    return window;
+}
+
 static int remote_socket_enqueue(asocket* s, apacket::payload_type data) {
     D("entered remote_socket_enqueue RS(%d) WRITE fd=%d peer.fd=%d", s->id, s->fd, s->peer->fd);
     apacket* p = get_apacket();
@@ -417,15 +512,43 @@ static int remote_socket_enqueue(asocket* s, apacket::payload_type data) {
     p->msg.data_length = p->payload.size();
 
     send_packet(p, s->transport);
+
+    // Keep going until the window is used up, rather than waiting for a READY after every WRITE.
+    if (s->available_send_bytes) {
+        *s->available_send_bytes -= p->msg.data_length;
+        if (s->transport->WriteQueueFull()) {
+            // The device isn't keeping up: wait for resume_blocked_sockets() rather than queue
+            // up the rest of the window too.
+            s->write_queue_blocked = true;
+            return 1;
+        }
+        return *s->available_send_bytes > 0 ? 0 : 1;
+    }
     return 1;
 }
 
 static void remote_socket_ready(asocket* s) {
     D("entered remote_socket_ready RS(%d) OKAY fd=%d peer.fd=%d", s->id, s->fd, s->peer->fd);
+    uint32_t ack_bytes = 0;
+    if (s->available_send_bytes) {
+        // Nothing to give back: the other side isn't waiting for this.
+        if (s->pending_ack_bytes == 0) {
+            return;
+        }
+        ack_bytes = s->pending_ack_bytes;
+        s->pending_ack_bytes = 0;
+    }
+
     apacket* p = get_apacket();
     p->msg.command = A_OKAY;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
+    if (ack_bytes != 0) {
+        // Native byte order, like the message header.
+        const char* bytes = reinterpret_cast<const char*>(&ack_bytes);
+        p->payload.assign(bytes, bytes + sizeof(ack_bytes));
+        p->msg.data_length = p->payload.size();
+    }
     send_packet(p, s->transport);
 }
 
@@ -450,6 +573,7 @@ static void remote_socket_close(asocket* s) {
     D("entered remote_socket_close RS(%d) CLOSE fd=%d peer->fd=%d", s->id, s->fd,
       s->peer ? s->peer->fd : -1);
     D("RS(%d): closed", s->id);
+    set_socket_transport(s, nullptr);
     delete s;
 }
 
@@ -467,7 +591,11 @@ asocket* create_remote_socket(unsigned id, atransport* t) {
     s->ready = remote_socket_ready;
     s->shutdown = remote_socket_shutdown;
     s->close = remote_socket_close;
-    s->transport = t;
+    set_socket_transport(s, t);
+    if (t->has_feature(kFeatureDelayedAck)) {
+        // The other side's grant adds to this when the stream is connected.
+        s->available_send_bytes = 0;
+    }
 
     D("RS(%d): created", s->id);
     return s;
@@ -480,6 +608,9 @@ void connect_to_remote(asocket* s, const char* destination) {
     D("LS(%d): connect('%s')", s->id, destination);
     p->msg.command = A_OPEN;
     p->msg.arg0 = s->id;
+    if (s->transport->has_feature(kFeatureDelayedAck)) {
+        p->msg.arg1 = get_delayed_ack_window();
+    }
 
     // adbd expects a null-terminated string.
     p->payload.assign(destination, destination + strlen(destination) + 1);
@@ -513,6 +644,40 @@ static void local_socket_close_notify(asocket* s) {
     s->close(s);
 }
 
+// Hands the local socket |s| over to the loop of |t|, which isn't the main loop, to connect to
+// |destination| from there. Called on the main thread.
+static void local_socket_connect_on_loop(asocket* s, atransport* t, std::string destination) {
+    // Whoever called us may still be using s->fde, so move the socket once they're done with it.
+    // The client may have closed it by then.
+    unsigned id = s->id;
+    fdevent_run_on_main_thread([id, t, destination]() {
+        asocket* s = find_local_socket(id, 0);
+        if (!s) {
+            return;
+        }
+
+        unsigned events = s->fde->state & (FDE_READ | FDE_WRITE);
+        int fd = fdevent_release(s->fde).release();
+        s->fde = nullptr;
+
+        // The transport outlives anything the main thread queues up for its loop.
+        t->RunOnLoop([s, t, fd, events, destination]() {
+            s->fde = fdevent_create(fd, local_socket_event_func, s);
+            fdevent_set(s->fde, events);
+
+            if (!ConnectionStateIsOnline(t->GetConnectionState())) {
+                s->close = local_socket_close;
+                SendFail(s->fd, "device offline (transport offline)");
+                s->close(s);
+                return;
+            }
+
+            set_socket_transport(s, t);
+            connect_to_remote(s, destination.c_str());
+        });
+    });
+}
+
 static unsigned unhex(const char* s, int len) {
     unsigned n = 0, c;
 
@@ -627,12 +792,8 @@ static int smart_socket_enqueue(asocket* s, apacket::payload_type data) {
 
     D("SS(%d): enqueue %zu", s->id, data.size());
 
-    if (s->smart_socket_data.empty()) {
-        // TODO: Make this an IOVector?
-        s->smart_socket_data.assign(data.begin(), data.end());
-    } else {
-        std::copy(data.begin(), data.end(), std::back_inserter(s->smart_socket_data));
-    }
+    // TODO: Make this an IOVector?
+    data.iterate_blocks([s](const char* buf, size_t len) { s->smart_socket_data.append(buf, len); });
 
     /* don't bother if we can't decode the length */
     if (s->smart_socket_data.size() < 4) {
@@ -769,10 +930,14 @@ static int smart_socket_enqueue(asocket* s, apacket::payload_type data) {
     s->peer->shutdown = nullptr;
     s->peer->close = local_socket_close_notify;
     s->peer->peer = nullptr;
-    /* give him our transport and upref it */
-    s->peer->transport = s->transport;
+    if (s->transport->loop() != fdevent_main_context()) {
+        local_socket_connect_on_loop(s->peer, s->transport, s->smart_socket_data.data() + 4);
+    } else {
+        /* give him our transport and upref it */
+        set_socket_transport(s->peer, s->transport);
 
-    connect_to_remote(s->peer, s->smart_socket_data.data() + 4);
+        connect_to_remote(s->peer, s->smart_socket_data.data() + 4);
+    }
     s->peer = nullptr;
     s->close(s);
     return 1;
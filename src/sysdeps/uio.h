@@ -18,6 +18,9 @@
 
 #include <sys/types.h>
 
+// The most iovecs that can be passed to a single adb_writev (IOV_MAX on Linux).
+constexpr int ADB_IOV_MAX = 1024;
+
 #if defined(_WIN32)
 
 // Layout of this struct must match struct WSABUF (verified via static assert in sysdeps_win32.cpp)
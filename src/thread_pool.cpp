@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sysdeps.h"
+
+#include "thread_pool.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <android-base/thread_annotations.h>
+
+struct ThreadPool::State {
+    State(std::string name, size_t max_threads, std::chrono::milliseconds idle_timeout)
+        : name(std::move(name)), max_threads(max_threads), idle_timeout(idle_timeout) {}
+
+    const std::string name;
+    const size_t max_threads;
+    const std::chrono::milliseconds idle_timeout;
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable exit_cv;
+    std::deque<std::function<void()>> tasks GUARDED_BY(mutex);
+    size_t threads GUARDED_BY(mutex) = 0;
+    size_t idle GUARDED_BY(mutex) = 0;
+    bool stopping GUARDED_BY(mutex) = false;
+};
+
+ThreadPool::ThreadPool(std::string name, size_t max_threads,
+                       std::chrono::milliseconds idle_timeout)
+    : state_(std::make_shared<State>(std::move(name), max_threads, idle_timeout)) {
+    CHECK_GT(max_threads, 0u);
+}
+
+ThreadPool::~ThreadPool() {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->stopping = true;
+    state_->work_cv.notify_all();
+    state_->exit_cv.wait(lock, [this]() { return state_->threads == 0; });
+}
+
+void ThreadPool::Run(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->tasks.push_back(std::move(task));
+
+    // Each idle worker that's been woken takes one task, so only start another worker if there are
+    // more tasks than that.
+    if (state_->tasks.size() <= state_->idle) {
+        state_->work_cv.notify_one();
+    } else if (state_->threads < state_->max_threads) {
+        ++state_->threads;
+        std::thread(Worker, state_, nullptr).detach();
+    }
+}
+
+void ThreadPool::RunBlocking(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    if (state_->tasks.size() < state_->idle) {
+        state_->tasks.push_back(std::move(task));
+        state_->work_cv.notify_one();
+    } else {
+        // Whatever's queued may be waiting for a worker too, so this one gets its own.
+        ++state_->threads;
+        std::thread(Worker, state_, std::move(task)).detach();
+    }
+}
+
+size_t ThreadPool::threads() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->threads;
+}
+
+size_t ThreadPool::idle_threads() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->idle;
+}
+
+void ThreadPool::Worker(std::shared_ptr<State> state, std::function<void()> task) {
+    adb_thread_setname(state->name);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (true) {
+        if (task) {
+            lock.unlock();
+            task();
+
+            // Drop whatever the task captured before waiting for the next, and undo any renaming.
+            task = nullptr;
+            adb_thread_setname(state->name);
+            lock.lock();
+            continue;
+        }
+
+        if (state->tasks.empty()) {
+            // Workers that RunBlocking() started past the limit don't stay around.
+            if (state->stopping || state->threads > state->max_threads) {
+                break;
+            }
+            ++state->idle;
+            bool woken = state->work_cv.wait_for(lock, state->idle_timeout, [&state]() {
+                return !state->tasks.empty() || state->stopping;
+            });
+            --state->idle;
+            if (!woken) {
+                break;
+            }
+            continue;
+        }
+
+        task = std::move(state->tasks.front());
+        state->tasks.pop_front();
+    }
+
+    --state->threads;
+    state->exit_cv.notify_all();
+}
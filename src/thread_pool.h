@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+// A pool of up to |max_threads| worker threads, started as they're needed. Workers that have had
+// nothing to do for |idle_timeout| exit, so an idle pool has no threads at all. Tasks run in the
+// order they were queued; once every worker is busy, new tasks wait for one to finish.
+//
+// Tasks that block for as long as they like go to RunBlocking() instead, which doesn't queue them:
+// they may take the pool past |max_threads|, which then only limits how many workers stay around.
+class ThreadPool {
+  public:
+    ThreadPool(std::string name, size_t max_threads, std::chrono::milliseconds idle_timeout);
+
+    // Waits for the queued and running tasks to finish.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool& copy) = delete;
+    ThreadPool& operator=(const ThreadPool& copy) = delete;
+
+    void Run(std::function<void()> task);
+
+    // Runs |task| right away, on an idle worker if there is one and on a new one otherwise.
+    void RunBlocking(std::function<void()> task);
+
+    // How many workers there are, busy or not, and how many of them are waiting for a task.
+    size_t threads() const;
+    size_t idle_threads() const;
+
+  private:
+    struct State;
+
+    // Runs |task| first, if there is one, and then whatever's queued.
+    static void Worker(std::shared_ptr<State> state, std::function<void()> task);
+
+    // Shared with the workers, which may still be on their way out when the pool is destroyed.
+    std::shared_ptr<State> state_;
+};
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "thread_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+TEST(ThreadPool, runs_everything) {
+    std::atomic<size_t> count(0);
+    {
+        ThreadPool pool("test pool", 4, 1s);
+        for (size_t i = 0; i < 1000; ++i) {
+            pool.Run([&count]() { ++count; });
+        }
+        EXPECT_LE(pool.threads(), 4u);
+    }
+    EXPECT_EQ(1000u, count);
+}
+
+TEST(ThreadPool, max_threads) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t running = 0;
+    bool release = false;
+    std::vector<size_t> order;
+
+    ThreadPool pool("test pool", 2, 1s);
+    for (size_t i = 0; i < 3; ++i) {
+        pool.Run([&, i]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            ++running;
+            order.push_back(i);
+            cv.notify_all();
+            cv.wait(lock, [&release]() { return release; });
+        });
+    }
+
+    // The third waits for one of the first two to finish.
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&running]() { return running == 2; });
+    EXPECT_FALSE(cv.wait_for(lock, 100ms, [&running]() { return running > 2; }));
+    EXPECT_EQ(2u, pool.threads());
+
+    release = true;
+    cv.notify_all();
+    cv.wait(lock, [&running]() { return running == 3; });
+    EXPECT_EQ(3u, order.size());
+    EXPECT_EQ(2u, order.back());
+}
+
+TEST(ThreadPool, run_blocking) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t running = 0;
+    bool release = false;
+
+    ThreadPool pool("test pool", 2, 10s);
+    auto block = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        ++running;
+        cv.notify_all();
+        cv.wait(lock, [&release]() { return release; });
+    };
+    for (size_t i = 0; i < 5; ++i) {
+        pool.RunBlocking(block);
+    }
+
+    // None of them waits for another to finish, however many there are.
+    std::unique_lock<std::mutex> lock(mutex);
+    ASSERT_TRUE(cv.wait_for(lock, 10s, [&running]() { return running == 5; }));
+    EXPECT_EQ(5u, pool.threads());
+    lock.unlock();
+
+    std::promise<void> done;
+    pool.RunBlocking([&done]() { done.set_value(); });
+    EXPECT_EQ(std::future_status::ready, done.get_future().wait_for(10s));
+
+    // Once they have, only |max_threads| workers stay around.
+    lock.lock();
+    release = true;
+    cv.notify_all();
+    lock.unlock();
+    auto deadline = std::chrono::steady_clock::now() + 10s;
+    while (pool.threads() != 2 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(5ms);
+    }
+    EXPECT_EQ(2u, pool.threads());
+}
+
+static void WaitForIdle(const ThreadPool& pool) {
+    auto deadline = std::chrono::steady_clock::now() + 10s;
+    while (pool.idle_threads() != pool.threads() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(1ms);
+    }
+    ASSERT_EQ(pool.threads(), pool.idle_threads());
+}
+
+TEST(ThreadPool, reuses_idle_workers) {
+    // Outlive the pool, since the workers might still be returning from set_value().
+    std::vector<std::promise<void>> done(100);
+    ThreadPool pool("test pool", 8, 10s);
+    for (std::promise<void>& promise : done) {
+        pool.Run([&promise]() { promise.set_value(); });
+        promise.get_future().wait();
+        WaitForIdle(pool);
+    }
+    EXPECT_EQ(1u, pool.threads());
+}
+
+TEST(ThreadPool, idle_timeout) {
+    std::promise<void> done, again;
+    ThreadPool pool("test pool", 4, 20ms);
+    pool.Run([&done]() { done.set_value(); });
+    done.get_future().wait();
+
+    auto deadline = std::chrono::steady_clock::now() + 10s;
+    while (pool.threads() != 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(5ms);
+    }
+    EXPECT_EQ(0u, pool.threads());
+
+    // And it starts another when there's more to do.
+    pool.Run([&again]() { again.set_value(); });
+    again.get_future().wait();
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+// How many ticks a slot on |level| spans.
+static constexpr uint64_t SlotSpan(size_t level) {
+    return uint64_t(1) << (TimerWheel::kSlotBits * level);
+}
+
+TimerWheel::TimerWheel(uint64_t now) : current_(now) {
+    for (auto& level : slots_) {
+        for (Entry& slot : level) {
+            slot.prev = slot.next = &slot;
+        }
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    Clear();
+}
+
+void TimerWheel::Unlink(Entry* entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = entry->next = nullptr;
+    entry->level = -1;
+}
+
+void TimerWheel::Insert(Entry* entry) {
+    // Anything too far out for the top level goes as far out as it can, and moves back up when
+    // its slot comes around.
+    uint64_t expiry = std::min(entry->expiry, current_ + SlotSpan(kLevels) - 1);
+    uint64_t delta = expiry - current_;
+
+    size_t level = 0;
+    while (delta >= SlotSpan(level + 1)) {
+        ++level;
+    }
+
+    Entry* slot = &slots_[level][(expiry >> (kSlotBits * level)) & (kSlots - 1)];
+    entry->level = level;
+    entry->prev = slot->prev;
+    entry->next = slot;
+    slot->prev->next = entry;
+    slot->prev = entry;
+    ++counts_[level];
+}
+
+void TimerWheel::Schedule(Entry* entry, uint64_t expiry) {
+    Cancel(entry);
+    entry->expiry = std::max(expiry, current_ + 1);
+    Insert(entry);
+}
+
+void TimerWheel::Cancel(Entry* entry) {
+    if (!entry->scheduled()) {
+        return;
+    }
+    if (entry->level >= 0) {
+        --counts_[entry->level];
+    }
+    Unlink(entry);
+}
+
+void TimerWheel::Clear() {
+    for (size_t level = 0; level < kLevels; ++level) {
+        for (size_t slot = 0; slot < kSlots; ++slot) {
+            Entry list;
+            TakeSlot(level, slot, &list);
+            while (list.next != &list) {
+                Unlink(list.next);
+            }
+        }
+    }
+}
+
+void TimerWheel::TakeSlot(size_t level, size_t index, Entry* list) {
+    Entry* slot = &slots_[level][index];
+    if (slot->next == slot) {
+        list->prev = list->next = list;
+        return;
+    }
+
+    list->next = slot->next;
+    list->prev = slot->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    slot->prev = slot->next = slot;
+
+    for (Entry* entry = list->next; entry != list; entry = entry->next) {
+        entry->level = -1;
+        --counts_[level];
+    }
+}
+
+uint64_t TimerWheel::NextTurnover() const {
+    for (size_t level = 1; level < kLevels; ++level) {
+        if (counts_[level] != 0) {
+            return (current_ | (SlotSpan(level) - 1)) + 1;
+        }
+    }
+    return UINT64_MAX;
+}
+
+void TimerWheel::Cascade(uint64_t tick) {
+    // The higher levels whose slots turn over at |tick|, starting from the top so that what comes
+    // down from one level can go on down through the next.
+    size_t top = 0;
+    while (top + 1 < kLevels && tick % SlotSpan(top + 1) == 0) {
+        ++top;
+    }
+
+    for (size_t level = top; level > 0; --level) {
+        Entry list;
+        TakeSlot(level, (tick >> (kSlotBits * level)) & (kSlots - 1), &list);
+        while (list.next != &list) {
+            Entry* entry = list.next;
+            Unlink(entry);
+            Insert(entry);
+        }
+    }
+}
+
+std::optional<uint64_t> TimerWheel::NextEvent() const {
+    if (counts_[0] != 0) {
+        for (uint64_t tick = current_ + 1; tick <= current_ + kSlots; ++tick) {
+            const Entry& slot = slots_[0][tick & (kSlots - 1)];
+            if (slot.next != &slot) {
+                return tick;
+            }
+        }
+    }
+
+    // Otherwise, the next time that a higher level has something to move down.
+    std::optional<uint64_t> result;
+    for (size_t level = 1; level < kLevels; ++level) {
+        if (counts_[level] == 0) {
+            continue;
+        }
+        uint64_t turn = current_ >> (kSlotBits * level);
+        for (uint64_t next = turn + 1; next <= turn + kSlots; ++next) {
+            const Entry& slot = slots_[level][next & (kSlots - 1)];
+            if (slot.next != &slot) {
+                uint64_t tick = next << (kSlotBits * level);
+                result = result ? std::min(*result, tick) : tick;
+                break;
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <optional>
+
+// A hierarchical timing wheel (Varghese and Lauck): four levels of 64 slots each, where the first
+// level's slots are a tick apart, and each slot of the levels above spans a whole turn of the level
+// below. Starting, stopping and expiring a timer are O(1), however many there are; timers further
+// out than a turn of the first level move down a level at a time as their turn comes.
+//
+// Time is in ticks, counted by the caller. Not thread-safe.
+class TimerWheel {
+  public:
+    // Embedded in whatever the timer is for. It mustn't be destroyed while it's scheduled.
+    struct Entry {
+        Entry* prev = nullptr;
+        Entry* next = nullptr;
+        uint64_t expiry = 0;
+        int level = -1;
+
+        bool scheduled() const { return next != nullptr; }
+    };
+
+    static constexpr size_t kLevels = 4;
+    static constexpr size_t kSlotBits = 6;
+    static constexpr size_t kSlots = 1 << kSlotBits;
+
+    explicit TimerWheel(uint64_t now = 0);
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel& copy) = delete;
+    TimerWheel& operator=(const TimerWheel& copy) = delete;
+
+    uint64_t now() const { return current_; }
+
+    // Schedules |entry| to expire at tick |expiry|, or the next tick if that's already gone,
+    // rescheduling it if it was already.
+    void Schedule(Entry* entry, uint64_t expiry);
+    void Cancel(Entry* entry);
+
+    // Unschedules everything.
+    void Clear();
+
+    // The first tick at which Advance() has anything to do, if anything is scheduled. That's
+    // sometimes earlier than the next expiry, when a timer has to move down a level first.
+    std::optional<uint64_t> NextEvent() const;
+
+    // Moves time forward to |now|, and calls |fn| with each entry that expires, in order of expiry.
+    // The entry is no longer scheduled by then, and |fn| is free to schedule or cancel any entry.
+    template <typename Fn>
+    void Advance(uint64_t now, Fn fn) {
+        while (current_ < now) {
+            if (counts_[0] == 0) {
+                // Nothing can expire before the lowest level with anything on it turns over.
+                uint64_t boundary = NextTurnover();
+                if (boundary > now) {
+                    current_ = now;
+                    return;
+                }
+                current_ = boundary - 1;
+            }
+
+            uint64_t tick = current_ + 1;
+            current_ = tick;
+            Cascade(tick);
+
+            // Take the slot's entries all at once, so that anything scheduled for now or earlier
+            // from |fn| waits for the next tick.
+            Entry expired;
+            TakeSlot(0, tick & (kSlots - 1), &expired);
+            while (expired.next != &expired) {
+                Entry* entry = expired.next;
+                Unlink(entry);
+                fn(entry);
+            }
+        }
+    }
+
+  private:
+    uint64_t NextTurnover() const;
+    void Cascade(uint64_t tick);
+    void Insert(Entry* entry);
+    void TakeSlot(size_t level, size_t slot, Entry* list);
+    static void Unlink(Entry* entry);
+
+    uint64_t current_;
+    size_t counts_[kLevels] = {};
+    Entry slots_[kLevels][kSlots];
+};
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "timer_wheel.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+struct TestEntry : public TimerWheel::Entry {
+    uint64_t expired_at = 0;
+};
+
+static void ExpectExpiresAt(uint64_t expiry) {
+    TimerWheel wheel(1000);
+    TestEntry entry;
+    wheel.Schedule(&entry, expiry);
+
+    // Follow NextEvent(), like the event loop does.
+    size_t wakeups = 0;
+    while (entry.scheduled()) {
+        std::optional<uint64_t> next = wheel.NextEvent();
+        ASSERT_TRUE(next);
+        ASSERT_LE(*next, expiry);
+        wheel.Advance(*next, [](TimerWheel::Entry*) {});
+        if (!entry.scheduled()) {
+            EXPECT_EQ(expiry, wheel.now());
+        }
+        ++wakeups;
+    }
+    EXPECT_LE(wakeups, 4 * TimerWheel::kLevels) << "expiry " << expiry;
+    EXPECT_FALSE(wheel.NextEvent());
+}
+
+TEST(TimerWheel, levels) {
+    for (uint64_t delay : {1ull, 63ull, 64ull, 65ull, 4095ull, 4096ull, 4097ull, 300000ull,
+                           (1ull << 24) - 1, 1ull << 24, (1ull << 24) + 12345}) {
+        ExpectExpiresAt(1000 + delay);
+    }
+    // Beyond the top level, it takes a few trips round.
+    ExpectExpiresAt(1000 + 3 * (1ull << 24));
+}
+
+TEST(TimerWheel, past) {
+    TimerWheel wheel(100);
+    TestEntry entry;
+    wheel.Schedule(&entry, 50);
+    EXPECT_EQ(101u, entry.expiry);
+    EXPECT_EQ(101u, wheel.NextEvent());
+    wheel.Cancel(&entry);
+}
+
+TEST(TimerWheel, cancel) {
+    TimerWheel wheel;
+    TestEntry a, b;
+    wheel.Schedule(&a, 10);
+    wheel.Schedule(&b, 5000);
+    wheel.Cancel(&a);
+    wheel.Cancel(&a);
+    EXPECT_FALSE(a.scheduled());
+
+    // Rescheduling moves it.
+    wheel.Schedule(&b, 20);
+    std::vector<TimerWheel::Entry*> expired;
+    wheel.Advance(100000, [&expired](TimerWheel::Entry* e) { expired.push_back(e); });
+    ASSERT_EQ(1u, expired.size());
+    EXPECT_EQ(&b, expired[0]);
+    EXPECT_EQ(100000u, wheel.now());
+}
+
+TEST(TimerWheel, reschedule_from_callback) {
+    TimerWheel wheel;
+    TestEntry periodic, other;
+    wheel.Schedule(&periodic, 10);
+    wheel.Schedule(&other, 10);
+
+    std::vector<uint64_t> ticks;
+    wheel.Advance(45, [&](TimerWheel::Entry* e) {
+        if (e == &periodic) {
+            ticks.push_back(wheel.now());
+            wheel.Schedule(e, wheel.now() + 10);
+            // Both expired on the same tick, but it can still be cancelled.
+            wheel.Cancel(&other);
+        } else {
+            ADD_FAILURE() << "cancelled entry expired";
+        }
+    });
+    EXPECT_EQ((std::vector<uint64_t>{10, 20, 30, 40}), ticks);
+    EXPECT_TRUE(periodic.scheduled());
+    EXPECT_EQ(50u, wheel.NextEvent());
+    wheel.Cancel(&periodic);
+}
+
+TEST(TimerWheel, random) {
+    std::mt19937_64 rng(1);
+    TimerWheel wheel;
+    std::vector<TestEntry> entries(2000);
+    for (TestEntry& entry : entries) {
+        // Mostly near, some far.
+        uint64_t delay = rng() % 8 == 0 ? rng() % (1ull << 26) : rng() % 5000;
+        wheel.Schedule(&entry, 1 + delay);
+    }
+
+    size_t expired = 0;
+    while (expired < entries.size()) {
+        uint64_t now = wheel.now() + 1 + rng() % 3000;
+        wheel.Advance(now, [&](TimerWheel::Entry* e) {
+            auto* entry = static_cast<TestEntry*>(e);
+            EXPECT_EQ(entry->expiry, wheel.now());
+            entry->expired_at = wheel.now();
+            ++expired;
+        });
+        if (std::optional<uint64_t> next = wheel.NextEvent()) {
+            // Skip idle stretches, like the event loop.
+            wheel.Advance(*next - 1, [](TimerWheel::Entry*) { FAIL() << "expired early"; });
+        }
+    }
+    for (const TestEntry& entry : entries) {
+        EXPECT_EQ(entry.expiry, entry.expired_at);
+    }
+}
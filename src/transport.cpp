@@ -37,6 +37,7 @@
 #include <mutex>
 #include <set>
 #include <thread>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/parsenetaddress.h>
@@ -64,11 +65,26 @@ static auto& pending_list = *new std::list<atransport*>();
 
 static auto& transport_lock = *new std::recursive_mutex();
 
+// What's in transport_list, for lookups that don't need transport_lock. Only changed with
+// transport_lock held, alongside transport_list.
+static auto& transport_index = *new TransportIndex();
+
+// Extra event loops that transports are shared out between, if any.
+static auto& transport_loops = *new std::vector<fdevent_context*>();
+static size_t next_transport_loop = 0;
+
 const char* const kFeatureShell2 = "shell_v2";
 const char* const kFeatureCmd = "cmd";
 const char* const kFeatureStat2 = "stat_v2";
 const char* const kFeatureLibusb = "libusb";
 const char* const kFeaturePushSync = "push_sync";
+const char* const kFeatureSyncPipeline = "sync_pipeline";
+const char* const kFeatureSyncChunkSize = "sync_chunk_size";
+const char* const kFeatureDelayedAck = "delayed_ack";
+const char* const kFeatureSyncDelta = "sync_delta";
+const char* const kFeatureSyncListTree = "sync_list_tree";
+const char* const kFeatureSyncLstatBatch = "sync_lstat_batch";
+const char* const kFeatureSyncCompress = "sync_compress";
 
 namespace {
 
@@ -84,28 +100,26 @@ class SCOPED_CAPABILITY ScopedAssumeLocked {
 };
 
 #if ADB_HOST
-// Tracks and handles atransport*s that are attempting reconnection.
+// Tracks and handles atransport*s that are attempting reconnection. Apart from CheckForKicked(), it
+// only runs on the main thread, which waits for the next attempt with a timer.
 class ReconnectHandler {
   public:
     ReconnectHandler() = default;
     ~ReconnectHandler() = default;
 
-    // Starts the ReconnectHandler thread.
+    // Starts the ReconnectHandler.
     void Start();
 
-    // Requests the ReconnectHandler thread to stop.
+    // Stops the ReconnectHandler, giving up on the transports that it's tracking.
     void Stop();
 
     // Adds the atransport* to the queue of reconnect attempts.
     void TrackTransport(atransport* transport);
 
-    // Wake up the ReconnectHandler thread to have it check for kicked transports.
+    // Have the ReconnectHandler check for kicked transports. May be called from any thread.
     void CheckForKicked();
 
   private:
-    // The main thread loop.
-    void Run();
-
     // Tracks a reconnection attempt.
     struct ReconnectAttempt {
         atransport* transport;
@@ -121,16 +135,22 @@ class ReconnectHandler {
         }
     };
 
+    // Gives up on kicked transports, and starts the attempts that are due.
+    void Run();
+
+    // Sets the timer for the next attempt.
+    void Reschedule();
+
+    void Attempt(ReconnectAttempt attempt);
+    void HandleResult(ReconnectAttempt attempt, ReconnectResult result);
+
     // Only retry for up to one minute.
     static constexpr const std::chrono::seconds kDefaultTimeout = 10s;
     static constexpr const size_t kMaxAttempts = 6;
 
-    // Protects all members.
-    std::mutex reconnect_mutex_;
-    bool running_ GUARDED_BY(reconnect_mutex_) = true;
-    std::thread handler_thread_;
-    std::condition_variable reconnect_cv_;
-    std::set<ReconnectAttempt> reconnect_queue_ GUARDED_BY(reconnect_mutex_);
+    bool running_ = true;
+    fdevent_timer* timer_ = nullptr;
+    std::set<ReconnectAttempt> reconnect_queue_;
 
     DISALLOW_COPY_AND_ASSIGN(ReconnectHandler);
 };
@@ -139,20 +159,17 @@ constexpr const std::chrono::seconds ReconnectHandler::kDefaultTimeout;
 
 void ReconnectHandler::Start() {
     check_main_thread();
-    handler_thread_ = std::thread(&ReconnectHandler::Run, this);
+    timer_ = fdevent_create_timer([this]() { Run(); });
+    Reschedule();
 }
 
 void ReconnectHandler::Stop() {
     check_main_thread();
-    {
-        std::lock_guard<std::mutex> lock(reconnect_mutex_);
-        running_ = false;
-    }
-    reconnect_cv_.notify_one();
-    handler_thread_.join();
+    running_ = false;
+    fdevent_destroy_timer(timer_);
+    timer_ = nullptr;
 
     // Drain the queue to free all resources.
-    std::lock_guard<std::mutex> lock(reconnect_mutex_);
     while (!reconnect_queue_.empty()) {
         ReconnectAttempt attempt = *reconnect_queue_.begin();
         reconnect_queue_.erase(reconnect_queue_.begin());
@@ -162,96 +179,101 @@ void ReconnectHandler::Stop() {
 
 void ReconnectHandler::TrackTransport(atransport* transport) {
     check_main_thread();
-    {
-        std::lock_guard<std::mutex> lock(reconnect_mutex_);
-        if (!running_) return;
-        // Arbitrary sleep to give adbd time to get ready, if we disconnected because it exited.
-        auto reconnect_time = std::chrono::steady_clock::now() + 250ms;
-        reconnect_queue_.emplace(
-                ReconnectAttempt{transport, reconnect_time, ReconnectHandler::kMaxAttempts});
-    }
-    reconnect_cv_.notify_one();
+    if (!running_) return;
+    // Arbitrary sleep to give adbd time to get ready, if we disconnected because it exited.
+    auto reconnect_time = std::chrono::steady_clock::now() + 250ms;
+    reconnect_queue_.emplace(
+            ReconnectAttempt{transport, reconnect_time, ReconnectHandler::kMaxAttempts});
+    Reschedule();
 }
 
 void ReconnectHandler::CheckForKicked() {
-    reconnect_cv_.notify_one();
+    fdevent_run_on_main_thread([this]() {
+        if (running_) {
+            Run();
+        }
+    });
 }
 
-void ReconnectHandler::Run() {
-    while (true) {
-        ReconnectAttempt attempt;
-        {
-            std::unique_lock<std::mutex> lock(reconnect_mutex_);
-            ScopedAssumeLocked assume_lock(reconnect_mutex_);
-
-            if (!reconnect_queue_.empty()) {
-                // FIXME: libstdc++ (used on Windows) implements condition_variable with
-                //        system_clock as its clock, so we're probably hosed if the clock changes,
-                //        even if we use steady_clock throughout. This problem goes away once we
-                //        switch to libc++.
-                reconnect_cv_.wait_until(lock, reconnect_queue_.begin()->reconnect_time);
-            } else {
-                reconnect_cv_.wait(lock);
-            }
+void ReconnectHandler::Reschedule() {
+    if (!timer_) {
+        return;
+    }
+    if (reconnect_queue_.empty()) {
+        fdevent_timer_stop(timer_);
+        return;
+    }
 
-            if (!running_) return;
+    auto delay = std::chrono::ceil<std::chrono::milliseconds>(
+            reconnect_queue_.begin()->reconnect_time - std::chrono::steady_clock::now());
+    fdevent_timer_start(timer_, std::max(delay, std::chrono::milliseconds::zero()));
+}
 
-            // Scan the whole list for kicked transports, so that we immediately handle an explicit
-            // disconnect request.
-            bool kicked = false;
-            for (auto it = reconnect_queue_.begin(); it != reconnect_queue_.end();) {
-                if (it->transport->kicked()) {
-                    D("transport %s was kicked. giving up on it.", it->transport->serial.c_str());
-                    remove_transport(it->transport);
-                    it = reconnect_queue_.erase(it);
-                } else {
-                    ++it;
-                }
-                kicked = true;
-            }
+void ReconnectHandler::Run() {
+    // Scan the whole list for kicked transports, so that we immediately handle an explicit
+    // disconnect request.
+    for (auto it = reconnect_queue_.begin(); it != reconnect_queue_.end();) {
+        if (it->transport->kicked()) {
+            D("transport %s was kicked. giving up on it.", it->transport->serial.c_str());
+            remove_transport(it->transport);
+            it = reconnect_queue_.erase(it);
+        } else {
+            ++it;
+        }
+    }
 
-            if (reconnect_queue_.empty()) continue;
+    auto now = std::chrono::steady_clock::now();
+    while (!reconnect_queue_.empty() && reconnect_queue_.begin()->reconnect_time <= now) {
+        ReconnectAttempt attempt = *reconnect_queue_.begin();
+        reconnect_queue_.erase(reconnect_queue_.begin());
+        Attempt(attempt);
+    }
+    Reschedule();
+}
 
-            // Go back to sleep if we either woke up spuriously, or we were woken up to remove
-            // a kicked transport, and the first transport isn't ready for reconnection yet.
-            auto now = std::chrono::steady_clock::now();
-            if (reconnect_queue_.begin()->reconnect_time > now) {
-                continue;
-            }
+void ReconnectHandler::Attempt(ReconnectAttempt attempt) {
+    D("attempting to reconnect %s", attempt.transport->serial.c_str());
 
-            attempt = *reconnect_queue_.begin();
-            reconnect_queue_.erase(reconnect_queue_.begin());
-        }
-        D("attempting to reconnect %s", attempt.transport->serial.c_str());
-
-        switch (attempt.transport->Reconnect()) {
-            case ReconnectResult::Retry: {
-                D("attempting to reconnect %s failed.", attempt.transport->serial.c_str());
-                if (attempt.attempts_left == 0) {
-                    D("transport %s exceeded the number of retry attempts. giving up on it.",
-                      attempt.transport->serial.c_str());
-                    remove_transport(attempt.transport);
-                    continue;
-                }
+    // Reconnecting can take as long as the connect timeout, so it gets a thread of its own.
+    std::thread([this, attempt]() {
+        adb_thread_setname("reconnect");
+        ReconnectResult result = attempt.transport->Reconnect();
+        fdevent_run_on_main_thread([this, attempt, result]() { HandleResult(attempt, result); });
+    }).detach();
+}
 
-                std::lock_guard<std::mutex> lock(reconnect_mutex_);
-                reconnect_queue_.emplace(ReconnectAttempt{
-                        attempt.transport,
-                        std::chrono::steady_clock::now() + ReconnectHandler::kDefaultTimeout,
-                        attempt.attempts_left - 1});
-                continue;
+void ReconnectHandler::HandleResult(ReconnectAttempt attempt, ReconnectResult result) {
+    if (!running_) {
+        remove_transport(attempt.transport);
+        return;
+    }
+
+    switch (result) {
+        case ReconnectResult::Retry:
+            D("attempting to reconnect %s failed.", attempt.transport->serial.c_str());
+            if (attempt.attempts_left == 0) {
+                D("transport %s exceeded the number of retry attempts. giving up on it.",
+                  attempt.transport->serial.c_str());
+                remove_transport(attempt.transport);
+                return;
             }
 
-            case ReconnectResult::Success:
-                D("reconnection to %s succeeded.", attempt.transport->serial.c_str());
-                register_transport(attempt.transport);
-                continue;
+            reconnect_queue_.emplace(ReconnectAttempt{
+                    attempt.transport,
+                    std::chrono::steady_clock::now() + ReconnectHandler::kDefaultTimeout,
+                    attempt.attempts_left - 1});
+            Reschedule();
+            return;
 
-            case ReconnectResult::Abort:
-                D("cancelling reconnection attempt to %s.", attempt.transport->serial.c_str());
-                remove_transport(attempt.transport);
-                continue;
-        }
+        case ReconnectResult::Success:
+            D("reconnection to %s succeeded.", attempt.transport->serial.c_str());
+            register_transport(attempt.transport);
+            return;
+
+        case ReconnectResult::Abort:
+            D("cancelling reconnection attempt to %s.", attempt.transport->serial.c_str());
+            remove_transport(attempt.transport);
+            return;
     }
 }
 
@@ -266,8 +288,15 @@ TransportId NextTransportId() {
     return next++;
 }
 
-BlockingConnectionAdapter::BlockingConnectionAdapter(std::unique_ptr<BlockingConnection> connection)
-    : underlying_(std::move(connection)) {}
+size_t get_transport_max_queued_bytes() {
+    static const size_t max_queued_bytes =
+            get_env_bytes("ADB_TRANSPORT_MAX_QUEUED_BYTES", DEFAULT_TRANSPORT_MAX_QUEUED_BYTES);
+    return max_queued_bytes;
+}
+
+BlockingConnectionAdapter::BlockingConnectionAdapter(std::unique_ptr<BlockingConnection> connection,
+                                                     size_t max_queued_bytes)
+    : underlying_(std::move(connection)), max_queued_bytes_(max_queued_bytes) {}
 
 BlockingConnectionAdapter::~BlockingConnectionAdapter() {
     LOG(INFO) << "BlockingConnectionAdapter(" << this->transport_name_ << "): destructing";
@@ -296,6 +325,7 @@ void BlockingConnectionAdapter::Start() {
 
     write_thread_ = std::thread([this]() {
         LOG(INFO) << this->transport_name_ << ": write thread spawning";
+        std::deque<std::unique_ptr<apacket>> packets;
         while (true) {
             std::unique_lock<std::mutex> lock(mutex_);
             ScopedAssumeLocked assume_locked(mutex_);
@@ -307,13 +337,35 @@ void BlockingConnectionAdapter::Start() {
                 return;
             }
 
-            std::unique_ptr<apacket> packet = std::move(this->write_queue_.front());
-            this->write_queue_.pop_front();
+            // Take what's queued up to write it out together, but not so much that something
+            // more urgent that arrives meanwhile has to wait for all of it.
+            size_t batch_bytes = 0;
+            while (batch_bytes < PacketScheduler::kDefaultQuantum) {
+                std::unique_ptr<apacket> packet = this->write_queue_.Pop();
+                if (!packet) {
+                    break;
+                }
+                batch_bytes += sizeof(packet->msg) + packet->payload.size();
+                packets.push_back(std::move(packet));
+            }
+
+            // Let the sockets that stopped for a full queue go again once it's half empty, rather
+            // than the moment there's room for one more packet.
+            bool resume = false;
+            if (this->write_queue_full_ && this->write_queue_.bytes() <= max_queued_bytes_ / 2) {
+                this->write_queue_full_ = false;
+                resume = true;
+            }
             lock.unlock();
 
-            if (!this->underlying_->Write(packet.get())) {
+            if (resume && this->writable_callback_) {
+                this->writable_callback_(this);
+            }
+
+            if (!this->underlying_->WriteBatch(packets)) {
                 break;
             }
+            packets.clear();
         }
         std::call_once(this->error_flag_, [this]() { this->error_callback_(this, "write failed"); });
     });
@@ -361,17 +413,80 @@ void BlockingConnectionAdapter::Stop() {
 }
 
 bool BlockingConnectionAdapter::Write(std::unique_ptr<apacket> packet) {
+    bool was_empty;
     {
         std::lock_guard<std::mutex> lock(this->mutex_);
-        write_queue_.emplace_back(std::move(packet));
+        was_empty = write_queue_.empty();
+        write_queue_.Push(std::move(packet));
+        if (write_queue_.bytes() >= max_queued_bytes_) {
+            write_queue_full_ = true;
+        }
     }
 
-    cv_.notify_one();
+    // The write thread only ever waits for an empty queue, so it can't miss a non-empty one.
+    if (was_empty) {
+        cv_.notify_one();
+    }
+    return true;
+}
+
+bool BlockingConnectionAdapter::GetWriteQueueStats(PacketQueueStats* stats) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    *stats = write_queue_.stats();
+    return true;
+}
+
+bool BlockingConnection::WriteBatch(const std::deque<std::unique_ptr<apacket>>& packets) {
+    for (const auto& packet : packets) {
+        if (!Write(packet.get())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FdConnection::ReadBuffered(void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    size_t buffered = std::min(len, read_end_ - read_begin_);
+    if (buffered > 0) {
+        memcpy(p, &read_buffer_[read_begin_], buffered);
+        read_begin_ += buffered;
+        p += buffered;
+        len -= buffered;
+    }
+    if (len == 0) {
+        return true;
+    }
+
+    if (read_buffer_.empty()) {
+        read_buffer_.resize(64 * 1024);
+    }
+
+    // Big payloads go straight to where they belong, without the extra copy.
+    if (len >= read_buffer_.size()) {
+        return ReadFdExactly(fd_.get(), p, len);
+    }
+
+    // Otherwise take whatever has arrived, which is likely to include the next few packets.
+    read_begin_ = 0;
+    read_end_ = 0;
+    while (read_end_ < len) {
+        int r = adb_read(fd_.get(), &read_buffer_[read_end_], read_buffer_.size() - read_end_);
+        if (r == -1) {
+            return false;
+        } else if (r == 0) {
+            errno = 0;
+            return false;
+        }
+        read_end_ += r;
+    }
+    memcpy(p, read_buffer_.data(), len);
+    read_begin_ = len;
     return true;
 }
 
 bool FdConnection::Read(apacket* packet) {
-    if (!ReadFdExactly(fd_.get(), &packet->msg, sizeof(amessage))) {
+    if (!ReadBuffered(&packet->msg, sizeof(amessage))) {
         D("remote local: read terminated (message)");
         return false;
     }
@@ -381,29 +496,53 @@ bool FdConnection::Read(apacket* packet) {
         return false;
     }
 
-    packet->payload.resize(packet->msg.data_length);
+    if (packet->msg.data_length == 0) {
+        return true;
+    }
 
-    if (!ReadFdExactly(fd_.get(), &packet->payload[0], packet->payload.size())) {
+    Block payload(packet->msg.data_length);
+    if (!ReadBuffered(payload.data(), payload.size())) {
         D("remote local: terminated (data)");
         return false;
     }
 
+    packet->payload = IOVector(std::move(payload));
     return true;
 }
 
+void FdConnection::AppendIovecs(apacket* packet) {
+    adb_iovec header;
+    header.iov_base = &packet->msg;
+    header.iov_len = sizeof(packet->msg);
+    write_iovecs_.push_back(header);
+
+    packet->payload.iterate_blocks([this](const char* data, size_t len) {
+        adb_iovec iov;
+        iov.iov_base = const_cast<char*>(data);
+        iov.iov_len = len;
+        write_iovecs_.push_back(iov);
+    });
+}
+
 bool FdConnection::Write(apacket* packet) {
-    if (!WriteFdExactly(fd_.get(), &packet->msg, sizeof(packet->msg))) {
+    write_iovecs_.clear();
+    AppendIovecs(packet);
+    if (!WriteFdExactly(fd_.get(), write_iovecs_.data(), write_iovecs_.size())) {
         D("remote local: write terminated");
         return false;
     }
+    return true;
+}
 
-    if (packet->msg.data_length) {
-        if (!WriteFdExactly(fd_.get(), &packet->payload[0], packet->msg.data_length)) {
-            D("remote local: write terminated");
-            return false;
-        }
+bool FdConnection::WriteBatch(const std::deque<std::unique_ptr<apacket>>& packets) {
+    write_iovecs_.clear();
+    for (const auto& packet : packets) {
+        AppendIovecs(packet.get());
+    }
+    if (!WriteFdExactly(fd_.get(), write_iovecs_.data(), write_iovecs_.size())) {
+        D("remote local: write terminated");
+        return false;
     }
-
     return true;
 }
 
@@ -444,7 +583,8 @@ static std::string dump_packet(const char* name, const char* func, apacket* p) {
 
     std::string result = android::base::StringPrintf("%s: %s: [%s] arg0=%s arg1=%s (len=%d) ", name,
                                                      func, cmd, arg0, arg1, len);
-    result += dump_hex(p->payload.data(), p->payload.size());
+    result += p->payload.coalesced(
+            [](const char* data, size_t len) { return dump_hex(data, len); });
     return result;
 }
 
@@ -475,7 +615,7 @@ void kick_transport(atransport* t) {
     // check if the transport is in transport_list first.
     //
     // TODO(jmgao): WTF? Is this actually true?
-    if (std::find(transport_list.begin(), transport_list.end(), t) != transport_list.end()) {
+    if (transport_index.Contains(t)) {
         t->Kick();
     }
 
@@ -484,6 +624,11 @@ void kick_transport(atransport* t) {
 #endif
 }
 
+void reindex_transport(atransport* t) {
+    std::lock_guard<std::recursive_mutex> lock(transport_lock);
+    transport_index.Update(t);
+}
+
 static int transport_registration_send = -1;
 static int transport_registration_recv = -1;
 static fdevent* transport_registration_fde;
@@ -542,13 +687,12 @@ static int device_tracker_enqueue(asocket* socket, apacket::payload_type) {
 static int device_tracker_send(device_tracker* tracker, const std::string& string) {
     asocket* peer = tracker->socket.peer;
 
-    apacket::payload_type data;
-    data.resize(4 + string.size());
+    Block data(4 + string.size());
     char buf[5];
     snprintf(buf, sizeof(buf), "%04x", static_cast<int>(string.size()));
     memcpy(&data[0], buf, 4);
     memcpy(&data[4], string.data(), string.size());
-    return peer->enqueue(peer, std::move(data));
+    return peer->enqueue(peer, IOVector(std::move(data)));
 }
 
 static void device_tracker_ready(asocket* socket) {
@@ -683,21 +827,34 @@ static void transport_registration_func(int _fd, unsigned ev, void*) {
         {
             std::lock_guard<std::recursive_mutex> lock(transport_lock);
             transport_list.remove(t);
+            transport_index.Remove(t);
         }
 
-        delete t;
+        if (t->loop() == fdevent_main_context()) {
+            delete t;
+        } else {
+            // Let the transport's loop get through whatever it still has queued up for it first.
+            t->RunOnLoop([t]() { fdevent_run_on_main_thread([t]() { delete t; }); });
+        }
 
         update_transports();
         return;
     }
 
+    // A transport that's reconnecting stays where it was.
+    if (!transport_loops.empty() && t->loop() == fdevent_main_context()) {
+        t->SetLoop(transport_loops[next_transport_loop++ % transport_loops.size()]);
+    }
+
     /* don't create transport threads for inaccessible devices */
     if (t->GetConnectionState() != kCsNoPerm) {
         // The connection gets a reference to the atransport. It will release it
         // upon a read/write error.
         t->ref_count++;
         t->connection()->SetTransportName(t->serial_name());
-        t->connection()->SetReadCallback([t](Connection*, std::unique_ptr<apacket> p) {
+        // How many packets have been sent to the main loop and not yet dealt with there.
+        auto on_main = std::make_shared<std::atomic<size_t>>(0);
+        t->connection()->SetReadCallback([t, on_main](Connection*, std::unique_ptr<apacket> p) {
             if (!check_header(p.get(), t)) {
                 D("%s: remote read: bad header", t->serial.c_str());
                 return false;
@@ -706,10 +863,39 @@ static void transport_registration_func(int _fd, unsigned ev, void*) {
             VLOG(TRANSPORT) << dump_packet(t->serial.c_str(), "from remote", p.get());
             apacket* packet = p.release();
 
-            // TODO: Does this need to run on the main thread?
-            fdevent_run_on_main_thread([packet, t]() { handle_packet(packet, t); });
+            // Packets for sockets go to the loop that owns them. The rest change the state of the
+            // transport itself, which is the main loop's business.
+            bool for_socket = false;
+            switch (packet->msg.command) {
+                case A_OPEN:
+                case A_OKAY:
+                case A_WRTE:
+                case A_CLSE:
+                    for_socket = true;
+                    break;
+            }
+            if (for_socket && *on_main == 0) {
+                fdevent_run_on(t->loop(), [packet, t]() { handle_packet(packet, t); });
+                return true;
+            }
+
+            // But not before what came ahead of them (an OPEN right after the CNXN mustn't find
+            // the transport still offline), so they go by way of the main loop until it's caught
+            // up.
+            ++*on_main;
+            fdevent_run_on_main_thread([packet, t, on_main, for_socket]() {
+                if (for_socket) {
+                    t->RunOnLoop([packet, t]() { handle_packet(packet, t); });
+                } else {
+                    handle_packet(packet, t);
+                }
+                --*on_main;
+            });
             return true;
         });
+        t->connection()->SetWritableCallback([t](Connection*) {
+            fdevent_run_on(t->loop(), [t]() { resume_blocked_sockets(t); });
+        });
         t->connection()->SetErrorCallback([t](Connection*, const std::string& error) {
             D("%s: connection terminated: %s", t->serial.c_str(), error.c_str());
             fdevent_run_on_main_thread([t]() {
@@ -730,12 +916,22 @@ static void transport_registration_func(int _fd, unsigned ev, void*) {
         if (it != pending_list.end()) {
             pending_list.remove(t);
             transport_list.push_front(t);
+            transport_index.Add(t);
         }
     }
 
     update_transports();
 }
 
+void init_transport_loops(size_t count) {
+    check_main_thread();
+    CHECK(transport_loops.empty());
+    for (size_t i = 0; i < count; ++i) {
+        transport_loops.push_back(
+                fdevent_start_loop_thread(android::base::StringPrintf("adb loop %zu", i)));
+    }
+}
+
 #if ADB_HOST
 void init_reconnect_handler(void) {
     reconnect_handler.Start();
@@ -858,57 +1054,45 @@ atransport* acquire_one_transport(TransportType type, const char* serial, Transp
         *error_out = "no devices found";
     }
 
-    std::unique_lock<std::recursive_mutex> lock(transport_lock);
-    for (const auto& t : transport_list) {
+    // Transports without permissions are never picked, but if nothing is, they may be why.
+    bool no_perm = false;
+    auto usable = [&no_perm](const atransport* t) {
         if (t->GetConnectionState() == kCsNoPerm) {
-            *error_out = UsbNoPermissionsLongHelpText();
-            continue;
+            no_perm = true;
+            return false;
         }
+        return true;
+    };
 
-        if (transport_id) {
-            if (t->id == transport_id) {
-                result = t;
-                break;
-            }
-        } else if (serial) {
-            if (t->MatchesTarget(serial)) {
-                if (result) {
-                    *error_out = "more than one device";
-                    if (is_ambiguous) *is_ambiguous = true;
-                    result = nullptr;
-                    break;
-                }
-                result = t;
-            }
-        } else {
-            if (type == kTransportUsb && t->type == kTransportUsb) {
-                if (result) {
-                    *error_out = "more than one device";
-                    if (is_ambiguous) *is_ambiguous = true;
-                    result = nullptr;
-                    break;
-                }
-                result = t;
-            } else if (type == kTransportLocal && t->type == kTransportLocal) {
-                if (result) {
-                    *error_out = "more than one emulator";
-                    if (is_ambiguous) *is_ambiguous = true;
-                    result = nullptr;
-                    break;
-                }
-                result = t;
-            } else if (type == kTransportAny) {
-                if (result) {
-                    *error_out = "more than one device/emulator";
-                    if (is_ambiguous) *is_ambiguous = true;
-                    result = nullptr;
-                    break;
-                }
-                result = t;
-            }
+    std::vector<atransport*> candidates;
+    const char* ambiguous_error = "more than one device";
+    if (transport_id) {
+        if (atransport* t = transport_index.FindById(transport_id, usable)) {
+            candidates.push_back(t);
+        }
+    } else if (serial) {
+        candidates = transport_index.FindByTarget(serial, usable);
+    } else if (type == kTransportUsb || type == kTransportLocal || type == kTransportAny) {
+        candidates = transport_index.FindByType(type, usable);
+        if (type == kTransportLocal) {
+            ambiguous_error = "more than one emulator";
+        } else if (type == kTransportAny) {
+            ambiguous_error = "more than one device/emulator";
+        }
+    }
+
+    if (candidates.size() > 1) {
+        *error_out = ambiguous_error;
+        if (is_ambiguous) *is_ambiguous = true;
+    } else if (candidates.size() == 1) {
+        result = candidates.front();
+    } else {
+        // Looks for any transport without permissions, not just ones that would have matched.
+        transport_index.FindByType(kTransportAny, usable);
+        if (no_perm) {
+            *error_out = UsbNoPermissionsLongHelpText();
         }
     }
-    lock.unlock();
 
     if (result && !accept_any_state) {
         // The caller requires an active transport.
@@ -982,6 +1166,15 @@ int atransport::Write(apacket* p) {
     return this->connection()->Write(std::unique_ptr<apacket>(p)) ? 0 : -1;
 }
 
+void atransport::RunOnLoop(std::function<void()> fn) {
+    check_main_thread();
+    if (loop_ == fdevent_main_context()) {
+        fn();
+    } else {
+        fdevent_run_on(loop_, std::move(fn));
+    }
+}
+
 void atransport::Kick() {
     if (!kicked_.exchange(true)) {
         D("kicking transport %p %s", this, this->serial.c_str());
@@ -1047,7 +1240,9 @@ size_t atransport::get_max_payload() const {
 const FeatureSet& supported_features() {
     // Local static allocation to avoid global non-POD variables.
     static const FeatureSet* features = new FeatureSet{
-        kFeatureShell2, kFeatureCmd, kFeatureStat2,
+        kFeatureShell2, kFeatureCmd, kFeatureStat2, kFeatureSyncPipeline,
+        kFeatureSyncChunkSize, kFeatureDelayedAck, kFeatureSyncDelta,
+        kFeatureSyncListTree, kFeatureSyncLstatBatch, kFeatureSyncCompress,
         // Increment ADB_SERVER_VERSION whenever the feature list changes to
         // make sure that the adb client and server features stay in sync
         // (http://b/24370690).
@@ -1073,12 +1268,17 @@ bool CanUseFeature(const FeatureSet& feature_set, const std::string& feature) {
     return feature_set.count(feature) > 0 && supported_features().count(feature) > 0;
 }
 
+FeatureSet atransport::features() const {
+    return *std::atomic_load(&features_);
+}
+
 bool atransport::has_feature(const std::string& feature) const {
-    return features_.count(feature) > 0;
+    return std::atomic_load(&features_)->count(feature) > 0;
 }
 
 void atransport::SetFeatures(const std::string& features_string) {
-    features_ = StringToFeatureSet(features_string);
+    std::atomic_store(&features_,
+                      std::make_shared<const FeatureSet>(StringToFeatureSet(features_string)));
 }
 
 void atransport::AddDisconnect(adisconnect* disconnect) {
@@ -1131,6 +1331,181 @@ bool atransport::MatchesTarget(const std::string& target) const {
            qual_match(target, "device:", device, false);
 }
 
+static std::string sanitize_qual(std::string qual) {
+    for (char& ch : qual) {
+        if (!isalnum(ch)) ch = '_';
+    }
+    return qual;
+}
+
+TransportIndex::Keys TransportIndex::KeysFor(const atransport* t) {
+    Keys keys;
+    keys.id = t->id;
+    keys.type = t->type;
+    keys.serial = t->serial;
+
+    // What MatchesTarget() compares against for the non-serial targets. As in qual_match(), an
+    // empty qualifier is only matched by an empty target.
+    keys.names.push_back(t->devpath);
+    keys.names.push_back(t->product.empty() ? "" : "product:" + t->product);
+    keys.names.push_back(t->model.empty() ? "" : "model:" + sanitize_qual(t->model));
+    keys.names.push_back(t->device.empty() ? "" : "device:" + t->device);
+    std::sort(keys.names.begin(), keys.names.end());
+    keys.names.erase(std::unique(keys.names.begin(), keys.names.end()), keys.names.end());
+
+    if (t->type == kTransportLocal && !t->serial.empty()) {
+        std::string error;
+        if (!android::base::ParseNetAddress(t->serial, &keys.host, &keys.port, nullptr, &error)) {
+            keys.host.clear();
+        }
+    }
+    return keys;
+}
+
+void TransportIndex::AddLocked(atransport* t) {
+    Keys keys = KeysFor(t);
+    ids_[keys.id] = t;
+    serials_.emplace(keys.serial, t);
+    for (const std::string& name : keys.names) {
+        names_.emplace(name, t);
+    }
+    if (!keys.host.empty()) {
+        hosts_.emplace(keys.host, t);
+    }
+    transports_[t] = std::move(keys);
+}
+
+void TransportIndex::RemoveLocked(atransport* t) {
+    auto it = transports_.find(t);
+    if (it == transports_.end()) {
+        return;
+    }
+
+    auto erase = [t](std::unordered_multimap<std::string, atransport*>& map,
+                     const std::string& key) {
+        auto range = map.equal_range(key);
+        for (auto entry = range.first; entry != range.second; ++entry) {
+            if (entry->second == t) {
+                map.erase(entry);
+                return;
+            }
+        }
+    };
+
+    const Keys& keys = it->second;
+    auto id = ids_.find(keys.id);
+    if (id != ids_.end() && id->second == t) {
+        ids_.erase(id);
+    }
+    erase(serials_, keys.serial);
+    for (const std::string& name : keys.names) {
+        erase(names_, name);
+    }
+    if (!keys.host.empty()) {
+        erase(hosts_, keys.host);
+    }
+    transports_.erase(it);
+}
+
+void TransportIndex::Add(atransport* t) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    RemoveLocked(t);
+    AddLocked(t);
+}
+
+void TransportIndex::Remove(atransport* t) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    RemoveLocked(t);
+}
+
+void TransportIndex::Update(atransport* t) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (transports_.count(t)) {
+        RemoveLocked(t);
+        AddLocked(t);
+    }
+}
+
+bool TransportIndex::Contains(atransport* t) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return transports_.count(t) != 0;
+}
+
+size_t TransportIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return transports_.size();
+}
+
+atransport* TransportIndex::FindById(TransportId id, const Filter& filter) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = ids_.find(id);
+    if (it == ids_.end() || (filter && !filter(it->second))) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+std::vector<atransport*> TransportIndex::FindBySerial(const std::string& serial,
+                                                      const Filter& filter) const {
+    std::vector<atransport*> result;
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto range = serials_.equal_range(serial);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (!filter || filter(it->second)) result.push_back(it->second);
+    }
+    return result;
+}
+
+std::vector<atransport*> TransportIndex::FindByTarget(const std::string& target,
+                                                      const Filter& filter) const {
+    std::vector<atransport*> result;
+    auto add = [&result, &filter](atransport* t) {
+        if (std::find(result.begin(), result.end(), t) == result.end() &&
+            (!filter || filter(t))) {
+            result.push_back(t);
+        }
+    };
+
+    // Parse the target as a network address up front, so as not to hold the lock for it.
+    std::string host, error;
+    int port = -1;
+    const char* local_target = target.c_str();
+    if (android::base::StartsWith(target, "tcp:") || android::base::StartsWith(target, "udp:")) {
+        local_target += 4;
+    }
+    if (!android::base::ParseNetAddress(local_target, &host, &port, nullptr, &error)) {
+        host.clear();
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (!target.empty()) {
+        auto range = serials_.equal_range(target);
+        for (auto it = range.first; it != range.second; ++it) add(it->second);
+    }
+    auto range = names_.equal_range(target);
+    for (auto it = range.first; it != range.second; ++it) add(it->second);
+    if (!host.empty()) {
+        // The target may omit the port to default to the transport's.
+        auto range = hosts_.equal_range(host);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (port == -1 || port == transports_.at(it->second).port) add(it->second);
+        }
+    }
+    return result;
+}
+
+std::vector<atransport*> TransportIndex::FindByType(TransportType type,
+                                                    const Filter& filter) const {
+    std::vector<atransport*> result;
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    for (const auto& it : transports_) {
+        if ((type == kTransportAny || it.second.type == type) && (!filter || filter(it.first))) {
+            result.push_back(it.first);
+        }
+    }
+    return result;
+}
+
 void atransport::SetConnectionEstablished(bool success) {
     connection_waitable_->SetConnectionEstablished(success);
 }
@@ -1243,14 +1618,12 @@ bool register_socket_transport(unique_fd s, std::string serial, int port, int lo
         }
     }
 
-    for (const auto& transport : transport_list) {
-        if (serial == transport->serial) {
-            VLOG(TRANSPORT) << "socket transport " << transport->serial
-                            << " is already in transport_list and fails to register";
-            delete t;
-            if (error) *error = EALREADY;
-            return false;
-        }
+    if (!transport_index.FindBySerial(serial).empty()) {
+        VLOG(TRANSPORT) << "socket transport " << serial
+                        << " is already in transport_list and fails to register";
+        delete t;
+        if (error) *error = EALREADY;
+        return false;
     }
 
     t->serial = std::move(serial);
@@ -1281,17 +1654,8 @@ bool register_socket_transport(unique_fd s, std::string serial, int port, int lo
 
 #if ADB_HOST
 atransport* find_transport(const char* serial) {
-    atransport* result = nullptr;
-
-    std::lock_guard<std::recursive_mutex> lock(transport_lock);
-    for (auto& t : transport_list) {
-        if (strcmp(serial, t->serial.c_str()) == 0) {
-            result = t;
-            break;
-        }
-    }
-
-    return result;
+    std::vector<atransport*> found = transport_index.FindBySerial(serial);
+    return found.empty() ? nullptr : found.front();
 }
 
 void kick_all_tcp_devices() {
@@ -1340,7 +1704,10 @@ void unregister_usb_transport(usb_handle* usb) {
     transport_list.remove_if([usb](atransport* t) {
         auto connection = t->connection();
         if (auto usb_connection = dynamic_cast<UsbConnection*>(connection.get())) {
-            return usb_connection->handle_ == usb && t->GetConnectionState() == kCsNoPerm;
+            if (usb_connection->handle_ == usb && t->GetConnectionState() == kCsNoPerm) {
+                transport_index.Remove(t);
+                return true;
+            }
         }
         return false;
     });
@@ -27,9 +27,12 @@
 #include <list>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <android-base/macros.h>
 #include <android-base/thread_annotations.h>
@@ -37,6 +40,8 @@
 
 #include "adb.h"
 #include "adb_unique_fd.h"
+#include "fdevent.h"
+#include "packet_scheduler.h"
 
 typedef std::unordered_set<std::string> FeatureSet;
 
@@ -59,9 +64,26 @@ extern const char* const kFeatureStat2;
 extern const char* const kFeatureLibusb;
 // The server supports `push --sync`.
 extern const char* const kFeaturePushSync;
+// The sync service keeps going after a per-file failure, so several files can be in flight.
+extern const char* const kFeatureSyncPipeline;
+// The sync service takes a chunk_size option, for DATA chunks larger than SYNC_DATA_MAX.
+extern const char* const kFeatureSyncChunkSize;
+// Streams may have several WRITEs in flight, up to a window that READY messages replenish.
+extern const char* const kFeatureDelayedAck;
+// The sync service can send block signatures of a file, and rebuild it from a delta against them.
+extern const char* const kFeatureSyncDelta;
+// The sync service can list a whole directory tree, with stat_v2-style entries, in one request.
+extern const char* const kFeatureSyncListTree;
+// The sync service can lstat a list of paths in one request.
+extern const char* const kFeatureSyncLstatBatch;
+// The sync service takes a compress option, to send and accept file data compressed.
+extern const char* const kFeatureSyncCompress;
 
 TransportId NextTransportId();
 
+// DEFAULT_TRANSPORT_MAX_QUEUED_BYTES, unless ADB_TRANSPORT_MAX_QUEUED_BYTES says otherwise.
+size_t get_transport_max_queued_bytes();
+
 // Abstraction for a non-blocking packet transport.
 struct Connection {
     Connection() = default;
@@ -84,14 +106,30 @@ struct Connection {
         error_callback_ = callback;
     }
 
+    // Called, on whatever thread the connection writes from, when WriteQueueFull() goes back to
+    // false.
+    using WritableCallback = std::function<void(Connection*)>;
+    void SetWritableCallback(WritableCallback callback) {
+        CHECK(!writable_callback_);
+        writable_callback_ = callback;
+    }
+
     virtual bool Write(std::unique_ptr<apacket> packet) = 0;
 
+    // Whether the packets waiting to be written have hit the connection's limit. Writes still
+    // succeed, but whoever is making them should hold off until the writable callback.
+    virtual bool WriteQueueFull() { return false; }
+
     virtual void Start() = 0;
     virtual void Stop() = 0;
 
+    // How long packets have waited to be written, for connections that queue them up.
+    virtual bool GetWriteQueueStats(PacketQueueStats*) { return false; }
+
     std::string transport_name_;
     ReadCallback read_callback_;
     ErrorCallback error_callback_;
+    WritableCallback writable_callback_;
 
     static std::unique_ptr<Connection> FromFd(unique_fd fd);
 };
@@ -110,6 +148,10 @@ struct BlockingConnection {
     virtual bool Read(apacket* packet) = 0;
     virtual bool Write(apacket* packet) = 0;
 
+    // Write several packets, in order. The default writes them one at a time: connections that can
+    // send them with fewer syscalls than that should override this.
+    virtual bool WriteBatch(const std::deque<std::unique_ptr<apacket>>& packets);
+
     // Terminate a connection.
     // This method must be thread-safe, and must cause concurrent Reads/Writes to terminate.
     // Formerly known as 'Kick' in atransport.
@@ -117,15 +159,19 @@ struct BlockingConnection {
 };
 
 struct BlockingConnectionAdapter : public Connection {
-    explicit BlockingConnectionAdapter(std::unique_ptr<BlockingConnection> connection);
+    explicit BlockingConnectionAdapter(std::unique_ptr<BlockingConnection> connection,
+                                       size_t max_queued_bytes = get_transport_max_queued_bytes());
 
     virtual ~BlockingConnectionAdapter();
 
     virtual bool Write(std::unique_ptr<apacket> packet) override final;
+    virtual bool WriteQueueFull() override final { return write_queue_full_; }
 
     virtual void Start() override final;
     virtual void Stop() override final;
 
+    virtual bool GetWriteQueueStats(PacketQueueStats* stats) override final;
+
     bool started_ GUARDED_BY(mutex_) = false;
     bool stopped_ GUARDED_BY(mutex_) = false;
 
@@ -133,7 +179,10 @@ struct BlockingConnectionAdapter : public Connection {
     std::thread read_thread_ GUARDED_BY(mutex_);
     std::thread write_thread_ GUARDED_BY(mutex_);
 
-    std::deque<std::unique_ptr<apacket>> write_queue_ GUARDED_BY(mutex_);
+    PacketScheduler write_queue_ GUARDED_BY(mutex_);
+    // Full from when write_queue_ reaches max_queued_bytes_ until it's down to half that.
+    const size_t max_queued_bytes_;
+    std::atomic<bool> write_queue_full_{false};
     std::mutex mutex_;
     std::condition_variable cv_;
 
@@ -145,11 +194,26 @@ struct FdConnection : public BlockingConnection {
 
     bool Read(apacket* packet) override final;
     bool Write(apacket* packet) override final;
+    bool WriteBatch(const std::deque<std::unique_ptr<apacket>>& packets) override final;
 
     void Close() override;
 
   private:
+    // Reads exactly |len| bytes, starting with whatever earlier reads left in read_buffer_.
+    bool ReadBuffered(void* buf, size_t len);
+
+    // Appends the header and payload of |packet| to write_iovecs_.
+    void AppendIovecs(apacket* packet);
+
     unique_fd fd_;
+
+    // Small packets are read together, as many as arrive at once. Only the read thread uses these.
+    std::vector<char> read_buffer_;
+    size_t read_begin_ = 0;
+    size_t read_end_ = 0;
+
+    // Only the write thread uses this.
+    std::vector<adb_iovec> write_iovecs_;
 };
 
 struct UsbConnection : public BlockingConnection {
@@ -225,6 +289,7 @@ class atransport {
     virtual ~atransport();
 
     int Write(apacket* p);
+    bool WriteQueueFull() { return this->connection()->WriteQueueFull(); }
     void Kick();
     bool kicked() const { return kicked_; }
 
@@ -240,7 +305,8 @@ class atransport {
 
     const TransportId id;
     size_t ref_count = 0;
-    bool online = false;
+    // Written on the main thread, and read on the transport's loop too.
+    std::atomic<bool> online{false};
     TransportType type = kTransportAny;
 
     // Used to identify transports for clients.
@@ -266,10 +332,9 @@ class atransport {
     int get_protocol_version() const;
     size_t get_max_payload() const;
 
-    const FeatureSet& features() const {
-        return features_;
-    }
+    FeatureSet features() const;
 
+    // Safe to call from the transport's loop.
     bool has_feature(const std::string& feature) const;
 
     // Loads the transport's feature set from the given string.
@@ -304,12 +369,24 @@ class atransport {
     // Attempts to reconnect with the underlying Connection.
     ReconnectResult Reconnect();
 
+    // The event loop that owns this transport's sockets, and handles the packets for them. The
+    // main loop owns everything else about the transport, and unless the server was started with
+    // more loops (see init_transport_loops), the two are one and the same.
+    fdevent_context* loop() const { return loop_; }
+    void SetLoop(fdevent_context* loop) { loop_ = loop; }
+
+    // Runs |fn| on the transport's loop, right away if that's the main loop. Must be called on the
+    // main thread, which is what keeps what it queues for the loop in order.
+    void RunOnLoop(std::function<void()> fn);
+
   private:
     std::atomic<bool> kicked_;
 
     // A set of features transmitted in the banner with the initial connection.
     // This is stored in the banner as 'features=feature0,feature1,etc'.
-    FeatureSet features_;
+    // It's replaced rather than changed, with std::atomic_store, since the transport's loop reads
+    // it while the main thread sets it.
+    std::shared_ptr<const FeatureSet> features_ = std::make_shared<const FeatureSet>();
     int protocol_version;
     size_t max_payload;
 
@@ -331,11 +408,76 @@ class atransport {
     // A callback that will be invoked when the atransport needs to reconnect.
     ReconnectCallback reconnect_;
 
+    fdevent_context* loop_ = fdevent_main_context();
+
     std::mutex mutex_;
 
     DISALLOW_COPY_AND_ASSIGN(atransport);
 };
 
+// The registered transports, indexed by everything a client can pick one out by: transport id,
+// serial, and the other targets atransport::MatchesTarget() accepts. Lookups only take a shared
+// lock, so that a busy server's clients don't queue up behind each other, or behind the main
+// thread registering devices, to find theirs.
+//
+// The index doesn't own its transports. Whatever |filter| the lookups are given runs with the lock
+// held, and so before anything it's looking at can be removed from the index and deleted; callers
+// are on their own after that.
+class TransportIndex {
+  public:
+    using Filter = std::function<bool(const atransport*)>;
+
+    TransportIndex() = default;
+
+    void Add(atransport* t);
+    void Remove(atransport* t);
+
+    // Call after changing the product, model or device of |t|, to find it by the new ones.
+    void Update(atransport* t);
+
+    bool Contains(atransport* t) const;
+    size_t size() const;
+
+    atransport* FindById(TransportId id, const Filter& filter = nullptr) const;
+    std::vector<atransport*> FindBySerial(const std::string& serial,
+                                          const Filter& filter = nullptr) const;
+
+    // Everything |t->MatchesTarget(target)| is true for.
+    std::vector<atransport*> FindByTarget(const std::string& target,
+                                          const Filter& filter = nullptr) const;
+
+    // Everything of the given type, or everything at all for kTransportAny.
+    std::vector<atransport*> FindByType(TransportType type, const Filter& filter = nullptr) const;
+
+  private:
+    // What a transport was indexed under, so that it can be taken out again after they've changed.
+    struct Keys {
+        TransportId id;
+        TransportType type;
+        std::string serial;
+        std::vector<std::string> names;
+        std::string host;
+        int port = -1;
+    };
+
+    static Keys KeysFor(const atransport* t);
+    void AddLocked(atransport* t) REQUIRES(mutex_);
+    void RemoveLocked(atransport* t) REQUIRES(mutex_);
+
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<atransport*, Keys> transports_ GUARDED_BY(mutex_);
+    std::unordered_map<TransportId, atransport*> ids_ GUARDED_BY(mutex_);
+    std::unordered_multimap<std::string, atransport*> serials_ GUARDED_BY(mutex_);
+
+    // devpath and the product:, model: and device: qualifiers.
+    std::unordered_multimap<std::string, atransport*> names_ GUARDED_BY(mutex_);
+
+    // The host part of local transports' serials, for [tcp:|udp:]<hostname>[:port] targets.
+    std::unordered_multimap<std::string, atransport*> hosts_ GUARDED_BY(mutex_);
+
+    DISALLOW_COPY_AND_ASSIGN(TransportIndex);
+};
+
 /*
  * Obtain a transport from the available transports.
  * If serial is non-null then only the device with that serial will be chosen.
@@ -350,12 +492,20 @@ atransport* acquire_one_transport(TransportType type, const char* serial, Transp
 void kick_transport(atransport* t);
 void update_transports(void);
 
+// Lets acquire_one_transport() find |t| by its product, model and device, once they're known.
+void reindex_transport(atransport* t);
+
 // Iterates across all of the current and pending transports.
 // Stops iteration and returns false if fn returns false, otherwise returns true.
 bool iterate_transports(std::function<bool(const atransport*)> fn);
 
 void init_reconnect_handler(void);
 void init_transport_registration(void);
+
+// Starts |count| event loops to share out transports' sockets between, so that the server isn't
+// limited to one core however many devices it's serving. Must be called before any transports are
+// registered. With no extra loops, everything happens on the main loop.
+void init_transport_loops(size_t count);
 void init_mdns_transport_discovery(void);
 std::string list_transports(bool long_listing);
 atransport* find_transport(const char* serial);
@@ -17,7 +17,12 @@
 #include <malloc.h>
 #include <stdio.h>
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
 #include <benchmark/benchmark.h>
 
 #include "adb_trace.h"
@@ -51,6 +56,13 @@ std::unique_ptr<Connection> MakeConnection<NonblockingFdConnection>(unique_fd fd
     return Connection::FromFd(std::move(fd));
 }
 
+// Report how many of the payload buffers allocated since |before| came out of the block pool.
+static void ReportBlockPoolStats(benchmark::State& state, const PoolStats& before) {
+    PoolStats after = block_pool_stats();
+    state.counters["pool_hits"] = after.hits - before.hits;
+    state.counters["pool_misses"] = after.misses - before.misses;
+}
+
 template <typename ConnectionType>
 void BM_Connection_Unidirectional(benchmark::State& state) {
     int fds[2];
@@ -77,15 +89,16 @@ void BM_Connection_Unidirectional(benchmark::State& state) {
     client->Start();
     server->Start();
 
+    PoolStats pool_stats = block_pool_stats();
     for (auto _ : state) {
         size_t data_size = state.range(0);
         std::unique_ptr<apacket> packet = std::make_unique<apacket>();
         memset(&packet->msg, 0, sizeof(packet->msg));
         packet->msg.command = A_WRTE;
         packet->msg.data_length = data_size;
-        packet->payload.resize(data_size);
-
-        memset(&packet->payload[0], 0xff, data_size);
+        Block payload(data_size);
+        memset(payload.data(), 0xff, data_size);
+        packet->payload = IOVector(std::move(payload));
 
         received_bytes = 0;
         client->Write(std::move(packet));
@@ -94,6 +107,7 @@ void BM_Connection_Unidirectional(benchmark::State& state) {
         }
     }
     state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    ReportBlockPoolStats(state, pool_stats);
 
     client->Stop();
     server->Stop();
@@ -106,6 +120,24 @@ enum class ThreadPolicy {
     SameThread,
 };
 
+// Echo takes (payload size, packets in flight): with many in flight, MainThread measures how fast
+// packets get handed over to the main thread, rather than the round trip.
+#define ADB_ECHO_BENCHMARK(policy)                                                             \
+    BENCHMARK_TEMPLATE(BM_Connection_Echo, FdConnection, policy)                               \
+        ->Args({1, 1})                                                                         \
+        ->Args({16384, 1})                                                                     \
+        ->Args({MAX_PAYLOAD, 1})                                                               \
+        ->Args({1, 256})                                                                       \
+        ->Args({16384, 256})                                                                   \
+        ->UseRealTime();                                                                       \
+    BENCHMARK_TEMPLATE(BM_Connection_Echo, NonblockingFdConnection, policy)                    \
+        ->Args({1, 1})                                                                         \
+        ->Args({16384, 1})                                                                     \
+        ->Args({MAX_PAYLOAD, 1})                                                               \
+        ->Args({1, 256})                                                                       \
+        ->Args({16384, 256})                                                                   \
+        ->UseRealTime()
+
 template <typename ConnectionType, enum ThreadPolicy Policy>
 void BM_Connection_Echo(benchmark::State& state) {
     int fds[2];
@@ -151,23 +183,28 @@ void BM_Connection_Echo(benchmark::State& state) {
     client->Start();
     server->Start();
 
+    PoolStats pool_stats = block_pool_stats();
+    const size_t data_size = state.range(0);
+    const size_t packet_count = state.range(1);
     for (auto _ : state) {
-        size_t data_size = state.range(0);
-        std::unique_ptr<apacket> packet = std::make_unique<apacket>();
-        memset(&packet->msg, 0, sizeof(packet->msg));
-        packet->msg.command = A_WRTE;
-        packet->msg.data_length = data_size;
-        packet->payload.resize(data_size);
-
-        memset(&packet->payload[0], 0xff, data_size);
-
         received_bytes = 0;
-        client->Write(std::move(packet));
-        while (received_bytes < data_size) {
+        for (size_t i = 0; i < packet_count; ++i) {
+            std::unique_ptr<apacket> packet = std::make_unique<apacket>();
+            memset(&packet->msg, 0, sizeof(packet->msg));
+            packet->msg.command = A_WRTE;
+            packet->msg.data_length = data_size;
+            Block payload(data_size);
+            memset(payload.data(), 0xff, data_size);
+            packet->payload = IOVector(std::move(payload));
+            client->Write(std::move(packet));
+        }
+        while (received_bytes < data_size * packet_count) {
             continue;
         }
     }
-    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data_size * packet_count);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * packet_count);
+    ReportBlockPoolStats(state, pool_stats);
 
     client->Stop();
     server->Stop();
@@ -179,12 +216,73 @@ void BM_Connection_Echo(benchmark::State& state) {
     fdevent_thread.join();
 }
 
-ADB_CONNECTION_BENCHMARK(BM_Connection_Echo, ThreadPolicy::SameThread);
-ADB_CONNECTION_BENCHMARK(BM_Connection_Echo, ThreadPolicy::MainThread);
+ADB_ECHO_BENCHMARK(ThreadPolicy::SameThread);
+ADB_ECHO_BENCHMARK(ThreadPolicy::MainThread);
+
+static void BM_Block_Allocate(benchmark::State& state) {
+    PoolStats pool_stats = block_pool_stats();
+    for (auto _ : state) {
+        Block block(state.range(0));
+        benchmark::DoNotOptimize(block.data());
+    }
+    ReportBlockPoolStats(state, pool_stats);
+}
+BENCHMARK(BM_Block_Allocate)->Arg(1)->Arg(16384)->Arg(MAX_PAYLOAD);
+
+// What Block used to do for every payload: a zero-filled allocation straight from the heap.
+static void BM_Block_AllocateUnpooled(benchmark::State& state) {
+    for (auto _ : state) {
+        std::unique_ptr<char[]> data(new char[state.range(0)]());
+        benchmark::DoNotOptimize(data.get());
+    }
+}
+BENCHMARK(BM_Block_AllocateUnpooled)->Arg(1)->Arg(16384)->Arg(MAX_PAYLOAD);
+
+// |count| network devices, and the serial of one of them to look up.
+struct TransportLookupFixture {
+    explicit TransportLookupFixture(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            auto t = std::make_unique<atransport>();
+            t->type = kTransportLocal;
+            t->serial = android::base::StringPrintf("192.168.%zu.%zu:5555", i / 256, i % 256);
+            t->product = "product";
+            index.Add(t.get());
+            transports.push_back(std::move(t));
+        }
+        target = transports.back()->serial;
+    }
+
+    std::vector<std::unique_ptr<atransport>> transports;
+    TransportIndex index;
+    std::string target;
+};
+
+static void BM_Transport_FindIndexed(benchmark::State& state) {
+    TransportLookupFixture fixture(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fixture.index.FindByTarget(fixture.target));
+    }
+}
+BENCHMARK(BM_Transport_FindIndexed)->Arg(1)->Arg(16)->Arg(256);
+
+// What acquire_one_transport() used to do.
+static void BM_Transport_FindLinear(benchmark::State& state) {
+    TransportLookupFixture fixture(state.range(0));
+    for (auto _ : state) {
+        std::vector<atransport*> result;
+        for (const auto& t : fixture.transports) {
+            if (t->MatchesTarget(fixture.target)) result.push_back(t.get());
+        }
+        benchmark::DoNotOptimize(result);
+    }
+}
+BENCHMARK(BM_Transport_FindLinear)->Arg(1)->Arg(16)->Arg(256);
 
 int main(int argc, char** argv) {
+#if defined(M_DECAY_TIME)
     // Set M_DECAY_TIME so that our allocations aren't immediately purged on free.
     mallopt(M_DECAY_TIME, 1);
+#endif
 
     android::base::SetMinimumLogSeverity(android::base::WARNING);
     adb_trace_init(argv);
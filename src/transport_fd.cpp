@@ -84,6 +84,7 @@ struct NonblockingFdConnection : public Connection {
             if (pfds[0].revents) {
                 if ((pfds[0].revents & POLLOUT)) {
                     std::lock_guard<std::mutex> lock(this->write_mutex_);
+                    writable_ = true;
                     WriteResult result = DispatchWrites();
                     switch (result) {
                         case WriteResult::Error:
@@ -91,16 +92,15 @@ struct NonblockingFdConnection : public Connection {
                             return;
 
                         case WriteResult::Completed:
-                            writable_ = true;
                             break;
 
                         case WriteResult::TryAgain:
+                            writable_ = false;
                             break;
                     }
                 }
 
                 if (pfds[0].revents & POLLIN) {
-                    // TODO: Should we be getting blocks from a free list?
                     auto block = std::make_unique<IOVector::block_type>(MAX_PAYLOAD);
                     rc = adb_read(fd_.get(), &(*block)[0], block->size());
                     if (rc == -1) {
@@ -113,21 +113,23 @@ struct NonblockingFdConnection : public Connection {
                     block->resize(rc);
                     read_buffer_.append(std::move(block));
 
-                    if (!read_header_ && read_buffer_.size() >= sizeof(amessage)) {
-                        auto header_buf = read_buffer_.take_front(sizeof(amessage)).coalesce();
-                        CHECK_EQ(sizeof(amessage), header_buf.size());
-                        read_header_ = std::make_unique<amessage>();
-                        memcpy(read_header_.get(), header_buf.data(), sizeof(amessage));
-                    }
+                    // A single read can bring in any number of packets.
+                    while (true) {
+                        if (!read_header_ && read_buffer_.size() >= sizeof(amessage)) {
+                            auto header_buf = read_buffer_.take_front(sizeof(amessage)).coalesce();
+                            CHECK_EQ(sizeof(amessage), header_buf.size());
+                            read_header_ = std::make_unique<amessage>();
+                            memcpy(read_header_.get(), header_buf.data(), sizeof(amessage));
+                        }
 
-                    if (read_header_ && read_buffer_.size() >= read_header_->data_length) {
-                        auto data_chain = read_buffer_.take_front(read_header_->data_length);
+                        if (!read_header_ || read_buffer_.size() < read_header_->data_length) {
+                            break;
+                        }
 
-                        // TODO: Make apacket carry around a IOVector instead of coalescing.
-                        auto payload = data_chain.coalesce<apacket::payload_type>();
+                        auto data_chain = read_buffer_.take_front(read_header_->data_length);
                         auto packet = std::make_unique<apacket>();
                         packet->msg = *read_header_;
-                        packet->payload = std::move(payload);
+                        packet->payload = std::move(data_chain);
                         read_header_ = nullptr;
                         read_callback_(this, std::move(packet));
                     }
@@ -182,17 +184,18 @@ struct NonblockingFdConnection : public Connection {
             return WriteResult::TryAgain;
         }
 
-        auto iovs = write_buffer_.iovecs();
-        ssize_t rc = adb_writev(fd_.get(), iovs.data(), iovs.size());
-        if (rc == -1) {
+        write_buffer_.iovecs(&write_iovecs_, ADB_IOV_MAX);
+        ssize_t rc = adb_writev(fd_.get(), write_iovecs_.data(), write_iovecs_.size());
+        if (rc == -1 && errno == EAGAIN) {
+            return WriteResult::TryAgain;
+        } else if (rc == -1) {
             return WriteResult::Error;
         } else if (rc == 0) {
             errno = 0;
             return WriteResult::Error;
         }
 
-        // TODO: Implement a more efficient drop_front?
-        write_buffer_.take_front(rc);
+        write_buffer_.drop_front(rc);
         if (write_buffer_.empty()) {
             return WriteResult::Completed;
         }
@@ -207,10 +210,14 @@ struct NonblockingFdConnection : public Connection {
         const char* header_end = header_begin + sizeof(packet->msg);
         auto header_block = std::make_unique<IOVector::block_type>(header_begin, header_end);
         write_buffer_.append(std::move(header_block));
-        if (!packet->payload.empty()) {
-            write_buffer_.append(std::make_unique<IOVector::block_type>(std::move(packet->payload)));
+        write_buffer_.append(std::move(packet->payload));
+        WriteResult result = DispatchWrites();
+        if (result == WriteResult::TryAgain && writable_) {
+            // The socket is full: have the thread wait for POLLOUT to write the rest.
+            writable_ = false;
+            WakeThread();
         }
-        return DispatchWrites() != WriteResult::Error;
+        return result != WriteResult::Error;
     }
 
     std::thread thread_;
@@ -229,6 +236,7 @@ struct NonblockingFdConnection : public Connection {
     std::mutex write_mutex_;
     bool writable_ GUARDED_BY(write_mutex_) = true;
     IOVector write_buffer_ GUARDED_BY(write_mutex_);
+    std::vector<adb_iovec> write_iovecs_ GUARDED_BY(write_mutex_);
 
     IOVector incoming_queue_;
 };
@@ -24,8 +24,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
-#include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <unordered_map>
@@ -186,7 +189,7 @@ static void PollAllLocalPortsForEmulator() {
     }
 }
 
-// Retry the disconnected local port for 60 times, and sleep 1 second between two retries.
+// Retry the disconnected local port for 60 times, and wait 1 second between two retries.
 static constexpr uint32_t LOCAL_PORT_RETRY_COUNT = 60;
 static constexpr auto LOCAL_PORT_RETRY_INTERVAL = 1s;
 
@@ -195,31 +198,38 @@ struct RetryPort {
     uint32_t retry_count;
 };
 
-// Retry emulators just kicked.
+// Retry emulators just kicked. Only the main thread touches these.
 static std::vector<RetryPort>& retry_ports = *new std::vector<RetryPort>;
-std::mutex &retry_ports_lock = *new std::mutex;
-std::condition_variable &retry_ports_cond = *new std::condition_variable;
+static fdevent_timer* retry_ports_timer = nullptr;
 
-static void client_socket_thread(int) {
-    adb_thread_setname("client_socket_thread");
-    D("transport: client_socket_thread() starting");
-    PollAllLocalPortsForEmulator();
-    while (true) {
-        std::vector<RetryPort> ports;
-        // Collect retry ports.
-        {
-            std::unique_lock<std::mutex> lock(retry_ports_lock);
-            while (retry_ports.empty()) {
-                retry_ports_cond.wait(lock);
-            }
-            retry_ports.swap(ports);
-        }
-        // Sleep here instead of the end of loop, because if we immediately try to reconnect
-        // the emulator just kicked, the adbd on the emulator may not have time to remove the
-        // just kicked transport.
-        std::this_thread::sleep_for(LOCAL_PORT_RETRY_INTERVAL);
+static void retry_emulator_ports();
+
+static void queue_retry_ports(const std::vector<RetryPort>& ports) {
+    check_main_thread();
+    if (ports.empty()) {
+        return;
+    }
+    retry_ports.insert(retry_ports.end(), ports.begin(), ports.end());
+
+    if (!retry_ports_timer) {
+        retry_ports_timer = fdevent_create_timer(retry_emulator_ports);
+    }
+    // Wait instead of trying right away, because if we immediately try to reconnect the
+    // emulator just kicked, the adbd on the emulator may not have time to remove the just
+    // kicked transport.
+    if (!fdevent_timer_running(retry_ports_timer)) {
+        fdevent_timer_start(retry_ports_timer, LOCAL_PORT_RETRY_INTERVAL);
+    }
+}
 
-        // Try connecting retry ports.
+static void retry_emulator_ports() {
+    std::vector<RetryPort> ports;
+    ports.swap(retry_ports);
+
+    // Connecting can block, with $ADBHOST, so do that on a thread of its own that comes back
+    // with the ports that are still down.
+    std::thread([ports = std::move(ports)]() mutable {
+        adb_thread_setname("emulator retry");
         std::vector<RetryPort> next_ports;
         for (auto& port : ports) {
             VLOG(TRANSPORT) << "retry port " << port.port << ", last retry_count "
@@ -235,12 +245,15 @@ static void client_socket_thread(int) {
             }
         }
 
-        // Copy back left retry ports.
-        {
-            std::unique_lock<std::mutex> lock(retry_ports_lock);
-            retry_ports.insert(retry_ports.end(), next_ports.begin(), next_ports.end());
-        }
-    }
+        fdevent_run_on_main_thread(
+                [next_ports = std::move(next_ports)]() { queue_retry_ports(next_ports); });
+    }).detach();
+}
+
+static void client_socket_thread(int) {
+    adb_thread_setname("client_socket_thread");
+    D("transport: client_socket_thread() starting");
+    PollAllLocalPortsForEmulator();
 }
 
 #else // ADB_HOST
@@ -445,12 +458,8 @@ struct EmulatorConnection : public FdConnection {
 
     ~EmulatorConnection() {
         VLOG(TRANSPORT) << "remote_close, local_port = " << local_port_;
-        std::unique_lock<std::mutex> lock(retry_ports_lock);
-        RetryPort port;
-        port.port = local_port_;
-        port.retry_count = LOCAL_PORT_RETRY_COUNT;
-        retry_ports.push_back(port);
-        retry_ports_cond.notify_one();
+        RetryPort port{local_port_, LOCAL_PORT_RETRY_COUNT};
+        fdevent_run_on_main_thread([port]() { queue_retry_ports({port}); });
     }
 
     void Close() override {
@@ -491,6 +500,14 @@ int init_socket_transport(atransport* t, unique_fd fd, int adb_port, int local)
 
     t->type = kTransportLocal;
 
+#if defined(TCP_NOTSENT_LOWAT)
+    // Keep what the kernel has yet to send to a minimum, so that bulk data waits in the write
+    // queue instead, where the connection can still put more urgent packets in front of it.
+    int notsent_lowat = 128 * 1024;
+    adb_setsockopt(fd.get(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat,
+                   sizeof(notsent_lowat));
+#endif
+
 #if ADB_HOST
     // Emulator connection.
     if (local) {
@@ -16,6 +16,8 @@
 
 #include "transport.h"
 
+#include <algorithm>
+
 #include <gtest/gtest.h>
 
 #include "adb.h"
@@ -182,3 +184,83 @@ TEST(transport, test_matches_target_local) {
         EXPECT_FALSE(t.MatchesTarget("abc:100.100.100.100"));
     }
 }
+
+TEST(transport, index_matches_target) {
+    atransport usb;
+    usb.type = kTransportUsb;
+    usb.serial = "foo";
+    usb.devpath = "/path/to/bar";
+    usb.product = "test_product";
+    usb.model = "test model";
+    usb.device = "test_device";
+
+    atransport local;
+    local.type = kTransportLocal;
+    local.serial = "100.100.100.100:5555";
+
+    atransport portless;
+    portless.type = kTransportLocal;
+    portless.serial = "100.100.100.100";
+
+    atransport unnamed;
+    unnamed.type = kTransportUsb;
+
+    TransportIndex index;
+    std::vector<atransport*> transports = {&usb, &local, &portless, &unnamed};
+    for (atransport* t : transports) {
+        index.Add(t);
+    }
+    ASSERT_EQ(4u, index.size());
+
+    // The index has to find exactly what a walk over MatchesTarget() would.
+    for (const std::string& target :
+         {"", "foo", "/path/to/bar", "product:test_product", "model:test_model",
+          "model:test model", "device:test_device", "test_product", "product:", "100.100.100.100",
+          "tcp:100.100.100.100", "udp:100.100.100.100:5555", "100.100.100.100:5554",
+          "100.100.100.100:", "abc:100.100.100.100", "bar"}) {
+        std::vector<atransport*> expected;
+        for (atransport* t : transports) {
+            if (t->MatchesTarget(target)) expected.push_back(t);
+        }
+        std::vector<atransport*> found = index.FindByTarget(target);
+        std::sort(expected.begin(), expected.end());
+        std::sort(found.begin(), found.end());
+        EXPECT_EQ(expected, found) << "target: '" << target << "'";
+    }
+}
+
+TEST(transport, index_add_remove_update) {
+    atransport a;
+    a.type = kTransportUsb;
+    a.serial = "a";
+    atransport b;
+    b.type = kTransportLocal;
+    b.serial = "b";
+
+    TransportIndex index;
+    index.Add(&a);
+    index.Add(&b);
+    EXPECT_TRUE(index.Contains(&a));
+    EXPECT_EQ(&a, index.FindById(a.id));
+    EXPECT_EQ(&b, index.FindById(b.id));
+    EXPECT_EQ(nullptr, index.FindById(b.id, [](const atransport*) { return false; }));
+    EXPECT_EQ(std::vector<atransport*>{&a}, index.FindBySerial("a"));
+    EXPECT_EQ(std::vector<atransport*>{&b}, index.FindByType(kTransportLocal));
+    EXPECT_EQ(2u, index.FindByType(kTransportAny).size());
+
+    // Qualifiers learned later are only found once the index is told about them.
+    a.product = "p";
+    EXPECT_TRUE(index.FindByTarget("product:p").empty());
+    index.Update(&a);
+    EXPECT_EQ(std::vector<atransport*>{&a}, index.FindByTarget("product:p"));
+
+    index.Remove(&a);
+    EXPECT_FALSE(index.Contains(&a));
+    EXPECT_EQ(nullptr, index.FindById(a.id));
+    EXPECT_TRUE(index.FindBySerial("a").empty());
+    EXPECT_TRUE(index.FindByTarget("product:p").empty());
+
+    // Updating something that isn't in the index doesn't add it.
+    index.Update(&a);
+    EXPECT_EQ(1u, index.size());
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "types.h"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+// Buffers from kMinPooledSize up to kMaxPooledSize (MAX_PAYLOAD) are rounded up to a power of two,
+// and kept around on release for the next allocation of the same class. Smaller buffers are cheap
+// enough to get from the heap, and nothing bigger is allocated on any hot path.
+static constexpr size_t kMinPooledSize = 4 * 1024;
+static constexpr size_t kMaxPooledSize = 1024 * 1024;
+static constexpr size_t kSizeClassCount = 9;
+static_assert(kMinPooledSize << (kSizeClassCount - 1) == kMaxPooledSize, "size class mismatch");
+
+// Upper bound on the memory cached in each size class.
+static constexpr size_t kMaxCachedBytesPerClass = 16 * 1024 * 1024;
+
+// Upper bound on the number of cached apackets.
+static constexpr size_t kMaxCachedPackets = 1024;
+
+namespace {
+
+struct FreeList {
+    std::mutex mutex;
+    std::vector<void*> items GUARDED_BY(mutex);
+
+    void* Take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty()) {
+            return nullptr;
+        }
+        void* result = items.back();
+        items.pop_back();
+        return result;
+    }
+
+    // Returns false if there are already |limit| items, in which case the caller keeps ownership.
+    bool Give(void* item, size_t limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.size() >= limit) {
+            return false;
+        }
+        items.push_back(item);
+        return true;
+    }
+};
+
+struct PoolCounters {
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+
+    PoolStats Get() const {
+        PoolStats stats;
+        stats.hits = hits.load(std::memory_order_relaxed);
+        stats.misses = misses.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+
+}  // namespace
+
+static auto& block_free_lists = *new std::array<FreeList, kSizeClassCount>();
+static auto& block_counters = *new PoolCounters();
+
+static auto& apacket_free_list = *new FreeList();
+static auto& apacket_counters = *new PoolCounters();
+
+// Returns the size class that |size| belongs to, or -1 if it isn't pooled.
+static int block_size_class(size_t size) {
+    if (size < kMinPooledSize || size > kMaxPooledSize) {
+        return -1;
+    }
+
+    int size_class = 0;
+    while ((kMinPooledSize << size_class) < size) {
+        ++size_class;
+    }
+    return size_class;
+}
+
+char* block_pool_allocate(size_t size, size_t* capacity) {
+    int size_class = block_size_class(size);
+    if (size_class == -1) {
+        *capacity = size;
+        return new char[size];
+    }
+
+    *capacity = kMinPooledSize << size_class;
+    char* result = static_cast<char*>(block_free_lists[size_class].Take());
+    if (result) {
+        block_counters.hits.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    block_counters.misses.fetch_add(1, std::memory_order_relaxed);
+    return new char[*capacity];
+}
+
+void block_pool_release(char* data, size_t capacity) {
+    // Anything in the pooled range was allocated with exactly the capacity of its size class.
+    int size_class = block_size_class(capacity);
+    if (size_class != -1 &&
+        block_free_lists[size_class].Give(data, kMaxCachedBytesPerClass / capacity)) {
+        return;
+    }
+    delete[] data;
+}
+
+PoolStats block_pool_stats() {
+    return block_counters.Get();
+}
+
+void block_pool_trim() {
+    for (size_t i = 0; i < kSizeClassCount; ++i) {
+        while (char* data = static_cast<char*>(block_free_lists[i].Take())) {
+            delete[] data;
+        }
+    }
+}
+
+void* apacket::operator new(size_t size) {
+    CHECK_EQ(sizeof(apacket), size);
+    if (void* result = apacket_free_list.Take()) {
+        apacket_counters.hits.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+    apacket_counters.misses.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(size);
+}
+
+void apacket::operator delete(void* ptr) {
+    if (ptr && !apacket_free_list.Give(ptr, kMaxCachedPackets)) {
+        ::operator delete(ptr);
+    }
+}
+
+PoolStats apacket_pool_stats() {
+    return apacket_counters.Get();
+}
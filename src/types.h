@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <algorithm>
 #include <deque>
 #include <memory>
@@ -29,7 +31,23 @@
 #include "sysdeps/memory.h"
 #include "sysdeps/uio.h"
 
+struct PoolStats {
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+// Size-classed, thread-safe pool for the buffers backing Block (see types.cpp).
+// block_pool_allocate returns a buffer of at least |size| bytes, and stores its real size in
+// |*capacity|; that's what has to be passed back to block_pool_release.
+char* block_pool_allocate(size_t size, size_t* capacity);
+void block_pool_release(char* data, size_t capacity);
+PoolStats block_pool_stats();
+
+// Drop every buffer cached by the pool.
+void block_pool_trim();
+
 // Essentially std::vector<char>, except without zero initialization or reallocation.
+// The storage comes from the block pool.
 struct Block {
     using iterator = char*;
 
@@ -39,7 +57,7 @@ struct Block {
 
     template <typename Iterator>
     Block(Iterator begin, Iterator end) : Block(end - begin) {
-        std::copy(begin, end, data_.get());
+        std::copy(begin, end, data_);
     }
 
     Block(const Block& copy) = delete;
@@ -75,11 +93,14 @@ struct Block {
     void assign(InputIt begin, InputIt end) {
         clear();
         allocate(end - begin);
-        std::copy(begin, end, data_.get());
+        std::copy(begin, end, data_);
     }
 
     void clear() {
-        data_.reset();
+        if (data_) {
+            block_pool_release(data_, capacity_);
+            data_ = nullptr;
+        }
         capacity_ = 0;
         size_ = 0;
     }
@@ -88,11 +109,11 @@ struct Block {
     size_t size() const { return size_; }
     bool empty() const { return size() == 0; }
 
-    char* data() { return data_.get(); }
-    const char* data() const { return data_.get(); }
+    char* data() { return data_; }
+    const char* data() const { return data_; }
 
-    char* begin() { return data_.get(); }
-    const char* begin() const { return data_.get(); }
+    char* begin() { return data_; }
+    const char* begin() const { return data_; }
 
     char* end() { return data() + size_; }
     const char* end() const { return data() + size_; }
@@ -110,13 +131,12 @@ struct Block {
         CHECK_EQ(0ULL, capacity_);
         CHECK_EQ(0ULL, size_);
         if (size != 0) {
-            data_ = std::unique_ptr<char[]>(new std::remove_extent_t<char[]>[size]());
-            capacity_ = size;
+            data_ = block_pool_allocate(size, &capacity_);
             size_ = size;
         }
     }
 
-    std::unique_ptr<char[]> data_;
+    char* data_ = nullptr;
     size_t capacity_ = 0;
     size_t size_ = 0;
 };
@@ -130,12 +150,9 @@ struct amessage {
     uint32_t magic;       /* command ^ 0xffffffff             */
 };
 
-struct apacket {
-    using payload_type = Block;
-    amessage msg;
-    payload_type payload;
-};
-
+// A chain of refcounted, immutable blocks, each of which is viewed through a [offset, length)
+// window. Splitting a chain, or appending one chain to another, shares the underlying blocks
+// instead of copying them.
 struct IOVector {
     using value_type = char;
     using block_type = Block;
@@ -147,6 +164,12 @@ struct IOVector {
         append(std::move(block));
     }
 
+    explicit IOVector(block_type&& block) {
+        if (!block.empty()) {
+            append(std::move(block));
+        }
+    }
+
     IOVector(const IOVector& copy) = delete;
     IOVector(IOVector&& move) : IOVector() {
         *this = std::move(move);
@@ -156,24 +179,18 @@ struct IOVector {
     IOVector& operator=(IOVector&& move) {
         chain_ = std::move(move.chain_);
         chain_length_ = move.chain_length_;
-        begin_offset_ = move.begin_offset_;
-        end_offset_ = move.end_offset_;
 
         move.chain_.clear();
         move.chain_length_ = 0;
-        move.begin_offset_ = 0;
-        move.end_offset_ = 0;
 
         return *this;
     }
 
-    size_type size() const { return chain_length_ - begin_offset_ - end_offset_; }
+    size_type size() const { return chain_length_; }
     bool empty() const { return size() == 0; }
 
     void clear() {
         chain_length_ = 0;
-        begin_offset_ = 0;
-        end_offset_ = 0;
         chain_.clear();
     }
 
@@ -186,105 +203,96 @@ struct IOVector {
         }
         CHECK_GE(size(), len);
 
-        std::shared_ptr<const block_type> first_block = chain_.front();
-        CHECK_GE(first_block->size(), begin_offset_);
-        head.append_shared(std::move(first_block));
-        head.begin_offset_ = begin_offset_;
-
         while (head.size() < len) {
-            pop_front_block();
             CHECK(!chain_.empty());
-
-            head.append_shared(chain_.front());
-        }
-
-        if (head.size() == len) {
-            // Head takes full ownership of the last block it took.
-            head.end_offset_ = 0;
-            begin_offset_ = 0;
-            pop_front_block();
-        } else {
-            // Head takes partial ownership of the last block it took.
-            size_t bytes_taken = head.size() - len;
-            head.end_offset_ = bytes_taken;
-            CHECK_GE(chain_.front()->size(), bytes_taken);
-            begin_offset_ = chain_.front()->size() - bytes_taken;
+            Slice& slice = chain_.front();
+            size_t wanted = len - head.size();
+            if (slice.length <= wanted) {
+                // Head takes full ownership of the slice.
+                head.append_slice(std::move(slice));
+                chain_length_ -= head.chain_.back().length;
+                chain_.pop_front();
+            } else {
+                // Head takes partial ownership of the slice.
+                head.append_slice(Slice{slice.block, slice.offset, wanted});
+                slice.offset += wanted;
+                slice.length -= wanted;
+                chain_length_ -= wanted;
+            }
         }
 
         return head;
     }
 
+    // Drop the first |len| bytes of the chain.
+    void drop_front(size_type len) {
+        CHECK_GE(size(), len);
+        chain_length_ -= len;
+        while (len > 0) {
+            Slice& slice = chain_.front();
+            if (slice.length <= len) {
+                len -= slice.length;
+                chain_.pop_front();
+            } else {
+                slice.offset += len;
+                slice.length -= len;
+                len = 0;
+            }
+        }
+    }
+
     // Add a nonempty block to the chain.
-    // The end of the chain must be a complete block (i.e. end_offset_ == 0).
     void append(std::unique_ptr<const block_type> block) {
         CHECK_NE(0ULL, block->size());
-        CHECK_EQ(0ULL, end_offset_);
-        chain_length_ += block->size();
-        chain_.emplace_back(std::move(block));
+        size_t length = block->size();
+        append_slice(Slice{std::move(block), 0, length});
     }
 
-    void append(block_type&& block) { append(std::unique_ptr<block_type>(new block_type(std::move(block)))); }
-
-    void trim_front() {
-        if (begin_offset_ == 0) {
-            return;
-        }
-
-        const block_type* first_block = chain_.front().get();
-        auto copy = std::unique_ptr<block_type>(new block_type(first_block->size() - begin_offset_));
-        memcpy(copy->data(), first_block->data() + begin_offset_, copy->size());
-        chain_.front() = std::move(copy);
-
-        chain_length_ -= begin_offset_;
-        begin_offset_ = 0;
+    void append(block_type&& block) {
+        append(std::unique_ptr<block_type>(new block_type(std::move(block))));
     }
 
-  private:
-    // append, except takes a shared_ptr.
-    // Private to prevent exterior mutation of blocks.
-    void append_shared(std::shared_ptr<const block_type> block) {
-        CHECK_NE(0ULL, block->size());
-        CHECK_EQ(0ULL, end_offset_);
-        chain_length_ += block->size();
-        chain_.emplace_back(std::move(block));
+    // Move all of the blocks of |chain| to the end of this one.
+    void append(IOVector&& chain) {
+        for (Slice& slice : chain.chain_) {
+            append_slice(std::move(slice));
+        }
+        chain.clear();
     }
 
-    // Drop the front block from the chain, and update chain_length_ appropriately.
-    void pop_front_block() {
-        chain_length_ -= chain_.front()->size();
-        begin_offset_ = 0;
-        chain_.pop_front();
+    // Replace the contents of the chain with a copy of [begin, end).
+    template <typename InputIt>
+    void assign(InputIt begin, InputIt end) {
+        clear();
+        if (begin != end) {
+            append(block_type(begin, end));
+        }
     }
 
-    // Iterate over the blocks with a callback with an operator()(const char*, size_t).
-    template <typename Fn>
-    void iterate_blocks(Fn&& callback) const {
-        if (chain_.size() == 0) {
+    // Copy the first block if only part of it is still in use, so that the rest can be freed.
+    void trim_front() {
+        if (chain_.empty()) {
             return;
         }
 
-        for (size_t i = 0; i < chain_.size(); ++i) {
-            const std::shared_ptr<const block_type>& block = chain_.at(i);
-            const char* begin = block->data();
-            size_t length = block->size();
-
-            // Note that both of these conditions can be true if there's only one block.
-            if (i == 0) {
-                CHECK_GE(block->size(), begin_offset_);
-                begin += begin_offset_;
-                length -= begin_offset_;
-            }
+        Slice& front = chain_.front();
+        if (front.offset == 0 && front.length == front.block->size()) {
+            return;
+        }
 
-            if (i == chain_.size() - 1) {
-                CHECK_GE(length, end_offset_);
-                length -= end_offset_;
-            }
+        const char* data = front.block->data() + front.offset;
+        front.block = std::make_shared<const block_type>(data, data + front.length);
+        front.offset = 0;
+    }
 
-            callback(begin, length);
+    // Iterate over the blocks with a callback with an operator()(const char*, size_t).
+    template <typename Fn>
+    void iterate_blocks(Fn&& callback) const {
+        for (const Slice& slice : chain_) {
+            callback(slice.block->data() + slice.offset, slice.length);
         }
     }
 
-  public:
     // Copy all of the blocks into a single block.
     template <typename CollectionType = block_type>
     CollectionType coalesce() const {
@@ -309,7 +317,8 @@ struct IOVector {
         typename std::result_of<FunctionType(const char*, size_t)>::type {
         if (chain_.size() == 1) {
             // If we only have one block, we can use it directly.
-            return f(chain_.front()->data() + begin_offset_, size());
+            const Slice& slice = chain_.front();
+            return f(slice.block->data() + slice.offset, slice.length);
         } else {
             // Otherwise, copy to a single block.
             auto data = coalesce();
@@ -320,21 +329,52 @@ struct IOVector {
     // Get a list of iovecs that can be used to write out all of the blocks.
     std::vector<adb_iovec> iovecs() const {
         std::vector<adb_iovec> result;
-        iterate_blocks([&result](const char* data, size_t len) {
-            adb_iovec iov;
-            iov.iov_base = const_cast<char*>(data);
-            iov.iov_len = len;
-            result.emplace_back(iov);
-        });
-
+        iovecs(&result);
         return result;
     }
 
+    // Fill |result| with iovecs for the first |max_count| blocks, reusing its storage.
+    void iovecs(std::vector<adb_iovec>* result, size_t max_count = SIZE_MAX) const {
+        result->clear();
+        for (const Slice& slice : chain_) {
+            if (result->size() == max_count) {
+                break;
+            }
+            adb_iovec iov;
+            iov.iov_base = const_cast<char*>(slice.block->data() + slice.offset);
+            iov.iov_len = slice.length;
+            result->push_back(iov);
+        }
+    }
+
   private:
-    // Total length of all of the blocks in the chain.
+    struct Slice {
+        std::shared_ptr<const block_type> block;
+        size_t offset;
+        size_t length;
+    };
+
+    void append_slice(Slice&& slice) {
+        CHECK_NE(0ULL, slice.length);
+        CHECK_GE(slice.block->size(), slice.offset + slice.length);
+        chain_length_ += slice.length;
+        chain_.emplace_back(std::move(slice));
+    }
+
+    // Total length of all of the slices in the chain.
     size_t chain_length_ = 0;
 
-    size_t begin_offset_ = 0;
-    size_t end_offset_ = 0;
-    std::deque<std::shared_ptr<const block_type>> chain_;
+    std::deque<Slice> chain_;
+};
+
+struct apacket {
+    using payload_type = IOVector;
+    amessage msg;
+    payload_type payload;
+
+    // apackets are recycled through a free list instead of going back to the heap.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
 };
+
+PoolStats apacket_pool_stats();
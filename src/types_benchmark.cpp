@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "adb.h"
+#include "types.h"
+
+// Chains are described by (block count, block size): lots of small blocks is what a local socket
+// sees when many small packets queue up, a few huge ones is a bulk transfer.
+#define ADB_IOVECTOR_BENCHMARK(benchmark_name) \
+    BENCHMARK(benchmark_name)->Args({4096, 64})->Args({4, MAX_PAYLOAD})
+
+static IOVector MakeChain(size_t block_count, size_t block_size) {
+    IOVector chain;
+    for (size_t i = 0; i < block_count; ++i) {
+        chain.append(Block(block_size));
+    }
+    return chain;
+}
+
+// Drop a chain in pieces of a block and a half, like a writer making partial progress would.
+template <bool UseDropFront>
+static void BM_IOVector_Drain(benchmark::State& state) {
+    const size_t block_count = state.range(0);
+    const size_t block_size = state.range(1);
+    const size_t step = block_size + block_size / 2;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        IOVector chain = MakeChain(block_count, block_size);
+        state.ResumeTiming();
+
+        while (!chain.empty()) {
+            size_t len = std::min(step, chain.size());
+            if (UseDropFront) {
+                chain.drop_front(len);
+            } else {
+                chain.take_front(len);
+            }
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * block_count);
+}
+
+static void BM_IOVector_DrainTakeFront(benchmark::State& state) {
+    BM_IOVector_Drain<false>(state);
+}
+ADB_IOVECTOR_BENCHMARK(BM_IOVector_DrainTakeFront);
+
+static void BM_IOVector_DrainDropFront(benchmark::State& state) {
+    BM_IOVector_Drain<true>(state);
+}
+ADB_IOVECTOR_BENCHMARK(BM_IOVector_DrainDropFront);
+
+static void BM_IOVector_Iovecs(benchmark::State& state) {
+    IOVector chain = MakeChain(state.range(0), state.range(1));
+    for (auto _ : state) {
+        std::vector<adb_iovec> iovs = chain.iovecs();
+        benchmark::DoNotOptimize(iovs.data());
+    }
+}
+ADB_IOVECTOR_BENCHMARK(BM_IOVector_Iovecs);
+
+static void BM_IOVector_IovecsReused(benchmark::State& state) {
+    IOVector chain = MakeChain(state.range(0), state.range(1));
+    std::vector<adb_iovec> iovs;
+    for (auto _ : state) {
+        chain.iovecs(&iovs);
+        benchmark::DoNotOptimize(iovs.data());
+    }
+}
+ADB_IOVECTOR_BENCHMARK(BM_IOVector_IovecsReused);
@@ -117,3 +117,134 @@ TEST(IOVector, misaligned_split) {
     ASSERT_EQ(1ULL, bc.size());
     ASSERT_EQ(*create_block("x"), bc.coalesce());
 }
+
+TEST(IOVector, append_chain) {
+    IOVector bc;
+    bc.append(create_block("foo"));
+    bc.append(create_block("bar"));
+
+    // Append chains that start and end partway into their blocks.
+    IOVector other;
+    other.append(create_block("xbaz"));
+    other.append(create_block("quxy"));
+    other.take_front(1);
+    IOVector middle = other.take_front(6);
+    bc.append(std::move(middle));
+    ASSERT_EQ(0ULL, middle.size());
+    ASSERT_EQ(12ULL, bc.size());
+    ASSERT_EQ(*create_block("foobarbazqux"), bc.coalesce());
+
+    bc.take_front(4);
+    bc.append(std::move(other));
+    ASSERT_EQ(*create_block("arbazquxy"), bc.coalesce());
+    ASSERT_EQ(4ULL, bc.iovecs().size());
+}
+
+TEST(IOVector, assign) {
+    std::string data = "foobar";
+    IOVector bc;
+    bc.append(create_block("baz"));
+    bc.assign(data.begin(), data.end());
+    ASSERT_EQ(data, bc.coalesce<std::string>());
+
+    bc.assign(data.end(), data.end());
+    ASSERT_TRUE(bc.empty());
+}
+
+TEST(IOVector, trim_front) {
+    IOVector bc;
+    bc.append(create_block("foobar"));
+    bc.append(create_block("baz"));
+    bc.take_front(3);
+    bc.trim_front();
+    ASSERT_EQ(6ULL, bc.size());
+    ASSERT_EQ(*create_block("barbaz"), bc.coalesce());
+}
+
+TEST(BlockPool, reuse) {
+    block_pool_trim();
+
+    // Buffers in the pooled range are rounded up to their size class, and recycled.
+    PoolStats before = block_pool_stats();
+    const char* data;
+    {
+        Block block(5000);
+        ASSERT_EQ(5000ULL, block.size());
+        ASSERT_EQ(8192ULL, block.capacity());
+        data = block.data();
+    }
+    {
+        Block block(8000);
+        ASSERT_EQ(data, block.data());
+    }
+    PoolStats after = block_pool_stats();
+    ASSERT_EQ(before.misses + 1, after.misses);
+    ASSERT_EQ(before.hits + 1, after.hits);
+
+    // Small and oversized buffers come straight from the heap.
+    Block small(100);
+    ASSERT_EQ(100ULL, small.capacity());
+    Block large(2 * 1024 * 1024);
+    ASSERT_EQ(2ULL * 1024 * 1024, large.capacity());
+    ASSERT_EQ(after.hits, block_pool_stats().hits);
+    ASSERT_EQ(after.misses, block_pool_stats().misses);
+}
+
+TEST(BlockPool, resize_within_capacity) {
+    Block block(5000);
+    block.resize(8192);
+    ASSERT_EQ(8192ULL, block.size());
+    block.resize(1);
+    ASSERT_EQ(1ULL, block.size());
+}
+
+TEST(BlockPool, apacket) {
+    PoolStats before = apacket_pool_stats();
+    delete new apacket();
+    auto packet = std::make_unique<apacket>();
+    PoolStats after = apacket_pool_stats();
+    ASSERT_EQ(before.hits + before.misses + 2, after.hits + after.misses);
+    ASSERT_LE(before.hits + 1, after.hits);
+}
+
+TEST(IOVector, drop_front) {
+    IOVector bc;
+    bc.append(create_block("foo"));
+    bc.append(create_block("bar"));
+    bc.append(create_block("baz"));
+
+    bc.drop_front(0);
+    ASSERT_EQ(9ULL, bc.size());
+
+    // Within a block, up to the end of a block, and across blocks.
+    bc.drop_front(1);
+    ASSERT_EQ(*create_block("oobarbaz"), bc.coalesce());
+    bc.drop_front(2);
+    ASSERT_EQ(*create_block("barbaz"), bc.coalesce());
+    bc.drop_front(4);
+    ASSERT_EQ(*create_block("az"), bc.coalesce());
+    ASSERT_EQ(1ULL, bc.iovecs().size());
+
+    bc.drop_front(2);
+    ASSERT_TRUE(bc.empty());
+}
+
+TEST(IOVector, iovecs_reuse) {
+    IOVector bc;
+    bc.append(create_block("foo"));
+    bc.append(create_block("bar"));
+    bc.append(create_block("baz"));
+    bc.drop_front(1);
+
+    std::vector<adb_iovec> iovs;
+    bc.iovecs(&iovs);
+    ASSERT_EQ(3ULL, iovs.size());
+    ASSERT_EQ(2ULL, iovs[0].iov_len);
+    ASSERT_EQ(0, memcmp("oo", iovs[0].iov_base, 2));
+
+    // Refilling replaces the previous contents, and honors the limit.
+    bc.iovecs(&iovs, 2);
+    ASSERT_EQ(2ULL, iovs.size());
+    ASSERT_EQ(3ULL, iovs[1].iov_len);
+    ASSERT_EQ(0, memcmp("bar", iovs[1].iov_base, 3));
+}